@@ -165,6 +165,16 @@ alloc_TSS (void *pPageDirectory, void *pEntry, int mod_num)
 }
 
 
+/* Boot modules that are not ELF programs are RAM disk images */
+static bool
+module_is_elf (multiboot_module * pmm)
+{
+  Elf32_Ehdr *pe = map_virtual_page ((uint32) pmm->pe | 3);
+  bool elf = strncmp ((char *) pe->e_ident, ELFMAG, SELFMAG) == 0;
+  unmap_virtual_page (pe);
+  return elf;
+}
+
 /* Create an address space for boot modules */
 static uint16
 load_module (multiboot_module * pmm, int mod_num)
@@ -353,6 +363,10 @@ parse_root_type (char *cmdline)
           p[0] == '(' && p[1] == 'u' && p[2] == 's' &&
           p[3] == 'b' && p[4] == ')')
         return VFS_FSYS_EZUSB;
+      if (q - p >= 5 &&
+          p[0] == '(' && p[1] == 'r' && p[2] == 'a' &&
+          p[3] == 'm' && p[4] == ')')
+        return VFS_FSYS_RAMDISK;
     }
   }
   return VFS_FSYS_NONE;
@@ -462,6 +476,16 @@ init (multiboot * pmb)
   /* Here, clear mm_table entries for any loadable modules. */
   for (i = 0; i < pmb->mods_count; i++) {
 
+    if (!module_is_elf (pmb->mods_addr + i)) {
+      /* keep the whole image, and serve it as the RAM disk */
+      u32 start = (u32) pmb->mods_addr[i].pe;
+      u32 end = (u32) pmb->mods_addr[i].mod_end;
+      for (k = start >> 12; k < (end + 0xFFF) >> 12; k++)
+        BITMAP_CLR (mm_table, k);
+      ramdisk_set_image (start, end - start);
+      continue;
+    }
+
     pe = map_virtual_page ((uint32)pmb->mods_addr[i].pe | 3);
 
     pph = (void *) pe + pe->e_phoff;
@@ -531,7 +555,11 @@ init (multiboot * pmb)
   /* Load modules from GRUB */
   if (!pmb->mods_count)
     panic ("No modules available");
+  if (!module_is_elf (pmb->mods_addr))
+    panic ("First module is not a program");
   for (i = 0; i < pmb->mods_count; i++) {
+    if (!module_is_elf (pmb->mods_addr + i))
+      continue;
     tss[i] = load_module (pmb->mods_addr + i, i);
     lookup_TSS (tss[i])->priority = MIN_PRIO;
   }
@@ -17,3 +17,6 @@ OPT = 0
 
 # Use VMX-based virtual machines for isolation
 # CFG += -DUSE_VMX
+
+# Discard and chargen servers for tools/bdptest.sh
+# CFG += -DNET_BDP_TEST
@@ -0,0 +1,709 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* AHCI SATA host controller driver.
+ *
+ * Each SATA disk gets a command list of up to 32 slots.  Requests
+ * are issued as NCQ (READ/WRITE FPDMA QUEUED) commands when both the
+ * HBA and the drive support it, otherwise as READ/WRITE DMA EXT,
+ * with a PRD table built from the caller's buffer.  The issuing task
+ * sleeps until the port interrupt reports its slot complete, so
+ * several tasks may have commands in flight on the same disk. */
+
+#include "drivers/pci/pci.h"
+#include "drivers/block/block.h"
+#include "arch/i386.h"
+#include "util/printf.h"
+#include "smp/smp.h"
+#include "smp/apic.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "mem/pow2.h"
+#include "sched/sched.h"
+#include "sched/vcpu.h"
+#include "kernel.h"
+
+//#define DEBUG_AHCI
+
+#ifdef DEBUG_AHCI
+#define DLOG(fmt,...) DLOG_PREFIX("ahci",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define AHCI_PCI_CLASS    0x01  /* mass storage */
+#define AHCI_PCI_SUBCLASS 0x06  /* SATA */
+#define AHCI_PCI_PROGIF   0x01  /* AHCI 1.0 */
+#define AHCI_ABAR         5
+
+/* HBA registers */
+#define AHCI_CAP   0x00
+#define AHCI_GHC   0x04
+#define AHCI_IS    0x08
+#define AHCI_PI    0x0C
+#define AHCI_VS    0x10
+
+#define AHCI_CAP_NP(c)   (((c) & 0x1F) + 1)
+#define AHCI_CAP_NCS(c)  ((((c) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SNCQ    (1 << 30)
+
+#define AHCI_GHC_HR      (1 << 0)
+#define AHCI_GHC_IE      (1 << 1)
+#define AHCI_GHC_AE      (1 << 31)
+
+/* Port registers, relative to the port base */
+#define AHCI_PORT(p)    (0x100 + (p) * 0x80)
+#define AHCI_PxCLB   0x00
+#define AHCI_PxCLBU  0x04
+#define AHCI_PxFB    0x08
+#define AHCI_PxFBU   0x0C
+#define AHCI_PxIS    0x10
+#define AHCI_PxIE    0x14
+#define AHCI_PxCMD   0x18
+#define AHCI_PxTFD   0x20
+#define AHCI_PxSIG   0x24
+#define AHCI_PxSSTS  0x28
+#define AHCI_PxSERR  0x30
+#define AHCI_PxSACT  0x34
+#define AHCI_PxCI    0x38
+
+#define AHCI_PxCMD_ST    (1 << 0)
+#define AHCI_PxCMD_SUD   (1 << 1)
+#define AHCI_PxCMD_POD   (1 << 2)
+#define AHCI_PxCMD_FRE   (1 << 4)
+#define AHCI_PxCMD_FR    (1 << 14)
+#define AHCI_PxCMD_CR    (1 << 15)
+
+#define AHCI_PxIS_DHRS   (1 << 0)
+#define AHCI_PxIS_PSS    (1 << 1)
+#define AHCI_PxIS_DSS    (1 << 2)
+#define AHCI_PxIS_SDBS   (1 << 3)
+#define AHCI_PxIS_ERROR  0x7C000000 /* TFES HBFS HBDS IFS INFS */
+#define AHCI_PxIE_MASK   (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | \
+                          AHCI_PxIS_SDBS | AHCI_PxIS_ERROR)
+
+#define AHCI_TFD_ERR     0x01
+#define AHCI_TFD_DRQ     0x08
+#define AHCI_TFD_BSY     0x80
+
+#define AHCI_SSTS_DET_PRESENT 3
+#define AHCI_SIG_ATA     0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_IDENTIFY        0xEC
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+
+#define AHCI_MAX_PORTS   32
+#define AHCI_MAX_SLOTS   32
+#define AHCI_SECTOR_SIZE 512
+/* Largest request; a page-straddling buffer needs one PRD more than
+ * the number of pages it covers. */
+#define AHCI_MAX_SECTORS 256
+#define AHCI_PRDT_ENTRIES 40
+
+/* Wait this many microseconds for the HBA before giving up */
+#define AHCI_TIMEOUT_USEC 500000
+
+typedef struct {
+  u8 cfl:5;                     /* command FIS length in dwords */
+  u8 a:1;                       /* ATAPI */
+  u8 w:1;                       /* write */
+  u8 p:1;                       /* prefetchable */
+  u8 r:1;                       /* reset */
+  u8 b:1;                       /* BIST */
+  u8 c:1;                       /* clear busy upon R_OK */
+  u8 _reserved0:1;
+  u8 pmp:4;                     /* port multiplier port */
+  u16 prdtl;                    /* PRD table length in entries */
+  volatile u32 prdbc;           /* bytes transferred */
+  u32 ctba;                     /* command table base */
+  u32 ctbau;
+  u32 _reserved1[4];
+} PACKED ahci_cmd_header;
+
+typedef struct {
+  u32 dba;                      /* data base address */
+  u32 dbau;
+  u32 _reserved0;
+  u32 dbc:22;                   /* byte count - 1 */
+  u32 _reserved1:9;
+  u32 i:1;                      /* interrupt on completion */
+} PACKED ahci_prd;
+
+typedef struct {
+  u8 cfis[64];
+  u8 acmd[16];
+  u8 _reserved[48];
+  ahci_prd prdt[AHCI_PRDT_ENTRIES];
+} PACKED ahci_cmd_table;
+
+typedef struct {
+  u8 type;
+  u8 pmport:4;
+  u8 _reserved0:3;
+  u8 c:1;                       /* command, not control */
+  u8 command;
+  u8 featurel;
+  u8 lba0, lba1, lba2;
+  u8 device;
+  u8 lba3, lba4, lba5;
+  u8 featureh;
+  u8 countl, counth;
+  u8 icc;
+  u8 control;
+  u8 _reserved1[4];
+} PACKED ahci_fis_h2d;
+
+/* Per-port DMA memory: command list, received-FIS area and one
+ * command table per slot, in physically contiguous pages. */
+struct ahci_port_mem {
+  ahci_cmd_header clb[AHCI_MAX_SLOTS]; /* 1K aligned */
+  u8 fis[256];                         /* 256 aligned */
+  u8 _pad[0x1000 - sizeof (ahci_cmd_header) * AHCI_MAX_SLOTS - 256];
+  ahci_cmd_table tables[AHCI_MAX_SLOTS]; /* 128 aligned */
+} PACKED;
+
+typedef struct {
+  uint num;
+  struct ahci_port_mem *mem;
+  u32 mem_phys;
+  bool ncq;
+  u32 slots;                    /* usable slots */
+  u32 busy;                     /* slots handed out */
+  u32 issued;                   /* slots issued, not yet complete */
+  task_id owner[AHCI_MAX_SLOTS];
+  sint result[AHCI_MAX_SLOTS];
+  task_id slot_waitq;
+  bool recovering;              /* restart pending in the bottom half */
+  block_device bdev;
+} ahci_port_t;
+
+static volatile u8 *ahci_mmio;
+static u32 ahci_cap;
+static bool ahci_polled = TRUE;
+static ahci_port_t *ahci_ports[AHCI_MAX_PORTS];
+static uint ahci_disk_count = 0;
+static u32 ahci_bh_pending;     /* ports waiting for a restart */
+static task_id ahci_bh_id = 0;
+static u32 ahci_bh_stack[1024] ALIGNED (0x1000);
+
+#define AHCI_MEM_PAGES ((sizeof (struct ahci_port_mem) + 0xFFF) >> 12)
+
+static inline u32
+ahci_read (u32 reg)
+{
+  return *(volatile u32 *) (ahci_mmio + reg);
+}
+
+static inline void
+ahci_write (u32 reg, u32 val)
+{
+  *(volatile u32 *) (ahci_mmio + reg) = val;
+}
+
+#define PREAD(p, r)    ahci_read (AHCI_PORT ((p)->num) + (r))
+#define PWRITE(p, r, v) ahci_write (AHCI_PORT ((p)->num) + (r), (v))
+
+/* Spin until (reg & mask) == val, or time out. */
+static bool
+ahci_wait (u32 reg, u32 mask, u32 val)
+{
+  uint i;
+  for (i = 0; i < AHCI_TIMEOUT_USEC / 10; i++) {
+    if ((ahci_read (reg) & mask) == val)
+      return TRUE;
+    tsc_delay_usec (10);
+  }
+  return FALSE;
+}
+
+static bool
+ahci_port_stop (ahci_port_t *p)
+{
+  u32 base = AHCI_PORT (p->num);
+  PWRITE (p, AHCI_PxCMD, PREAD (p, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+  if (!ahci_wait (base + AHCI_PxCMD, AHCI_PxCMD_CR, 0))
+    return FALSE;
+  PWRITE (p, AHCI_PxCMD, PREAD (p, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+  return ahci_wait (base + AHCI_PxCMD, AHCI_PxCMD_FR, 0);
+}
+
+static bool
+ahci_port_start (ahci_port_t *p)
+{
+  u32 base = AHCI_PORT (p->num);
+  PWRITE (p, AHCI_PxSERR, ~0);
+  PWRITE (p, AHCI_PxIS, ~0);
+  PWRITE (p, AHCI_PxCMD, PREAD (p, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+  if (!ahci_wait (base + AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0))
+    return FALSE;
+  PWRITE (p, AHCI_PxCMD, PREAD (p, AHCI_PxCMD) | AHCI_PxCMD_ST);
+  return TRUE;
+}
+
+/* Retire every slot the HBA has finished with and wake its owner.
+ * On a task-file error the port is restarted and all outstanding
+ * commands fail: with NCQ the failing tag cannot be told apart
+ * without READ LOG EXT. */
+static void
+ahci_port_complete (ahci_port_t *p)
+{
+  u32 is, pending, done;
+  uint slot;
+
+  is = PREAD (p, AHCI_PxIS);
+  PWRITE (p, AHCI_PxIS, is);
+
+  if (is & AHCI_PxIS_ERROR) {
+    DLOG ("port %d: error IS=%p TFD=%p SERR=%p", p->num, is,
+          PREAD (p, AHCI_PxTFD), PREAD (p, AHCI_PxSERR));
+    done = p->issued;
+    for (slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+      if (done & (1 << slot))
+        p->result[slot] = -1;
+    ahci_port_stop (p);
+    ahci_port_start (p);
+  } else {
+    pending = PREAD (p, AHCI_PxCI) | PREAD (p, AHCI_PxSACT);
+    done = p->issued & ~pending;
+  }
+
+  p->issued &= ~done;
+  for (slot = 0; done; slot++, done >>= 1)
+    if ((done & 1) && p->owner[slot] && sched_enabled)
+      wakeup (p->owner[slot]);
+}
+
+/* Restarting a port waits for the HBA to stop the command list, so
+ * the interrupt handler leaves it to this thread. */
+static void
+ahci_bh_thread (void)
+{
+  ahci_port_t *p;
+  uint i;
+
+  for (;;) {
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+      if (!(ahci_bh_pending & (1 << i)))
+        continue;
+      ahci_bh_pending &= ~(1 << i);
+      p = ahci_ports[i];
+      ahci_port_complete (p);
+      p->recovering = FALSE;
+      PWRITE (p, AHCI_PxIE, AHCI_PxIE_MASK);
+      wakeup_queue (&p->slot_waitq);
+    }
+    iovcpu_job_completion ();
+  }
+}
+
+static uint32
+ahci_irq_handler (uint8 vec)
+{
+  ahci_port_t *p;
+  u32 is;
+  uint i;
+
+  lock_kernel ();
+  is = ahci_read (AHCI_IS);
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (!(is & (1 << i)) || !(p = ahci_ports[i]))
+      continue;
+    if ((PREAD (p, AHCI_PxIS) & AHCI_PxIS_ERROR) && ahci_bh_id) {
+      extern vcpu *vcpu_lookup (int);
+      /* masked, and no new commands, until the port is restarted */
+      PWRITE (p, AHCI_PxIE, 0);
+      p->recovering = TRUE;
+      ahci_bh_pending |= 1 << i;
+      iovcpu_job_wakeup (ahci_bh_id, vcpu_lookup (2)->T);
+    } else
+      ahci_port_complete (p);
+  }
+  ahci_write (AHCI_IS, is);
+  unlock_kernel ();
+  return 0;
+}
+
+static uint
+ahci_get_slot (ahci_port_t *p)
+{
+  u32 avail;
+  /* a port being restarted takes no new commands */
+  while (p->recovering || !(avail = p->slots & ~p->busy)) {
+    queue_append (&p->slot_waitq, str ());
+    schedule ();
+  }
+  avail = ffs (avail);
+  p->busy |= 1 << avail;
+  return avail;
+}
+
+static void
+ahci_put_slot (ahci_port_t *p, uint slot)
+{
+  p->busy &= ~(1 << slot);
+  p->owner[slot] = 0;
+  wakeup_queue (&p->slot_waitq);
+}
+
+/* Describe buf with PRDs, one per physically contiguous piece.
+ * Returns the number of entries used, or 0 if they do not fit. */
+static uint
+ahci_build_prdt (ahci_cmd_table *t, u8 *buf, u32 len)
+{
+  uint n = 0;
+  u32 phys, chunk;
+
+  while (len > 0) {
+    phys = (u32) get_phys_addr (buf);
+    chunk = 0x1000 - ((u32) buf & 0xFFF);
+    if (chunk > len)
+      chunk = len;
+    if (n > 0 && t->prdt[n - 1].dba + t->prdt[n - 1].dbc + 1 == phys &&
+        t->prdt[n - 1].dbc + 1 + chunk <= 0x400000)
+      t->prdt[n - 1].dbc += chunk;
+    else {
+      if (n == AHCI_PRDT_ENTRIES)
+        return 0;
+      t->prdt[n].dba = phys;
+      t->prdt[n].dbau = 0;
+      t->prdt[n].dbc = chunk - 1;
+      t->prdt[n].i = 0;
+      n++;
+    }
+    buf += chunk;
+    len -= chunk;
+  }
+  return n;
+}
+
+/* Issue one ATA command on the port and wait for it.  Returns the
+ * number of bytes transferred or -1. */
+static sint
+ahci_exec (ahci_port_t *p, u8 command, u64 lba, uint count, u8 *buf,
+           u32 len, bool write)
+{
+  uint slot = ahci_get_slot (p);
+  ahci_cmd_header *h = &p->mem->clb[slot];
+  ahci_cmd_table *t = &p->mem->tables[slot];
+  ahci_fis_h2d *fis = (ahci_fis_h2d *) t->cfis;
+  bool queued = (command == ATA_CMD_READ_FPDMA ||
+                 command == ATA_CMD_WRITE_FPDMA);
+  uint prds = 0;
+  sint res;
+
+  memset (t, 0, sizeof (ahci_cmd_table));
+  if (len > 0 && !(prds = ahci_build_prdt (t, buf, len))) {
+    ahci_put_slot (p, slot);
+    return -1;
+  }
+
+  fis->type = FIS_TYPE_REG_H2D;
+  fis->c = 1;
+  fis->command = command;
+  fis->lba0 = lba;
+  fis->lba1 = lba >> 8;
+  fis->lba2 = lba >> 16;
+  fis->lba3 = lba >> 24;
+  fis->lba4 = lba >> 32;
+  fis->lba5 = lba >> 40;
+  fis->device = (command == ATA_CMD_IDENTIFY ? 0 : 0x40); /* LBA mode */
+  if (queued) {
+    /* sector count moves to the feature field; the tag goes in count */
+    fis->featurel = count;
+    fis->featureh = count >> 8;
+    fis->countl = slot << 3;
+  } else {
+    fis->countl = count;
+    fis->counth = count >> 8;
+  }
+
+  memset (h, 0, sizeof (ahci_cmd_header));
+  h->cfl = sizeof (ahci_fis_h2d) / 4;
+  h->w = write ? 1 : 0;
+  h->prdtl = prds;
+  h->ctba = p->mem_phys + ((u8 *) t - (u8 *) p->mem);
+
+  p->owner[slot] = str ();
+  p->result[slot] = len;
+  p->issued |= 1 << slot;
+
+  if (queued)
+    PWRITE (p, AHCI_PxSACT, 1 << slot);
+  PWRITE (p, AHCI_PxCI, 1 << slot);
+
+  if (ahci_polled || !sched_enabled) {
+    uint i;
+    for (i = 0; (p->issued & (1 << slot)) && i < AHCI_TIMEOUT_USEC; i++) {
+      ahci_port_complete (p);
+      tsc_delay_usec (1);
+    }
+    if (p->issued & (1 << slot)) {
+      DLOG ("port %d: slot %d timed out", p->num, slot);
+      p->issued &= ~(1 << slot);
+      p->result[slot] = -1;
+      ahci_port_stop (p);
+      ahci_port_start (p);
+    }
+  } else {
+    while (p->issued & (1 << slot))
+      schedule ();
+  }
+
+  res = p->result[slot];
+  ahci_put_slot (p, slot);
+  return res;
+}
+
+static sint
+ahci_rw (block_device *dev, uint32 lba, uint count, uint8 *buf, bool write)
+{
+  ahci_port_t *p = dev->drvdata;
+  u8 command;
+
+  if (p->ncq)
+    command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+  else
+    command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+
+  return ahci_exec (p, command, lba, count, buf,
+                    count * AHCI_SECTOR_SIZE, write);
+}
+
+static sint
+ahci_block_read (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return ahci_rw (dev, lba, count, buf, FALSE);
+}
+
+static sint
+ahci_block_write (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return ahci_rw (dev, lba, count, buf, TRUE);
+}
+
+/* Bring up one port with a SATA disk attached and register it. */
+static bool
+ahci_port_init (uint num)
+{
+  ahci_port_t *p;
+  u32 phys, ssts, sig;
+  u16 *id;
+  u32 id_frame;
+  uint depth;
+
+  ssts = ahci_read (AHCI_PORT (num) + AHCI_PxSSTS);
+  sig = ahci_read (AHCI_PORT (num) + AHCI_PxSIG);
+  DLOG ("port %d: SSTS=%p SIG=%p", num, ssts, sig);
+  if ((ssts & 0xF) != AHCI_SSTS_DET_PRESENT || sig != AHCI_SIG_ATA)
+    return FALSE;
+
+  if (pow2_alloc (sizeof (ahci_port_t), (u8 **) &p) < 0 || !p)
+    return FALSE;
+  memset (p, 0, sizeof (ahci_port_t));
+  p->num = num;
+
+  phys = alloc_phys_frames (AHCI_MEM_PAGES);
+  if (phys == -1)
+    goto abort;
+  p->mem = map_contiguous_virtual_pages (phys | 3, AHCI_MEM_PAGES);
+  if (!p->mem)
+    goto abort_phys;
+  p->mem_phys = phys;
+  memset (p->mem, 0, AHCI_MEM_PAGES << 12);
+
+  if (!ahci_port_stop (p)) {
+    DLOG ("port %d: unable to stop", num);
+    goto abort_virt;
+  }
+  PWRITE (p, AHCI_PxCLB, phys);
+  PWRITE (p, AHCI_PxCLBU, 0);
+  PWRITE (p, AHCI_PxFB, phys + offsetof (struct ahci_port_mem, fis));
+  PWRITE (p, AHCI_PxFBU, 0);
+  if (!ahci_port_start (p)) {
+    DLOG ("port %d: unable to start", num);
+    goto abort_virt;
+  }
+  PWRITE (p, AHCI_PxIE, AHCI_PxIE_MASK);
+
+  p->slots = 1;                 /* slot 0 only until IDENTIFY is done */
+  ahci_ports[num] = p;
+
+  id_frame = alloc_phys_frame ();
+  id = map_virtual_page (id_frame | 3);
+  if (ahci_exec (p, ATA_CMD_IDENTIFY, 0, 0, (u8 *) id, 512, FALSE) != 512) {
+    DLOG ("port %d: IDENTIFY failed", num);
+    unmap_virtual_page (id);
+    free_phys_frame (id_frame);
+    goto abort_port;
+  }
+
+  if (id[83] & (1 << 10))       /* LBA48 */
+    p->bdev.num_sectors = *(u64 *) &id[100];
+  else
+    p->bdev.num_sectors = *(u32 *) &id[60];
+
+  depth = AHCI_CAP_NCS (ahci_cap);
+  if ((ahci_cap & AHCI_CAP_SNCQ) && (id[76] & (1 << 8))) {
+    p->ncq = TRUE;
+    if ((id[75] & 0x1F) + 1 < depth)
+      depth = (id[75] & 0x1F) + 1;
+  }
+  p->slots = depth == 32 ? ~0 : (1 << depth) - 1;
+
+  unmap_virtual_page (id);
+  free_phys_frame (id_frame);
+
+  p->bdev.name[0] = 's';
+  p->bdev.name[1] = 'd';
+  p->bdev.name[2] = '0' + ahci_disk_count;
+  p->bdev.sector_size = AHCI_SECTOR_SIZE;
+  p->bdev.max_sectors = AHCI_MAX_SECTORS;
+  p->bdev.dma_align = 2;        /* PRD addresses must be word aligned */
+  p->bdev.read_func = ahci_block_read;
+  p->bdev.write_func = ahci_block_write;
+  p->bdev.drvdata = p;
+
+  if (!block_register_device (&p->bdev))
+    goto abort_port;
+  ahci_disk_count++;
+
+  logger_printf ("ahci: port %d: %s: %d sectors, %s, %d slots\n", num,
+                 p->bdev.name, (u32) p->bdev.num_sectors,
+                 p->ncq ? "NCQ" : "no NCQ", depth);
+  return TRUE;
+
+ abort_port:
+  ahci_ports[num] = NULL;
+  ahci_port_stop (p);
+ abort_virt:
+  unmap_virtual_pages (p->mem, AHCI_MEM_PAGES);
+ abort_phys:
+  free_phys_frames (phys, AHCI_MEM_PAGES);
+ abort:
+  pow2_free ((u8 *) p);
+  return FALSE;
+}
+
+extern bool
+ahci_init (void)
+{
+  uint device_index, mem_addr, irq_line, irq_pin, i;
+  pci_device dev;
+  pci_irq_t irq;
+  u32 pi;
+
+  if (mp_ISA_PC) {
+    DLOG ("Requires PCI support");
+    return FALSE;
+  }
+
+  /* Find the AHCI controller on the PCI bus */
+  device_index = ~0;
+  i=0;
+  while (pci_find_device (0xFFFF, 0xFFFF, AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS,
+                          i, &i)) {
+    if (pci_get_device (i, &dev)) {
+      if (dev.progIF == AHCI_PCI_PROGIF) {
+        device_index = i;
+        break;
+      }
+      i++;
+    } else break;
+  }
+
+  if (device_index == ~0) {
+    DLOG ("Unable to detect AHCI controller.");
+    return FALSE;
+  }
+
+  if (!pci_decode_bar (device_index, AHCI_ABAR, &mem_addr, NULL, NULL) ||
+      mem_addr == 0) {
+    DLOG ("Invalid PCI configuration or ABAR not found");
+    return FALSE;
+  }
+
+  DLOG ("Using PCI bus=%x dev=%x func=%x ABAR=%p",
+        dev.bus, dev.slot, dev.func, mem_addr);
+
+  /* enable memory mapped I/O and bus mastering */
+  pci_write_word (pci_addr (dev.bus, dev.slot, dev.func, 0x04), 0x0006);
+
+  ahci_mmio = map_contiguous_virtual_pages (mem_addr | 3, 2);
+  if (ahci_mmio == NULL) {
+    DLOG ("Unable to map page to phys=%p", mem_addr);
+    return FALSE;
+  }
+
+  ahci_write (AHCI_GHC, ahci_read (AHCI_GHC) | AHCI_GHC_AE);
+  ahci_cap = ahci_read (AHCI_CAP);
+  pi = ahci_read (AHCI_PI);
+  DLOG ("CAP=%p PI=%p VS=%p", ahci_cap, pi, ahci_read (AHCI_VS));
+
+  if (pci_get_interrupt (device_index, &irq_line, &irq_pin) &&
+      pci_irq_find (dev.bus, dev.slot, irq_pin, &irq) &&
+      pci_irq_map_handler (&irq, ahci_irq_handler, 0x01,
+                           IOAPIC_DESTINATION_LOGICAL,
+                           IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+    ahci_polled = FALSE;
+  } else
+    DLOG ("No IRQ routing; polling for completions");
+
+  for (i = 0; i < AHCI_MAX_PORTS && i < AHCI_CAP_NP (ahci_cap); i++)
+    if (pi & (1 << i))
+      ahci_port_init (i);
+
+  if (ahci_disk_count == 0) {
+    unmap_virtual_pages ((void *) ahci_mmio, 2);
+    return FALSE;
+  }
+
+  ahci_write (AHCI_IS, ~0);
+  if (!ahci_polled) {
+    ahci_bh_id = create_kernel_thread_args ((u32) ahci_bh_thread,
+                                            (u32) &ahci_bh_stack[1023],
+                                            FALSE, 0);
+    set_iovcpu (ahci_bh_id, IOVCPU_CLASS_DISK);
+    ahci_write (AHCI_GHC, ahci_read (AHCI_GHC) | AHCI_GHC_IE);
+  }
+
+  return TRUE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = ahci_init
+};
+
+DEF_MODULE (storage___ahci, "AHCI SATA driver", &mod_ops, {"pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -23,6 +23,7 @@
 #include "smp/apic.h"
 #include "sched/sched.h"
 #include "sched/vcpu.h"
+#include "drivers/block/block.h"
 #include "kernel.h"
 
 //#define DEBUG_ATA
@@ -142,6 +143,9 @@ ata_drive_select (uint32 bus, uint32 drive)
   ATA_SELECT_DELAY (bus);
 }
 
+/* Capacity reported by the last successful IDENTIFY */
+static uint32 ata_identify_sectors;
+
 /* Use the ATA IDENTIFY command to find out what kind of drive is
  * attached to the given bus/slot. */
 uint32
@@ -150,6 +154,7 @@ ata_identify (uint32 bus, uint32 drive)
   uint8 status;
   uint16 buffer[256];
 
+  ata_identify_sectors = 0;
   ata_drive_select (bus, drive);
 
   outb (0xEC, ATA_COMMAND (bus));       /* Send IDENTIFY command */
@@ -204,6 +209,7 @@ ata_identify (uint32 bus, uint32 drive)
     logger_printf ("LBA48 mode supported.\n");
   logger_printf ("LBA48 addressable sectors: %.4X %.4X %.4X %.4X\n",
                  buffer[100], buffer[101], buffer[102], buffer[103]);
+  ata_identify_sectors = buffer[60] | ((uint32) buffer[61] << 16);
   return ATA_TYPE_PATA;
 
 guess_identity:{
@@ -387,6 +393,61 @@ ata_poll_for_irq (uint32 bus)
   tsc_delay_usec (50000);      /* wait 50 milliseconds */
 }
 
+/* PATA disks as block devices.  The PIO path moves one sector per
+ * command, so these simply loop. */
+
+static block_device pata_block_devices[4];
+
+static sint
+ata_block_read (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  ata_info *info = dev->drvdata;
+  uint i;
+
+  for (i = 0; i < count; i++, buf += ATA_SECTOR_SIZE)
+    if (ata_drive_read_sector (info->ata_bus, info->ata_drive,
+                               lba + i, buf) != ATA_SECTOR_SIZE)
+      return -1;
+  return count * ATA_SECTOR_SIZE;
+}
+
+static sint
+ata_block_write (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  ata_info *info = dev->drvdata;
+  uint i;
+
+  for (i = 0; i < count; i++, buf += ATA_SECTOR_SIZE)
+    if (ata_drive_write_sector (info->ata_bus, info->ata_drive,
+                                lba + i, buf) != ATA_SECTOR_SIZE)
+      return -1;
+  return count * ATA_SECTOR_SIZE;
+}
+
+static void
+ata_register_block_devices (void)
+{
+  uint i, n = 0;
+
+  for (i = 0; i < 4; i++) {
+    block_device *dev = &pata_block_devices[i];
+    if (pata_drives[i].ata_type != ATA_TYPE_PATA)
+      continue;
+    dev->name[0] = 'h';
+    dev->name[1] = 'd';
+    dev->name[2] = '0' + n;
+    dev->sector_size = ATA_SECTOR_SIZE;
+    dev->num_sectors = pata_drives[i].ata_sectors;
+    dev->max_sectors = 256;
+    dev->dma_align = 1;
+    dev->read_func = ata_block_read;
+    dev->write_func = ata_block_write;
+    dev->drvdata = &pata_drives[i];
+    if (block_register_device (dev))
+      n++;
+  }
+}
+
 /* Initialize and identify the ATA drives in the system. */
 bool
 ata_init (void)
@@ -399,6 +460,7 @@ ata_init (void)
   pata_drives[i].ata_type = ata_identify (bus, drive);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
+  pata_drives[i].ata_sectors = ata_identify_sectors;
 
   i = 1;
   bus = ATA_BUS_PRIMARY;
@@ -406,6 +468,7 @@ ata_init (void)
   pata_drives[i].ata_type = ata_identify (bus, drive);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
+  pata_drives[i].ata_sectors = ata_identify_sectors;
 
   i = 2;
   bus = ATA_BUS_SECONDARY;
@@ -413,6 +476,7 @@ ata_init (void)
   pata_drives[i].ata_type = ata_identify (bus, drive);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
+  pata_drives[i].ata_sectors = ata_identify_sectors;
 
   i = 3;
   bus = ATA_BUS_SECONDARY;
@@ -420,6 +484,7 @@ ata_init (void)
   pata_drives[i].ata_type = ata_identify (bus, drive);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
+  pata_drives[i].ata_sectors = ata_identify_sectors;
 
   if (mp_ISA_PC) {
     set_vector_handler ((ATA_IRQ_PRIMARY - 8) + PIC2_BASE_IRQ,
@@ -435,6 +500,8 @@ ata_init (void)
     set_vector_handler (ATA_VECTOR_SECONDARY, ata_irq_handler);
   }
 
+  ata_register_block_devices ();
+
   return TRUE;
 }
 
@@ -461,31 +528,55 @@ u64 atapi_cycles=0, atapi_count=0, atapi_max=0, atapi_min=~0LL;
 
 static u64 atapi_bytes = 0, atapi_timestamps = 0;
 
-/* Indicate which IRQs to measure response time */
-#define FIRST
-#define SECOND
+/* Largest byte count the drive may hand us per DRQ block: the
+ * biggest multiple of the sector size that fits the 16-bit limit. */
+#define ATAPI_BYTE_COUNT_LIMIT 0xF800
+
+/* Block until the drive raises its IRQ, either by sleeping (with the
+ * usual response-time instrumentation) or by polling. */
+static void
+atapi_wait_irq (uint32 bus)
+{
+  if (sched_enabled) {
+    ATAPI_MEASURE_START;
+    u64 finish;
+    RDTSC (irq_start);
+    schedule ();
+    RDTSC (finish);
+    irq_turnaround += finish - irq_start;
+    ATAPI_MEASURE_FINISH;
+  } else
+    ata_poll_for_irq (bus);
+}
 
-/* Use the ATAPI protocol to read a single sector from the given
- * bus/drive into the buffer. */
+/* Use the ATAPI protocol to read count consecutive sectors from the
+ * given bus/drive into the buffer with a single READ(12).  The drive
+ * delivers the data in DRQ blocks of at most ATAPI_BYTE_COUNT_LIMIT
+ * bytes, each announced by an IRQ, and a final IRQ with DRQ clear
+ * completes the command.  Returns the number of bytes read or -1. */
 int
-_atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 *buffer)
+_atapi_drive_read_sectors (uint32 bus, uint32 drive, uint32 lba,
+                           uint32 count, uint8 *buffer)
 {
   /* 0xA8 is READ SECTORS command byte. */
   uint8 read_cmd[12] = { 0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
   uint8 status;
-  int size, fake_size;
+  int size, total = 0, want = count * ATAPI_SECTOR_SIZE;
   task_id cpu = 0;
 
+  if (count == 0)
+    return 0;
+
   ata_grab ();
 
-  DLOG ("atapi_drive_read_sector(%X,%X,%X,%p)", bus, drive, lba,
-        buffer);
+  DLOG ("atapi_drive_read_sectors(%X,%X,%X,%X,%p)", bus, drive, lba,
+        count, buffer);
 
   outb (drive & (1 << 4), ATA_DRIVE_SELECT (bus));      /* select drive (only slavebit needed) */
   ATA_SELECT_DELAY (bus);
   outb (0x0, ATA_FEATURES (bus));       /* PIO mode */
-  outb (ATAPI_SECTOR_SIZE & 0xFF, ATA_ADDRESS2 (bus));
-  outb (ATAPI_SECTOR_SIZE >> 8, ATA_ADDRESS3 (bus));
+  outb (ATAPI_BYTE_COUNT_LIMIT & 0xFF, ATA_ADDRESS2 (bus));
+  outb (ATAPI_BYTE_COUNT_LIMIT >> 8, ATA_ADDRESS3 (bus));
   outb (0xA0, ATA_COMMAND (bus));       /* ATA PACKET command */
 
   while ((status = inb (ATA_COMMAND (bus))) & 0x80)     /* BUSY */
@@ -495,108 +586,81 @@ _atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 *buffer)
     asm volatile ("pause");
   /* DRQ or ERROR set */
   if (status & 0x1) {
-    size = -1;
+    total = -1;
     goto cleanup;
   }
 
-  read_cmd[9] = 1;              /* 1 sector */
   read_cmd[2] = (lba >> 0x18) & 0xFF;   /* most sig. byte of LBA */
   read_cmd[3] = (lba >> 0x10) & 0xFF;
   read_cmd[4] = (lba >> 0x08) & 0xFF;
   read_cmd[5] = (lba >> 0x00) & 0xFF;   /* least sig. byte of LBA */
+  read_cmd[6] = (count >> 0x18) & 0xFF; /* transfer length in sectors */
+  read_cmd[7] = (count >> 0x10) & 0xFF;
+  read_cmd[8] = (count >> 0x08) & 0xFF;
+  read_cmd[9] = (count >> 0x00) & 0xFF;
 
   /* Send ATAPI/SCSI command */
   outsw (ATA_DATA (bus), (uint16 *) read_cmd, 6);
 
-  /* Wait for IRQ. */
   if (sched_enabled) {
-    /* Switch to IO-VCPU */
+    /* Switch to IO-VCPU for the data phase */
     cpu = lookup_TSS (str ())->cpu;
     set_iovcpu (str (), IOVCPU_CLASS_ATA | IOVCPU_CLASS_CDROM);
     extern vcpu *vcpu_lookup (int);
     vcpu_lookup (lookup_TSS (str ())->cpu)->T = vcpu_lookup (cpu)->T;
+  }
 
-#ifdef FIRST
-    ATAPI_MEASURE_START;
-    u64 finish;
-    RDTSC (irq_start);
-#else
-    irq_start = 0;
-#endif
-    schedule ();
-#ifdef FIRST
-    RDTSC (finish);
-    irq_turnaround += finish - irq_start;
-    ATAPI_MEASURE_FINISH;
-#endif
-  } else
-    ata_poll_for_irq (bus);
-
-  /* Wait for DRQ to set */
-  while (!(inb (ATA_COMMAND (bus)) & 0x08))
-    asm volatile ("pause");
-
-  /* Read actual size */
-  size =
-    (((int) inb (ATA_ADDRESS3 (bus))) << 8) |
-    (int) (inb (ATA_ADDRESS2 (bus)));
+  for (;;) {
+    atapi_wait_irq (bus);
 
-  DLOG ("atapi_drive_read_sector(%X,%X,%X,%p): actual size = %X",
-        bus, drive, lba, buffer, size);
+    while ((status = inb (ATA_COMMAND (bus))) & 0x80)   /* BUSY */
+      asm volatile ("pause");
 
-  /* Workaround possible size-reporting bug in hardware */
-  if (size > ATAPI_SECTOR_SIZE)
-    size = ATAPI_SECTOR_SIZE;
+    if (status & 0x1) {         /* ERROR */
+      total = -1;
+      break;
+    }
+    if (!(status & 0x8))        /* no DRQ: command complete */
+      break;
+
+    /* Read actual size of this block */
+    size =
+      (((int) inb (ATA_ADDRESS3 (bus))) << 8) |
+      (int) (inb (ATA_ADDRESS2 (bus)));
+
+    DLOG ("atapi_drive_read_sectors(%X,%X,%X,%X,%p): block size = %X",
+          bus, drive, lba, count, buffer, size);
+
+    /* Once all our data is in, the hardware may still report the
+     * same size value as before on the completion IRQ.  Never read
+     * past what we asked for. */
+    if (size > want - total)
+      size = want - total;
+
+    if (size > 0) {
+      insw (ATA_DATA (bus), buffer + total, size / 2);
+      total += size;
+    }
 
-  /* Read data */
-  insw (ATA_DATA (bus), buffer, size / 2);
+    if (total >= want) {
+      /* Wait for the completion IRQ back on the Main VCPU */
+      if (sched_enabled)
+        lookup_TSS (str ())->cpu = cpu;
+      atapi_wait_irq (bus);
+      break;
+    }
+  }
 
-  /* Wait for IRQ indicating next transfer ready.  It will be a
-   * zero-byte transfer but we must still wait for the IRQ.*/
-  if (sched_enabled) {
-    /* Return to Main VCPU */
+  if (sched_enabled)
     lookup_TSS (str ())->cpu = cpu;
 
-#ifdef SECOND
-    ATAPI_MEASURE_START;
-    u64 finish;
-    RDTSC (irq_start);
-#else
-    irq_start = 0;
-#endif
-    schedule ();
-#ifdef SECOND
-    RDTSC (finish);
-    irq_turnaround += finish - irq_start;
-    ATAPI_MEASURE_FINISH;
-#endif
-  } else
-    ata_poll_for_irq (bus);
-
-  /* Read size of "fake" transfer (may be 0) */
-  fake_size =
-    (((int) inb (ATA_ADDRESS3 (bus))) << 8) |
-    (int) (inb (ATA_ADDRESS2 (bus)));
-
-  DLOG ("atapi_drive_read_sector(%X,%X,%X,%p): fake size = %X",
-        bus, drive, lba, buffer, fake_size);
-
-  /* At this point we already have read all our data, but the hardware
-   * may still report the same size value as before.  It is up to us
-   * to know that this second IRQ fired but there is no more data to
-   * be read. */
-
-  /* To be sure, if the hardware sends me less than a sector at a
-   * time, the above code is broken.  Not sure that will be an
-   * issue. */
-
   /* Wait for BSY and DRQ to clear */
   while ((status = inb (ATA_COMMAND (bus))) & 0x88)
     asm volatile ("pause");
 
  cleanup:
   ata_release ();
-  return size;
+  return total;
 }
 
 /* instrumentation variables */
@@ -607,7 +671,8 @@ u32 atapi_req_count = 0;
 u64 atapi_req_diff;
 
 int
-atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+atapi_drive_read_sectors (uint32 bus, uint32 drive, uint32 lba,
+                          uint32 count, uint8 * buffer)
 {
   int size;
   u64 start = 0, finish;
@@ -625,7 +690,7 @@ atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
   }
 
   /* invoke actual function */
-  size = _atapi_drive_read_sector (bus, drive, lba, buffer);
+  size = _atapi_drive_read_sectors (bus, drive, lba, count, buffer);
 
   if (sched_enabled) {
     /* conclude instrumentation */
@@ -633,7 +698,8 @@ atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
     vfinish = vcpu_current_vtsc ();
 
     /* record size and timing info */
-    atapi_bytes += size;
+    if (size > 0)
+      atapi_bytes += size;
     atapi_timestamps += finish - start;
     atapi_sector_read_time += finish - start;
     atapi_sector_cpu_time += vfinish - vstart;
@@ -647,6 +713,12 @@ atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
   return size;
 }
 
+int
+atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+{
+  return atapi_drive_read_sectors (bus, drive, lba, 1, buffer);
+}
+
 extern u32
 atapi_sample_bps (void)
 {
@@ -0,0 +1,151 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Block device registry.  Drivers register disks here; filesystems
+ * look them up by name and issue multi-sector requests, which are
+ * split to the driver's limit and bounced if misaligned. */
+
+#include "drivers/block/block.h"
+#include "arch/i386.h"
+#include "util/printf.h"
+#include "sched/sched.h"
+#include "kernel.h"
+
+//#define DEBUG_BLOCK
+
+#ifdef DEBUG_BLOCK
+#define DLOG(fmt,...) DLOG_PREFIX("block",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+static block_device *block_devices[BLOCK_MAX_DEVICES];
+static uint block_device_count = 0;
+
+/* Bounce page for requests whose buffer the driver cannot use
+ * directly.  Drivers may sleep, so it is handed out one task at a
+ * time. */
+static u8 block_bounce[0x1000] ALIGNED (0x1000);
+static bool block_bounce_busy = FALSE;
+static task_id block_bounce_waitq = 0;
+
+bool
+block_register_device (block_device *dev)
+{
+  if (block_device_count >= BLOCK_MAX_DEVICES)
+    return FALSE;
+  if (dev->sector_size == 0 || dev->max_sectors == 0 || !dev->read_func)
+    return FALSE;
+  if (dev->dma_align == 0)
+    dev->dma_align = 1;
+
+  block_devices[block_device_count++] = dev;
+
+  logger_printf ("block: %s: %d sectors of %d bytes\n",
+                 dev->name, (u32) dev->num_sectors, dev->sector_size);
+  return TRUE;
+}
+
+block_device *
+block_lookup (char *name)
+{
+  uint i;
+  for (i=0; i<block_device_count; i++)
+    if (strncmp (block_devices[i]->name, name, BLOCK_NAME_LEN) == 0)
+      return block_devices[i];
+  return NULL;
+}
+
+static sint
+block_xfer (block_device *dev, uint32 lba, uint count, uint8 *buf,
+            block_xfer_func_t func, bool write)
+{
+  uint n, total = 0, max = dev->max_sectors;
+  bool bounce;
+  sint res = 0;
+
+  if (!func)
+    return -1;
+
+  bounce = ((uint) buf & (dev->dma_align - 1)) != 0;
+  if (bounce) {
+    DLOG ("%s: bouncing %d sectors at %p", dev->name, count, buf);
+    if (max > sizeof (block_bounce) / dev->sector_size)
+      max = sizeof (block_bounce) / dev->sector_size;
+    while (block_bounce_busy) {
+      queue_append (&block_bounce_waitq, str ());
+      schedule ();
+    }
+    block_bounce_busy = TRUE;
+  }
+
+  while (count > 0) {
+    n = count > max ? max : count;
+
+    if (bounce) {
+      if (write)
+        memcpy (block_bounce, buf + total, n * dev->sector_size);
+      res = func (dev, lba, n, block_bounce);
+      if (res > 0 && !write)
+        memcpy (buf + total, block_bounce, res);
+    } else
+      res = func (dev, lba, n, buf + total);
+
+    if (res != n * dev->sector_size) {
+      res = -1;
+      break;
+    }
+
+    total += res;
+    lba += n;
+    count -= n;
+  }
+
+  if (bounce) {
+    block_bounce_busy = FALSE;
+    wakeup_queue (&block_bounce_waitq);
+  }
+
+  return res < 0 ? -1 : total;
+}
+
+/* Read count sectors starting at lba into buf.  Returns the number
+ * of bytes read, or -1. */
+sint
+block_read (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return block_xfer (dev, lba, count, buf, dev->read_func, FALSE);
+}
+
+/* Write count sectors starting at lba from buf.  Returns the number
+ * of bytes written, or -1. */
+sint
+block_write (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return block_xfer (dev, lba, count, buf, dev->write_func, TRUE);
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
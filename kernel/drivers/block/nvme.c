@@ -0,0 +1,696 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* NVMe block driver.
+ *
+ * One I/O submission/completion queue pair is created per processor
+ * (as many as the controller grants), so each CPU submits to its own
+ * queue and nothing is shared on the I/O path apart from the queue's
+ * own lock.  Each pair has a bottom-half thread on the disk IO-VCPU
+ * that reaps the completion queue and wakes the submitters; the
+ * interrupt handler only masks the interrupt and schedules those
+ * threads.  Namespace 1 is registered as block device "nvme0". */
+
+#include "drivers/pci/pci.h"
+#include "drivers/block/block.h"
+#include "arch/i386.h"
+#include "arch/i386-percpu.h"
+#include "util/printf.h"
+#include "util/cassert.h"
+#include "smp/smp.h"
+#include "smp/apic.h"
+#include "smp/spinlock.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "sched/sched.h"
+#include "sched/vcpu.h"
+#include "kernel.h"
+
+//#define DEBUG_NVME
+
+#ifdef DEBUG_NVME
+#define DLOG(fmt,...) DLOG_PREFIX("nvme",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define NVME_PCI_CLASS    0x01  /* mass storage */
+#define NVME_PCI_SUBCLASS 0x08  /* non-volatile memory */
+#define NVME_PCI_PROGIF   0x02  /* NVM Express */
+
+/* Controller registers */
+#define NVME_CAP    0x00
+#define NVME_VS     0x08
+#define NVME_INTMS  0x0C
+#define NVME_INTMC  0x10
+#define NVME_CC     0x14
+#define NVME_CSTS   0x1C
+#define NVME_AQA    0x24
+#define NVME_ASQ    0x28
+#define NVME_ACQ    0x30
+#define NVME_DBS    0x1000
+
+#define NVME_CAP_MQES(c)   ((c) & 0xFFFF)
+#define NVME_CAP_TO(c)     (((c) >> 24) & 0xFF) /* in 500ms units */
+#define NVME_CAP_DSTRD(c)  ((c) & 0xF)          /* in the high dword */
+
+#define NVME_CC_EN         (1 << 0)
+#define NVME_CC_IOSQES     (6 << 16)            /* 64-byte SQ entries */
+#define NVME_CC_IOCQES     (4 << 20)            /* 16-byte CQ entries */
+#define NVME_CSTS_RDY      (1 << 0)
+#define NVME_CSTS_CFS      (1 << 1)
+
+/* Admin opcodes */
+#define NVME_ADMIN_CREATE_SQ  0x01
+#define NVME_ADMIN_CREATE_CQ  0x05
+#define NVME_ADMIN_IDENTIFY   0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEAT_NUM_QUEUES  0x07
+
+/* NVM opcodes */
+#define NVME_CMD_WRITE  0x01
+#define NVME_CMD_READ   0x02
+
+#define NVME_QUEUE_DEPTH  32
+#define NVME_MAX_IO_QUEUES MAX_CPUS
+/* Largest transfer: one PRP list of 16 entries per command covers it
+ * from any starting offset. */
+#define NVME_MAX_XFER     0x10000
+#define NVME_PRP_ENTRIES  (NVME_MAX_XFER >> 12)
+#define NVME_NSID         1
+
+typedef struct {
+  u8 opcode;
+  u8 flags;
+  u16 cid;
+  u32 nsid;
+  u32 _reserved[2];
+  u64 mptr;
+  u64 prp1;
+  u64 prp2;
+  u32 cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+} PACKED nvme_cmd;
+
+typedef struct {
+  u32 result;
+  u32 _reserved;
+  u16 sq_head;
+  u16 sq_id;
+  u16 cid;
+  volatile u16 status;          /* bit 0 is the phase tag */
+} PACKED nvme_cqe;
+
+CASSERT (sizeof (nvme_cmd) == 64, nvme_cmd_size);
+CASSERT (sizeof (nvme_cqe) == 16, nvme_cqe_size);
+
+/* A submission/completion queue pair.  The DMA memory is three
+ * contiguous pages: SQ, CQ and one PRP list per command id. */
+typedef struct {
+  uint qid;
+  nvme_cmd *sq;
+  nvme_cqe *cq;
+  u64 *prps;
+  u32 phys;
+  u16 sq_tail, cq_head;
+  u16 phase;
+  spinlock lock;
+  u32 busy;                     /* command ids handed out */
+  u32 done;                     /* command ids completed, not yet collected */
+  task_id owner[NVME_QUEUE_DEPTH];
+  u16 status[NVME_QUEUE_DEPTH];
+  u32 result[NVME_QUEUE_DEPTH];
+  task_id waitq;
+  task_id bh_id;
+  u64 T;                        /* period of the last submitter's VCPU */
+} nvme_queue_t;
+
+#define NVME_QUEUE_PAGES 3
+
+static volatile u8 *nvme_mmio;
+static uint nvme_mmio_pages;
+static u32 nvme_dstrd;
+static bool nvme_polled = TRUE;
+static nvme_queue_t nvme_admin_queue;
+static nvme_queue_t nvme_io_queues[NVME_MAX_IO_QUEUES];
+static uint nvme_num_io_queues = 0;
+static u32 nvme_bh_pending = 0;
+static uint32 nvme_bh_stack[NVME_MAX_IO_QUEUES][1024] ALIGNED (0x1000);
+static block_device nvme_bdev;
+
+extern DEF_PER_CPU (vcpu *, vcpu_current);
+
+static inline u32
+nvme_read (u32 reg)
+{
+  return *(volatile u32 *) (nvme_mmio + reg);
+}
+
+static inline void
+nvme_write (u32 reg, u32 val)
+{
+  *(volatile u32 *) (nvme_mmio + reg) = val;
+}
+
+#define NVME_SQ_DB(q) (NVME_DBS + ((2 * (q)->qid) << (2 + nvme_dstrd)))
+#define NVME_CQ_DB(q) (NVME_DBS + ((2 * (q)->qid + 1) << (2 + nvme_dstrd)))
+
+static bool
+nvme_wait_ready (u32 rdy, u32 timeout_ms)
+{
+  while ((nvme_read (NVME_CSTS) & NVME_CSTS_RDY) != rdy) {
+    if (timeout_ms-- == 0)
+      return FALSE;
+    tsc_delay_usec (1000);
+  }
+  return TRUE;
+}
+
+static bool
+nvme_queue_alloc (nvme_queue_t *q, uint qid)
+{
+  u8 *mem;
+  u32 phys = alloc_phys_frames (NVME_QUEUE_PAGES);
+
+  if (phys == -1)
+    return FALSE;
+  mem = map_contiguous_virtual_pages (phys | 3, NVME_QUEUE_PAGES);
+  if (!mem) {
+    free_phys_frames (phys, NVME_QUEUE_PAGES);
+    return FALSE;
+  }
+  memset (mem, 0, NVME_QUEUE_PAGES << 12);
+  memset (q, 0, sizeof (nvme_queue_t));
+  q->qid = qid;
+  q->phys = phys;
+  q->sq = (nvme_cmd *) mem;
+  q->cq = (nvme_cqe *) (mem + 0x1000);
+  q->prps = (u64 *) (mem + 0x2000);
+  q->phase = 1;
+  /* a full ring (tail == head) would read as empty: never hand out
+   * the last id, so at most NVME_QUEUE_DEPTH - 1 are in flight */
+  q->busy = 1 << (NVME_QUEUE_DEPTH - 1);
+  spinlock_init (&q->lock);
+  return TRUE;
+}
+
+static void
+nvme_queue_free (nvme_queue_t *q)
+{
+  unmap_virtual_pages (q->sq, NVME_QUEUE_PAGES);
+  free_phys_frames (q->phys, NVME_QUEUE_PAGES);
+}
+
+/* Collect new completion entries.  Returns TRUE if any were found. */
+static bool
+nvme_queue_reap (nvme_queue_t *q)
+{
+  nvme_cqe *e;
+  u16 cid;
+  bool found = FALSE;
+
+  spinlock_lock (&q->lock);
+  for (;;) {
+    e = &q->cq[q->cq_head];
+    if ((e->status & 1) != q->phase)
+      break;
+    cid = e->cid;
+    if (cid < NVME_QUEUE_DEPTH) {
+      q->status[cid] = e->status >> 1;
+      q->result[cid] = e->result;
+      q->done |= 1 << cid;
+      if (q->owner[cid] && sched_enabled && !nvme_polled)
+        wakeup (q->owner[cid]);
+    }
+    if (++q->cq_head == NVME_QUEUE_DEPTH) {
+      q->cq_head = 0;
+      q->phase ^= 1;
+    }
+    found = TRUE;
+  }
+  if (found)
+    nvme_write (NVME_CQ_DB (q), q->cq_head);
+  spinlock_unlock (&q->lock);
+  return found;
+}
+
+static inline bool
+nvme_queue_pending (nvme_queue_t *q)
+{
+  return (q->cq[q->cq_head].status & 1) == q->phase;
+}
+
+/* Reserve a command id on the queue, sleeping while all are busy. */
+static uint
+nvme_get_cid (nvme_queue_t *q)
+{
+  uint cid;
+
+  spinlock_lock (&q->lock);
+  while (q->busy == ~0U) {
+    queue_append (&q->waitq, str ());
+    spinlock_unlock (&q->lock);
+    schedule ();
+    spinlock_lock (&q->lock);
+  }
+  cid = ffs (~q->busy);
+  q->busy |= 1 << cid;
+  spinlock_unlock (&q->lock);
+  return cid;
+}
+
+/* Issue a command under a reserved id and wait for it; the id is
+ * released afterwards.  Returns the NVMe status code (0 on success),
+ * with the completion's dword 0 stored in *result if given. */
+static uint
+nvme_exec (nvme_queue_t *q, uint cid, nvme_cmd *cmd, u32 *result)
+{
+  vcpu *cur;
+  u32 bit = 1 << cid;
+  uint status, i;
+
+  spinlock_lock (&q->lock);
+  q->owner[cid] = str ();
+  if ((cur = percpu_read (vcpu_current)))
+    q->T = cur->T;
+
+  cmd->cid = cid;
+  memcpy (&q->sq[q->sq_tail], cmd, sizeof (nvme_cmd));
+  if (++q->sq_tail == NVME_QUEUE_DEPTH)
+    q->sq_tail = 0;
+  nvme_write (NVME_SQ_DB (q), q->sq_tail);
+  spinlock_unlock (&q->lock);
+
+  if (nvme_polled || !sched_enabled || q->qid == 0) {
+    for (i = 0; !(q->done & bit) && i < 5000000; i++) {
+      nvme_queue_reap (q);
+      tsc_delay_usec (1);
+    }
+  } else {
+    while (!(q->done & bit))
+      schedule ();
+  }
+
+  spinlock_lock (&q->lock);
+  status = (q->done & bit) ? q->status[cid] : ~0;
+  if (result)
+    *result = q->result[cid];
+  /* a timed-out id stays busy: the controller may still use it */
+  if (q->done & bit)
+    q->busy &= ~bit;
+  q->done &= ~bit;
+  q->owner[cid] = 0;
+  wakeup_queue (&q->waitq);
+  spinlock_unlock (&q->lock);
+
+  DLOG ("q%d cid %d opcode 0x%x status 0x%x", q->qid, cid, cmd->opcode,
+        status);
+  return status;
+}
+
+static uint
+nvme_admin (nvme_cmd *cmd, u32 *result)
+{
+  return nvme_exec (&nvme_admin_queue, nvme_get_cid (&nvme_admin_queue),
+                    cmd, result);
+}
+
+static void
+nvme_bh_thread (nvme_queue_t *q)
+{
+  for (;;) {
+    nvme_queue_reap (q);
+
+    /* unmask once every queue that was pending has been drained */
+    nvme_bh_pending &= ~(1 << q->qid);
+    if (nvme_bh_pending == 0)
+      nvme_write (NVME_INTMC, 1);
+
+    iovcpu_job_completion ();
+  }
+}
+
+/* All queues share pin-based vector 0.  The line stays asserted until
+ * the completion queues are drained, so mask it and hand the work to
+ * the bottom halves. */
+static uint32
+nvme_irq_handler (uint8 vec)
+{
+  nvme_queue_t *q;
+  uint i;
+
+  lock_kernel ();
+  for (i = 0; i < nvme_num_io_queues; i++) {
+    q = &nvme_io_queues[i];
+    if (nvme_queue_pending (q) && !(nvme_bh_pending & (1 << q->qid))) {
+      if (nvme_bh_pending == 0)
+        nvme_write (NVME_INTMS, 1);
+      nvme_bh_pending |= 1 << q->qid;
+      iovcpu_job_wakeup (q->bh_id, q->T);
+    }
+  }
+  unlock_kernel ();
+  return 0;
+}
+
+/* Fill in PRP1/PRP2 for buf, spilling into the command id's PRP
+ * list when the buffer spans more than two pages. */
+static void
+nvme_build_prps (nvme_cmd *cmd, u64 *list, u32 list_phys, u8 *buf, u32 len)
+{
+  u32 first = 0x1000 - ((u32) buf & 0xFFF);
+  uint i, n;
+
+  cmd->prp1 = (u32) get_phys_addr (buf);
+  if (len <= first)
+    return;
+  buf += first;
+  len -= first;
+  if (len <= 0x1000) {
+    cmd->prp2 = (u32) get_phys_addr (buf);
+    return;
+  }
+  n = (len + 0xFFF) >> 12;
+  for (i = 0; i < n; i++, buf += 0x1000)
+    list[i] = (u32) get_phys_addr (buf);
+  cmd->prp2 = list_phys;
+}
+
+static sint
+nvme_rw (block_device *dev, uint32 lba, uint count, uint8 *buf, bool write)
+{
+  nvme_queue_t *q = &nvme_io_queues[get_pcpu_id () % nvme_num_io_queues];
+  u32 len = count * dev->sector_size;
+  nvme_cmd cmd;
+  uint cid, status;
+
+  cid = nvme_get_cid (q);
+
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+  cmd.nsid = NVME_NSID;
+  cmd.cdw10 = lba;
+  cmd.cdw11 = 0;
+  cmd.cdw12 = count - 1;
+  nvme_build_prps (&cmd, &q->prps[cid * NVME_PRP_ENTRIES],
+                   q->phys + 0x2000 + cid * NVME_PRP_ENTRIES * sizeof (u64),
+                   buf, len);
+
+  status = nvme_exec (q, cid, &cmd, NULL);
+
+  if (status != 0) {
+    DLOG ("%s lba=%d count=%d failed: status 0x%x",
+          write ? "write" : "read", lba, count, status);
+    return -1;
+  }
+  return len;
+}
+
+static sint
+nvme_block_read (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return nvme_rw (dev, lba, count, buf, FALSE);
+}
+
+static sint
+nvme_block_write (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return nvme_rw (dev, lba, count, buf, TRUE);
+}
+
+/* Create I/O queue pair qid (CQ first, as the SQ refers to it). */
+static bool
+nvme_create_io_queue (nvme_queue_t *q, uint qid)
+{
+  nvme_cmd cmd;
+
+  if (!nvme_queue_alloc (q, qid))
+    return FALSE;
+
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = NVME_ADMIN_CREATE_CQ;
+  cmd.prp1 = q->phys + 0x1000;
+  cmd.cdw10 = ((NVME_QUEUE_DEPTH - 1) << 16) | qid;
+  cmd.cdw11 = (0 << 16) | (1 << 1) | 1; /* vector 0, IEN, PC */
+  if (nvme_admin (&cmd, NULL) != 0)
+    goto abort;
+
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = NVME_ADMIN_CREATE_SQ;
+  cmd.prp1 = q->phys;
+  cmd.cdw10 = ((NVME_QUEUE_DEPTH - 1) << 16) | qid;
+  cmd.cdw11 = (qid << 16) | 1;          /* CQID, PC */
+  if (nvme_admin (&cmd, NULL) != 0)
+    goto abort;
+
+  return TRUE;
+
+ abort:
+  DLOG ("unable to create I/O queue %d", qid);
+  nvme_queue_free (q);
+  return FALSE;
+}
+
+static bool
+nvme_identify (u32 *lba_size, u64 *nsze, u32 *mdts)
+{
+  u8 *id = (u8 *) nvme_admin_queue.prps;
+  u32 id_phys = nvme_admin_queue.phys + 0x2000;
+  nvme_cmd cmd;
+  uint flbas;
+
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.prp1 = id_phys;
+  cmd.cdw10 = 1;                        /* controller */
+  if (nvme_admin (&cmd, NULL) != 0)
+    return FALSE;
+  *mdts = id[77];
+  DLOG ("model: %.40s MDTS=%d", id + 24, *mdts);
+
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.nsid = NVME_NSID;
+  cmd.prp1 = id_phys;
+  cmd.cdw10 = 0;                        /* namespace */
+  if (nvme_admin (&cmd, NULL) != 0)
+    return FALSE;
+  *nsze = *(u64 *) id;
+  flbas = id[26] & 0xF;
+  *lba_size = 1 << id[128 + flbas * 4 + 2];
+  return *nsze != 0;
+}
+
+extern bool
+nvme_init (void)
+{
+  uint device_index, mem_addr, irq_line, irq_pin, i;
+  u32 cap_lo, cap_hi, cc, lba_size, mdts, result, nq;
+  u64 nsze;
+  uint timeout;
+  pci_device dev;
+  pci_irq_t irq;
+  nvme_cmd cmd;
+
+  if (mp_ISA_PC) {
+    DLOG ("Requires PCI support");
+    return FALSE;
+  }
+
+  /* Find the NVMe controller on the PCI bus */
+  device_index = ~0;
+  i=0;
+  while (pci_find_device (0xFFFF, 0xFFFF, NVME_PCI_CLASS, NVME_PCI_SUBCLASS,
+                          i, &i)) {
+    if (pci_get_device (i, &dev)) {
+      if (dev.progIF == NVME_PCI_PROGIF) {
+        device_index = i;
+        break;
+      }
+      i++;
+    } else break;
+  }
+
+  if (device_index == ~0) {
+    DLOG ("Unable to detect NVMe controller.");
+    return FALSE;
+  }
+
+  if (!pci_decode_bar (device_index, 0, &mem_addr, NULL, NULL) ||
+      mem_addr == 0) {
+    DLOG ("Invalid PCI configuration or BAR0 not found");
+    return FALSE;
+  }
+
+  DLOG ("Using PCI bus=%x dev=%x func=%x BAR0=%p",
+        dev.bus, dev.slot, dev.func, mem_addr);
+
+  /* enable memory mapped I/O and bus mastering */
+  pci_write_word (pci_addr (dev.bus, dev.slot, dev.func, 0x04), 0x0006);
+
+  /* map the registers, then again once the doorbell stride is known */
+  nvme_mmio = map_virtual_page (mem_addr | 3);
+  if (nvme_mmio == NULL)
+    return FALSE;
+  cap_lo = nvme_read (NVME_CAP);
+  cap_hi = nvme_read (NVME_CAP + 4);
+  unmap_virtual_page ((void *) nvme_mmio);
+  nvme_dstrd = NVME_CAP_DSTRD (cap_hi);
+  nvme_mmio_pages = 1 + ((((2 * (NVME_MAX_IO_QUEUES + 1)) << (2 + nvme_dstrd))
+                          + 0xFFF) >> 12);
+  nvme_mmio = map_contiguous_virtual_pages (mem_addr | 3, nvme_mmio_pages);
+  if (nvme_mmio == NULL) {
+    DLOG ("Unable to map registers at phys=%p", mem_addr);
+    return FALSE;
+  }
+
+  DLOG ("CAP=%p%p VS=%p", cap_hi, cap_lo, nvme_read (NVME_VS));
+  if (NVME_CAP_MQES (cap_lo) + 1 < NVME_QUEUE_DEPTH) {
+    DLOG ("Queues too shallow (MQES=%d)", NVME_CAP_MQES (cap_lo));
+    goto abort_mmio;
+  }
+  timeout = NVME_CAP_TO (cap_lo) * 500 + 500;
+
+  /* reset */
+  nvme_write (NVME_CC, nvme_read (NVME_CC) & ~NVME_CC_EN);
+  if (!nvme_wait_ready (0, timeout)) {
+    DLOG ("Controller did not reset");
+    goto abort_mmio;
+  }
+
+  if (!nvme_queue_alloc (&nvme_admin_queue, 0))
+    goto abort_mmio;
+  nvme_write (NVME_AQA, ((NVME_QUEUE_DEPTH - 1) << 16) |
+              (NVME_QUEUE_DEPTH - 1));
+  nvme_write (NVME_ASQ, nvme_admin_queue.phys);
+  nvme_write (NVME_ASQ + 4, 0);
+  nvme_write (NVME_ACQ, nvme_admin_queue.phys + 0x1000);
+  nvme_write (NVME_ACQ + 4, 0);
+
+  /* admin commands complete by polling; keep the interrupt quiet */
+  nvme_write (NVME_INTMS, ~0);
+
+  cc = NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES; /* NVM set, 4K pages */
+  nvme_write (NVME_CC, cc);
+  if (!nvme_wait_ready (NVME_CSTS_RDY, timeout) ||
+      (nvme_read (NVME_CSTS) & NVME_CSTS_CFS)) {
+    DLOG ("Controller did not become ready");
+    goto abort_admin;
+  }
+
+  if (!nvme_identify (&lba_size, &nsze, &mdts)) {
+    DLOG ("IDENTIFY failed");
+    goto abort_disable;
+  }
+
+  /* ask for one queue pair per CPU */
+  nq = mp_num_cpus;
+  if (nq > NVME_MAX_IO_QUEUES)
+    nq = NVME_MAX_IO_QUEUES;
+  if (nq == 0)
+    nq = 1;
+  memset (&cmd, 0, sizeof (cmd));
+  cmd.opcode = NVME_ADMIN_SET_FEATURES;
+  cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+  cmd.cdw11 = ((nq - 1) << 16) | (nq - 1);
+  if (nvme_admin (&cmd, &result) != 0) {
+    DLOG ("Set Features (number of queues) failed");
+    goto abort_disable;
+  }
+  if ((result & 0xFFFF) + 1 < nq)
+    nq = (result & 0xFFFF) + 1;
+  if ((result >> 16) + 1 < nq)
+    nq = (result >> 16) + 1;
+
+  for (i = 0; i < nq; i++) {
+    if (!nvme_create_io_queue (&nvme_io_queues[i], i + 1))
+      break;
+    nvme_num_io_queues++;
+  }
+  if (nvme_num_io_queues == 0)
+    goto abort_disable;
+
+  if (pci_get_interrupt (device_index, &irq_line, &irq_pin) &&
+      pci_irq_find (dev.bus, dev.slot, irq_pin, &irq) &&
+      pci_irq_map_handler (&irq, nvme_irq_handler, 0x01,
+                           IOAPIC_DESTINATION_LOGICAL,
+                           IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+    nvme_polled = FALSE;
+    for (i = 0; i < nvme_num_io_queues; i++) {
+      nvme_queue_t *q = &nvme_io_queues[i];
+      q->bh_id = create_kernel_thread_args ((u32) nvme_bh_thread,
+                                            (u32) &nvme_bh_stack[i][1023],
+                                            FALSE, 1, q);
+      set_iovcpu (q->bh_id, IOVCPU_CLASS_DISK);
+    }
+    nvme_write (NVME_INTMC, 1);
+  } else
+    DLOG ("No IRQ routing; polling for completions");
+
+  nvme_bdev.name[0] = 'n';
+  nvme_bdev.name[1] = 'v';
+  nvme_bdev.name[2] = 'm';
+  nvme_bdev.name[3] = 'e';
+  nvme_bdev.name[4] = '0';
+  nvme_bdev.sector_size = lba_size;
+  nvme_bdev.num_sectors = nsze;
+  nvme_bdev.max_sectors = NVME_MAX_XFER / lba_size;
+  if (mdts && (0x1000 << mdts) / lba_size < nvme_bdev.max_sectors)
+    nvme_bdev.max_sectors = (0x1000 << mdts) / lba_size;
+  nvme_bdev.dma_align = 4;              /* PRP entries are dword aligned */
+  nvme_bdev.read_func = nvme_block_read;
+  nvme_bdev.write_func = nvme_block_write;
+  nvme_bdev.drvdata = NULL;
+  if (!block_register_device (&nvme_bdev))
+    goto abort_disable;
+
+  logger_printf ("nvme: %d I/O queue pairs for %d CPUs, %s\n",
+                 nvme_num_io_queues, mp_num_cpus,
+                 nvme_polled ? "polled" : "interrupts");
+  return TRUE;
+
+ abort_disable:
+  nvme_write (NVME_CC, 0);
+  nvme_wait_ready (0, timeout);
+  for (i = 0; i < nvme_num_io_queues; i++)
+    nvme_queue_free (&nvme_io_queues[i]);
+  nvme_num_io_queues = 0;
+ abort_admin:
+  nvme_queue_free (&nvme_admin_queue);
+ abort_mmio:
+  unmap_virtual_pages ((void *) nvme_mmio, nvme_mmio_pages);
+  return FALSE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = nvme_init
+};
+
+DEF_MODULE (storage___nvme, "NVMe driver", &mod_ops, {"pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,342 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Virtio block device.  Each request is a header, the caller's buffer
+ * described page by page, and a status byte, normally packed into
+ * one indirect descriptor.  Several tasks may have requests in
+ * flight; each sleeps until the interrupt handler finds its request
+ * in the used ring.  Registered as block device "vd0". */
+
+#include "drivers/virtio/virtio.h"
+#include "drivers/block/block.h"
+#include "arch/i386.h"
+#include "util/printf.h"
+#include "smp/smp.h"
+#include "smp/apic.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "sched/sched.h"
+#include "kernel.h"
+
+//#define DEBUG_VIRTIO_BLK
+
+#ifdef DEBUG_VIRTIO_BLK
+#define DLOG(fmt,...) DLOG_PREFIX("virtio-blk",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define VIRTIO_BLK_LEGACY_ID 0x1001
+#define VIRTIO_BLK_MODERN_ID 0x1042
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SEG_MAX  2
+#define VIRTIO_BLK_F_RO       5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+
+/* Device configuration */
+#define VIRTIO_BLK_CFG_CAPACITY 0
+#define VIRTIO_BLK_CFG_SEG_MAX  12
+
+#define VIRTIO_BLK_T_IN   0
+#define VIRTIO_BLK_T_OUT  1
+#define VIRTIO_BLK_S_OK   0
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_MAX_REQS    32
+#define VIRTIO_BLK_MAX_SECTORS 128
+/* header, one piece per page of a maximal misaligned buffer, status */
+#define VIRTIO_BLK_MAX_SG ((VIRTIO_BLK_MAX_SECTORS * VIRTIO_BLK_SECTOR_SIZE \
+                            >> 12) + 3)
+
+struct virtio_blk_hdr {
+  u32 type;
+  u32 ioprio;
+  u64 sector;
+} PACKED;
+
+/* Request headers and status bytes, in one DMA page */
+struct virtio_blk_reqs {
+  struct virtio_blk_hdr hdr[VIRTIO_BLK_MAX_REQS];
+  u8 status[VIRTIO_BLK_MAX_REQS];
+} PACKED;
+
+static virtio_device vblk_dev;
+static virtqueue vblk_vq;
+static struct virtio_blk_reqs *vblk_reqs;
+static u32 vblk_reqs_phys;
+static u32 vblk_busy = 0, vblk_done = 0;
+static task_id vblk_owner[VIRTIO_BLK_MAX_REQS];
+static task_id vblk_waitq = 0;
+static bool vblk_polled = TRUE;
+static uint vblk_seg_max = VIRTIO_BLK_MAX_SG - 2;
+static block_device vblk_bdev;
+
+/* Collect finished requests.  Interrupts are suppressed while the
+ * used ring is drained, and re-armed (at the current used index, with
+ * event-idx) only once it is empty. */
+static void
+virtio_blk_reap (void)
+{
+  void *data;
+  uint slot;
+
+  do {
+    virtqueue_disable_cb (&vblk_vq);
+    while ((data = virtqueue_get_buf (&vblk_vq, NULL))) {
+      slot = (uint) data - 1;
+      vblk_done |= 1 << slot;
+      if (vblk_owner[slot] && sched_enabled && !vblk_polled)
+        wakeup (vblk_owner[slot]);
+    }
+  } while (!virtqueue_enable_cb (&vblk_vq));
+
+  /* ring slots freed up */
+  wakeup_queue (&vblk_waitq);
+}
+
+static uint32
+virtio_blk_irq_handler (uint8 vec)
+{
+  lock_kernel ();
+  if (virtio_isr (&vblk_dev) & 1)
+    virtio_blk_reap ();
+  unlock_kernel ();
+  return 0;
+}
+
+static void
+virtio_blk_wait (uint slot)
+{
+  uint i;
+
+  if (vblk_polled || !sched_enabled) {
+    for (i = 0; !(vblk_done & (1 << slot)) && i < 5000000; i++) {
+      virtio_blk_reap ();
+      tsc_delay_usec (1);
+    }
+  } else {
+    while (!(vblk_done & (1 << slot)))
+      schedule ();
+  }
+}
+
+static sint
+virtio_blk_rw (block_device *dev, uint32 lba, uint count, uint8 *buf,
+               bool write)
+{
+  virtio_sg sg[VIRTIO_BLK_MAX_SG];
+  u32 len = count * VIRTIO_BLK_SECTOR_SIZE, chunk, phys;
+  uint slot, n = 0;
+  sint res;
+
+  while (vblk_busy == ~0U) {
+    queue_append (&vblk_waitq, str ());
+    schedule ();
+  }
+  slot = ffs (~vblk_busy);
+  vblk_busy |= 1 << slot;
+
+  vblk_reqs->hdr[slot].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vblk_reqs->hdr[slot].ioprio = 0;
+  vblk_reqs->hdr[slot].sector = lba;
+  vblk_reqs->status[slot] = 0xFF;
+
+  sg[n].addr = vblk_reqs_phys + offsetof (struct virtio_blk_reqs, hdr[slot]);
+  sg[n++].len = sizeof (struct virtio_blk_hdr);
+  while (len > 0) {
+    phys = (u32) get_phys_addr (buf);
+    chunk = 0x1000 - ((u32) buf & 0xFFF);
+    if (chunk > len)
+      chunk = len;
+    if (n > 1 && sg[n - 1].addr + sg[n - 1].len == phys)
+      sg[n - 1].len += chunk;
+    else {
+      if (n - 1 == vblk_seg_max) {
+        res = -1;
+        goto out;
+      }
+      sg[n].addr = phys;
+      sg[n++].len = chunk;
+    }
+    buf += chunk;
+    len -= chunk;
+  }
+  sg[n].addr = vblk_reqs_phys +
+    offsetof (struct virtio_blk_reqs, status[slot]);
+  sg[n++].len = 1;
+
+  vblk_owner[slot] = str ();
+  /* a write's data is device-readable, a read's device-writable */
+  while (virtqueue_add (&vblk_vq, sg, write ? n - 1 : 1,
+                        write ? 1 : n - 1, (void *) (slot + 1)) < 0) {
+    if (vblk_polled || !sched_enabled)
+      virtio_blk_reap ();
+    else {
+      queue_append (&vblk_waitq, str ());
+      schedule ();
+    }
+  }
+  virtqueue_kick (&vblk_vq);
+
+  virtio_blk_wait (slot);
+
+  if (!(vblk_done & (1 << slot))) {
+    /* timed out: leave the slot busy, the device still owns it */
+    DLOG ("request %d timed out", slot);
+    vblk_owner[slot] = 0;
+    return -1;
+  }
+  res = vblk_reqs->status[slot] == VIRTIO_BLK_S_OK ?
+    count * VIRTIO_BLK_SECTOR_SIZE : -1;
+
+ out:
+  vblk_done &= ~(1 << slot);
+  vblk_busy &= ~(1 << slot);
+  vblk_owner[slot] = 0;
+  wakeup_queue (&vblk_waitq);
+  return res;
+}
+
+static sint
+virtio_blk_read (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return virtio_blk_rw (dev, lba, count, buf, FALSE);
+}
+
+static sint
+virtio_blk_write (block_device *dev, uint32 lba, uint count, uint8 *buf)
+{
+  return virtio_blk_rw (dev, lba, count, buf, TRUE);
+}
+
+extern bool
+virtio_blk_init (void)
+{
+  uint irq_line, irq_pin, max;
+  pci_irq_t irq;
+  u32 phys;
+
+  if (mp_ISA_PC) {
+    DLOG ("Requires PCI support");
+    return FALSE;
+  }
+
+  if (!virtio_pci_find (VIRTIO_BLK_LEGACY_ID, VIRTIO_BLK_MODERN_ID,
+                        &vblk_dev)) {
+    DLOG ("Unable to detect virtio block device.");
+    return FALSE;
+  }
+
+  virtio_reset (&vblk_dev);
+  virtio_add_status (&vblk_dev, VIRTIO_STATUS_ACKNOWLEDGE);
+  virtio_add_status (&vblk_dev, VIRTIO_STATUS_DRIVER);
+
+  if (!virtio_negotiate (&vblk_dev,
+                         VIRTIO_FEATURE (VIRTIO_F_INDIRECT_DESC) |
+                         VIRTIO_FEATURE (VIRTIO_F_EVENT_IDX) |
+                         VIRTIO_FEATURE (VIRTIO_BLK_F_SEG_MAX) |
+                         VIRTIO_FEATURE (VIRTIO_BLK_F_RO) |
+                         VIRTIO_FEATURE (VIRTIO_BLK_F_BLK_SIZE))) {
+    DLOG ("Feature negotiation failed");
+    goto abort;
+  }
+
+  if (virtio_has_feature (&vblk_dev, VIRTIO_BLK_F_SEG_MAX)) {
+    max = virtio_config_read32 (&vblk_dev, VIRTIO_BLK_CFG_SEG_MAX);
+    if (max > 0 && max < vblk_seg_max)
+      vblk_seg_max = max;
+  }
+
+  if (!virtqueue_init (&vblk_dev, 0, &vblk_vq)) {
+    DLOG ("Unable to set up request queue");
+    goto abort;
+  }
+
+  phys = alloc_phys_frame ();
+  if (phys == -1)
+    goto abort;
+  vblk_reqs = map_virtual_page (phys | 3);
+  if (!vblk_reqs) {
+    free_phys_frame (phys);
+    goto abort;
+  }
+  vblk_reqs_phys = phys;
+  memset (vblk_reqs, 0, sizeof (struct virtio_blk_reqs));
+
+  if (pci_get_interrupt (vblk_dev.index, &irq_line, &irq_pin) &&
+      pci_irq_find (vblk_dev.pci.bus, vblk_dev.pci.slot, irq_pin, &irq) &&
+      pci_irq_map_handler (&irq, virtio_blk_irq_handler, 0x01,
+                           IOAPIC_DESTINATION_LOGICAL,
+                           IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+    vblk_polled = FALSE;
+  } else
+    DLOG ("No IRQ routing; polling for completions");
+
+  virtio_add_status (&vblk_dev, VIRTIO_STATUS_DRIVER_OK);
+
+  vblk_bdev.name[0] = 'v';
+  vblk_bdev.name[1] = 'd';
+  vblk_bdev.name[2] = '0';
+  vblk_bdev.sector_size = VIRTIO_BLK_SECTOR_SIZE;
+  vblk_bdev.num_sectors = virtio_config_read64 (&vblk_dev,
+                                                VIRTIO_BLK_CFG_CAPACITY);
+  /* the worst-case buffer straddles one page more than it covers */
+  max = (vblk_seg_max - 1) * (0x1000 / VIRTIO_BLK_SECTOR_SIZE);
+  vblk_bdev.max_sectors = max < VIRTIO_BLK_MAX_SECTORS ?
+    max : VIRTIO_BLK_MAX_SECTORS;
+  vblk_bdev.dma_align = 1;
+  vblk_bdev.read_func = virtio_blk_read;
+  vblk_bdev.write_func =
+    virtio_has_feature (&vblk_dev, VIRTIO_BLK_F_RO) ? NULL : virtio_blk_write;
+  vblk_bdev.drvdata = &vblk_dev;
+  if (vblk_bdev.max_sectors == 0 || !block_register_device (&vblk_bdev))
+    goto abort;
+
+  logger_printf ("virtio-blk: %s transport, %s%s, %s\n",
+                 vblk_dev.modern ? "modern" : "legacy",
+                 virtio_has_feature (&vblk_dev, VIRTIO_F_INDIRECT_DESC) ?
+                 "indirect " : "",
+                 virtio_has_feature (&vblk_dev, VIRTIO_F_EVENT_IDX) ?
+                 "event-idx" : "",
+                 vblk_polled ? "polled" : "interrupts");
+  return TRUE;
+
+ abort:
+  virtio_add_status (&vblk_dev, VIRTIO_STATUS_FAILED);
+  return FALSE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = virtio_blk_init
+};
+
+DEF_MODULE (storage___virtio_blk, "virtio block driver", &mod_ops, {"pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -19,6 +19,9 @@
 
 #include "drivers/pci/pci.h"
 #include "drivers/net/ethernet.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip.h"
+#include "netif/etharp.h"
 #include "arch/i386.h"
 #include "arch/i386-percpu.h"
 #include "util/printf.h"
@@ -51,26 +54,65 @@ nvm_info_t *nvm = &i82543_nvm;
 #define DLOG(fmt,...) ;
 #endif
 
-#define RDESC_COUNT 8           /* must be multiple of 8 */
+/* Ring sizes: powers of two from 256 to 1024, may be overridden at
+ * build time.  Only the rings are mapped into the kernel's window, at
+ * 16 bytes a descriptor; the RX buffers are not. */
+#ifndef E1000_RDESC_COUNT
+#define E1000_RDESC_COUNT 256
+#endif
+#ifndef E1000_TDESC_COUNT
+#define E1000_TDESC_COUNT 256
+#endif
+#if E1000_RDESC_COUNT < 256 || E1000_RDESC_COUNT > 1024 || \
+  (E1000_RDESC_COUNT & (E1000_RDESC_COUNT - 1))
+#error "E1000_RDESC_COUNT must be a power of two from 256 to 1024"
+#endif
+#if E1000_TDESC_COUNT < 256 || E1000_TDESC_COUNT > 1024 || \
+  (E1000_TDESC_COUNT & (E1000_TDESC_COUNT - 1))
+#error "E1000_TDESC_COUNT must be a power of two from 256 to 1024"
+#endif
+
+#define RDESC_COUNT E1000_RDESC_COUNT
 #define RDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
 #define RBUF_SIZE   2048        /* configured in RCTL.BSIZE */
 #define RBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
-
-#define TDESC_COUNT 8           /* must be multiple of 8 */
-#define TDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
-#define TBUF_SIZE   2048        /* configured in TCTL.BSIZE */
-#define TBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
+/* RX buffers are physical frames, two to a page, that stay with their
+ * slot.  A frame is copied out of them into pool pbufs, with each
+ * buffer mapped only for the copy. */
+#define RBUFS_PER_PAGE (0x1000 / RBUF_SIZE)
+/* Long packets (RCTL.LPE) take up to 16 KB, spread over as many
+ * descriptors as it takes; jumbo frames stop a little short of it */
+#define E1000_MAX_MTU 9000
+#define RX_MAX_DESCS  (16384 / RBUF_SIZE)
+
+#define TDESC_COUNT E1000_TDESC_COUNT
+#define TDESC_COUNT_MOD_MASK (TDESC_COUNT - 1)
+#define TX_MAX_SEGS 64          /* descriptors per frame */
 #define TCTL_CT_MASK   0x100
 #define TCTL_COLD_MASK 0x40000
 #define TIPG_MASK (10 | (10 << 10) | (10 << 20))
 
+/* Interrupt moderation.  RDTR, RADV, TIDV and TADV count in units of
+ * 1.024 usec; ITR caps the interrupt rate of the 82540 and later. */
+#define E1000_RDTR 16
+#define E1000_RADV 64
+#define E1000_TIDV 64
+#define E1000_TADV 256
+#define E1000_INTS_PER_SEC 8000
+#define E1000_ITR (1000000000 / (E1000_INTS_PER_SEC * 256))
+
+/* RX descriptors handled per round of the bottom half before it
+ * yields; a full round means it stays in polling mode. */
+#define E1000_POLL_BUDGET 64
+
 /* List of compatible cards (ended by { 0xFFFF, 0xFFFF }) */
-static struct { uint16 vendor, device; } compatible_ids[] = {
-  { 0x8086, 0x1004 },
-  { 0x8086, 0x1008 },
-  { 0x8086, 0x100E },
+static struct { uint16 vendor, device; bool itr, tso; } compatible_ids[] = {
+  { 0x8086, 0x1004, FALSE, FALSE }, /* 82543GC: no ITR, RADV, TADV, TSO */
+  { 0x8086, 0x1008, FALSE, TRUE },  /* 82544EI: no ITR, RADV, TADV */
+  { 0x8086, 0x100E, TRUE, TRUE },
   { 0xFFFF, 0xFFFF }
 };
+static bool has_itr, has_tso;
 
 static uint8 hwaddr[ETH_ADDR_LEN];
 static uint device_index, mem_addr, irq_line, irq_pin, e1000_phys;
@@ -113,13 +155,21 @@ static volatile uint32 *mmio_base;
 #define ICR    (REG (0x30))     /* Interrupt Cause Read */
 #define ICR_RXT (0x80)          /* RX Timer Int. */
 #define ICR_RXO (0x40)          /* RX Overrun Int. */
+#define ICR_RXDMT (0x10)        /* RX Desc. Min. Threshold Int. */
 #define ICR_TXQE (0x02)         /* TX Queue Empty Int. */
+#define ICR_TXDW (0x01)         /* TX Desc. Written Back Int. */
+#define ITR    (REG (0x31))     /* Interrupt Throttling */
 #define IMS    (REG (0x34))     /* Interrupt Mask Set */
 #define IMS_RXT (0x80)          /* RX Timer Int. */
 #define IMS_RXO (0x40)          /* RX Overrun Int. */
+#define IMS_RXDMT (0x10)        /* RX Desc. Min. Threshold Int. */
 #define IMS_TXQE (0x02)         /* TX Queue Empty Int. */
+#define IMS_TXDW (0x01)         /* TX Desc. Written Back Int. */
+#define IMS_ENABLE (IMS_RXT | IMS_RXO | IMS_RXDMT | IMS_TXDW)
+#define IMC    (REG (0x36))     /* Interrupt Mask Clear */
 #define RCTL   (REG (0x40))     /* Receive Control */
 #define RCTL_EN (0x02)          /* RX Enable */
+#define RCTL_LPE (0x20)         /* Long Packet Enable */
 #define RCTL_BAM (1<<15)        /* Accept Broadcast packets */
 #define RCTL_BSIZE (0x30000)    /* Buffer size */
 #define RCTL_BSEX (1<<25)       /* "Extension" (x16) of size */
@@ -136,11 +186,19 @@ static volatile uint32 *mmio_base;
 #define RDLEN  (REG (0xA02))    /* RX Desc. Length */
 #define RDH    (REG (0xA04))    /* RX Desc Head */
 #define RDT    (REG (0xA06))    /* RX Desc Tail */
+#define RDTR   (REG (0xA08))    /* RX Delay Timer */
+#define RADV   (REG (0xA0B))    /* RX Absolute Int. Delay */
 #define TDBAL  (REG (0xE00))    /* TX Desc. Base Address Low */
 #define TDBAH  (REG (0xE01))    /* TX Desc. Base Address High */
 #define TDLEN  (REG (0xE02))    /* TX Desc. Length */
 #define TDH    (REG (0xE04))    /* TX Desc Head */
 #define TDT    (REG (0xE06))    /* TX Desc Tail */
+#define TIDV   (REG (0xE08))    /* TX Int. Delay Value */
+#define TADV   (REG (0xE0B))    /* TX Absolute Int. Delay */
+#define MPC    (REG (0x1004))   /* Missed Packets Count */
+#define RXCSUM (REG (0x1400))   /* RX Checksum Control */
+#define RXCSUM_IPOFL (0x100)    /* IP Checksum Offload */
+#define RXCSUM_TUOFL (0x200)    /* TCP/UDP Checksum Offload */
 #define RAL    (REG (0x1500))   /* RX HW Address Low */
 #define RAH    (REG (0x1501))   /* RX HW Address High */
 #define TPT    (REG (0x1035))   /* Total Packets Transmitted */
@@ -160,6 +218,11 @@ struct e1000_rdesc {
 } PACKED;
 #define RDESC_STATUS_DD  0x01    /* indicates hardware done with descriptor */
 #define RDESC_STATUS_EOP 0x02    /* indicates end of packet */
+#define RDESC_STATUS_IXSM 0x04   /* checksums not checked */
+#define RDESC_STATUS_TCPCS 0x20  /* TCP/UDP checksum checked */
+#define RDESC_STATUS_IPCS 0x40   /* IP checksum checked */
+#define RDESC_ERRORS_TCPE 0x20   /* TCP/UDP checksum error */
+#define RDESC_ERRORS_IPE 0x40    /* IP checksum error */
 
 /* ************************************************** */
 
@@ -178,16 +241,54 @@ struct e1000_tdesc {
 #define TDESC_CMD_EOP  0x01 /* indicates end of packet */
 #define TDESC_CMD_IFCS 0x02 /* insert frame checksum (FCS) */
 #define TDESC_CMD_RS   0x08 /* requests status report */
+#define TDESC_CMD_DEXT 0x20 /* extended descriptor (context or data) */
+
+/* Transmit context descriptor (16-bytes) sets up checksum offload
+ * for the data descriptors that follow it */
+struct e1000_tctx {
+  uint8  ipcss;                 /* IP checksum start */
+  uint8  ipcso;                 /* IP checksum offset */
+  uint16 ipcse;                 /* IP checksum end */
+  uint8  tucss;                 /* TCP/UDP checksum start */
+  uint8  tucso;                 /* TCP/UDP checksum offset */
+  uint16 tucse;                 /* TCP/UDP checksum end, 0 = frame end */
+  uint32 paylen:20;
+  uint32 dtyp:4;                /* descriptor type */
+  uint32 tucmd:8;               /* command */
+  uint8  sta:4;                 /* status */
+  uint8  rsv:4;                 /* reserved */
+  uint8  hdrlen;
+  uint16 mss;
+} PACKED;
+#define TDESC_TUCMD_TCP 0x01    /* TCP, else UDP */
+#define TDESC_TUCMD_IP  0x02    /* IPv4 */
+#define TDESC_TUCMD_TSE 0x04    /* TCP segmentation */
+
+/* Transmit data descriptor (16-bytes), extended form */
+struct e1000_tdata {
+  uint64 address;
+  uint32 dtalen:20;             /* length */
+  uint32 dtyp:4;                /* descriptor type */
+  uint32 dcmd:8;                /* command, as TDESC_CMD_ */
+  uint8  sta:4;                 /* status */
+  uint8  rsv:4;                 /* reserved */
+  uint8  popts;                 /* packet options */
+  uint16 special;
+} PACKED;
+#define TDESC_DTYP_CTX   0x0
+#define TDESC_DTYP_DATA  0x1
+#define TDESC_DCMD_TSE   0x04   /* TCP segmentation */
+#define TDESC_POPTS_IXSM 0x01   /* insert IP checksum */
+#define TDESC_POPTS_TXSM 0x02   /* insert TCP/UDP checksum */
 
 /* ************************************************** */
 
 static struct e1000_interface {
   struct e1000_rdesc rdescs[RDESC_COUNT] ALIGNED(0x10);
   struct e1000_tdesc tdescs[TDESC_COUNT] ALIGNED(0x10);
-  uint8 rbufs[RDESC_COUNT][RBUF_SIZE];
-  uint8 tbufs[TDESC_COUNT][TBUF_SIZE];
   uint  rx_idx;                 /* current RX descriptor */
   uint  tx_cnt;                 /* number of pending TX descriptors */
+  uint  tx_clean;               /* oldest pending TX descriptor */
 } *e1000;
 
 /* Virtual-to-Physical */
@@ -198,6 +299,17 @@ static struct e1000_interface {
 static ethernet_device e1000_ethdev;
 static pci_device e1000_pci_device;
 
+/* Frame whose last descriptor sits in each TX slot, held until the
+ * hardware reports it done */
+static struct pbuf *tx_pbufs[TDESC_COUNT];
+
+/* The checksum offsets last loaded with a context descriptor */
+static net_tx_csum_t tx_ctx;
+static bool tx_ctx_valid;
+
+/* Pieces of the frame being queued */
+static net_tx_seg_t tx_segs[TX_MAX_SEGS];
+
 /* ************************************************** */
 
 extern bool
@@ -209,12 +321,155 @@ e1000_get_hwaddr (uint8 a[ETH_ADDR_LEN])
   return TRUE;
 }
 
+u32 e1000_packet_count = 0;
+u64 e1000_packet_bytes = 0;
+/* for the statistics dump */
+u32 e1000_irq_count = 0;
+u32 e1000_rx_drops = 0;
+u32 e1000_tx_drops = 0;
+
+/* Reclaim completed TX descriptors.  The hardware finishes them in
+ * ring order, so stop at the first one still pending. */
+static void
+handle_tx (void)
+{
+  uint i = e1000->tx_clean;
+  DLOG ("TX: tx_cnt=%d", e1000->tx_cnt);
+
+  while (e1000->tx_cnt > 0 && (e1000->tdescs[i].sta & TDESC_STA_DD)) {
+    e1000->tdescs[i].cmd = 0;
+    e1000->tdescs[i].sta = 0;
+    e1000->tx_cnt--;
+    if (tx_pbufs[i]) {
+      pbuf_free (tx_pbufs[i]);
+      tx_pbufs[i] = NULL;
+    }
+    i = (i + 1) & TDESC_COUNT_MOD_MASK;
+  }
+  e1000->tx_clean = i;
+}
+
+/* Make room for need descriptors */
+static bool
+e1000_tx_room (uint need)
+{
+  if (e1000->tx_cnt + need > TDESC_COUNT - 1)
+    handle_tx ();
+  if (e1000->tx_cnt + need > TDESC_COUNT - 1) { /* overrun */
+    e1000_tx_drops++;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Whether a frame's checksum offload needs a new context descriptor:
+ * always, for a frame to cut into segments */
+static bool
+e1000_tx_new_ctx (net_tx_csum_t *c)
+{
+  return c && (c->mss || !tx_ctx_valid ||
+               !(tx_ctx.ipcss == c->ipcss && tx_ctx.ipcso == c->ipcso &&
+                 tx_ctx.ipcse == c->ipcse && tx_ctx.tucss == c->tucss &&
+                 tx_ctx.tucso == c->tucso && tx_ctx.tcp == c->tcp));
+}
+
+/* Queue a frame, room permitting: a context descriptor if its
+ * checksum offsets are not the ones loaded, then a data descriptor
+ * per piece.  p, if any, is held until the last one is done. */
+static bool
+e1000_tx_queue (net_tx_seg_t *segs, uint n, struct pbuf *p, net_tx_csum_t *c)
+{
+  uint32 tdt = TDT;
+  bool ctx = e1000_tx_new_ctx (c);
+  uint i;
+
+  if (!e1000_tx_room (n + ctx))
+    return FALSE;
+
+  if (ctx) {
+    struct e1000_tctx *tc = (struct e1000_tctx *) &e1000->tdescs[tdt];
+    tc->ipcss = c->ipcss;
+    tc->ipcso = c->ipcso;
+    tc->ipcse = c->ipcse;
+    tc->tucss = c->tucss;
+    tc->tucso = c->tucso;
+    tc->tucse = 0;
+    tc->paylen = 0;
+    tc->dtyp = TDESC_DTYP_CTX;
+    tc->tucmd = TDESC_CMD_DEXT | TDESC_CMD_RS | TDESC_TUCMD_IP |
+      (c->tcp ? TDESC_TUCMD_TCP : 0);
+    tc->sta = 0;
+    tc->hdrlen = 0;
+    tc->mss = 0;
+    if (c->mss) {
+      for (i=0; i<n; i++)
+        tc->paylen += segs[i].len;
+      tc->paylen -= c->hdrlen;
+      tc->tucmd |= TDESC_TUCMD_TSE;
+      tc->hdrlen = c->hdrlen;
+      tc->mss = c->mss;
+    }
+    tx_ctx = *c;
+    /* a segmentation context is good for its own frame only */
+    tx_ctx_valid = !c->mss;
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+
+  for (i=0; i<n; i++) {
+    uint8 eop = (i == n - 1 ? TDESC_CMD_EOP : 0);
+    if (c) {
+      struct e1000_tdata *td = (struct e1000_tdata *) &e1000->tdescs[tdt];
+      td->address = segs[i].phys;
+      td->dtalen = segs[i].len;
+      td->dtyp = TDESC_DTYP_DATA;
+      td->dcmd = TDESC_CMD_DEXT | TDESC_CMD_IFCS | TDESC_CMD_RS | eop |
+        (c->mss ? TDESC_DCMD_TSE : 0);
+      td->sta = 0;
+      td->popts = (c->ip_csum ? TDESC_POPTS_IXSM : 0) |
+        (c->l4_csum ? TDESC_POPTS_TXSM : 0);
+      td->special = 0;
+    } else {
+      e1000->tdescs[tdt].address = segs[i].phys;
+      e1000->tdescs[tdt].length = segs[i].len;
+      e1000->tdescs[tdt].cso = 0;
+      e1000->tdescs[tdt].cmd = TDESC_CMD_IFCS | TDESC_CMD_RS | eop;
+      e1000->tdescs[tdt].sta = 0;
+      e1000->tdescs[tdt].css = 0;
+      e1000->tdescs[tdt].special = 0;
+    }
+    if (eop && p) {
+      pbuf_ref (p);
+      tx_pbufs[tdt] = p;
+    }
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+  e1000->tx_cnt += n + ctx;
+
+  /* advance the TDT, notifying hardware */
+  TDT = tdt;
+
+  return TRUE;
+}
+
+/* Queue a frame copied into one PBUF_RAM buffer, which the ring
+ * holds on to like any other chain.  Returns the length queued. */
+static sint
+e1000_tx_queue_copy (struct pbuf *q, net_tx_csum_t *c)
+{
+  uint n = net_tx_segments (q, tx_segs, TX_MAX_SEGS);
+  sint res = 0;
+
+  if (n > 0 && e1000_tx_queue (tx_segs, n, q, c))
+    res = q->tot_len;
+  pbuf_free (q);
+  return res;
+}
+
 extern sint
 e1000_transmit (uint8* buffer, sint len)
 {
-  struct e1000_tdesc *td;
-  uint32 tdt = TDT;
-  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", buffer, len, TDH, tdt);
+  struct pbuf *q;
+  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", buffer, len, TDH, TDT);
   DLOG ("TX:   %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X",
         buffer[0], buffer[1], buffer[2], buffer[3],
         buffer[4], buffer[5], buffer[6], buffer[7]);
@@ -222,103 +477,228 @@ e1000_transmit (uint8* buffer, sint len)
         buffer[8], buffer[9], buffer[10], buffer[11],
         buffer[12], buffer[13], buffer[14], buffer[15]);
 
-  if (len > TBUF_SIZE)
+  if (len <= 0 || len > E1000_MAX_MTU + SIZEOF_ETH_HDR)
     return 0;
 
-  if (e1000->tx_cnt >= TDESC_COUNT - 1) /* overrun */
+  /* the caller's buffer is gone by the time the device reads it */
+  q = pbuf_alloc (PBUF_RAW, len, PBUF_RAM);
+  if (q == NULL) {
+    e1000_tx_drops++;
     return 0;
+  }
+  memcpy (q->payload, buffer, len);
+  return e1000_tx_queue_copy (q, NULL);
+}
 
-  /* set up the first available descriptor */
-  memcpy (e1000->tbufs[tdt], buffer, len);
-  e1000->tdescs[tdt].length = len;
-  e1000->tdescs[tdt].cmd = TDESC_CMD_IFCS | TDESC_CMD_RS | TDESC_CMD_EOP;
-  td = &e1000->tdescs[tdt];
+/* Gather a chain too fragmented for the ring into one buffer.  It may
+ * still cross pages, a TCP super-segment certainly does, but it needs
+ * no more than a descriptor per page. */
+static sint
+e1000_tx_copy (struct pbuf *p, net_tx_csum_t *c)
+{
+  struct pbuf *q = pbuf_alloc (PBUF_RAW, p->tot_len, PBUF_RAM);
 
-  /* advance the TDT, notifying hardware */
-  tdt++;
-  if (tdt >= TDESC_COUNT)
-    tdt = 0;
-  TDT = tdt;
+  if (q == NULL) {
+    e1000_tx_drops++;
+    return 0;
+  }
+  pbuf_copy (q, p);
+  return e1000_tx_queue_copy (q, c);
+}
+
+/* Scatter-gather transmit: one descriptor per physically contiguous
+ * piece of the chain, which stays referenced until handle_tx sees the
+ * last one done.  A chain too fragmented for the ring is copied.
+ * Checksums lwIP left to the device are inserted on the way out, and
+ * a TCP super-segment (see netif->tso_mss) is cut up by the device. */
+extern sint
+e1000_transmit_pbuf (struct pbuf *p)
+{
+  struct netif *netif = &e1000_ethdev.netif;
+  net_tx_csum_t csum, *c = NULL;
+  uint n;
+
+  DLOG ("TX: pbuf %p len=%d TDH=%d TDT=%d", p, p->tot_len, TDH, TDT);
+
+  if (netif->tso_mss) {
+    if (!net_tx_tso (p, netif->tso_mss, &csum))
+      return 0;
+    c = &csum;
+  } else {
+    /* a super-segment that lost its MSS, queued behind ARP, say */
+    if (p->tot_len > netif->mtu + SIZEOF_ETH_HDR)
+      return 0;
+    if (net_tx_csum (p, &csum))
+      c = &csum;
+  }
 
-  e1000->tx_cnt++;
+  n = net_tx_segments (p, tx_segs, TX_MAX_SEGS);
+  if (n == 0)
+    return e1000_tx_copy (p, c);
 
-  return len;
+  return e1000_tx_queue (tx_segs, n, p, c) ? p->tot_len : 0;
 }
 
-u32 e1000_packet_count = 0;
-u64 e1000_packet_bytes = 0;
+/* Whether the hardware checked every checksum lwIP would have: for
+ * anything but IPv4, there is nothing to check */
+static bool
+e1000_rx_csum_checked (struct e1000_rdesc *rd, uint8 *frame)
+{
+  uint8 proto;
 
-extern void
-e1000_rx_poll (void)
+  if (rd->status & RDESC_STATUS_IXSM)
+    return FALSE;
+  if (frame[12] != 0x08 || frame[13] != 0x00)
+    return TRUE;
+  if (!(rd->status & RDESC_STATUS_IPCS))
+    return FALSE;
+  proto = frame[14 + 9];        /* IP protocol */
+  return (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) ||
+    (rd->status & RDESC_STATUS_TCPCS);
+}
+
+/* Copy len bytes to offset off of a pbuf chain */
+static void
+e1000_rx_copy_in (struct pbuf *p, uint off, uint8 *src, uint len)
 {
-  uint32 entry, rdt;
-  uint8 *ptr;
+  uint chunk;
 
-  DLOG ("RX: %d %d %d %d %d %d %d %d",
-        e1000->rdescs[0].status & RDESC_STATUS_DD,
-        e1000->rdescs[1].status & RDESC_STATUS_DD,
-        e1000->rdescs[2].status & RDESC_STATUS_DD,
-        e1000->rdescs[3].status & RDESC_STATUS_DD,
-        e1000->rdescs[4].status & RDESC_STATUS_DD,
-        e1000->rdescs[5].status & RDESC_STATUS_DD,
-        e1000->rdescs[6].status & RDESC_STATUS_DD,
-        e1000->rdescs[7].status & RDESC_STATUS_DD);
+  for (; p != NULL && len > 0; p = p->next) {
+    if (off >= p->len) {
+      off -= p->len;
+      continue;
+    }
+    chunk = p->len - off < len ? p->len - off : len;
+    memcpy ((uint8 *) p->payload + off, src, chunk);
+    src += chunk;
+    len -= chunk;
+    off = 0;
+  }
+}
+
+/* Copy the frame in the n buffers from entry on into pool pbufs,
+ * mapping each buffer in turn.  Returns NULL if out of pbufs or
+ * virtual pages. */
+static struct pbuf *
+e1000_rx_pbuf (uint32 entry, uint n, uint16 len)
+{
+  struct pbuf *p;
+  uint8 *page;
+  uint64 phys;
+  uint i, off = 0;
+  uint16 dlen;
+
+  p = pbuf_alloc (PBUF_RAW, len, PBUF_POOL);
+  if (p == NULL)
+    return NULL;
+  for (i=0; i<n; i++, entry = (entry + 1) & RDESC_COUNT_MOD_MASK) {
+    phys = e1000->rdescs[entry].address;
+    dlen = e1000->rdescs[entry].length;
+    page = map_virtual_page (((uint32) phys & ~0xFFF) | 3);
+    if (page == NULL) {
+      pbuf_free (p);
+      return NULL;
+    }
+    e1000_rx_copy_in (p, off, page + ((uint32) phys & 0xFFF), dlen);
+    unmap_virtual_page (page);
+    off += dlen;
+  }
+  return p;
+}
+
+/* Pass up at most budget received frames, returning how many
+ * descriptors were consumed.  A frame longer than a buffer spans
+ * several descriptors, only the last of which has EOP set; it is
+ * left alone until that one is done too. */
+static uint
+e1000_rx_clean (uint budget)
+{
+  uint32 entry, last;
+  uint work = 0, n, i;
 
   entry = e1000->rx_idx & RDESC_COUNT_MOD_MASK;
-  while (e1000->rdescs[entry].status & RDESC_STATUS_DD) {
-    if (e1000->rdescs[entry].status & RDESC_STATUS_EOP) {
-      uint16 len;
-      /* full packet */
-      ptr = e1000->rbufs[entry];
-      len = e1000->rdescs[entry].length;
-      DLOG ("RX: full packet@%p len=%d", ptr, len);
-      e1000_packet_count++;
-      e1000_packet_bytes += len;
-      if (e1000_ethdev.recv_func)
-        e1000_ethdev.recv_func (&e1000_ethdev, ptr, len);
-      else                      /* drop it */
-        DLOG ("recv_func is null");
-    } else {
+  while (work < budget && (e1000->rdescs[entry].status & RDESC_STATUS_DD)) {
+    uint16 len = e1000->rdescs[entry].length;
+    struct pbuf *p;
+    bool checked;
+
+    /* find the end of the frame */
+    for (n = 1, last = entry;
+         !(e1000->rdescs[last].status & RDESC_STATUS_EOP); n++) {
+      if (n == RX_MAX_DESCS)
+        break;
+      last = (last + 1) & RDESC_COUNT_MOD_MASK;
+      if (!(e1000->rdescs[last].status & RDESC_STATUS_DD))
+        /* the rest of it is still coming */
+        goto out;
+      len += e1000->rdescs[last].length;
+    }
+
+    DLOG ("RX: full packet len=%d descs=%d", len, n);
+    e1000_packet_count++;
+    e1000_packet_bytes += len;
+    if (!(e1000->rdescs[last].status & RDESC_STATUS_EOP)) {
       /* error */
       DLOG ("RX: error. status=%p", e1000->rdescs[entry].status);
+      e1000_rx_drops++;
+      goto next;
     }
+    if (e1000->rdescs[last].errors &
+        (RDESC_ERRORS_IPE | RDESC_ERRORS_TCPE)) {
+      DLOG ("RX: bad checksum. errors=%p", e1000->rdescs[last].errors);
+      e1000_rx_drops++;
+      goto next;
+    }
+    if (!e1000_ethdev.recv_pbuf_func) { /* drop it */
+      DLOG ("recv_pbuf_func is null");
+      goto next;
+    }
+    p = e1000_rx_pbuf (entry, n, len);
+    if (p == NULL) {
+      DLOG ("RX: no pbufs, len=%d", len);
+      e1000_rx_drops++;
+      goto next;
+    }
+    /* lwIP handles the frame before the upcall returns, so it can
+     * check this one (an IP fragment, say) in software */
+    checked = e1000_rx_csum_checked (&e1000->rdescs[last], p->payload);
+    if (!checked)
+      NETIF_SET_CHECKSUM_CTRL (&e1000_ethdev.netif,
+                               NETIF_CHECKSUM_ENABLE_ALL);
+    e1000_ethdev.recv_pbuf_func (&e1000_ethdev, p);
+    if (!checked)
+      NETIF_SET_CHECKSUM_CTRL (&e1000_ethdev.netif,
+                               NETIF_CHECKSUM_DISABLE_ALL);
+
+  next:
+    /* clear status, and check next entry */
+    for (i=0; i<n; i++) {
+      e1000->rdescs[entry].status = 0;
+      entry = (++e1000->rx_idx) & RDESC_COUNT_MOD_MASK;
+    }
+    work += n;
+  }
 
-    /* clear status */
-    e1000->rdescs[entry].status = 0;
-
-    /* advance "tail" to notify hardware */
-    rdt = RDT;
-    rdt++;
-    if (rdt >= RDESC_COUNT)
-      rdt = 0;
-    RDT = rdt;
+ out:
+  if (work > 0)
+    /* hand the consumed descriptors back to hardware at once: the
+     * tail trails the next descriptor to be checked by one */
+    RDT = (e1000->rx_idx - 1) & RDESC_COUNT_MOD_MASK;
 
-    /* check next entry */
-    entry = (++e1000->rx_idx) & RDESC_COUNT_MOD_MASK;
-  }
+  return work;
 }
 
-static void
-handle_tx (uint32 icr)
+extern void
+e1000_rx_poll (void)
 {
-  uint i;
-  DLOG ("TX: tx_cnt=%d", e1000->tx_cnt);
-
-  /* find descriptors that have completed */
-  for (i=0; i<TDESC_COUNT; i++) {
-    if (e1000->tdescs[i].cmd && (e1000->tdescs[i].sta & TDESC_STA_DD)) {
-      e1000->tdescs[i].cmd = 0;
-      e1000->tdescs[i].sta = 0;
-      e1000->tx_cnt--;
-    }
-  }
+  e1000_rx_clean (~0);
 }
 
 extern void
 e1000_poll (void)
 {
   e1000_rx_poll ();
-  handle_tx (ICR_TXQE);
+  handle_tx ();
 }
 
 #ifdef E1000_DEBUG
@@ -364,13 +744,20 @@ mdi_write (uint8 phy_reg, uint16 val)
 
 static uint32 e1000_bh_stack[1024] ALIGNED (0x1000);
 static task_id e1000_bh_id = 0;
+/* The IRQ handler masks the device's interrupts and wakes this
+ * thread, which then polls the rings.  As long as frames keep coming
+ * faster than it can take E1000_POLL_BUDGET of them per round, it
+ * stays in polling mode, yielding between rounds; once a round comes
+ * up short it unmasks interrupts again. */
 static void
 e1000_bh_thread (void)
 {
   for (;;) {
     /* ICR is cleared upon read; this implicitly acknowledges the
-     * interrupt. */
+     * interrupt.  A cause raised after this read stays latched, and
+     * interrupts again as soon as it is unmasked. */
     uint32 icr = ICR;
+    uint work;
     DLOG ("IRQ: ICR=%p CTRL=%p CTRLE=%p STA=%p", icr, CTRL, CTRLEXT, STATUS);
     //DLOG ("PHY_CTL=0x%.04X", mdi_read (0));
     //DLOG ("PHY_STA=0x%.04X", mdi_read (1));
@@ -378,10 +765,16 @@ e1000_bh_thread (void)
     //DLOG ("PHY_GSTA=0x%.04X", mdi_read (10));
     DLOG ("TPT=%p", TPT);
 
-    if (icr & ICR_RXT)            /* RX */
-      e1000_rx_poll ();
-    if (icr & ICR_TXQE)           /* TX queue empty */
-      handle_tx (icr);
+    work = e1000_rx_clean (E1000_POLL_BUDGET);
+    handle_tx ();
+    if (icr & ICR_RXO)
+      e1000_rx_drops += MPC;    /* clear on read */
+
+    if (work >= E1000_POLL_BUDGET)
+      /* still busy: come back for another round */
+      iovcpu_job_wakeup_for_me (e1000_bh_id);
+    else
+      IMS = IMS_ENABLE;
 
 #if 0
     unlock_kernel ();
@@ -399,8 +792,11 @@ extern DEF_PER_CPU (vcpu *, vcpu_current);
 static uint32
 e1000_irq_handler (uint8 vec)
 {
+  e1000_irq_count++;
   if (e1000_bh_id) {
     extern vcpu *vcpu_lookup (int);
+    /* masked until the bottom half has caught up */
+    IMC = ~0;
     /* hack: use VCPU2's period */
     iovcpu_job_wakeup (e1000_bh_id, vcpu_lookup (2)->T);
   }
@@ -604,6 +1000,36 @@ set_loopback_mode (void)
 }
 #endif
 
+/* Give every RX slot its buffer for good: a page per RBUFS_PER_PAGE
+ * slots, recorded only in the rdescs. */
+static bool
+e1000_alloc_rbufs (void)
+{
+  uint32 frame;
+  uint i, j;
+
+  for (i=0; i<RDESC_COUNT; i+=RBUFS_PER_PAGE) {
+    frame = alloc_phys_frame ();
+    if (frame == -1)
+      return FALSE;
+    for (j=0; j<RBUFS_PER_PAGE; j++)
+      e1000->rdescs[i + j].address = frame + j * RBUF_SIZE;
+  }
+  return TRUE;
+}
+
+static void
+e1000_free_rbufs (void)
+{
+  uint i;
+
+  for (i=0; i<RDESC_COUNT; i+=RBUFS_PER_PAGE)
+    if (e1000->rdescs[i].address) {
+      free_phys_frame ((uint32) e1000->rdescs[i].address);
+      e1000->rdescs[i].address = 0;
+    }
+}
+
 static void
 reset (void)
 {
@@ -645,16 +1071,19 @@ reset (void)
 
   DLOG ("RAL=%p RAH=%p", RAL, RAH);
 
+  /* check IP, TCP and UDP checksums on receipt */
+  RXCSUM |= RXCSUM_IPOFL | RXCSUM_TUOFL;
+
   /* set rx buffer size code */
   RCTL &= ~RCTL_BSIZE;
   RCTL |= RBUF_SIZE_MASK;
   RCTL &= ~RCTL_BSEX;
+  /* frames longer than a buffer span several descriptors */
+  RCTL |= RCTL_LPE;
 
-  /* set up rdesc addresses */
-  for (i=0; i<RDESC_COUNT; i++) {
-    e1000->rdescs[i].address = V2P (uint64, e1000->rbufs[i]);
+  /* the rdesc addresses were set when the buffers were allocated */
+  for (i=0; i<RDESC_COUNT; i++)
     e1000->rdescs[i].status = 0;
-  }
 
   /* program the rdesc base address and length */
   RDBAL = V2P (uint32, e1000->rdescs);
@@ -671,10 +1100,13 @@ reset (void)
         V2P (uint32, e1000->rdescs), RDESC_COUNT * sizeof (struct e1000_rdesc),
         RDH, RDT);
 
-  /* set up tdesc addresses */
+  /* reset the tdescs, releasing frames still held */
   for (i=0; i<TDESC_COUNT; i++) {
-    e1000->tdescs[i].address = V2P (uint64, e1000->tbufs[i]);
     e1000->tdescs[i].sta = 0;
+    if (tx_pbufs[i]) {
+      pbuf_free (tx_pbufs[i]);
+      tx_pbufs[i] = NULL;
+    }
   }
 
   /* program the tdesc base address and length */
@@ -687,16 +1119,24 @@ reset (void)
   TDT = 0;
 
   e1000->tx_cnt = 0;
+  e1000->tx_clean = 0;
+  tx_ctx_valid = FALSE;
 
   DLOG ("TDBAL=%p TDLEN=%p TDH=%d TDT=%d",
         V2P (uint32, e1000->tdescs), TDESC_COUNT * sizeof (struct e1000_tdesc),
         TDH, TDT);
 
-  /* setup RX interrupts */
-  IMS |= IMS_RXT;
+  /* interrupt moderation */
+  RDTR = E1000_RDTR;
+  TIDV = E1000_TIDV;
+  if (has_itr) {
+    RADV = E1000_RADV;
+    TADV = E1000_TADV;
+    ITR = E1000_ITR;
+  }
 
-  /* setup TX interrupts */
-  IMS |= IMS_TXQE;
+  /* setup RX and TX interrupts */
+  IMS = IMS_ENABLE;
 
   /* enable RX operation and broadcast reception */
   RCTL |= (RCTL_EN | RCTL_BAM);
@@ -730,6 +1170,7 @@ reset (void)
 
 
   (void) TPT;                   /* clear TPT statistic */
+  (void) MPC;
 }
 
 extern bool
@@ -754,6 +1195,8 @@ e1000_init (void)
     DLOG ("Unable to detect compatible device.");
     goto abort;
   }
+  has_itr = compatible_ids[i].itr;
+  has_tso = compatible_ids[i].tso;
 
   DLOG ("Found device_index=%d", device_index);
 
@@ -815,9 +1258,14 @@ e1000_init (void)
 
   DLOG ("DMA region at virt=%p phys=%p count=%d", e1000, e1000_phys, frame_count);
 
+  if (!e1000_alloc_rbufs ()) {
+    DLOG ("Unable to allocate RX buffers");
+    goto abort_virt;
+  }
+
   if (!pci_get_interrupt (device_index, &irq_line, &irq_pin)) {
     DLOG ("Unable to get IRQ");
-    goto abort_virt;
+    goto abort_rbufs;
   }
 
   if (pci_irq_find (e1000_pci_device.bus, e1000_pci_device.slot,
@@ -827,7 +1275,7 @@ e1000_init (void)
     if (!pci_irq_map_handler (&irq, e1000_irq_handler, 0x01,
                               IOAPIC_DESTINATION_LOGICAL,
                               IOAPIC_DELIVERY_FIXED))
-      goto abort_virt;
+      goto abort_rbufs;
     irq_line = irq.gsi;
   }
 
@@ -866,14 +1314,22 @@ e1000_init (void)
   /* Register network device with net subsystem */
   e1000_ethdev.recv_func = NULL;
   e1000_ethdev.send_func = e1000_transmit;
+  e1000_ethdev.send_pbuf_func = e1000_transmit_pbuf;
   e1000_ethdev.get_hwaddr_func = e1000_get_hwaddr;
   e1000_ethdev.poll_func = e1000_poll;
+  e1000_ethdev.max_mtu = E1000_MAX_MTU;
 
   if (!net_register_device (&e1000_ethdev)) {
     DLOG ("registration failed");
-    goto abort_virt;
+    goto abort_rbufs;
   }
 
+  /* IP, TCP and UDP checksums are left to the hardware, and so is TCP
+   * segmentation where it can do it */
+  NETIF_SET_CHECKSUM_CTRL (&e1000_ethdev.netif, NETIF_CHECKSUM_DISABLE_ALL);
+  if (has_tso)
+    e1000_ethdev.netif.flags |= NETIF_FLAG_TSO;
+
   e1000_bh_id = create_kernel_thread_args ((u32) e1000_bh_thread,
                                            (u32) &e1000_bh_stack[1023],
                                            FALSE, 0);
@@ -881,6 +1337,8 @@ e1000_init (void)
 
   return TRUE;
 
+ abort_rbufs:
+  e1000_free_rbufs ();
  abort_virt:
   unmap_virtual_pages (e1000, frame_count);
  abort_phys:
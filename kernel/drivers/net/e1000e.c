@@ -19,6 +19,8 @@
 
 #include "drivers/pci/pci.h"
 #include "drivers/net/ethernet.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip.h"
 #include "arch/i386.h"
 #include "util/printf.h"
 #include "smp/smp.h"
@@ -26,6 +28,7 @@
 #include "mem/physical.h"
 #include "mem/virtual.h"
 #include "kernel.h"
+#include "sched/vcpu.h"
 
 #define DEBUG_E1000E
 
@@ -38,13 +41,21 @@
 
 #define E1000E_VECTOR 0x4D       /* arbitrary */
 
-#define RDESC_COUNT 8           /* must be multiple of 8 */
+/* Receive queues, as many as the 82574 has.  RSS spreads flows over
+ * them by hash, so a TCP connection always lands on the same one. */
+#define E1000E_RX_QUEUES 2
+
+/* RX descriptors handled per round of a bottom half before it
+ * yields; a full round means it stays in polling mode. */
+#define E1000E_POLL_BUDGET 32
+
+#define RDESC_COUNT 8           /* per queue, must be multiple of 8 */
 #define RDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
 #define RBUF_SIZE   2048        /* configured in RCTL.BSIZE */
 #define RBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
 
 #define TDESC_COUNT 8           /* must be multiple of 8 */
-#define TDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
+#define TDESC_COUNT_MOD_MASK (TDESC_COUNT - 1)
 #define TBUF_SIZE   2048        /* configured in TCTL.BSIZE */
 #define TBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
 #define TCTL_CT_MASK   0x100
@@ -72,6 +83,8 @@ static volatile uint32 *mmio_base, *flash_base;
 #define CTRL_RST (1<<26)        /* Reset */
 #define STATUS (REG (0x02))     /* Status */
 #define EERD   (REG (0x05))     /* EEPROM Read */
+#define CTRLEXT (REG (0x06))    /* Extended Control */
+#define CTRLEXT_PBA_CLR (0x80000000) /* clear MSI-X pending bits on read */
 #define ICR    (REG (0x30))     /* Interrupt Cause Read */
 #define ICR_RXT (0x80)          /* RX Timer Int. */
 #define ICR_RXO (0x40)          /* RX Overrun Int. */
@@ -80,7 +93,16 @@ static volatile uint32 *mmio_base, *flash_base;
 #define IMS_RXT (0x80)          /* RX Timer Int. */
 #define IMS_RXO (0x40)          /* RX Overrun Int. */
 #define IMS_TXQE (0x02)         /* TX Queue Empty Int. */
+#define IMS_RXQ(q) (1<<(20+(q))) /* RX Queue Int. (MSI-X) */
+#define IMS_TXQ0 (1<<22)        /* TX Queue 0 Int. (MSI-X) */
+#define IMS_ENABLE (IMS_RXT | IMS_TXQE)
 #define IMC    (REG (0x36))     /* Interrupt Mask Clear */
+#define EIAC   (REG (0x37))     /* Ext. Int. Auto Clear (MSI-X) */
+#define IVAR   (REG (0x39))     /* Int. Vector Allocation (MSI-X) */
+#define IVAR_VALID (0x8)
+#define IVAR_RXQ(q,v) ((IVAR_VALID | (v)) << ((q) * 4))
+#define IVAR_TXQ0(v) ((IVAR_VALID | (v)) << 8)
+#define IVAR_TX_EVERY_WB (0x80000000)
 #define RCTL   (REG (0x40))     /* Receive Control */
 #define RCTL_EN (0x02)          /* RX Enable */
 #define RCTL_BAM (1<<15)        /* Accept Broadcast packets */
@@ -92,11 +114,11 @@ static volatile uint32 *mmio_base, *flash_base;
 #define TCTL_CT (0xFF0)         /* TX Collision Threshold */
 #define TCTL_COLD (0x3FF000)    /* TX Collision Distance */
 #define TIPG   (REG (0x104))    /* TX Inter Packet Gap */
-#define RDBAL  (REG (0xA00))    /* RX Desc. Base Address Low */
-#define RDBAH  (REG (0xA01))    /* RX Desc. Base Address High */
-#define RDLEN  (REG (0xA02))    /* RX Desc. Length */
-#define RDH    (REG (0xA04))    /* RX Desc Head */
-#define RDT    (REG (0xA06))    /* RX Desc Tail */
+#define RDBAL(q) (REG (0xA00 + (q) * 0x40)) /* RX Desc. Base Address Low */
+#define RDBAH(q) (REG (0xA01 + (q) * 0x40)) /* RX Desc. Base Address High */
+#define RDLEN(q) (REG (0xA02 + (q) * 0x40)) /* RX Desc. Length */
+#define RDH(q)   (REG (0xA04 + (q) * 0x40)) /* RX Desc Head */
+#define RDT(q)   (REG (0xA06 + (q) * 0x40)) /* RX Desc Tail */
 #define TDBAL  (REG (0xE00))    /* TX Desc. Base Address Low */
 #define TDBAH  (REG (0xE01))    /* TX Desc. Base Address High */
 #define TDLEN  (REG (0xE02))    /* TX Desc. Length */
@@ -104,20 +126,43 @@ static volatile uint32 *mmio_base, *flash_base;
 #define TDT    (REG (0xE06))    /* TX Desc Tail */
 #define RAL    (REG (0x1500))   /* RX HW Address Low */
 #define RAH    (REG (0x1501))   /* RX HW Address High */
-
+#define RXCSUM (REG (0x1400))   /* RX Checksum Control */
+#define RXCSUM_IPOFL (0x100)    /* IP Checksum Offload */
+#define RXCSUM_TUOFL (0x200)    /* TCP/UDP Checksum Offload */
+#define RXCSUM_PCSD (0x2000)    /* RSS hash in place of packet checksum */
+#define RFCTL  (REG (0x1402))   /* RX Filter Control */
+#define RFCTL_EXSTEN (1<<15)    /* extended RX descriptors */
+#define MRQC   (REG (0x1606))   /* Multiple RX Queues Command */
+#define MRQC_RSS (0x1)          /* RSS enable */
+#define MRQC_TCPIPV4 (1<<16)    /* hash TCP/IPv4 on addresses and ports */
+#define MRQC_IPV4 (1<<17)       /* hash other IPv4 on addresses */
+#define RETA(i) (REG (0x1700 + (i))) /* RSS Redirection Table, 32 regs */
+#define RETA_QUEUE1 (0x80)      /* entry sends its hashes to queue 1 */
+#define RSSRK(i) (REG (0x1720 + (i))) /* RSS Random Key, 10 regs */
 /* ************************************************** */
 
-/* Receive descriptor (16-bytes) describes a buffer in memory */
-struct e1000e_rdesc {
-  uint64 address;
-  uint16 length;
-  uint16 checksum;
-  uint8  status;
-  uint8  errors;
-  uint16 special;
-} PACKED;
+/* Receive descriptor (16-bytes), extended form, which RSS needs:
+ * describes a buffer in memory until the hardware writes it back */
+union e1000e_rdesc {
+  struct {
+    uint64 address;
+    uint64 reserved;
+  } PACKED read;
+  struct {
+    uint32 mrq;                 /* RSS type */
+    uint32 rss;                 /* RSS hash */
+    uint32 status;              /* status, errors in the top byte */
+    uint16 length;
+    uint16 vlan;
+  } PACKED wb;
+};
 #define RDESC_STATUS_DD  0x01    /* indicates hardware done with descriptor */
 #define RDESC_STATUS_EOP 0x02    /* indicates end of packet */
+#define RDESC_STATUS_IXSM 0x04   /* checksums not checked */
+#define RDESC_STATUS_TCPCS 0x20  /* TCP/UDP checksum checked */
+#define RDESC_STATUS_IPCS 0x40   /* IP checksum checked */
+#define RDESC_ERRORS_TCPE (0x20<<24) /* TCP/UDP checksum error */
+#define RDESC_ERRORS_IPE (0x40<<24)  /* IP checksum error */
 
 /* ************************************************** */
 
@@ -135,15 +180,52 @@ struct e1000e_tdesc {
 #define TDESC_STA_DD  0x01 /* indicates hardware done with descriptor */
 #define TDESC_CMD_EOP 0x01 /* indicates end of packet */
 #define TDESC_CMD_RS 0x08  /* requests status report */
+#define TDESC_CMD_DEXT 0x20 /* extended descriptor (context or data) */
+
+/* Transmit context descriptor (16-bytes) sets up checksum offload
+ * for the data descriptors that follow it */
+struct e1000e_tctx {
+  uint8  ipcss;                 /* IP checksum start */
+  uint8  ipcso;                 /* IP checksum offset */
+  uint16 ipcse;                 /* IP checksum end */
+  uint8  tucss;                 /* TCP/UDP checksum start */
+  uint8  tucso;                 /* TCP/UDP checksum offset */
+  uint16 tucse;                 /* TCP/UDP checksum end, 0 = frame end */
+  uint32 paylen:20;
+  uint32 dtyp:4;                /* descriptor type */
+  uint32 tucmd:8;               /* command */
+  uint8  sta:4;                 /* status */
+  uint8  rsv:4;                 /* reserved */
+  uint8  hdrlen;
+  uint16 mss;
+} PACKED;
+#define TDESC_TUCMD_TCP 0x01    /* TCP, else UDP */
+#define TDESC_TUCMD_IP  0x02    /* IPv4 */
+
+/* Transmit data descriptor (16-bytes), extended form */
+struct e1000e_tdata {
+  uint64 address;
+  uint32 dtalen:20;             /* length */
+  uint32 dtyp:4;                /* descriptor type */
+  uint32 dcmd:8;                /* command, as TDESC_CMD_ */
+  uint8  sta:4;                 /* status */
+  uint8  rsv:4;                 /* reserved */
+  uint8  popts;                 /* packet options */
+  uint16 special;
+} PACKED;
+#define TDESC_DTYP_CTX   0x0
+#define TDESC_DTYP_DATA  0x1
+#define TDESC_POPTS_IXSM 0x01   /* insert IP checksum */
+#define TDESC_POPTS_TXSM 0x02   /* insert TCP/UDP checksum */
 
 /* ************************************************** */
 
 static struct e1000e_interface {
-  struct e1000e_rdesc rdescs[RDESC_COUNT] ALIGNED(0x10);
+  union e1000e_rdesc rdescs[E1000E_RX_QUEUES][RDESC_COUNT] ALIGNED(0x10);
   struct e1000e_tdesc tdescs[TDESC_COUNT] ALIGNED(0x10);
-  uint8 rbufs[RDESC_COUNT][RBUF_SIZE];
+  uint8 rbufs[E1000E_RX_QUEUES][RDESC_COUNT][RBUF_SIZE];
   uint8 tbufs[TDESC_COUNT][TBUF_SIZE];
-  uint  rx_idx;                 /* current RX descriptor */
+  uint  rx_idx[E1000E_RX_QUEUES]; /* current RX descriptor */
   uint  tx_cnt;                 /* number of pending TX descriptors */
 } *e1000e;
 
@@ -154,6 +236,37 @@ static struct e1000e_interface {
 
 static ethernet_device e1000e_ethdev;
 
+/* Frame whose last descriptor sits in each TX slot, held until the
+ * hardware reports it done; NULL for copied frames */
+static struct pbuf *tx_pbufs[TDESC_COUNT];
+
+/* The checksum offsets last loaded with a context descriptor */
+static net_tx_csum_t tx_ctx;
+static bool tx_ctx_valid;
+
+/* A receive queue and the bottom half that drains it.  Queue 0 also
+ * reaps the TX ring. */
+static struct e1000e_rxq {
+  uint num;
+  task_id bh_id;
+  uint32 ims;                   /* causes its MSI-X vector stands for */
+} rxqs[E1000E_RX_QUEUES];
+static uint32 e1000e_bh_stack[E1000E_RX_QUEUES][1024] ALIGNED (0x1000);
+
+/* Number of MSI-X vectors, one per queue in use; 0 when all queues
+ * share the pin-based interrupt */
+static uint e1000e_msix;
+/* Queues RSS spreads flows over */
+static uint e1000e_rx_queues = 1;
+/* queues woken by the pin-based interrupt and not yet drained */
+static uint32 e1000e_bh_pending;
+
+/* Toeplitz key for the RSS hash */
+static const uint32 rss_key[10] = {
+  0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0,
+  0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe
+};
+
 /* ************************************************** */
 
 extern bool
@@ -165,10 +278,89 @@ e1000e_get_hwaddr (uint8 a[ETH_ADDR_LEN])
   return TRUE;
 }
 
+/* Whether a frame's checksum offload needs a new context descriptor */
+static bool
+e1000e_tx_new_ctx (net_tx_csum_t *c)
+{
+  return c && !(tx_ctx_valid &&
+                tx_ctx.ipcss == c->ipcss && tx_ctx.ipcso == c->ipcso &&
+                tx_ctx.ipcse == c->ipcse && tx_ctx.tucss == c->tucss &&
+                tx_ctx.tucso == c->tucso && tx_ctx.tcp == c->tcp);
+}
+
+/* Queue a frame, room permitting: a context descriptor if its
+ * checksum offsets are not the ones loaded, then a data descriptor
+ * per piece.  p, if any, is held until the last one is done. */
+static bool
+e1000e_tx_queue (net_tx_seg_t *segs, uint n, struct pbuf *p, net_tx_csum_t *c)
+{
+  uint32 tdt = TDT;
+  bool ctx = e1000e_tx_new_ctx (c);
+  uint i;
+
+  if (e1000e->tx_cnt + n + ctx > TDESC_COUNT - 1) /* overrun */
+    return FALSE;
+
+  if (ctx) {
+    struct e1000e_tctx *tc = (struct e1000e_tctx *) &e1000e->tdescs[tdt];
+    tc->ipcss = c->ipcss;
+    tc->ipcso = c->ipcso;
+    tc->ipcse = c->ipcse;
+    tc->tucss = c->tucss;
+    tc->tucso = c->tucso;
+    tc->tucse = 0;
+    tc->paylen = 0;
+    tc->dtyp = TDESC_DTYP_CTX;
+    tc->tucmd = TDESC_CMD_DEXT | TDESC_CMD_RS | TDESC_TUCMD_IP |
+      (c->tcp ? TDESC_TUCMD_TCP : 0);
+    tc->sta = 0;
+    tc->hdrlen = 0;
+    tc->mss = 0;
+    tx_ctx = *c;
+    tx_ctx_valid = TRUE;
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+
+  for (i=0; i<n; i++) {
+    uint8 eop = (i == n - 1 ? TDESC_CMD_EOP : 0);
+    if (c) {
+      struct e1000e_tdata *td = (struct e1000e_tdata *) &e1000e->tdescs[tdt];
+      td->address = segs[i].phys;
+      td->dtalen = segs[i].len;
+      td->dtyp = TDESC_DTYP_DATA;
+      td->dcmd = TDESC_CMD_DEXT | TDESC_CMD_RS | eop;
+      td->sta = 0;
+      td->popts = (c->ip_csum ? TDESC_POPTS_IXSM : 0) |
+        (c->l4_csum ? TDESC_POPTS_TXSM : 0);
+      td->special = 0;
+    } else {
+      e1000e->tdescs[tdt].address = segs[i].phys;
+      e1000e->tdescs[tdt].length = segs[i].len;
+      e1000e->tdescs[tdt].cso = 0;
+      e1000e->tdescs[tdt].cmd = TDESC_CMD_RS | eop;
+      e1000e->tdescs[tdt].sta = 0;
+      e1000e->tdescs[tdt].css = 0;
+      e1000e->tdescs[tdt].special = 0;
+    }
+    if (eop && p) {
+      pbuf_ref (p);
+      tx_pbufs[tdt] = p;
+    }
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+  e1000e->tx_cnt += n + ctx;
+
+  /* advance the TDT, notifying hardware */
+  TDT = tdt;
+
+  return TRUE;
+}
+
 extern sint
 e1000e_transmit (uint8* buffer, sint len)
 {
   uint32 tdt = TDT;
+  net_tx_seg_t seg;
   DLOG ("TX: (%p, %d) TDH=%d TDT=%d", buffer, len, TDH, tdt);
 
   if (len > TBUF_SIZE)
@@ -177,68 +369,132 @@ e1000e_transmit (uint8* buffer, sint len)
   if (e1000e->tx_cnt >= TDESC_COUNT - 1) /* overrun */
     return 0;
 
-  /* set up the first available descriptor */
+  /* use the first available descriptor's buffer */
   memcpy (e1000e->tbufs[tdt], buffer, len);
-  e1000e->tdescs[tdt].length = len;
-  e1000e->tdescs[tdt].cmd = TDESC_CMD_RS | TDESC_CMD_EOP;
+  seg.phys = V2P (uint32, e1000e->tbufs[tdt]);
+  seg.len = len;
+  if (!e1000e_tx_queue (&seg, 1, NULL, NULL))
+    return 0;
 
-  /* advance the TDT, notifying hardware */
-  tdt++;
-  if (tdt >= TDESC_COUNT)
-    tdt = 0;
-  TDT = tdt;
+  return len;
+}
 
-  e1000e->tx_cnt++;
+/* Scatter-gather transmit: one descriptor per physically contiguous
+ * piece of the chain, which stays referenced until handle_tx sees the
+ * last one done.  A chain too fragmented for the ring is copied.
+ * Checksums lwIP left to the device are inserted on the way out. */
+extern sint
+e1000e_transmit_pbuf (struct pbuf *p)
+{
+  net_tx_seg_t segs[TDESC_COUNT - 1];
+  net_tx_csum_t csum, *c = NULL;
+  uint n;
+
+  DLOG ("TX: pbuf %p len=%d TDH=%d TDT=%d", p, p->tot_len, TDH, TDT);
+
+  if (net_tx_csum (p, &csum))
+    c = &csum;
+
+  n = net_tx_segments (p, segs, TDESC_COUNT - 1);
+  if (n == 0) {
+    bool ctx = e1000e_tx_new_ctx (c);
+    uint slot;
+
+    if (p->tot_len > TBUF_SIZE)
+      return 0;
+    if (e1000e->tx_cnt + 1 + ctx > TDESC_COUNT - 1)
+      return 0;
+    /* the buffer of the slot the data descriptor lands in */
+    slot = (TDT + ctx) & TDESC_COUNT_MOD_MASK;
+    pbuf_copy_partial (p, e1000e->tbufs[slot], p->tot_len, 0);
+    segs[0].phys = V2P (uint32, e1000e->tbufs[slot]);
+    segs[0].len = p->tot_len;
+    return e1000e_tx_queue (segs, 1, NULL, c) ? p->tot_len : 0;
+  }
 
-  return len;
+  return e1000e_tx_queue (segs, n, p, c) ? p->tot_len : 0;
 }
 
-extern void
-e1000e_rx_poll (void)
+/* Whether the hardware checked every checksum lwIP would have: for
+ * anything but IPv4, there is nothing to check */
+static bool
+e1000e_rx_csum_checked (union e1000e_rdesc *rd, uint8 *frame)
+{
+  uint8 proto;
+
+  if (rd->wb.status & RDESC_STATUS_IXSM)
+    return FALSE;
+  if (frame[12] != 0x08 || frame[13] != 0x00)
+    return TRUE;
+  if (!(rd->wb.status & RDESC_STATUS_IPCS))
+    return FALSE;
+  proto = frame[14 + 9];        /* IP protocol */
+  return (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) ||
+    (rd->wb.status & RDESC_STATUS_TCPCS);
+}
+
+/* Pass up at most budget frames received on queue q, returning how
+ * many descriptors were consumed */
+static uint
+e1000e_rx_clean (uint q, uint budget)
 {
-  uint32 entry, rdt;
+  union e1000e_rdesc *rd;
+  uint32 entry;
   uint8 *ptr;
+  uint work = 0;
 
-  DLOG ("RX: %d %d %d %d %d %d %d %d",
-        e1000e->rdescs[0].status & RDESC_STATUS_DD,
-        e1000e->rdescs[1].status & RDESC_STATUS_DD,
-        e1000e->rdescs[2].status & RDESC_STATUS_DD,
-        e1000e->rdescs[3].status & RDESC_STATUS_DD,
-        e1000e->rdescs[4].status & RDESC_STATUS_DD,
-        e1000e->rdescs[5].status & RDESC_STATUS_DD,
-        e1000e->rdescs[6].status & RDESC_STATUS_DD,
-        e1000e->rdescs[7].status & RDESC_STATUS_DD);
-
-  entry = e1000e->rx_idx & RDESC_COUNT_MOD_MASK;
-  while (e1000e->rdescs[entry].status & RDESC_STATUS_DD) {
-    if (e1000e->rdescs[entry].status & RDESC_STATUS_EOP) {
+  entry = e1000e->rx_idx[q] & RDESC_COUNT_MOD_MASK;
+  rd = &e1000e->rdescs[q][entry];
+  while (work < budget && (rd->wb.status & RDESC_STATUS_DD)) {
+    if (rd->wb.status & RDESC_STATUS_EOP) {
       uint16 len;
       /* full packet */
-      ptr = e1000e->rbufs[entry];
-      len = e1000e->rdescs[entry].length;
-      DLOG ("RX: full packet@%p len=%d", ptr, len);
-      if (e1000e_ethdev.recv_func)
+      ptr = e1000e->rbufs[q][entry];
+      len = rd->wb.length;
+      DLOG ("RX%d: full packet@%p len=%d", q, ptr, len);
+      if (rd->wb.status & (RDESC_ERRORS_IPE | RDESC_ERRORS_TCPE))
+        DLOG ("RX%d: bad checksum. status=%p", q, rd->wb.status);
+      else if (e1000e_ethdev.recv_func) {
+        /* lwIP handles the frame before the upcall returns, so it
+         * can check this one (an IP fragment, say) in software */
+        bool checked = e1000e_rx_csum_checked (rd, ptr);
+        if (!checked)
+          NETIF_SET_CHECKSUM_CTRL (&e1000e_ethdev.netif,
+                                   NETIF_CHECKSUM_ENABLE_ALL);
         e1000e_ethdev.recv_func (&e1000e_ethdev, ptr, len);
-      else                      /* drop it */
+        if (!checked)
+          NETIF_SET_CHECKSUM_CTRL (&e1000e_ethdev.netif,
+                                   NETIF_CHECKSUM_DISABLE_ALL);
+      } else                    /* drop it */
         DLOG ("recv_func is null");
     } else {
       /* error */
-      DLOG ("RX: error. status=%p", e1000e->rdescs[entry].status);
+      DLOG ("RX%d: error. status=%p", q, rd->wb.status);
     }
 
-    /* clear status */
-    e1000e->rdescs[entry].status = 0;
-
-    /* advance "tail" to notify hardware */
-    rdt = RDT;
-    rdt++;
-    if (rdt >= RDESC_COUNT)
-      rdt = 0;
-    RDT = rdt;
+    /* hand the buffer back, which also clears the status */
+    rd->read.address = V2P (uint64, e1000e->rbufs[q][entry]);
+    rd->read.reserved = 0;
+    work++;
 
     /* check next entry */
-    entry = (++e1000e->rx_idx) & RDESC_COUNT_MOD_MASK;
+    entry = (++e1000e->rx_idx[q]) & RDESC_COUNT_MOD_MASK;
+    rd = &e1000e->rdescs[q][entry];
   }
+
+  /* advance "tail" to notify hardware */
+  if (work > 0)
+    RDT (q) = (entry - 1) & RDESC_COUNT_MOD_MASK;
+  return work;
+}
+
+extern void
+e1000e_rx_poll (void)
+{
+  uint q;
+
+  for (q=0; q<E1000E_RX_QUEUES; q++)
+    e1000e_rx_clean (q, ~0);
 }
 
 static void
@@ -253,6 +509,10 @@ handle_tx (uint32 icr)
       e1000e->tdescs[i].cmd = 0;
       e1000e->tdescs[i].sta = 0;
       e1000e->tx_cnt--;
+      if (tx_pbufs[i]) {
+        pbuf_free (tx_pbufs[i]);
+        tx_pbufs[i] = NULL;
+      }
     }
   }
 }
@@ -264,18 +524,83 @@ e1000e_poll (void)
   handle_tx (ICR_TXQE);
 }
 
+/* One per receive queue: frames a flow hashes to are handled here,
+ * in order.  lwIP itself still runs under the kernel lock. */
+static void
+e1000e_bh_thread (struct e1000e_rxq *q)
+{
+  for (;;) {
+    uint work = e1000e_rx_clean (q->num, E1000E_POLL_BUDGET);
+
+    if (q->num == 0)
+      handle_tx (ICR_TXQE);
+
+    if (work >= E1000E_POLL_BUDGET)
+      /* still busy: come back for another round */
+      iovcpu_job_wakeup_for_me (q->bh_id);
+    else if (e1000e_msix)
+      IMS = q->ims;
+    else {
+      /* the shared interrupt waits for every queue */
+      e1000e_bh_pending &= ~(1 << q->num);
+      if (e1000e_bh_pending == 0)
+        IMS = IMS_ENABLE;
+    }
+
+    iovcpu_job_completion ();
+  }
+}
+
+/* Mask the causes and wake the bottom half of queue q */
+static void
+e1000e_queue_irq (struct e1000e_rxq *q)
+{
+  extern vcpu *vcpu_lookup (int);
+  IMC = q->ims;
+  /* hack: use VCPU2's period */
+  iovcpu_job_wakeup (q->bh_id, vcpu_lookup (2)->T);
+}
+
+static uint32
+e1000e_msix_handler0 (uint8 vec)
+{
+  if (rxqs[0].bh_id)
+    e1000e_queue_irq (&rxqs[0]);
+  return 0;
+}
+
+static uint32
+e1000e_msix_handler1 (uint8 vec)
+{
+  if (rxqs[1].bh_id)
+    e1000e_queue_irq (&rxqs[1]);
+  return 0;
+}
+
+static vector_handler e1000e_msix_handlers[E1000E_RX_QUEUES] = {
+  e1000e_msix_handler0, e1000e_msix_handler1
+};
+
 static uint32
 e1000e_irq_handler (uint8 vec)
 {
   /* ICR is cleared upon read; this implicitly acknowledges the
-   * interrupt. */
+   * interrupt.  A cause raised after this read stays latched, and
+   * interrupts again as soon as it is unmasked. */
   uint32 icr = ICR;
+  uint q;
   DLOG ("IRQ: ICR=%p", icr);
 
-  if (icr & ICR_RXT)            /* RX */
-    e1000e_rx_poll ();
-  if (icr & ICR_TXQE)           /* TX queue empty */
-    handle_tx (icr);
+  if (icr == 0 || rxqs[0].bh_id == 0)
+    return 0;
+
+  /* masked until every bottom half has caught up */
+  IMC = ~0;
+  for (q=0; q<e1000e_rx_queues; q++) {
+    extern vcpu *vcpu_lookup (int);
+    e1000e_bh_pending |= 1 << q;
+    iovcpu_job_wakeup (rxqs[q].bh_id, vcpu_lookup (2)->T);
+  }
 
   return 0;
 }
@@ -283,7 +608,7 @@ e1000e_irq_handler (uint8 vec)
 static void
 reset (void)
 {
-  uint i;
+  uint i, q;
 
   /* disable PCIe mastering */
   //DLOG ("Master Disable CTRL=%p", CTRL);
@@ -326,36 +651,55 @@ reset (void)
 
   DLOG ("RAL=%p RAH=%p", RAL, RAH);
 
+  /* check IP, TCP and UDP checksums on receipt; the descriptor
+   * carries the RSS hash rather than the packet checksum */
+  RXCSUM |= RXCSUM_IPOFL | RXCSUM_TUOFL | RXCSUM_PCSD;
+  RFCTL |= RFCTL_EXSTEN;
+
+  /* spread flows over the queues by hash: alternate RETA entries */
+  for (i=0; i<10; i++)
+    RSSRK (i) = rss_key[i];
+  for (i=0; i<32; i++)
+    RETA (i) = e1000e_rx_queues > 1 ?
+      (RETA_QUEUE1 << 8) | (RETA_QUEUE1 << 24) : 0;
+  MRQC = MRQC_RSS | MRQC_TCPIPV4 | MRQC_IPV4;
+
   /* set rx buffer size code */
   RCTL &= ~RCTL_BSIZE;
   RCTL |= RBUF_SIZE_MASK;
   RCTL &= ~RCTL_BSEX;
 
-  /* set up rdesc addresses */
-  for (i=0; i<RDESC_COUNT; i++) {
-    e1000e->rdescs[i].address = V2P (uint64, e1000e->rbufs[i]);
-    e1000e->rdescs[i].status = 0;
-  }
+  for (q=0; q<E1000E_RX_QUEUES; q++) {
+    /* set up rdesc addresses */
+    for (i=0; i<RDESC_COUNT; i++) {
+      e1000e->rdescs[q][i].read.address = V2P (uint64, e1000e->rbufs[q][i]);
+      e1000e->rdescs[q][i].read.reserved = 0;
+    }
 
-  /* program the rdesc base address and length */
-  RDBAL = V2P (uint32, e1000e->rdescs);
-  RDBAH = 0;
-  RDLEN = RDESC_COUNT * sizeof (struct e1000e_rdesc);
+    /* program the rdesc base address and length */
+    RDBAL (q) = V2P (uint32, e1000e->rdescs[q]);
+    RDBAH (q) = 0;
+    RDLEN (q) = RDESC_COUNT * sizeof (union e1000e_rdesc);
 
-  /* set head, tail of rx ring buffer */
-  RDH = 0;
-  RDT = RDESC_COUNT - 1;
+    /* set head, tail of rx ring buffer */
+    RDH (q) = 0;
+    RDT (q) = RDESC_COUNT - 1;
 
-  e1000e->rx_idx = 0;
+    e1000e->rx_idx[q] = 0;
 
-  DLOG ("RDBAL=%p RDLEN=%p RDH=%d RDT=%d",
-        V2P (uint32, e1000e->rdescs), RDESC_COUNT * sizeof (struct e1000e_rdesc),
-        RDH, RDT);
+    DLOG ("RDBAL%d=%p RDLEN=%p RDH=%d RDT=%d", q,
+          V2P (uint32, e1000e->rdescs[q]),
+          RDESC_COUNT * sizeof (union e1000e_rdesc), RDH (q), RDT (q));
+  }
 
   /* set up tdesc addresses */
   for (i=0; i<TDESC_COUNT; i++) {
     e1000e->tdescs[i].address = V2P (uint64, e1000e->tbufs[i]);
     e1000e->tdescs[i].sta = 0;
+    if (tx_pbufs[i]) {
+      pbuf_free (tx_pbufs[i]);
+      tx_pbufs[i] = NULL;
+    }
   }
 
   /* program the tdesc base address and length */
@@ -368,16 +712,32 @@ reset (void)
   TDT = 0;
 
   e1000e->tx_cnt = 0;
+  tx_ctx_valid = FALSE;
 
   DLOG ("TDBAL=%p TDLEN=%p TDH=%d TDT=%d",
         V2P (uint32, e1000e->tdescs), TDESC_COUNT * sizeof (struct e1000e_tdesc),
         TDH, TDT);
 
-  /* setup RX interrupts */
-  IMS |= IMS_RXT;
-
-  /* setup TX interrupts */
-  IMS |= IMS_TXQE;
+  if (e1000e_msix) {
+    /* a vector per queue; TX completions go with queue 0 */
+    uint32 ivar = IVAR_TXQ0 (0) | IVAR_TX_EVERY_WB;
+    uint32 eiac = IMS_TXQ0;
+    for (q=0; q<e1000e_rx_queues; q++) {
+      ivar |= IVAR_RXQ (q, q);
+      eiac |= IMS_RXQ (q);
+      rxqs[q].ims = IMS_RXQ (q);
+    }
+    rxqs[0].ims |= IMS_TXQ0;
+    IVAR = ivar;
+    EIAC = eiac;                /* causes clear as their message goes */
+    CTRLEXT |= CTRLEXT_PBA_CLR;
+    IMS = eiac;
+  } else {
+    for (q=0; q<E1000E_RX_QUEUES; q++)
+      rxqs[q].ims = ~0;
+    /* setup RX and TX interrupts */
+    IMS = IMS_ENABLE;
+  }
 
   /* enable RX operation and broadcast reception */
   RCTL |= (RCTL_EN | RCTL_BAM);
@@ -402,7 +762,8 @@ reset (void)
 extern bool
 e1000e_init (void)
 {
-  uint i, io_base, mask, frame_count;
+  uint i, q, io_base, mask, frame_count;
+  pci_device dev;
 
   if (mp_ISA_PC) {
     DLOG ("Requires PCI support");
@@ -498,17 +859,34 @@ e1000e_init (void)
 
   DLOG ("DMA region at virt=%p phys=%p count=%d", e1000e, e1000e_phys, frame_count);
 
-  if (!pci_get_interrupt (device_index, &irq_line, &irq_pin)) {
-    DLOG ("Unable to get IRQ");
-    goto abort_virt;
-  }
+  /* A vector per receive queue, each sent to its own CPU, if the
+   * device has MSI-X; otherwise the queues share the pin */
+  if (pci_get_device (device_index, &dev))
+    for (q=0; q<E1000E_RX_QUEUES; q++) {
+      if (!pci_irq_map_msix_handler (dev.bus, dev.slot, dev.func, q,
+                                     e1000e_msix_handlers[q],
+                                     1 << (q % mp_num_cpus)))
+        break;
+      e1000e_msix++;
+    }
 
-  DLOG ("Using IRQ line=%.02X pin=%X", irq_line, irq_pin);
+  if (e1000e_msix > 0) {
+    DLOG ("Using %d MSI-X vectors", e1000e_msix);
+    e1000e_rx_queues = e1000e_msix;
+  } else {
+    if (!pci_get_interrupt (device_index, &irq_line, &irq_pin)) {
+      DLOG ("Unable to get IRQ");
+      goto abort_virt;
+    }
 
-  /* Map IRQ to handler */
-  IOAPIC_map_GSI (IRQ_to_GSI (mp_ISA_bus_id, irq_line),
-                  E1000E_VECTOR, 0xFF00000000000800LL);
-  set_vector_handler (E1000E_VECTOR, e1000e_irq_handler);
+    DLOG ("Using IRQ line=%.02X pin=%X", irq_line, irq_pin);
+
+    /* Map IRQ to handler */
+    IOAPIC_map_GSI (IRQ_to_GSI (mp_ISA_bus_id, irq_line),
+                    E1000E_VECTOR, 0xFF00000000000800LL);
+    set_vector_handler (E1000E_VECTOR, e1000e_irq_handler);
+    e1000e_rx_queues = E1000E_RX_QUEUES;
+  }
 
 #if 0
   /* read hardware individual address from EEPROM */
@@ -535,6 +913,7 @@ e1000e_init (void)
   /* Register network device with net subsystem */
   e1000e_ethdev.recv_func = NULL;
   e1000e_ethdev.send_func = e1000e_transmit;
+  e1000e_ethdev.send_pbuf_func = e1000e_transmit_pbuf;
   e1000e_ethdev.get_hwaddr_func = e1000e_get_hwaddr;
   e1000e_ethdev.poll_func = e1000e_poll;
 
@@ -543,6 +922,21 @@ e1000e_init (void)
     goto abort_virt;
   }
 
+  /* IP, TCP and UDP checksums are left to the hardware */
+  NETIF_SET_CHECKSUM_CTRL (&e1000e_ethdev.netif, NETIF_CHECKSUM_DISABLE_ALL);
+
+  for (q=0; q<e1000e_rx_queues; q++) {
+    rxqs[q].num = q;
+    rxqs[q].bh_id =
+      create_kernel_thread_args ((u32) e1000e_bh_thread,
+                                 (u32) &e1000e_bh_stack[q][1023],
+                                 FALSE, 1, &rxqs[q]);
+    set_iovcpu (rxqs[q].bh_id, IOVCPU_CLASS_NET);
+  }
+
+  logger_printf ("e1000e: %d RX queues, %s\n", e1000e_rx_queues,
+                 e1000e_msix ? "MSI-X" : "shared interrupt");
+
   return TRUE;
 
  abort_virt:
@@ -67,6 +67,8 @@
 #include "types.h"
 #include "string.h"
 #include "drivers/net/ethernet.h"
+#include "drivers/net/socket.h"
+#include "mem/virtual.h"
 #include "util/debug.h"
 #include "util/printf.h"
 #include "util/circular.h"
@@ -101,6 +103,7 @@ struct ethernetif {
 
 /* Forward declarations. */
 static void  ethernetif_input(struct netif *netif);
+static void  ethernetif_input_pbuf(struct netif *netif, struct pbuf *p);
 
 /**
  * In this function, the hardware should be initialized.
@@ -118,8 +121,8 @@ low_level_init(struct netif *netif)
 
   ethernetif->dev->get_hwaddr_func (netif->hwaddr);
 
-  /* maximum transfer unit */
-  netif->mtu = 1500;
+  /* maximum transfer unit, until net_set_mtu says otherwise */
+  netif->mtu = ETH_MTU;
 
   /* device capabilities */
   /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
@@ -153,17 +156,25 @@ low_level_output(struct netif *netif, struct pbuf *p)
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-  ptr = buffer;
-  for(q = p; q != NULL; q = q->next) {
-    /* Send the data from the pbuf to the interface, one pbuf at a
-       time. The size of the data in each pbuf is kept in the ->len
-       variable. */
-    memcpy(ptr, q->payload, q->len);
-    ptr += q->len;
-  }
+  if (ethernetif->dev->send_pbuf_func) {
+    /* the driver sends straight out of the pbufs */
+    if (ethernetif->dev->send_pbuf_func (p) != p->tot_len)
+      return ERR_BUF;
+  } else {
+    if (p->tot_len > MAX_FRAME_SIZE)
+      return ERR_BUF;
+    ptr = buffer;
+    for(q = p; q != NULL; q = q->next) {
+      /* Send the data from the pbuf to the interface, one pbuf at a
+         time. The size of the data in each pbuf is kept in the ->len
+         variable. */
+      memcpy(ptr, q->payload, q->len);
+      ptr += q->len;
+    }
 
-  if (ethernetif->dev->send_func (buffer, p->tot_len) != p->tot_len)
-    return ERR_BUF;
+    if (ethernetif->dev->send_func (buffer, p->tot_len) != p->tot_len)
+      return ERR_BUF;
+  }
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
@@ -255,13 +266,24 @@ low_level_input(struct netif *netif)
 static void
 ethernetif_input(struct netif *netif)
 {
-  /*struct ethernetif *ethernetif;*/
-  struct eth_hdr *ethhdr;
   struct pbuf *p = low_level_input (netif);
 
   if (!p) return;
 
-  /*ethernetif = netif->state;*/
+  ethernetif_input_pbuf (netif, p);
+}
+
+/**
+ * Hands a received frame to lwIP according to its type.  The pbuf
+ * is freed here if lwIP does not take it.
+ *
+ * @param netif the lwip network interface structure for this ethernetif
+ * @param p the received frame (including MAC header)
+ */
+static void
+ethernetif_input_pbuf(struct netif *netif, struct pbuf *p)
+{
+  struct eth_hdr *ethhdr;
 
   ethhdr = (struct eth_hdr*) (p->payload);
 
@@ -344,6 +366,153 @@ dispatch(ethernet_device *dev, uint8* buf, sint len)
   ethernetif_input (&dev->netif);
 }
 
+/* Break an outgoing pbuf chain into physically contiguous pieces for
+ * a driver's scatter-gather descriptors.  A pbuf may straddle a page
+ * boundary, so each one is split wherever its pages are not adjacent.
+ * No piece is longer than a page, which any descriptor can take.
+ * Returns the number of pieces, or 0 if there are more than max. */
+uint
+net_tx_segments (struct pbuf *p, net_tx_seg_t *segs, uint max)
+{
+  uint n = 0;
+  struct pbuf *q;
+
+  for (q = p; q != NULL; q = q->next) {
+    uint8 *ptr = q->payload;
+    uint left = q->len;
+
+    while (left > 0) {
+      uint32 phys = (uint32) get_phys_addr (ptr);
+      uint chunk = 0x1000 - ((uint32) ptr & 0xFFF);
+
+      if (chunk > left)
+        chunk = left;
+      if (n > 0 && segs[n-1].phys + segs[n-1].len == phys &&
+          segs[n-1].len + chunk <= 0x1000)
+        segs[n-1].len += chunk;
+      else {
+        if (n == max)
+          return 0;
+        segs[n].phys = phys;
+        segs[n].len = chunk;
+        n++;
+      }
+      ptr += chunk;
+      left -= chunk;
+    }
+  }
+  return n;
+}
+
+/* Fill in the offload of an outgoing frame, and seed its TCP/UDP
+ * checksum field with the pseudo-header sum, which the hardware adds
+ * the header and payload to.  For segmentation (mss != 0) both
+ * checksums are always inserted, and the seed leaves out the length,
+ * which the hardware adds for each segment it cuts. */
+static bool
+tx_offload (struct pbuf *p, uint16 mss, net_tx_csum_t *c)
+{
+  uint8 *frame = p->payload;
+  struct ip_hdr *iphdr;
+  uint hlen, off;
+
+  c->ip_csum = c->l4_csum = c->tcp = FALSE;
+  c->tucso = 0;
+  c->mss = mss;
+  c->hdrlen = 0;
+  if (p->len < SIZEOF_ETH_HDR + IP_HLEN ||
+      ((struct eth_hdr *) frame)->type != htons (ETHTYPE_IP))
+    return FALSE;
+  iphdr = (struct ip_hdr *) (frame + SIZEOF_ETH_HDR);
+  hlen = IPH_HL (iphdr) * 4;
+  if (hlen < IP_HLEN || p->len < SIZEOF_ETH_HDR + hlen)
+    return FALSE;
+
+  c->ipcss = SIZEOF_ETH_HDR;
+  c->ipcso = SIZEOF_ETH_HDR + 10;
+  c->ipcse = SIZEOF_ETH_HDR + hlen - 1;
+  c->tucss = SIZEOF_ETH_HDR + hlen;
+  c->ip_csum = (IPH_CHKSUM (iphdr) == 0);
+
+  if (IPH_OFFSET (iphdr) & htons (IP_MF | IP_OFFMASK))
+    /* the transport checksum covers all fragments */
+    return c->ip_csum && !mss;
+
+  switch (IPH_PROTO (iphdr)) {
+  case IP_PROTO_TCP:
+    c->tcp = TRUE;
+    off = 16;
+    break;
+  case IP_PROTO_UDP:
+    off = 6;
+    break;
+  default:
+    return c->ip_csum && !mss;
+  }
+  c->tucso = c->tucss + off;
+  if (p->len < c->tucso + 2)
+    return c->ip_csum && !mss;
+
+  if (mss) {
+    struct tcp_hdr *tcphdr = (struct tcp_hdr *) (frame + c->tucss);
+
+    if (!c->tcp || p->len < c->tucss + TCPH_HDRLEN (tcphdr) * 4)
+      return FALSE;
+    c->hdrlen = c->tucss + TCPH_HDRLEN (tcphdr) * 4;
+    IPH_CHKSUM_SET (iphdr, 0);
+    c->ip_csum = TRUE;
+  } else if (*(u16_t *) (frame + c->tucso) != 0)
+    return c->ip_csum;
+
+  {
+    u32_t src = iphdr->src.addr, dest = iphdr->dest.addr;
+    u32_t sum = (src & 0xFFFF) + (src >> 16) + (dest & 0xFFFF) + (dest >> 16) +
+      htons (IPH_PROTO (iphdr));
+
+    if (!mss)
+      sum += htons (ntohs (IPH_LEN (iphdr)) - hlen);
+    while (sum >> 16)
+      sum = (sum & 0xFFFF) + (sum >> 16);
+    *(u16_t *) (frame + c->tucso) = sum;
+    c->l4_csum = TRUE;
+  }
+  return TRUE;
+}
+
+/* Prepare an outgoing frame for checksum offload.  lwIP leaves the
+ * checksums it does not generate on a netif at zero, and only those
+ * are offloaded: a header that already carries a checksum (an IP
+ * fragment, say) is left alone.  Returns FALSE if there is nothing
+ * to offload. */
+bool
+net_tx_csum (struct pbuf *p, net_tx_csum_t *c)
+{
+  return tx_offload (p, 0, c);
+}
+
+/* Prepare a TCP super-segment (see netif->tso_mss) for the hardware
+ * to cut into segments of mss bytes of payload.  Returns FALSE if the
+ * frame is not one it can cut. */
+bool
+net_tx_tso (struct pbuf *p, uint16 mss, net_tx_csum_t *c)
+{
+  return tx_offload (p, mss, c);
+}
+
+/* A pbuf the driver filled itself (recv_pbuf_func) goes up without
+ * another copy */
+static void
+dispatch_pbuf(ethernet_device *dev, struct pbuf *p)
+{
+  if (p == NULL) {
+    LINK_STATS_INC(link.memerr);
+    LINK_STATS_INC(link.drop);
+    return;
+  }
+  LINK_STATS_INC(link.recv);
+  ethernetif_input_pbuf (&dev->netif, p);
+}
+
 /* ************************************************** */
 
 /* Demo Echo server on port 7 */
@@ -546,6 +715,133 @@ khttpd_init (void)
 
 /* ************************************************** */
 
+#ifdef NET_BDP_TEST
+
+/* Bandwidth-delay-product test: discard (port 9) and chargen (port
+ * 19), on the raw API so that they get the full TCP_WND, which
+ * sockets do not.  Only built with -DNET_BDP_TEST (see default-config.mk):
+ * chargen will flood whoever connects.  tools/bdptest.sh boots Quest
+ * with the ports forwarded and measures both directions; over a tap
+ * device, add delay on the host side with netem.
+ *
+ * The discard side logs the receive rate when the peer closes.  With
+ * window scaling on, a single connection should track the link rate
+ * up to TCP_WND / RTT. */
+
+typedef struct {
+  u32 bytes;
+  u32 start;
+} bdp_stat_t;
+
+static bdp_stat_t bdp_discard_stat;
+static u8 bdp_pattern[1460];
+
+static err_t
+bdp_discard_recv (void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err)
+{
+  bdp_stat_t *st = (bdp_stat_t *) arg;
+
+  if (p == NULL) {
+    u32 ms = sys_now () - st->start;
+    logger_printf ("bdp: discard %d bytes in %d ms (%d KB/s)\n",
+                   st->bytes, ms, ms ? st->bytes / ms : 0);
+    tcp_arg (pcb, NULL);
+    tcp_recv (pcb, NULL);
+    tcp_close (pcb);
+    return ERR_OK;
+  }
+  if (err == ERR_OK) {
+    st->bytes += p->tot_len;
+    tcp_recved (pcb, p->tot_len);
+  }
+  pbuf_free (p);
+  return ERR_OK;
+}
+
+static err_t
+bdp_discard_accept (void* arg, struct tcp_pcb* pcb, err_t err)
+{
+  tcp_accepted (pcb);
+  bdp_discard_stat.bytes = 0;
+  bdp_discard_stat.start = sys_now ();
+  tcp_arg (pcb, &bdp_discard_stat);
+  tcp_recv (pcb, bdp_discard_recv);
+  return ERR_OK;
+}
+
+/* keep the send buffer full */
+static err_t
+bdp_chargen_fill (struct tcp_pcb* pcb)
+{
+  while (tcp_sndbuf (pcb) >= sizeof (bdp_pattern) &&
+         pcb->snd_queuelen < TCP_SND_QUEUELEN - 1)
+    if (tcp_write (pcb, bdp_pattern, sizeof (bdp_pattern), 0) != ERR_OK)
+      break;
+  tcp_output (pcb);
+  return ERR_OK;
+}
+
+static err_t
+bdp_chargen_sent (void* arg, struct tcp_pcb* pcb, u16_t len)
+{
+  return bdp_chargen_fill (pcb);
+}
+
+static err_t
+bdp_chargen_poll (void* arg, struct tcp_pcb* pcb)
+{
+  return bdp_chargen_fill (pcb);
+}
+
+static err_t
+bdp_chargen_recv (void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err)
+{
+  if (p == NULL) {
+    tcp_sent (pcb, NULL);
+    tcp_poll (pcb, NULL, 0);
+    tcp_recv (pcb, NULL);
+    tcp_close (pcb);
+    return ERR_OK;
+  }
+  tcp_recved (pcb, p->tot_len);
+  pbuf_free (p);
+  return ERR_OK;
+}
+
+static err_t
+bdp_chargen_accept (void* arg, struct tcp_pcb* pcb, err_t err)
+{
+  tcp_accepted (pcb);
+  tcp_recv (pcb, bdp_chargen_recv);
+  tcp_sent (pcb, bdp_chargen_sent);
+  tcp_poll (pcb, bdp_chargen_poll, 2);
+  return bdp_chargen_fill (pcb);
+}
+
+static void
+bdp_init (void)
+{
+  struct tcp_pcb* pcb;
+  uint i;
+
+  for (i = 0; i < sizeof (bdp_pattern); i++)
+    bdp_pattern[i] = ' ' + (i % 95);
+
+  pcb = tcp_new ();
+  tcp_bind (pcb, IP_ADDR_ANY, 9);
+  pcb = tcp_listen (pcb);
+  tcp_accept (pcb, bdp_discard_accept);
+
+  pcb = tcp_new ();
+  tcp_bind (pcb, IP_ADDR_ANY, 19);
+  pcb = tcp_listen (pcb);
+  tcp_accept (pcb, bdp_chargen_accept);
+}
+
+#endif /* NET_BDP_TEST */
+
+/* ************************************************** */
+
 /* gdbstub debugging over tcp */
 
 #ifdef GDBSTUB_TCP
@@ -711,8 +1007,12 @@ bool
 net_init(void)
 {
   lwip_init ();
+  sock_init ();
   echo_init ();
   khttpd_init ();
+#ifdef NET_BDP_TEST
+  bdp_init ();
+#endif
 
   net_tmr_pid = start_kernel_thread ((uint) net_tmr_thread,
                                      (uint) &net_tmr_stack[1023]);
@@ -745,6 +1045,7 @@ net_register_device (ethernet_device *dev)
 
   dev->num = ethernet_device_count++;
   dev->recv_func = dispatch;
+  dev->recv_pbuf_func = dispatch_pbuf;
 
   DLOG ("net_register_device num=%d", dev->num);
 
@@ -799,6 +1100,27 @@ net_set_up (char *devname)
   return FALSE;
 }
 
+/* set the MTU of device, up to what its driver takes (see
+ * ethernet_device.max_mtu).  TCP connections opened from then on
+ * advertise and use an MSS to match. */
+bool
+net_set_mtu (char *devname, uint16 mtu)
+{
+  struct netif *netif = netif_find (devname);
+  ethernet_device *dev;
+  uint16 max;
+
+  if (!netif)
+    return FALSE;
+  dev = ((struct ethernetif *) netif->state)->dev;
+  max = dev->max_mtu ? dev->max_mtu : ETH_MTU;
+  /* no less than the datagram every IP host must take */
+  if (mtu < 576 || mtu > max)
+    return FALSE;
+  netif->mtu = mtu;
+  return TRUE;
+}
+
 /* give device a static configuration */
 bool
 net_static_config(char *devname, char *myip_s, char *gwip_s, char *netmask_s)
@@ -825,6 +1147,15 @@ net_static_config(char *devname, char *myip_s, char *gwip_s, char *netmask_s)
   return TRUE;
 }
 
+/* lwIP's clock, for TCP timestamps: milliseconds */
+u32_t
+sys_now (void)
+{
+  extern volatile uint32 tick;
+
+  return tick * (1000 / HZ);
+}
+
 void
 net_tmr_process(void)
 {
@@ -861,6 +1192,9 @@ net_tmr_process(void)
     next_dhcp_fine_time = now + (DHCP_FINE_TIMER_MSECS / 10);
   }
 #endif
+
+  /* epoll_wait timeouts */
+  sock_tmr_process ();
 }
 
 static const struct module_ops mod_ops = {
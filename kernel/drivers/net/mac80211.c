@@ -170,6 +170,7 @@ ieee80211_register_hw (struct ieee80211_hw *hw)
 
   local->ethdev.recv_func = NULL;
   local->ethdev.send_func = mac80211_tx;
+  local->ethdev.send_pbuf_func = NULL;
   local->ethdev.get_hwaddr_func = mac80211_get_hwaddr;
   local->ethdev.poll_func = mac80211_poll;
   hack_local = local;           /* until I fix ethernet_device */
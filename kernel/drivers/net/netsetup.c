@@ -24,6 +24,10 @@ bool
 netsetup_init (void)
 {
   net_set_default ("en0");
+#ifdef NETSETUP_MTU
+  /* jumbo frames, where the LAN and the device take them */
+  net_set_mtu ("en0", NETSETUP_MTU);
+#endif
   net_dhcp_start ("en0");
   return TRUE;
 }
@@ -19,6 +19,7 @@
 
 #include "drivers/pci/pci.h"
 #include "drivers/net/pcnet.h"
+#include "lwip/pbuf.h"
 #include "arch/i386.h"
 #include "util/printf.h"
 #include "smp/smp.h"
@@ -26,6 +27,7 @@
 #include "mem/physical.h"
 #include "mem/virtual.h"
 #include "kernel.h"
+#include "sched/vcpu.h"
 
 #define DEBUG_PCNET
 
@@ -45,7 +47,14 @@
 #define RX_RING_MOD_MASK (RX_RING_SIZE - 1)
 #define RX_RING_LEN_BITS ((NUM_RX_BUFFERS_LOG2) << 29)
 #define RX_RING_BUF_SIZE MAX_FRAME_SIZE   /* multiple of 16 */
+
+#define NUM_TX_BUFFERS_LOG2 4 /* 16 Tx descriptors */
+
+#define TX_RING_SIZE (1 << NUM_TX_BUFFERS_LOG2)
+#define TX_RING_MOD_MASK (TX_RING_SIZE - 1)
 #define TX_RING_BUF_SIZE MAX_FRAME_SIZE   /* multiple of 16 */
+/* descriptors one frame may take */
+#define TX_MAX_SEGS 8
 
 #define PCNET_VECTOR 0x4B
 
@@ -134,13 +143,24 @@ struct pcnet_tx_head {
   uint32 _reserved;
 } PACKED;
 
+/* TMD1 written as a whole, so that OWN goes in with the rest */
+#define TMD1_OWN  0x80000000
+#define TMD1_ERR  0x40000000
+#define TMD1_STP  0x02000000
+#define TMD1_ENP  0x01000000
+#define TMD1_ONES 0x0000F000
+#define TMD1_BCNT(len) ((-(len)) & 0xFFFF) /* 2s complement, with ONES */
+
 struct pcnet_interface {
   struct pcnet_rx_head rx_ring[RX_RING_SIZE];
-  struct pcnet_tx_head tx_ring;
+  struct pcnet_tx_head tx_ring[TX_RING_SIZE];
   struct pcnet_init_block init_block;
   uint8 rbuf[RX_RING_SIZE][RX_RING_BUF_SIZE] ALIGNED(16);
-  uint8 tbuf[TX_RING_BUF_SIZE] ALIGNED(16);
+  uint8 tbuf[TX_RING_SIZE][TX_RING_BUF_SIZE] ALIGNED(16);
   sint32 rx_idx;
+  uint32 tx_idx;                /* next TX descriptor to fill */
+  uint32 tx_clean;              /* oldest pending TX descriptor */
+  uint32 tx_cnt;                /* number of pending TX descriptors */
 } PACKED;
 
 /* ************************************************** */
@@ -267,24 +287,29 @@ reset (void)
     card->rx_ring[i].rmd0.rbadr = V2P (uint32, card->rbuf[i]);
     card->rx_ring[i].rmd1.own = 1;
   }
-  card->tx_ring.rmd1.buf_length = -TX_RING_BUF_SIZE;
-  card->tx_ring.rmd0.tbadr = V2P (uint32, card->tbuf);
+  /* TX descriptors belong to the driver until a frame is queued */
+  for (i=0; i<TX_RING_SIZE; i++) {
+    card->tx_ring[i].rmd0.tbadr = V2P (uint32, card->tbuf[i]);
+    card->tx_ring[i].rmd1.raw = TMD1_ONES;
+    card->tx_ring[i].rmd2.raw = 0;
+  }
 
   card->rx_idx = 0;
+  card->tx_idx = card->tx_clean = card->tx_cnt = 0;
   card->init_block.mode = 0;      /* enable Rx and Tx */
   card->init_block.filter[0] = card->init_block.filter[1] = 0;
 
-  /* multiple Rx buffers and one Tx buffer */
+  /* multiple Rx and Tx buffers */
   card->init_block.rx_ring = V2P (uint32, card->rx_ring);
-  card->init_block.tx_ring = V2P (uint32, &card->tx_ring);
+  card->init_block.tx_ring = V2P (uint32, card->tx_ring);
   card->init_block.rlen = NUM_RX_BUFFERS_LOG2;
-  card->init_block.tlen = 0;
+  card->init_block.tlen = NUM_TX_BUFFERS_LOG2;
 
   phys_init = V2P (uint, &card->init_block);
 
-  DLOG ("phys_init=%p rx_ring=%p tx_ring=%p rbuf[0]=%p tbuf=%p",
+  DLOG ("phys_init=%p rx_ring=%p tx_ring=%p rbuf[0]=%p tbuf[0]=%p",
         phys_init, card->init_block.rx_ring, card->init_block.tx_ring,
-        V2P (uint, card->rbuf[0]), V2P (uint, card->tbuf));
+        V2P (uint, card->rbuf[0]), V2P (uint, card->tbuf[0]));
 
   outw (0, ADDR); (void) inw (ADDR);
   outw (4, DATA);               /* STOP */
@@ -319,32 +344,128 @@ reset (void)
   DLOG ("reset: complete.  CSR0=%p", inw (DATA));
 }
 
+/* Frame whose last descriptor sits in each TX slot, held until the
+ * card gives the descriptor back; NULL for copied frames */
+static struct pbuf *tx_pbufs[TX_RING_SIZE];
+
+/* Pieces of the frame being queued */
+static net_tx_seg_t tx_segs[TX_MAX_SEGS];
+
+/* Reclaim the descriptors of frames the card has sent, oldest first */
+static void
+pcnet_tx_reclaim (void)
+{
+  struct pcnet_tx_head *td;
+
+  while (card->tx_cnt > 0) {
+    td = &card->tx_ring[card->tx_clean];
+    if (td->rmd1.raw & TMD1_OWN)
+      break;
+    if (td->rmd1.raw & TMD1_ERR)
+      DLOG ("TX error entry=%d tmd1=%p tmd2=%p",
+            card->tx_clean, td->rmd1.raw, td->rmd2.raw);
+    if (tx_pbufs[card->tx_clean]) {
+      pbuf_free (tx_pbufs[card->tx_clean]);
+      tx_pbufs[card->tx_clean] = NULL;
+    }
+    td->rmd1.raw = TMD1_ONES;
+    card->tx_clean = (card->tx_clean + 1) & TX_RING_MOD_MASK;
+    card->tx_cnt--;
+  }
+}
+
+/* Queue a frame, room permitting: one descriptor per piece.  The first
+ * is handed over last, so the card never sees a partial frame.  p, if
+ * any, is held until the last descriptor is done. */
+static bool
+pcnet_tx_queue (net_tx_seg_t *segs, uint n, struct pbuf *p)
+{
+  uint32 first = card->tx_idx, entry = first, i, own;
+
+  if (card->tx_cnt + n > TX_RING_SIZE)
+    return FALSE;
+
+  for (i=0; i<n; i++) {
+    entry = (first + i) & TX_RING_MOD_MASK;
+    card->tx_ring[entry].rmd0.tbadr = segs[i].phys;
+    card->tx_ring[entry].rmd2.raw = 0;
+    own = (i == 0 ? 0 : TMD1_OWN);
+    card->tx_ring[entry].rmd1.raw = own | TMD1_BCNT (segs[i].len) |
+      (i == 0 ? TMD1_STP : 0) | (i == n - 1 ? TMD1_ENP : 0);
+  }
+  if (p)
+    pbuf_ref (p);
+  tx_pbufs[entry] = p;
+  card->tx_idx = (first + n) & TX_RING_MOD_MASK;
+  card->tx_cnt += n;
+
+  /* pass ownership of the frame to NIC */
+  asm volatile ("":::"memory");
+  card->tx_ring[first].rmd1.raw |= TMD1_OWN;
+
+  /* trigger a send poll (TDMD), keeping interrupts enabled (IENA).
+   * Should the bottom half have them masked, this unmasks them a
+   * little early, which costs no more than another wakeup. */
+  outw (0, ADDR); (void) inw (ADDR);
+  outw (0x48, DATA);
+  return TRUE;
+}
+
+/* Copy a frame into the buffer of the descriptor it will take */
+static sint
+pcnet_tx_copy (struct pbuf *p)
+{
+  net_tx_seg_t seg;
+
+  if (card->tx_cnt >= TX_RING_SIZE)
+    return 0;
+  pbuf_copy_partial (p, card->tbuf[card->tx_idx], p->tot_len, 0);
+  seg.phys = V2P (uint32, card->tbuf[card->tx_idx]);
+  seg.len = p->tot_len;
+  return pcnet_tx_queue (&seg, 1, NULL) ? p->tot_len : 0;
+}
+
 extern sint
 pcnet_transmit (uint8* buf, sint len)
 {
+  net_tx_seg_t seg;
+
   DLOG ("pcnet_transmit (%p, %d)", buf, len);
-  if (card->tx_ring.rmd1.own != 0) {
-    /* we don't control the transmit buffer at the moment */
+  pcnet_tx_reclaim ();
+  if (len > MAX_FRAME_SIZE)
+    /* too big */
+    return -1;
+  if (card->tx_cnt >= TX_RING_SIZE)
+    /* ring full at the moment */
     return 0;
-  } else if (len > MAX_FRAME_SIZE) {
+  /* copy into the buffer of the next descriptor */
+  memcpy (card->tbuf[card->tx_idx], buf, len);
+  seg.phys = V2P (uint32, card->tbuf[card->tx_idx]);
+  seg.len = len;
+  return pcnet_tx_queue (&seg, 1, NULL) ? len : 0;
+}
+
+/* Scatter-gather transmit: one descriptor per physically contiguous
+ * piece of the chain, which stays referenced until the card gives the
+ * last one back.  Frames queue up behind each other in the ring, so
+ * back-to-back sends go out without waiting on the wire.  A chain too
+ * fragmented for the ring is copied. */
+extern sint
+pcnet_transmit_pbuf (struct pbuf *p)
+{
+  uint n;
+
+  DLOG ("pcnet_transmit_pbuf (%p, %d)", p, p->tot_len);
+  pcnet_tx_reclaim ();
+  if (p->tot_len > MAX_FRAME_SIZE)
     /* too big */
     return -1;
-  } else {
-    /* copy into transmission buffer */
-    memcpy (card->tbuf, buf, len);
-    /* set tbuf length */
-    card->tx_ring.rmd1.buf_length = -len;
-    /* clear misc. info */
-    card->tx_ring.rmd2.raw = 0;
-    /* this is a single packet, start and end */
-    card->tx_ring.rmd1.stp = card->tx_ring.rmd1.enp = 1;
-    /* pass ownership to NIC */
-    card->tx_ring.rmd1.own = 1;
-    /* trigger a send poll */
-    outw (0, ADDR); (void) inw (ADDR);
-    outw (0x48, DATA);
-  }
-  return len;
+
+  n = net_tx_segments (p, tx_segs, TX_MAX_SEGS);
+  if (n == 0)
+    return pcnet_tx_copy (p);
+
+  return pcnet_tx_queue (tx_segs, n, p) ? p->tot_len : 0;
 }
 
 static void
@@ -356,7 +477,7 @@ pcnet_drop_packet (uint8* packet, uint len)
 static ethernet_device pcnet_ethdev;
 
 static void
-pcnet_poll (void)
+pcnet_rx_poll (void)
 {
   uint32 entry;
   uint32* ptr;
@@ -402,36 +523,49 @@ pcnet_poll (void)
 }
 
 static void
-handle_rint (void)
+pcnet_poll (void)
 {
-  DLOG ("IRQ: RINT rx_ring=%.01x %p %.01x %p %.01x %p %.01x %p",
-        card->rx_ring[0].rmd1.own, card->rx_ring[0].rmd0.rbadr,
-        card->rx_ring[1].rmd1.own, card->rx_ring[1].rmd0.rbadr,
-        card->rx_ring[2].rmd1.own, card->rx_ring[2].rmd0.rbadr,
-        card->rx_ring[3].rmd1.own, card->rx_ring[3].rmd0.rbadr);
-
-  pcnet_poll ();
+  pcnet_rx_poll ();
+  pcnet_tx_reclaim ();
 }
 
+static uint32 pcnet_bh_stack[1024] ALIGNED (0x1000);
+static task_id pcnet_bh_id = 0;
+/* The IRQ handler acknowledges the interrupt, leaving the card's
+ * interrupts masked, and wakes this thread, which handles received
+ * frames and sent ones under the kernel lock before unmasking. */
 static void
-handle_tint (void)
+pcnet_bh_thread (void)
 {
-  DLOG ("IRQ: TINT tx_ring=%.01x %p",
-        card->tx_ring.rmd1.own, card->tx_ring.rmd0.tbadr);
+  for (;;) {
+    DLOG ("BH: rx_idx=%d tx_clean=%d tx_cnt=%d",
+          card->rx_idx, card->tx_clean, card->tx_cnt);
+
+    pcnet_rx_poll ();
+    pcnet_tx_reclaim ();
+
+    /* ack anything further and set IENA; a frame that came in since
+     * the poll above interrupts again right away */
+    outw (0, ADDR); (void) inw (ADDR);
+    outw (0x7940, DATA);
+
+    iovcpu_job_completion ();
+  }
 }
 
 static uint32
 pcnet_irq_handler (uint8 vec)
 {
+  extern vcpu *vcpu_lookup (int);
   uint16 csr0;
-  lock_kernel ();
 
   outw (0, ADDR); (void) inw (ADDR);
   csr0 = inw (DATA);
 
   DLOG ("IRQ: vec=%.02X csr0=%.04X", vec, csr0);
 
-  /* acknowledge interrupt sources */
+  /* acknowledge interrupt sources, clearing IENA: masked until the
+   * bottom half has caught up */
   outw (csr0 & ~0x004f, DATA);
 
   if (csr0 & 0x8000) {          /* ERR */
@@ -441,18 +575,8 @@ pcnet_irq_handler (uint8 vec)
       DLOG ("IRQ: collision detected");
   }
 
-  if (csr0 & 0x400)             /* RINT */
-    handle_rint ();
-  if (csr0 & 0x200)             /* TINT */
-    handle_tint ();
-
-  /* ack anything further and set IENA */
-  outw (0, ADDR); (void) inw (ADDR);
-  outw (0x7940, DATA);
-
-  DLOG ("IRQ: finished. csr0=%.04X", inw (DATA));
-
-  unlock_kernel ();
+  /* hack: use VCPU2's period */
+  iovcpu_job_wakeup (pcnet_bh_id, vcpu_lookup (2)->T);
   return 0;
 }
 
@@ -564,11 +688,18 @@ pcnet_init (void)
     goto abort_virt;
   }
 
+  /* the IRQ handler relies on it from the first interrupt on */
+  pcnet_bh_id = create_kernel_thread_args ((u32) pcnet_bh_thread,
+                                           (u32) &pcnet_bh_stack[1023],
+                                           FALSE, 0);
+  set_iovcpu (pcnet_bh_id, IOVCPU_CLASS_NET);
+
   reset ();
 
   /* Register network device with net subsystem */
   pcnet_ethdev.recv_func = NULL;
   pcnet_ethdev.send_func = pcnet_transmit;
+  pcnet_ethdev.send_pbuf_func = pcnet_transmit_pbuf;
   pcnet_ethdev.get_hwaddr_func = pcnet_get_hwaddr;
   pcnet_ethdev.poll_func = pcnet_poll;
 
@@ -3638,6 +3638,7 @@ r8169_init (void)
   /* Register network device with net subsystem */
   tp->ethdev.recv_func = NULL;
   tp->ethdev.send_func = r8169_transmit;
+  tp->ethdev.send_pbuf_func = NULL;
   tp->ethdev.get_hwaddr_func = r8169_get_hwaddr;
   tp->ethdev.poll_func = r8169_poll;
   tp->ethdev.drvdata = tp;
@@ -0,0 +1,928 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* TCP sockets for user programs, on top of the raw lwIP API.
+ *
+ * The lwIP callbacks only queue data and record state changes; the
+ * syscalls copy to and from user memory.  Every state change is also
+ * posted to the epoll instance the socket is registered with, which
+ * keeps a list of sockets with new events so that waiting on it costs
+ * nothing per idle connection.
+ *
+ * Everything here runs under the kernel lock, like the rest of lwIP. */
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+
+#include "kernel.h"
+#include "string.h"
+#include "drivers/net/socket.h"
+#include "sched/sched.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+//#define DEBUG_SOCKET
+
+#ifdef DEBUG_SOCKET
+#define DLOG(fmt,...) DLOG_PREFIX("socket",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define SOCK_BACKLOG_MAX 128
+
+/* Received data waits in lwIP's heap (MEM_SIZE) until its owner reads
+ * it, and the heap also holds every tcp_write copy.  So a socket
+ * queues at most SOCK_RCVBUF bytes (or one larger segment), and all
+ * sockets together at most SOCK_RCVQ_MAX, which leaves the rest of
+ * the heap to senders however many readers sit idle.  Past either
+ * limit the data is refused and lwIP offers it again later.  The
+ * window a socket announces shrinks to SOCK_RCVBUF as its first
+ * TCP_WND is read, see sock_recv, so a well-behaved peer soon stops
+ * running into the limit. */
+#define SOCK_RCVBUF      (4 * TCP_MSS)
+#define SOCK_RCVQ_MAX    (MEM_SIZE / 2)
+
+#if SOCK_RCVBUF > TCP_WND
+#error "SOCK_RCVBUF larger than TCP_WND"
+#endif
+
+/* socket states */
+#define SOCK_FREE       0
+#define SOCK_NEW        1       /* created, maybe bound */
+#define SOCK_LISTEN     2
+#define SOCK_CONNECTING 3
+#define SOCK_CONNECTED  4
+#define SOCK_PENDING    5       /* arrived, not yet accepted */
+
+/* socket flags */
+#define SF_NONBLOCK 0x01
+#define SF_EOF      0x02        /* peer has closed its side */
+#define SF_ERR      0x04        /* connection is gone, see err */
+
+typedef struct {
+  uint8 state;
+  uint8 flags;
+  sint8 err;                    /* lwIP error that ended the connection */
+  task_id owner;
+  uint16 waitq;                 /* task blocked in a syscall */
+  struct tcp_pcb *pcb;
+  /* received data not yet read, linked through pbuf->next.  Only
+   * len is meaningful along the queue, tot_len is not maintained. */
+  struct pbuf *rcvq, *rcvq_tail;
+  uint32 rcvq_len;              /* bytes on rcvq */
+  uint32 wnd_held;              /* window still to keep back */
+  /* listening: connections not yet accepted; pending: next one */
+  sint16 accq, accq_tail, next;
+  uint16 backlog, naccq;
+  /* epoll registration */
+  sint8 ep;
+  bool ep_queued;
+  sint16 ep_next;
+  uint32 ep_events, ep_data, ep_pending;
+} sock_t;
+
+typedef struct {
+  bool used;
+  task_id owner;
+  uint16 waitq;
+  sint16 head, tail;            /* sockets with events to report */
+  uint32 deadline;              /* tick to give up waiting, 0 = never */
+} epoll_t;
+
+static sock_t socks[SOCK_MAX];
+static epoll_t epolls[EPOLL_MAX];
+static uint sock_hint;
+static uint32 sock_rcvq_total;  /* bytes on all rcvqs */
+static bool sock_ready = FALSE;
+
+extern volatile uint32 tick;
+
+/* ************************************************** */
+
+static sint32
+sock_errno (err_t err)
+{
+  switch (err) {
+  case ERR_OK:
+    return 0;
+  case ERR_MEM:
+  case ERR_BUF:
+    return -SOCK_ENOMEM;
+  case ERR_USE:
+    return -SOCK_EADDRINUSE;
+  case ERR_ISCONN:
+    return -SOCK_EISCONN;
+  case ERR_CONN:
+    return -SOCK_ENOTCONN;
+  case ERR_RST:
+  case ERR_ABRT:
+    return -SOCK_ECONNRESET;
+  case ERR_CLSD:
+    return -SOCK_EPIPE;
+  default:
+    return -SOCK_EINVAL;
+  }
+}
+
+static sock_t *
+sock_alloc (void)
+{
+  uint i, n;
+  sock_t *s;
+
+  for (n = 0; n < SOCK_MAX; n++) {
+    i = (sock_hint + n) % SOCK_MAX;
+    if (socks[i].state == SOCK_FREE) {
+      sock_hint = i + 1;
+      s = &socks[i];
+      memset (s, 0, sizeof (sock_t));
+      s->accq = s->accq_tail = s->next = -1;
+      s->ep = -1;
+      s->ep_next = -1;
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static inline sint32
+sock_fd (sock_t *s)
+{
+  return s - socks;
+}
+
+/* The caller's socket, or NULL */
+static sock_t *
+sock_get (uint32 fd)
+{
+  sock_t *s;
+
+  if (fd >= SOCK_MAX)
+    return NULL;
+  s = &socks[fd];
+  if (s->state == SOCK_FREE || s->state == SOCK_PENDING ||
+      s->owner != str ())
+    return NULL;
+  return s;
+}
+
+static epoll_t *
+epoll_get (uint32 fd)
+{
+  epoll_t *ep;
+
+  if (fd < SOCK_MAX || fd >= SOCK_MAX + EPOLL_MAX)
+    return NULL;
+  ep = &epolls[fd - SOCK_MAX];
+  if (!ep->used || ep->owner != str ())
+    return NULL;
+  return ep;
+}
+
+/* Block the caller until something happens on s.  Called, and
+ * returns, with the kernel lock held. */
+static void
+sock_wait (sock_t *s)
+{
+  queue_append (&s->waitq, str ());
+  schedule ();
+}
+
+/* Record events on s: wake up whoever is blocked on it and queue the
+ * socket on its epoll instance's ready list. */
+static void
+sock_event (sock_t *s, uint32 ev)
+{
+  epoll_t *ep;
+
+  wakeup_queue (&s->waitq);
+  if (s->ep < 0)
+    return;
+  ev &= s->ep_events | EPOLLERR | EPOLLHUP;
+  if (ev == 0)
+    return;
+  s->ep_pending |= ev;
+  ep = &epolls[s->ep];
+  if (!s->ep_queued) {
+    s->ep_next = -1;
+    if (ep->tail >= 0)
+      socks[ep->tail].ep_next = sock_fd (s);
+    else
+      ep->head = sock_fd (s);
+    ep->tail = sock_fd (s);
+    s->ep_queued = TRUE;
+  }
+  wakeup_queue (&ep->waitq);
+}
+
+/* What a newly registered socket is ready for right now */
+static uint32
+sock_readiness (sock_t *s)
+{
+  uint32 ev = 0;
+
+  if (s->flags & SF_ERR)
+    ev |= EPOLLERR | EPOLLHUP;
+  if (s->state == SOCK_LISTEN && s->accq >= 0)
+    ev |= EPOLLIN;
+  if (s->rcvq)
+    ev |= EPOLLIN;
+  if (s->flags & SF_EOF)
+    ev |= EPOLLIN | EPOLLRDHUP;
+  if (s->state == SOCK_CONNECTED && s->pcb && tcp_sndbuf (s->pcb) > 0)
+    ev |= EPOLLOUT;
+  return ev;
+}
+
+static void
+epoll_unlink (sock_t *s)
+{
+  epoll_t *ep;
+  sint16 i, prev = -1;
+
+  if (s->ep < 0)
+    return;
+  ep = &epolls[s->ep];
+  if (s->ep_queued) {
+    for (i = ep->head; i >= 0; prev = i, i = socks[i].ep_next) {
+      if (i == sock_fd (s)) {
+        if (prev >= 0)
+          socks[prev].ep_next = s->ep_next;
+        else
+          ep->head = s->ep_next;
+        if (ep->tail == i)
+          ep->tail = prev;
+        break;
+      }
+    }
+  }
+  s->ep = -1;
+  s->ep_queued = FALSE;
+  s->ep_next = -1;
+  s->ep_pending = 0;
+}
+
+/* ************************************************** */
+
+/* lwIP callbacks */
+
+static err_t
+sock_recv_cb (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+  sock_t *s = arg;
+  struct pbuf *q;
+
+  if (p == NULL) {
+    s->flags |= SF_EOF;
+    sock_event (s, EPOLLIN | EPOLLRDHUP);
+    return ERR_OK;
+  }
+  if (err != ERR_OK) {
+    pbuf_free (p);
+    return ERR_OK;
+  }
+  DLOG ("%d: received %d bytes", sock_fd (s), p->tot_len);
+  if ((s->rcvq_len > 0 && s->rcvq_len + p->tot_len > SOCK_RCVBUF) ||
+      sock_rcvq_total + p->tot_len > SOCK_RCVQ_MAX)
+    return ERR_MEM;
+  /* Data waits here until the owner reads it, which may be never.
+   * Pool pbufs are shared by every connection and the drivers, so
+   * keep a heap copy instead; if there is no room, lwIP holds on to p
+   * and offers it again later. */
+  for (q = p; q && q->type == PBUF_RAM; q = q->next);
+  if (q) {
+    q = pbuf_alloc (PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (q == NULL)
+      return ERR_MEM;
+    pbuf_copy (q, p);
+    pbuf_free (p);
+    p = q;
+  }
+  s->rcvq_len += p->tot_len;
+  sock_rcvq_total += p->tot_len;
+  if (s->rcvq)
+    s->rcvq_tail->next = p;
+  else
+    s->rcvq = p;
+  for (q = p; q->next; q = q->next);
+  s->rcvq_tail = q;
+  sock_event (s, EPOLLIN);
+  return ERR_OK;
+}
+
+static err_t
+sock_sent_cb (void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+  sock_event ((sock_t *) arg, EPOLLOUT);
+  return ERR_OK;
+}
+
+/* pcb has already been freed by lwIP */
+static void
+sock_err_cb (void *arg, err_t err)
+{
+  sock_t *s = arg;
+
+  DLOG ("%d: error %d", sock_fd (s), err);
+  s->pcb = NULL;
+  s->flags |= SF_ERR;
+  s->err = err;
+  sock_event (s, EPOLLERR | EPOLLHUP);
+}
+
+static err_t
+sock_connected_cb (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  sock_t *s = arg;
+
+  s->state = SOCK_CONNECTED;
+  sock_event (s, EPOLLOUT);
+  return ERR_OK;
+}
+
+static void
+sock_setup (sock_t *s)
+{
+  s->wnd_held = TCP_WND - SOCK_RCVBUF;
+  tcp_arg (s->pcb, s);
+  tcp_recv (s->pcb, sock_recv_cb);
+  tcp_sent (s->pcb, sock_sent_cb);
+  tcp_err (s->pcb, sock_err_cb);
+}
+
+static err_t
+sock_accept_cb (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  sock_t *l = arg, *s;
+
+  /* returning an error makes lwIP abort the connection */
+  if (l == NULL || l->naccq >= l->backlog)
+    return ERR_MEM;
+  if (!(s = sock_alloc ()))
+    return ERR_MEM;
+
+  s->state = SOCK_PENDING;
+  s->owner = l->owner;
+  s->pcb = pcb;
+  sock_setup (s);
+
+  if (l->accq_tail >= 0)
+    socks[l->accq_tail].next = sock_fd (s);
+  else
+    l->accq = sock_fd (s);
+  l->accq_tail = sock_fd (s);
+  l->naccq++;
+  DLOG ("%d: pending connection %d", sock_fd (l), sock_fd (s));
+
+  sock_event (l, EPOLLIN);
+  return ERR_OK;
+}
+
+/* ************************************************** */
+
+static void
+sock_close (sock_t *s)
+{
+  struct tcp_pcb *pcb = s->pcb;
+
+  DLOG ("%d: close", sock_fd (s));
+  epoll_unlink (s);
+  if (s->state == SOCK_LISTEN) {
+    /* drop connections nobody accepted */
+    while (s->accq >= 0) {
+      sock_t *n = &socks[s->accq];
+      s->accq = n->next;
+      sock_close (n);
+    }
+    if (pcb) {
+      tcp_arg (pcb, NULL);
+      tcp_accept (pcb, NULL);
+      tcp_close (pcb);
+    }
+  } else if (pcb) {
+    tcp_arg (pcb, NULL);
+    tcp_recv (pcb, NULL);
+    tcp_sent (pcb, NULL);
+    tcp_err (pcb, NULL);
+    if (tcp_close (pcb) != ERR_OK)
+      tcp_abort (pcb);
+  }
+  if (s->rcvq)
+    pbuf_free (s->rcvq);
+  s->rcvq = s->rcvq_tail = NULL;
+  sock_rcvq_total -= s->rcvq_len;
+  s->rcvq_len = 0;
+  s->pcb = NULL;
+  s->state = SOCK_FREE;
+  wakeup_queue (&s->waitq);
+}
+
+static void
+epoll_close (epoll_t *ep)
+{
+  uint i;
+
+  for (i = 0; i < SOCK_MAX; i++)
+    if (socks[i].state != SOCK_FREE && socks[i].ep == ep - epolls)
+      epoll_unlink (&socks[i]);
+  ep->used = FALSE;
+  wakeup_queue (&ep->waitq);
+}
+
+/* ************************************************** */
+
+/* Syscalls */
+
+static sint32
+sock_socket (uint32 type)
+{
+  sock_t *s;
+
+  if ((type & ~SOCK_NONBLOCK) != SOCK_STREAM)
+    return -SOCK_EINVAL;
+  if (!(s = sock_alloc ()))
+    return -SOCK_EMFILE;
+  if (!(s->pcb = tcp_new ()))
+    return -SOCK_ENOMEM;        /* slot is still free */
+  s->state = SOCK_NEW;
+  s->owner = str ();
+  if (type & SOCK_NONBLOCK)
+    s->flags |= SF_NONBLOCK;
+  sock_setup (s);
+  DLOG ("%d: new socket", sock_fd (s));
+  return sock_fd (s);
+}
+
+static sint32
+sock_bind (sock_t *s, uint32 addr, uint32 port)
+{
+  struct ip_addr ip;
+
+  if (s->state != SOCK_NEW || !s->pcb)
+    return -SOCK_EINVAL;
+  ip.addr = addr;
+  return sock_errno (tcp_bind (s->pcb, &ip, (u16_t) port));
+}
+
+static sint32
+sock_listen (sock_t *s, sint32 backlog)
+{
+  struct tcp_pcb *lpcb;
+
+  if (s->state != SOCK_NEW || !s->pcb)
+    return -SOCK_EINVAL;
+  /* frees the pcb on success */
+  if (!(lpcb = tcp_listen (s->pcb)))
+    return -SOCK_ENOMEM;
+  s->pcb = lpcb;
+  tcp_arg (lpcb, s);
+  tcp_accept (lpcb, sock_accept_cb);
+  if (backlog < 1)
+    backlog = 1;
+  if (backlog > SOCK_BACKLOG_MAX)
+    backlog = SOCK_BACKLOG_MAX;
+  s->backlog = backlog;
+  s->state = SOCK_LISTEN;
+  return 0;
+}
+
+/* Accepted sockets inherit SOCK_NONBLOCK from the listener. */
+static sint32
+sock_accept (sock_t *s, uint32 *addr, uint16 *port)
+{
+  task_id me = str ();
+  sock_t *n;
+
+  if (s->state != SOCK_LISTEN)
+    return -SOCK_EINVAL;
+  while (s->accq < 0) {
+    if (s->flags & SF_NONBLOCK)
+      return -SOCK_EAGAIN;
+    sock_wait (s);
+    if (s->state != SOCK_LISTEN || s->owner != me)
+      return -SOCK_EBADF;
+  }
+
+  n = &socks[s->accq];
+  s->accq = n->next;
+  if (s->accq < 0)
+    s->accq_tail = -1;
+  s->naccq--;
+  if (s->pcb)
+    tcp_accepted (s->pcb);
+
+  n->next = -1;
+  n->state = SOCK_CONNECTED;
+  n->owner = me;
+  n->flags |= s->flags & SF_NONBLOCK;
+  if (addr)
+    *addr = n->pcb ? n->pcb->remote_ip.addr : 0;
+  if (port)
+    *port = n->pcb ? n->pcb->remote_port : 0;
+  DLOG ("%d: accepted %d", sock_fd (s), sock_fd (n));
+  return sock_fd (n);
+}
+
+static sint32
+sock_connect_result (sock_t *s)
+{
+  if (s->state == SOCK_CONNECTED)
+    return -SOCK_EISCONN;
+  if (s->err == ERR_RST)
+    return -SOCK_ECONNREFUSED;
+  if (s->err == ERR_ABRT)
+    return -SOCK_ETIMEDOUT;
+  return sock_errno (s->err);
+}
+
+static sint32
+sock_connect (sock_t *s, uint32 addr, uint32 port)
+{
+  struct ip_addr ip;
+  task_id me = str ();
+  err_t err;
+
+  if (s->flags & SF_ERR)
+    return sock_connect_result (s);
+  if (s->state == SOCK_CONNECTING)
+    return -SOCK_EALREADY;
+  if (s->state != SOCK_NEW || !s->pcb)
+    return s->state == SOCK_CONNECTED ? -SOCK_EISCONN : -SOCK_EINVAL;
+
+  ip.addr = addr;
+  err = tcp_connect (s->pcb, &ip, (u16_t) port, sock_connected_cb);
+  if (err != ERR_OK)
+    return sock_errno (err);
+  s->state = SOCK_CONNECTING;
+  if (s->flags & SF_NONBLOCK)
+    return -SOCK_EINPROGRESS;
+
+  while (s->state == SOCK_CONNECTING && !(s->flags & SF_ERR)) {
+    sock_wait (s);
+    if (s->state == SOCK_FREE || s->owner != me)
+      return -SOCK_EBADF;
+  }
+  if (s->flags & SF_ERR)
+    return sock_connect_result (s);
+  return 0;
+}
+
+static sint32
+sock_send (sock_t *s, const uint8 *buf, uint32 len)
+{
+  task_id me = str ();
+  uint32 sent = 0, n;
+  err_t err;
+
+  if (s->state == SOCK_CONNECTING && (s->flags & SF_NONBLOCK))
+    return -SOCK_EAGAIN;
+  if (s->state != SOCK_CONNECTED && s->state != SOCK_CONNECTING)
+    return -SOCK_ENOTCONN;
+  if (len > 0 && !buf)
+    return -SOCK_EFAULT;
+
+  while (sent < len) {
+    if (s->state == SOCK_FREE || s->owner != me)
+      return -SOCK_EBADF;
+    if ((s->flags & SF_ERR) || !s->pcb)
+      return sent ? sent : sock_errno (s->err ? s->err : ERR_CLSD);
+
+    err = ERR_MEM;
+    if (s->state == SOCK_CONNECTED) {
+      n = tcp_sndbuf (s->pcb);
+      if (n > len - sent)
+        n = len - sent;
+      if (n > 0)
+        /* copies out of user memory */
+        err = tcp_write (s->pcb, buf + sent, (u16_t) n, 1);
+    }
+    if (err == ERR_OK) {
+      sent += n;
+      continue;
+    }
+    if (err != ERR_MEM)
+      return sent ? sent : sock_errno (err);
+
+    /* no room until something is acknowledged */
+    if (s->pcb)
+      tcp_output (s->pcb);
+    if (s->flags & SF_NONBLOCK)
+      return sent ? sent : -SOCK_EAGAIN;
+    sock_wait (s);
+  }
+  if (s->pcb)
+    tcp_output (s->pcb);
+  return sent;
+}
+
+static sint32
+sock_recv (sock_t *s, uint8 *buf, uint32 len)
+{
+  task_id me = str ();
+  uint32 copied = 0, n, w;
+  struct pbuf *p;
+
+  if (s->state != SOCK_CONNECTED)
+    return s->state == SOCK_CONNECTING && (s->flags & SF_NONBLOCK) ?
+      -SOCK_EAGAIN : -SOCK_ENOTCONN;
+  if (len > 0 && !buf)
+    return -SOCK_EFAULT;
+
+  while (!s->rcvq) {
+    /* lwIP reports the FIN even if it is still holding data we had
+     * no room for (sock_recv_cb) */
+    if ((s->flags & SF_EOF) && !(s->pcb && s->pcb->refused_data))
+      return 0;
+    if (s->flags & SF_ERR)
+      return sock_errno (s->err);
+    if (s->flags & SF_NONBLOCK)
+      return -SOCK_EAGAIN;
+    sock_wait (s);
+    if (s->state != SOCK_CONNECTED || s->owner != me)
+      return -SOCK_EBADF;
+  }
+
+  while (copied < len && (p = s->rcvq)) {
+    n = p->len;
+    if (n > len - copied)
+      n = len - copied;
+    memcpy (buf + copied, p->payload, n);
+    copied += n;
+    if (n == p->len) {
+      s->rcvq = p->next;
+      p->next = NULL;
+      pbuf_free (p);
+    } else
+      pbuf_header (p, -(s16_t) n);
+  }
+  if (!s->rcvq)
+    s->rcvq_tail = NULL;
+  s->rcvq_len -= copied;
+  sock_rcvq_total -= copied;
+
+  /* take what lwIP is holding for us now rather than at its next
+   * timer tick */
+  if (s->pcb && s->pcb->refused_data &&
+      sock_recv_cb (s, s->pcb, s->pcb->refused_data, ERR_OK) == ERR_OK)
+    s->pcb->refused_data = NULL;
+
+  /* open the window by what was taken, less what is still held back
+   * to bring it down to SOCK_RCVBUF */
+  n = copied;
+  w = n < s->wnd_held ? n : s->wnd_held;
+  s->wnd_held -= w;
+  n -= w;
+  for (; s->pcb && n > 0; n -= w) {
+    w = n > 0xFFFF ? 0xFFFF : n;
+    tcp_recved (s->pcb, (u16_t) w);
+  }
+  return copied;
+}
+
+static sint32
+sock_epoll_create (void)
+{
+  uint i;
+
+  for (i = 0; i < EPOLL_MAX; i++) {
+    if (!epolls[i].used) {
+      memset (&epolls[i], 0, sizeof (epoll_t));
+      epolls[i].used = TRUE;
+      epolls[i].owner = str ();
+      epolls[i].head = epolls[i].tail = -1;
+      return SOCK_MAX + i;
+    }
+  }
+  return -SOCK_EMFILE;
+}
+
+static sint32
+sock_epoll_ctl (epoll_t *ep, uint32 op, uint32 fd, struct epoll_event *ev)
+{
+  sock_t *s = sock_get (fd);
+  sint8 idx = ep - epolls;
+
+  if (!s)
+    return -SOCK_EBADF;
+
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    if (s->ep >= 0)
+      return -SOCK_EEXIST;
+    if (!ev)
+      return -SOCK_EFAULT;
+    s->ep = idx;
+    break;
+  case EPOLL_CTL_MOD:
+    if (s->ep != idx)
+      return -SOCK_ENOENT;
+    if (!ev)
+      return -SOCK_EFAULT;
+    break;
+  case EPOLL_CTL_DEL:
+    if (s->ep != idx)
+      return -SOCK_ENOENT;
+    epoll_unlink (s);
+    return 0;
+  default:
+    return -SOCK_EINVAL;
+  }
+
+  s->ep_events = ev->events;
+  s->ep_data = ev->data;
+  /* report what is already there, once */
+  sock_event (s, sock_readiness (s));
+  return 0;
+}
+
+/* timeout in milliseconds: 0 polls, negative waits forever */
+static sint32
+sock_epoll_wait (epoll_t *ep, struct epoll_event *events, sint32 max,
+                 sint32 timeout)
+{
+  task_id me = str ();
+  sint32 n;
+  sock_t *s;
+
+  if (max <= 0)
+    return -SOCK_EINVAL;
+  if (!events)
+    return -SOCK_EFAULT;
+
+  ep->deadline = 0;
+  if (timeout > 0)
+    ep->deadline = (tick + (timeout / 1000) * HZ +
+                    ((timeout % 1000) * HZ + 999) / 1000) | 1;
+
+  for (;;) {
+    n = 0;
+    while (n < max && ep->head >= 0) {
+      s = &socks[ep->head];
+      ep->head = s->ep_next;
+      if (ep->head < 0)
+        ep->tail = -1;
+      s->ep_next = -1;
+      s->ep_queued = FALSE;
+      if (s->ep_pending) {
+        events[n].events = s->ep_pending;
+        events[n].data = s->ep_data;
+        s->ep_pending = 0;
+        n++;
+      }
+    }
+    if (n > 0 || timeout == 0)
+      break;
+    if (ep->deadline && (sint32) (tick - ep->deadline) >= 0)
+      break;
+
+    queue_append (&ep->waitq, me);
+    schedule ();
+    if (!ep->used || ep->owner != me)
+      return -SOCK_EBADF;
+  }
+  ep->deadline = 0;
+  return n;
+}
+
+/* ************************************************** */
+
+/* Syscall: socket calls, EAX = op */
+sint32
+_socketcall (uint32 op, uint32 a, uint32 b, uint32 c, uint32 d)
+{
+  sint32 ret = -SOCK_EBADF;
+  sock_t *s;
+  epoll_t *ep;
+
+  lock_kernel ();
+
+  if (!sock_ready) {
+    ret = -SOCK_ENETDOWN;
+    goto done;
+  }
+
+  switch (op) {
+  case SOCK_OP_SOCKET:
+    ret = sock_socket (a);
+    break;
+  case SOCK_OP_EPOLL_CREATE:
+    ret = sock_epoll_create ();
+    break;
+  case SOCK_OP_CLOSE:
+    if ((s = sock_get (a))) {
+      sock_close (s);
+      ret = 0;
+    } else if ((ep = epoll_get (a))) {
+      epoll_close (ep);
+      ret = 0;
+    }
+    break;
+  case SOCK_OP_EPOLL_CTL:
+    if ((ep = epoll_get (a)))
+      ret = sock_epoll_ctl (ep, b, c, (struct epoll_event *) d);
+    break;
+  case SOCK_OP_EPOLL_WAIT:
+    if ((ep = epoll_get (a)))
+      ret = sock_epoll_wait (ep, (struct epoll_event *) b, (sint32) c,
+                             (sint32) d);
+    break;
+  default:
+    if (!(s = sock_get (a)))
+      break;
+    switch (op) {
+    case SOCK_OP_BIND:
+      ret = sock_bind (s, b, c);
+      break;
+    case SOCK_OP_LISTEN:
+      ret = sock_listen (s, (sint32) b);
+      break;
+    case SOCK_OP_ACCEPT:
+      ret = sock_accept (s, (uint32 *) b, (uint16 *) c);
+      break;
+    case SOCK_OP_CONNECT:
+      ret = sock_connect (s, b, c);
+      break;
+    case SOCK_OP_SEND:
+      ret = sock_send (s, (const uint8 *) b, c);
+      break;
+    case SOCK_OP_RECV:
+      ret = sock_recv (s, (uint8 *) b, c);
+      break;
+    default:
+      ret = -SOCK_EINVAL;
+    }
+  }
+
+ done:
+  unlock_kernel ();
+  return ret;
+}
+
+/* Close everything a task left open, called on exit with the kernel
+ * lock held. */
+void
+sock_release_task (task_id owner)
+{
+  uint i;
+
+  if (!sock_ready)
+    return;
+  for (i = 0; i < EPOLL_MAX; i++)
+    if (epolls[i].used && epolls[i].owner == owner)
+      epoll_close (&epolls[i]);
+  /* pending connections go with their listener */
+  for (i = 0; i < SOCK_MAX; i++)
+    if (socks[i].state != SOCK_FREE && socks[i].state != SOCK_PENDING &&
+        socks[i].owner == owner)
+      sock_close (&socks[i]);
+}
+
+/* Wake up epoll waiters whose timeout has expired; runs from the
+ * network timer thread. */
+void
+sock_tmr_process (void)
+{
+  uint i;
+
+  for (i = 0; i < EPOLL_MAX; i++)
+    if (epolls[i].used && epolls[i].waitq && epolls[i].deadline &&
+        (sint32) (tick - epolls[i].deadline) >= 0)
+      wakeup_queue (&epolls[i].waitq);
+}
+
+/* after lwip_init */
+void
+sock_init (void)
+{
+  memset (socks, 0, sizeof (socks));
+  memset (epolls, 0, sizeof (epolls));
+  sock_ready = TRUE;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,804 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Virtio network device.  Each queue pair (a receive and a transmit
+ * virtqueue) has a bottom half of its own; when the device offers
+ * several pairs, flows are spread over them by a hash of their
+ * addresses and ports.  Receive buffers are unmapped halves of
+ * physical pages: vnet_rx_copy maps one just long enough to copy its
+ * frame into pool pbufs, and it goes back on the ring at once; with
+ * mergeable buffers a frame may span several.  Outgoing frames are
+ * sent straight out of their pbufs, with checksums and TCP
+ * segmentation left to the device when it offers them. */
+
+#include "drivers/virtio/virtio.h"
+#include "drivers/net/ethernet.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip.h"
+#include "netif/etharp.h"
+#include "arch/i386.h"
+#include "util/printf.h"
+#include "smp/smp.h"
+#include "smp/apic.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "kernel.h"
+#include "sched/vcpu.h"
+
+//#define DEBUG_VIRTIO_NET
+
+#ifdef DEBUG_VIRTIO_NET
+#define DLOG(fmt,...) DLOG_PREFIX("virtio-net",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define VIRTIO_NET_LEGACY_ID 0x1000
+#define VIRTIO_NET_MODERN_ID 0x1041
+
+/* Feature bits */
+#define VIRTIO_NET_F_CSUM       0
+#define VIRTIO_NET_F_GUEST_CSUM 1
+#define VIRTIO_NET_F_MAC        5
+#define VIRTIO_NET_F_HOST_TSO4  11
+#define VIRTIO_NET_F_MRG_RXBUF  15
+#define VIRTIO_NET_F_CTRL_VQ    17
+#define VIRTIO_NET_F_MQ         22
+
+/* Device configuration */
+#define VIRTIO_NET_CFG_MAC       0
+#define VIRTIO_NET_CFG_MAX_PAIRS 8
+
+/* Per-frame header */
+struct virtio_net_hdr {
+  u8 flags;
+  u8 gso_type;
+  u16 hdr_len;
+  u16 gso_size;
+  u16 csum_start;
+  u16 csum_offset;
+  u16 num_buffers;              /* mergeable buffers or modern only */
+} PACKED;
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+#define VIRTIO_NET_HDR_GSO_NONE  0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+
+/* Control queue */
+struct virtio_net_ctrl {
+  u8 class;
+  u8 cmd;
+  u16 pairs;
+  u8 ack;
+} PACKED;
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK 0
+
+/* Queue pairs used at most; each has its own bottom half, and maps a
+ * single page for its TX headers */
+#define VNET_MAX_QUEUES 4
+
+/* RX descriptors handled per round of a bottom half before it
+ * yields; a full round means it stays in polling mode. */
+#define VNET_POLL_BUDGET 32
+
+/* RX buffers are physical frames, two to a page, handed to the
+ * device and never mapped for long: a frame is copied out of them
+ * into pool pbufs, and the buffer goes straight back on the ring. */
+#define VNET_RX_BUFS 128        /* per queue */
+#define VNET_MAX_MTU 9000       /* with mergeable buffers */
+#define RBUF_SIZE    2048
+#define RBUFS_PER_PAGE (0x1000 / RBUF_SIZE)
+
+#define VNET_TX_SLOTS 64        /* frames in flight per queue */
+/* pieces of a frame; a TCP super-segment needs a few dozen */
+#define VNET_TX_MAX_SEGS 64
+
+/* DMA memory of a queue pair, one page */
+struct vnet_dma {
+  struct virtio_net_hdr thdrs[VNET_TX_SLOTS];
+};
+
+static struct vnet_queue {
+  uint num;
+  virtqueue rx, tx;
+  task_id bh_id;
+  struct vnet_dma *dma;
+  u32 dma_phys;
+  u32 rx_phys[VNET_RX_BUFS];    /* the RX buffers */
+  uint rx_posted;               /* buffers the device holds */
+  u8 rx_spare[VNET_RX_BUFS];    /* ones the ring had no room for */
+  uint rx_nspare;
+  /* frame in each TX slot, held until the device is done with it */
+  struct pbuf *tx_pbufs[VNET_TX_SLOTS];
+  u8 tx_free[VNET_TX_SLOTS];
+  uint tx_nfree;
+} vnet_queues[VNET_MAX_QUEUES];
+static uint32 vnet_bh_stack[VNET_MAX_QUEUES][1024] ALIGNED (0x1000);
+
+#define V2P(q,p) ((u32) (p) - (u32) (q)->dma + (q)->dma_phys)
+
+static virtio_device vnet_dev;
+static ethernet_device vnet_ethdev;
+static uint8 hwaddr[ETH_ADDR_LEN];
+static uint vnet_queue_count = 1;
+static uint vnet_hdr_len;
+/* checksums lwIP handles for frames the device did not check */
+static u16 vnet_csum_ctrl;
+static virtqueue vnet_ctrl_vq;
+static struct virtio_net_ctrl *vnet_ctrl;
+static u32 vnet_ctrl_phys;
+
+/* Pieces of the frame being queued */
+static net_tx_seg_t tx_segs[VNET_TX_MAX_SEGS];
+
+/* for the statistics dump */
+u32 vnet_packet_count = 0;
+u64 vnet_packet_bytes = 0;
+u32 vnet_irq_count = 0;
+u32 vnet_rx_drops = 0;
+u32 vnet_tx_drops = 0;
+
+/* ************************************************** */
+
+extern bool
+virtio_net_get_hwaddr (uint8 a[ETH_ADDR_LEN])
+{
+  int i;
+  for (i=0; i<ETH_ADDR_LEN; i++)
+    a[i] = hwaddr[i];
+  return TRUE;
+}
+
+/* Hand receive buffer j to the device.  Without mergeable buffers, a
+ * legacy device wants the header in a descriptor of its own. */
+static void
+vnet_rx_post (struct vnet_queue *q, uint j)
+{
+  virtio_sg sg[2];
+  uint n = 0;
+
+  sg[n].addr = q->rx_phys[j];
+  if (vnet_dev.modern || virtio_has_feature (&vnet_dev,
+                                             VIRTIO_NET_F_MRG_RXBUF))
+    sg[n++].len = RBUF_SIZE;
+  else {
+    sg[n++].len = vnet_hdr_len;
+    sg[n].addr = q->rx_phys[j] + vnet_hdr_len;
+    sg[n++].len = RBUF_SIZE - vnet_hdr_len;
+  }
+  if (virtqueue_add (&q->rx, sg, 0, n, (void *) (j + 1)) == 0)
+    q->rx_posted++;
+  else
+    q->rx_spare[q->rx_nspare++] = j;
+}
+
+/* Copy len bytes received into the buffer at phys into pool pbufs,
+ * mapping it just for the copy.  With h, the buffer starts with the
+ * frame's header, which is copied there and not into the pbufs.
+ * Returns NULL if out of pbufs or virtual pages. */
+static struct pbuf *
+vnet_rx_copy (u32 phys, uint len, struct virtio_net_hdr *h)
+{
+  uint off = h ? vnet_hdr_len : 0;
+  struct pbuf *p = NULL;
+  uint8 *page;
+
+  page = map_virtual_page ((phys & ~0xFFF) | 3);
+  if (page == NULL)
+    return NULL;
+  if (h)
+    memcpy (h, page + (phys & 0xFFF), vnet_hdr_len);
+  if (len > off && (p = pbuf_alloc (PBUF_RAW, len - off, PBUF_POOL)))
+    pbuf_take (p, page + (phys & 0xFFF) + off, len - off);
+  unmap_virtual_page (page);
+  return p;
+}
+
+/* Whether lwIP can skip the TCP/UDP checksum of a received frame:
+ * either the device checked it, or it comes from the host and was
+ * never computed.  The IP header checksum is always left to lwIP. */
+static bool
+vnet_rx_csum_checked (struct virtio_net_hdr *h)
+{
+  return virtio_has_feature (&vnet_dev, VIRTIO_NET_F_GUEST_CSUM) &&
+    (h->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM));
+}
+
+/* Pass up at most budget frames received on queue q, returning how
+ * many were taken off the ring */
+static uint
+vnet_rx_clean (struct vnet_queue *q, uint budget)
+{
+  struct virtio_net_hdr h;
+  struct pbuf *p, *tail;
+  void *cookie;
+  u32 len;
+  uint work = 0, nbufs, reposted = 0, i, j;
+
+  /* buffers the ring had no room for */
+  while (q->rx_nspare > 0 && q->rx_posted < VNET_RX_BUFS) {
+    uint before = q->rx_nspare;
+
+    j = q->rx_spare[--q->rx_nspare];
+    vnet_rx_post (q, j);
+    reposted++;
+    if (q->rx_nspare == before)
+      break;
+  }
+
+  while (work < budget && (cookie = virtqueue_get_buf (&q->rx, &len))) {
+    j = (uint) cookie - 1;
+    q->rx_posted--;
+    work++;
+    memset (&h, 0, sizeof (h));
+    p = NULL;
+    /* the header is needed to skip the rest of the frame, if merged */
+    if (len >= vnet_hdr_len)
+      p = vnet_rx_copy (q->rx_phys[j], len, &h);
+    if (p && (len < vnet_hdr_len + SIZEOF_ETH_HDR ||
+              !vnet_ethdev.recv_pbuf_func)) {
+      pbuf_free (p);
+      p = NULL;
+    }
+    vnet_rx_post (q, j);
+    reposted++;
+    nbufs = virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MRG_RXBUF) ?
+      h.num_buffers : 1;
+    vnet_packet_count++;
+    if (len > vnet_hdr_len)
+      vnet_packet_bytes += len - vnet_hdr_len;
+
+    /* the rest of a merged frame carries data only */
+    for (i = 1; i < nbufs; i++) {
+      cookie = virtqueue_get_buf (&q->rx, &len);
+      if (!cookie)
+        break;
+      j = (uint) cookie - 1;
+      q->rx_posted--;
+      vnet_packet_bytes += len;
+      if (p) {
+        tail = vnet_rx_copy (q->rx_phys[j], len, NULL);
+        if (tail)
+          pbuf_cat (p, tail);
+        else {
+          pbuf_free (p);
+          p = NULL;
+        }
+      }
+      vnet_rx_post (q, j);
+      reposted++;
+    }
+
+    if (p == NULL) {
+      /* a runt, or nowhere to put it */
+      DLOG ("RX%d: dropped frame len=%d", q->num, len);
+      vnet_rx_drops++;
+      continue;
+    }
+
+    if (!vnet_rx_csum_checked (&h))
+      NETIF_SET_CHECKSUM_CTRL (&vnet_ethdev.netif,
+                               NETIF_CHECKSUM_ENABLE_ALL);
+    vnet_ethdev.recv_pbuf_func (&vnet_ethdev, p);
+    NETIF_SET_CHECKSUM_CTRL (&vnet_ethdev.netif, vnet_csum_ctrl);
+  }
+
+  if (reposted > 0)
+    virtqueue_kick (&q->rx);
+  return work;
+}
+
+/* Release the frames the device has finished sending */
+static void
+vnet_tx_clean (struct vnet_queue *q)
+{
+  void *data;
+  uint slot;
+
+  while ((data = virtqueue_get_buf (&q->tx, NULL))) {
+    slot = (uint) data - 1;
+    if (q->tx_pbufs[slot]) {
+      pbuf_free (q->tx_pbufs[slot]);
+      q->tx_pbufs[slot] = NULL;
+    }
+    q->tx_free[q->tx_nfree++] = slot;
+  }
+}
+
+/* Queue a frame behind its header on queue q, room permitting.  p is
+ * held until the device is done with it.  Returns the slot used, or
+ * -1. */
+static sint
+vnet_tx_queue (struct vnet_queue *q, struct virtio_net_hdr *h,
+               net_tx_seg_t *segs, uint n, struct pbuf *p)
+{
+  virtio_sg sg[VNET_TX_MAX_SEGS + 1];
+  uint slot, i;
+
+  vnet_tx_clean (q);
+  if (q->tx_nfree == 0)
+    return -1;
+  slot = q->tx_free[q->tx_nfree - 1];
+
+  q->dma->thdrs[slot] = *h;
+  sg[0].addr = V2P (q, &q->dma->thdrs[slot]);
+  sg[0].len = vnet_hdr_len;
+  for (i = 0; i < n; i++) {
+    sg[i + 1].addr = segs[i].phys;
+    sg[i + 1].len = segs[i].len;
+  }
+  if (virtqueue_add (&q->tx, sg, n + 1, 0, (void *) (slot + 1)) < 0)
+    return -1;
+  q->tx_nfree--;
+  pbuf_ref (p);
+  q->tx_pbufs[slot] = p;
+  virtqueue_kick (&q->tx);
+  return slot;
+}
+
+/* Gather a frame too fragmented to map into one PBUF_RAM buffer,
+ * which goes out like any other chain: a descriptor per page it
+ * crosses. */
+static sint
+vnet_tx_copy (struct vnet_queue *q, struct virtio_net_hdr *h, struct pbuf *p)
+{
+  struct pbuf *c;
+  uint n;
+  sint res = 0;
+
+  c = pbuf_alloc (PBUF_RAW, p->tot_len, PBUF_RAM);
+  if (c == NULL) {
+    vnet_tx_drops++;
+    return 0;
+  }
+  pbuf_copy (c, p);
+  n = net_tx_segments (c, tx_segs, VNET_TX_MAX_SEGS);
+  if (n > 0 && vnet_tx_queue (q, h, tx_segs, n, c) >= 0)
+    res = c->tot_len;
+  pbuf_free (c);
+  return res;
+}
+
+/* The queue pair a frame's flow belongs to, so that its segments stay
+ * in order and the device steers the replies back to the same pair */
+static struct vnet_queue *
+vnet_tx_select (struct pbuf *p)
+{
+  uint8 *frame = p->payload;
+  struct ip_hdr *iphdr;
+  u32 hash;
+  uint hlen;
+
+  if (vnet_queue_count == 1 || p->len < SIZEOF_ETH_HDR + IP_HLEN ||
+      ((struct eth_hdr *) frame)->type != htons (ETHTYPE_IP))
+    return &vnet_queues[0];
+
+  iphdr = (struct ip_hdr *) (frame + SIZEOF_ETH_HDR);
+  hash = iphdr->src.addr ^ iphdr->dest.addr;
+  hlen = IPH_HL (iphdr) * 4;
+  if ((IPH_PROTO (iphdr) == IP_PROTO_TCP ||
+       IPH_PROTO (iphdr) == IP_PROTO_UDP) &&
+      !(IPH_OFFSET (iphdr) & htons (IP_MF | IP_OFFMASK)) &&
+      p->len >= SIZEOF_ETH_HDR + hlen + 4)
+    /* source and destination ports */
+    hash ^= *(u32 *) (frame + SIZEOF_ETH_HDR + hlen);
+  hash ^= hash >> 16;
+  hash ^= hash >> 8;
+  return &vnet_queues[hash % vnet_queue_count];
+}
+
+extern sint
+virtio_net_transmit (uint8* buffer, sint len)
+{
+  struct virtio_net_hdr h;
+  struct pbuf *p;
+  sint res;
+
+  DLOG ("TX: (%p, %d)", buffer, len);
+
+  if (len <= 0 || len > VNET_MAX_MTU + SIZEOF_ETH_HDR)
+    return 0;
+  p = pbuf_alloc (PBUF_RAW, len, PBUF_REF);
+  if (!p)
+    return 0;
+  p->payload = buffer;
+  memset (&h, 0, sizeof (h));
+  res = vnet_tx_copy (&vnet_queues[0], &h, p);
+  pbuf_free (p);
+  return res;
+}
+
+/* Scatter-gather transmit: the header, then one descriptor per
+ * physically contiguous piece of the chain, which stays referenced
+ * until the device is done with it.  Checksums lwIP left to the
+ * device, and the cutting of a TCP super-segment (see
+ * netif->tso_mss), are described in the header. */
+extern sint
+virtio_net_transmit_pbuf (struct pbuf *p)
+{
+  struct netif *netif = &vnet_ethdev.netif;
+  struct vnet_queue *q = vnet_tx_select (p);
+  struct virtio_net_hdr h;
+  net_tx_csum_t csum;
+  bool offload;
+  uint n;
+
+  DLOG ("TX%d: pbuf %p len=%d", q->num, p, p->tot_len);
+
+  memset (&h, 0, sizeof (h));
+  if (netif->tso_mss) {
+    if (!net_tx_tso (p, netif->tso_mss, &csum)) {
+      vnet_tx_drops++;
+      return 0;
+    }
+    h.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    h.gso_size = csum.mss;
+    h.hdr_len = csum.hdrlen;
+    offload = TRUE;
+  } else {
+    /* a super-segment that lost its MSS, queued behind ARP, say */
+    if (p->tot_len > netif->mtu + SIZEOF_ETH_HDR) {
+      vnet_tx_drops++;
+      return 0;
+    }
+    offload = net_tx_csum (p, &csum) && csum.l4_csum;
+  }
+  if (offload) {
+    h.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    h.csum_start = csum.tucss;
+    h.csum_offset = csum.tucso - csum.tucss;
+  }
+
+  n = net_tx_segments (p, tx_segs, VNET_TX_MAX_SEGS);
+  if (n == 0)
+    return vnet_tx_copy (q, &h, p);
+
+  return vnet_tx_queue (q, &h, tx_segs, n, p) >= 0 ? p->tot_len : 0;
+}
+
+extern void
+virtio_net_poll (void)
+{
+  uint i;
+
+  for (i=0; i<vnet_queue_count; i++) {
+    vnet_rx_clean (&vnet_queues[i], ~0);
+    vnet_tx_clean (&vnet_queues[i]);
+  }
+}
+
+/* One per queue pair: frames a flow hashes to are handled here, in
+ * order, and so are the pair's TX completions.  Interrupts from the
+ * pair stay suppressed as long as a round comes up full. */
+static void
+vnet_bh_thread (struct vnet_queue *q)
+{
+  for (;;) {
+    uint work;
+
+    virtqueue_disable_cb (&q->rx);
+    virtqueue_disable_cb (&q->tx);
+    work = vnet_rx_clean (q, VNET_POLL_BUDGET);
+    vnet_tx_clean (q);
+
+    if (work >= VNET_POLL_BUDGET)
+      /* still busy: come back for another round */
+      iovcpu_job_wakeup_for_me (q->bh_id);
+    else {
+      bool rx_idle = virtqueue_enable_cb (&q->rx);
+      bool tx_idle = virtqueue_enable_cb (&q->tx);
+
+      if (!rx_idle || !tx_idle)
+        /* more came in while re-arming */
+        iovcpu_job_wakeup_for_me (q->bh_id);
+    }
+
+    iovcpu_job_completion ();
+  }
+}
+
+static uint32
+virtio_net_irq_handler (uint8 vec)
+{
+  extern vcpu *vcpu_lookup (int);
+  uint i;
+
+  /* reading the ISR acknowledges the interrupt */
+  if (!(virtio_isr (&vnet_dev) & 1))
+    return 0;
+  vnet_irq_count++;
+
+  /* every pair shares the line; each bottom half suppresses its own
+   * interrupts until it has caught up */
+  for (i=0; i<vnet_queue_count; i++)
+    if (vnet_queues[i].bh_id)
+      /* hack: use VCPU2's period */
+      iovcpu_job_wakeup (vnet_queues[i].bh_id, vcpu_lookup (2)->T);
+
+  return 0;
+}
+
+/* Tell the device how many queue pairs to spread flows over */
+static bool
+vnet_set_queue_pairs (uint pairs)
+{
+  virtio_sg sg[3];
+  uint i;
+
+  vnet_ctrl->class = VIRTIO_NET_CTRL_MQ;
+  vnet_ctrl->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+  vnet_ctrl->pairs = pairs;
+  vnet_ctrl->ack = 0xFF;
+  sg[0].addr = vnet_ctrl_phys + offsetof (struct virtio_net_ctrl, class);
+  sg[0].len = 2;
+  sg[1].addr = vnet_ctrl_phys + offsetof (struct virtio_net_ctrl, pairs);
+  sg[1].len = 2;
+  sg[2].addr = vnet_ctrl_phys + offsetof (struct virtio_net_ctrl, ack);
+  sg[2].len = 1;
+  if (virtqueue_add (&vnet_ctrl_vq, sg, 2, 1, vnet_ctrl) < 0)
+    return FALSE;
+  virtqueue_kick (&vnet_ctrl_vq);
+
+  for (i = 0; !virtqueue_get_buf (&vnet_ctrl_vq, NULL); i++) {
+    if (i == 100000)
+      return FALSE;
+    tsc_delay_usec (10);
+  }
+  return vnet_ctrl->ack == VIRTIO_NET_OK;
+}
+
+static void
+vnet_queue_free (struct vnet_queue *q)
+{
+  uint j;
+
+  for (j=0; j<VNET_RX_BUFS; j+=RBUFS_PER_PAGE)
+    if (q->rx_phys[j]) {
+      free_phys_frame (q->rx_phys[j]);
+      q->rx_phys[j] = 0;
+    }
+  if (q->dma) {
+    unmap_virtual_page (q->dma);
+    free_phys_frame (q->dma_phys);
+    q->dma = NULL;
+  }
+}
+
+/* Set up queue pair i: virtqueues 2i and 2i+1, and its buffers */
+static bool
+vnet_queue_init (uint i)
+{
+  struct vnet_queue *q = &vnet_queues[i];
+  u32 frame;
+  uint j, k;
+
+  q->num = i;
+  if (!virtqueue_init (&vnet_dev, 2 * i, &q->rx) ||
+      !virtqueue_init (&vnet_dev, 2 * i + 1, &q->tx))
+    return FALSE;
+
+  q->dma_phys = alloc_phys_frame ();
+  if (q->dma_phys == -1)
+    return FALSE;
+  q->dma = map_virtual_page (q->dma_phys | 3);
+  if (!q->dma) {
+    free_phys_frame (q->dma_phys);
+    return FALSE;
+  }
+  memset (q->dma, 0, sizeof (struct vnet_dma));
+
+  for (j=0; j<VNET_RX_BUFS; j+=RBUFS_PER_PAGE) {
+    frame = alloc_phys_frame ();
+    if (frame == -1) {
+      vnet_queue_free (q);
+      return FALSE;
+    }
+    for (k=0; k<RBUFS_PER_PAGE; k++)
+      q->rx_phys[j + k] = frame + k * RBUF_SIZE;
+  }
+
+  for (j=0; j<VNET_TX_SLOTS; j++)
+    q->tx_free[j] = j;
+  q->tx_nfree = VNET_TX_SLOTS;
+
+  for (j=0; j<VNET_RX_BUFS; j++)
+    vnet_rx_post (q, j);
+  DLOG ("queue pair %d: %d RX buffers posted", i, q->rx_posted);
+  return TRUE;
+}
+
+extern bool
+virtio_net_init (void)
+{
+  uint irq_line, irq_pin, max_pairs = 1, pairs, i;
+  pci_irq_t irq;
+  u32 phys;
+
+  if (mp_ISA_PC) {
+    DLOG ("Requires PCI support");
+    return FALSE;
+  }
+
+  if (!virtio_pci_find (VIRTIO_NET_LEGACY_ID, VIRTIO_NET_MODERN_ID,
+                        &vnet_dev)) {
+    DLOG ("Unable to detect virtio network device.");
+    return FALSE;
+  }
+
+  virtio_reset (&vnet_dev);
+  virtio_add_status (&vnet_dev, VIRTIO_STATUS_ACKNOWLEDGE);
+  virtio_add_status (&vnet_dev, VIRTIO_STATUS_DRIVER);
+
+  if (!virtio_negotiate (&vnet_dev,
+                         VIRTIO_FEATURE (VIRTIO_F_INDIRECT_DESC) |
+                         VIRTIO_FEATURE (VIRTIO_F_EVENT_IDX) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_CSUM) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_GUEST_CSUM) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_MAC) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_HOST_TSO4) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_MRG_RXBUF) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_CTRL_VQ) |
+                         VIRTIO_FEATURE (VIRTIO_NET_F_MQ))) {
+    DLOG ("Feature negotiation failed");
+    goto abort;
+  }
+
+  vnet_hdr_len = vnet_dev.modern ||
+    virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MRG_RXBUF) ?
+    sizeof (struct virtio_net_hdr) :
+    offsetof (struct virtio_net_hdr, num_buffers);
+
+  if (virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MAC))
+    for (i=0; i<ETH_ADDR_LEN; i++)
+      hwaddr[i] = virtio_config_read8 (&vnet_dev, VIRTIO_NET_CFG_MAC + i);
+  else {
+    /* locally administered */
+    hwaddr[0] = 0x52; hwaddr[1] = 0x54; hwaddr[2] = 0x00;
+    hwaddr[3] = 0x12; hwaddr[4] = 0x34; hwaddr[5] = 0x56;
+  }
+
+  DLOG ("hwaddr=%.02x:%.02x:%.02x:%.02x:%.02x:%.02x",
+        hwaddr[0], hwaddr[1], hwaddr[2], hwaddr[3], hwaddr[4], hwaddr[5]);
+
+  /* the pairs to use: no more than there are CPUs to spread them on */
+  if (virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MQ) &&
+      virtio_has_feature (&vnet_dev, VIRTIO_NET_F_CTRL_VQ))
+    max_pairs = virtio_config_read16 (&vnet_dev, VIRTIO_NET_CFG_MAX_PAIRS);
+  if (max_pairs == 0)
+    max_pairs = 1;
+  pairs = max_pairs;
+  if (pairs > VNET_MAX_QUEUES)
+    pairs = VNET_MAX_QUEUES;
+  if (pairs > mp_num_cpus)
+    pairs = mp_num_cpus;
+
+  for (i=0; i<pairs; i++)
+    if (!vnet_queue_init (i)) {
+      DLOG ("Unable to set up queue pair %d", i);
+      if (i == 0)
+        goto abort;
+      break;
+    }
+  vnet_queue_count = i;
+
+  /* the control queue follows every pair the device has */
+  if (vnet_queue_count > 1) {
+    if (!virtqueue_init (&vnet_dev, 2 * max_pairs, &vnet_ctrl_vq) ||
+        (phys = alloc_phys_frame ()) == -1)
+      vnet_queue_count = 1;
+    else {
+      vnet_ctrl = map_virtual_page (phys | 3);
+      if (!vnet_ctrl) {
+        free_phys_frame (phys);
+        vnet_queue_count = 1;
+      } else
+        vnet_ctrl_phys = phys;
+    }
+  }
+
+  if (!pci_get_interrupt (vnet_dev.index, &irq_line, &irq_pin) ||
+      !pci_irq_find (vnet_dev.pci.bus, vnet_dev.pci.slot, irq_pin, &irq) ||
+      !pci_irq_map_handler (&irq, virtio_net_irq_handler, 0x01,
+                            IOAPIC_DESTINATION_LOGICAL,
+                            IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Unable to map IRQ");
+    goto abort;
+  }
+  DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+
+  virtio_add_status (&vnet_dev, VIRTIO_STATUS_DRIVER_OK);
+
+  if (vnet_queue_count > 1 && !vnet_set_queue_pairs (vnet_queue_count)) {
+    DLOG ("Device refused %d queue pairs", vnet_queue_count);
+    vnet_queue_count = 1;
+  }
+
+  /* Register network device with net subsystem */
+  vnet_ethdev.recv_func = NULL;
+  vnet_ethdev.send_func = virtio_net_transmit;
+  vnet_ethdev.send_pbuf_func = virtio_net_transmit_pbuf;
+  vnet_ethdev.get_hwaddr_func = virtio_net_get_hwaddr;
+  vnet_ethdev.poll_func = virtio_net_poll;
+  vnet_ethdev.drvdata = &vnet_dev;
+  /* a long frame spreads over as many mergeable buffers as it takes */
+  if (virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MRG_RXBUF))
+    vnet_ethdev.max_mtu = VNET_MAX_MTU;
+
+  if (!net_register_device (&vnet_ethdev)) {
+    DLOG ("registration failed");
+    goto abort;
+  }
+
+  /* The device never deals with the IP header checksum.  TCP and UDP
+   * checksums, and TCP segmentation, are left to it when it offers
+   * them. */
+  vnet_csum_ctrl = NETIF_CHECKSUM_GEN_IP | NETIF_CHECKSUM_CHECK_IP;
+  if (!virtio_has_feature (&vnet_dev, VIRTIO_NET_F_CSUM))
+    vnet_csum_ctrl |= NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP;
+  if (!virtio_has_feature (&vnet_dev, VIRTIO_NET_F_GUEST_CSUM))
+    vnet_csum_ctrl |= NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP;
+  NETIF_SET_CHECKSUM_CTRL (&vnet_ethdev.netif, vnet_csum_ctrl);
+  if (virtio_has_feature (&vnet_dev, VIRTIO_NET_F_CSUM) &&
+      virtio_has_feature (&vnet_dev, VIRTIO_NET_F_HOST_TSO4))
+    vnet_ethdev.netif.flags |= NETIF_FLAG_TSO;
+
+  for (i=0; i<vnet_queue_count; i++) {
+    vnet_queues[i].bh_id =
+      create_kernel_thread_args ((u32) vnet_bh_thread,
+                                 (u32) &vnet_bh_stack[i][1023],
+                                 FALSE, 1, &vnet_queues[i]);
+    set_iovcpu (vnet_queues[i].bh_id, IOVCPU_CLASS_NET);
+  }
+
+  logger_printf ("virtio-net: %s transport, %d queue pairs, %s%s%s%s\n",
+                 vnet_dev.modern ? "modern" : "legacy", vnet_queue_count,
+                 virtio_has_feature (&vnet_dev, VIRTIO_NET_F_CSUM) ?
+                 "csum " : "",
+                 vnet_ethdev.netif.flags & NETIF_FLAG_TSO ? "tso " : "",
+                 virtio_has_feature (&vnet_dev, VIRTIO_NET_F_MRG_RXBUF) ?
+                 "mrg-rxbuf " : "",
+                 virtio_has_feature (&vnet_dev, VIRTIO_F_EVENT_IDX) ?
+                 "event-idx" : "");
+  return TRUE;
+
+ abort:
+  virtio_add_status (&vnet_dev, VIRTIO_STATUS_FAILED);
+  return FALSE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = virtio_net_init
+};
+
+DEF_MODULE (net___virtio_net, "virtio network driver", &mod_ops, {"net___ethernet", "pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
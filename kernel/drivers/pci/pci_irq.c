@@ -20,6 +20,7 @@
 #include "util/printf.h"
 #include "smp/smp.h"
 #include "smp/apic.h"
+#include "mem/virtual.h"
 #include "kernel.h"
 
 /* A generic interface for storing and looking up PCI IRQ routing
@@ -110,6 +111,113 @@ pci_irq_map_handler (pci_irq_t *irq, vector_handler handler,
   return TRUE;
 }
 
+/* Walk the capability list of a device.  Returns the configuration
+ * space offset of capability id, or 0 if it has none. */
+extern uint8
+pci_find_capability (uint8 bus, uint8 dev, uint8 func, uint8 id)
+{
+  uint8 ptr;
+  uint limit = 48;
+
+  if (!(pci_read_word (pci_addr (bus, dev, func, 0x06)) & 0x10))
+    return 0;
+  ptr = pci_read_byte (pci_addr (bus, dev, func, 0x34)) & ~0x3;
+  while (ptr >= 0x40 && limit--) {
+    if (pci_read_byte (pci_addr (bus, dev, func, ptr)) == id)
+      return ptr;
+    ptr = pci_read_byte (pci_addr (bus, dev, func, ptr + 1)) & ~0x3;
+  }
+  return 0;
+}
+
+/* Program the MSI capability of a device to deliver a fixed,
+ * edge-triggered interrupt on a fresh vector to the logical CPU set
+ * destmask, and install handler for it.  The device's INTx pin is
+ * not used afterwards. */
+extern bool
+pci_irq_map_msi_handler (uint8 bus, uint8 dev, uint8 func,
+                         vector_handler handler, uint8 destmask)
+{
+  uint8 cap = pci_find_capability (bus, dev, func, PCI_CAP_ID_MSI);
+  uint16 ctrl;
+  u8 vector;
+
+  if (cap == 0)
+    return FALSE;
+  vector = find_unused_vector (MINIMUM_VECTOR_PRIORITY);
+  DLOG ("MSI cap=0x%X vector=0x%X", cap, vector);
+  if (!vector)
+    return FALSE;
+  set_vector_handler (vector, handler);
+
+  ctrl = pci_read_word (pci_addr (bus, dev, func, cap + 2));
+  /* logical destination, redirection hint set */
+  pci_write_dword (pci_addr (bus, dev, func, cap + 4),
+                   0xFEE00000 | (destmask << 12) | 0xC);
+  if (ctrl & 0x80) {
+    /* 64-bit message address */
+    pci_write_dword (pci_addr (bus, dev, func, cap + 8), 0);
+    pci_write_word (pci_addr (bus, dev, func, cap + 12), vector);
+  } else
+    pci_write_word (pci_addr (bus, dev, func, cap + 8), vector);
+  /* one message, enabled; mask INTx */
+  pci_write_word (pci_addr (bus, dev, func, cap + 2), (ctrl & ~0x70) | 0x01);
+  pci_write_word (pci_addr (bus, dev, func, 0x04),
+                  pci_read_word (pci_addr (bus, dev, func, 0x04)) | 0x400);
+  return TRUE;
+}
+
+/* Program entry of the MSI-X table of a device to deliver a fixed,
+ * edge-triggered interrupt on a fresh vector to the logical CPU set
+ * destmask, and install handler for it.  MSI-X is enabled, and the
+ * device's INTx pin not used, from the first entry on. */
+extern bool
+pci_irq_map_msix_handler (uint8 bus, uint8 dev, uint8 func, uint entry,
+                          vector_handler handler, uint8 destmask)
+{
+  uint8 cap = pci_find_capability (bus, dev, func, PCI_CAP_ID_MSIX);
+  uint16 ctrl;
+  uint32 table, bar, phys;
+  volatile uint32 *page, *ent;
+  u8 vector;
+
+  if (cap == 0)
+    return FALSE;
+  ctrl = pci_read_word (pci_addr (bus, dev, func, cap + 2));
+  if (entry > (ctrl & 0x7FF))   /* table size - 1 */
+    return FALSE;
+  /* the table lives in a memory BAR, at an offset */
+  table = pci_read_dword (pci_addr (bus, dev, func, cap + 4));
+  bar = pci_read_dword (pci_addr (bus, dev, func, 0x10 + (table & 0x7) * 4));
+  if (bar & 0x1)
+    return FALSE;
+  phys = (bar & ~0xF) + (table & ~0x7) + entry * 16;
+
+  vector = find_unused_vector (MINIMUM_VECTOR_PRIORITY);
+  DLOG ("MSI-X cap=0x%X entry=%d vector=0x%X", cap, entry, vector);
+  if (!vector)
+    return FALSE;
+  page = map_virtual_page ((phys & ~0xFFF) | 3);
+  if (page == NULL)
+    return FALSE;
+  set_vector_handler (vector, handler);
+
+  ent = page + ((phys & 0xFFF) >> 2);
+  /* logical destination, redirection hint set */
+  ent[0] = 0xFEE00000 | (destmask << 12) | 0xC;
+  ent[1] = 0;
+  ent[2] = vector;
+  ent[3] = 0;                   /* unmasked */
+  unmap_virtual_page ((void *) page);
+
+  /* enabled, function not masked; mask INTx */
+  pci_write_word (pci_addr (bus, dev, func, cap + 2),
+                  (ctrl & ~0x4000) | 0x8000);
+  pci_write_word (pci_addr (bus, dev, func, 0x04),
+                  pci_read_word (pci_addr (bus, dev, func, 0x04)) | 0x400);
+  return TRUE;
+}
+
 /* Unmap given PCI IRQ routing entry */
 extern bool
 pci_irq_unmap (pci_irq_t *irq)
@@ -0,0 +1,854 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* EHCI (USB 2.0) host controller driver.
+ *
+ * Every endpoint in use gets its own queue head, created on first use
+ * and left linked into the schedule: control and bulk endpoints on
+ * the asynchronous ring, interrupt endpoints behind an anchor QH that
+ * every periodic frame list entry points to.  A transfer is a chain
+ * of qTDs of up to 20 KB each which is handed to the QH through its
+ * overlay; the submitter sleeps until the controller interrupts.
+ * Full- and low-speed devices are passed to the companion
+ * controller, so only high-speed devices are enumerated here. */
+
+#include <smp/apic.h>
+#include <drivers/pci/pci.h>
+#include <drivers/usb/usb.h>
+#include <drivers/usb/ehci.h>
+#include <util/printf.h>
+#include <mem/virtual.h>
+#include <kernel.h>
+#include "sched/sched.h"
+
+#define DEBUG_EHCI
+//#define DEBUG_EHCI_VERBOSE
+
+#ifdef DEBUG_EHCI
+#define DLOG(fmt,...) DLOG_PREFIX("EHCI",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#ifdef DEBUG_EHCI_VERBOSE
+#define DLOGV(fmt,...) DLOG_PREFIX("EHCI",fmt,##__VA_ARGS__)
+#else
+#define DLOGV(fmt,...) ;
+#endif
+
+static uint32 ehci_irq_handler (uint8 vec);
+
+static volatile uint8 *cap_regs, *op_regs;
+static uint num_ports;
+static bool ehci_operational = FALSE;
+static bool ehci_irq = FALSE;   /* completions are signalled by IRQ */
+
+static uint32 ehci_frame_list[1024] ALIGNED(0x1000);
+static EHCI_QTD ehci_qtd[EHCI_QTD_POOL_SIZE] ALIGNED(0x20);
+static EHCI_QH ehci_qh[EHCI_QH_POOL_SIZE] ALIGNED(0x20);
+static uint32 qtd_phys, qh_phys;
+static EHCI_QTD *free_qtds = NULL;
+static uint num_qhs = 0;
+
+static EHCI_QH *async_head;     /* reclamation head of the async ring */
+static EHCI_QH *periodic_head;  /* anchor of the interrupt QHs */
+static EHCI_QTD *terminator;    /* inactive qTD ending a short transfer */
+
+static task_id ehci_waitq = 0;  /* Tasks waiting for IRQ */
+
+/* Virtual-to-Physical */
+#define QTD_V2P(p) ((((uint) (p)) - ((uint) ehci_qtd)) + qtd_phys)
+#define QH_V2P(p)  ((((uint) (p)) - ((uint) ehci_qh)) + qh_phys)
+
+#define EHCI_PENDING (-1)
+
+static inline uint32
+ehci_read (uint reg)
+{
+  return *((volatile uint32 *) (op_regs + reg));
+}
+
+static inline void
+ehci_write (uint reg, uint32 v)
+{
+  *((volatile uint32 *) (op_regs + reg)) = v;
+}
+
+static EHCI_QTD *
+ehci_alloc_qtd (void)
+{
+  EHCI_QTD *t = free_qtds;
+
+  if (t == NULL) {
+    DLOG ("Error! Not enough qTDs in the pool!");
+    return NULL;
+  }
+  free_qtds = t->sw_next;
+  memset (t, 0, sizeof (EHCI_QTD));
+  t->next = t->alt_next = EHCI_TERMINATE;
+  return t;
+}
+
+static void
+ehci_free_chain (EHCI_QTD *t)
+{
+  EHCI_QTD *next;
+
+  for (; t; t = next) {
+    next = t->sw_next;
+    t->token = 0;
+    t->sw_next = free_qtds;
+    free_qtds = t;
+  }
+}
+
+/* Point the buffer list of t at len bytes from virtual address data.
+ * The pages need not be physically contiguous. */
+static void
+ehci_qtd_buffer (EHCI_QTD *t, uint8 *data, uint32 len)
+{
+  uint32 page = (uint32) data & ~0xFFF;
+  uint i;
+
+  if (len == 0)
+    return;
+  t->buf[0] = (uint32) get_phys_addr (data);
+  for (i = 1; i < 5; i++) {
+    page += 0x1000;
+    if (page >= (uint32) data + len)
+      break;
+    t->buf[i] = (uint32) get_phys_addr ((void *) page);
+  }
+}
+
+/* Build a chain of qTDs moving len bytes at data, each holding as
+ * many whole packets as fit in five pages.  toggle is the data
+ * toggle of the first packet; it only matters to control endpoints,
+ * which take it from the qTD.  Returns the head and sets *tail, or
+ * NULL if the pool ran dry. */
+static EHCI_QTD *
+ehci_build_chain (uint8 *data, uint32 len, uint32 pid, uint maxpkt,
+                  uint toggle, uint32 alt_next, EHCI_QTD **tail)
+{
+  EHCI_QTD *head = NULL, *prev = NULL, *t;
+  uint32 n;
+
+  do {
+    t = ehci_alloc_qtd ();
+    if (t == NULL) {
+      ehci_free_chain (head);
+      return NULL;
+    }
+
+    n = EHCI_QTD_MAX_LEN - ((uint32) data & 0xFFF);
+    if (len > n)
+      n -= n % maxpkt;          /* only the last qTD may end short */
+    else
+      n = len;
+
+    t->alt_next = alt_next;
+    t->token = QTD_ACTIVE | pid | QTD_CERR (3) | (n << 16) |
+      (toggle ? QTD_TOGGLE : 0);
+    t->len = n;
+    ehci_qtd_buffer (t, data, n);
+
+    if (((n + maxpkt - 1) / maxpkt) & 1)
+      toggle ^= 1;
+
+    if (prev) {
+      prev->next = QTD_V2P (t);
+      prev->sw_next = t;
+    } else
+      head = t;
+    prev = t;
+    data += n;
+    len -= n;
+  } while (len > 0);
+
+  *tail = prev;
+  return head;
+}
+
+static void
+ehci_link_qtd (EHCI_QTD *prev, EHCI_QTD *t)
+{
+  prev->next = QTD_V2P (t);
+  prev->sw_next = t;
+}
+
+/* Look up the QH of an endpoint, creating it on first use. */
+static EHCI_QH *
+ehci_get_qh (uint8 address, uint8 endpoint, uint8 dir, uint maxpkt,
+             bool control, bool periodic)
+{
+  uint32 key = address | (endpoint << 8) | ((control ? 0 : dir) << 12) |
+    (periodic << 13) | 0x80000000;
+  EHCI_QH *q, *head;
+  uint i;
+
+  for (i = 0; i < num_qhs; i++) {
+    q = &ehci_qh[i];
+    if (q->key == key) {
+      /* the default pipe's packet size is found out during enumeration */
+      if (!q->busy)
+        q->ep_char = (q->ep_char & ~QH_MAXPKT (0x7FF)) | QH_MAXPKT (maxpkt);
+      return q;
+    }
+  }
+
+  if (num_qhs >= EHCI_QH_POOL_SIZE) {
+    DLOG ("Error! Not enough QHs in the pool!");
+    return NULL;
+  }
+  q = &ehci_qh[num_qhs++];
+  memset (q, 0, sizeof (EHCI_QH));
+  q->key = key;
+  q->ep_char = QH_ADDR (address) | QH_ENDPT (endpoint) | QH_EPS_HIGH |
+    QH_MAXPKT (maxpkt) | (control ? QH_DTC : 0) | (periodic ? 0 : QH_RL (4));
+  q->ep_caps = QH_MULT (1) | (periodic ? QH_SMASK (0x01) : 0);
+  q->current = 0;
+  q->next = q->alt_next = EHCI_TERMINATE;
+  q->token = 0;
+
+  head = periodic ? periodic_head : async_head;
+  q->link = head->link;
+  head->link = QH_V2P (q) | EHCI_TYPE_QH;
+  DLOGV ("new QH addr=%d ep=%d dir=%d%s", address, endpoint, dir,
+         periodic ? " (periodic)" : "");
+  return q;
+}
+
+/* Returns EHCI_PENDING while the chain from first is in progress,
+ * the status bits of a halted qTD, or 0 with the byte count. */
+static int
+ehci_check_qtds (EHCI_QTD *first, EHCI_QTD *last, bool control,
+                 uint32 *act_len)
+{
+  EHCI_QTD *t;
+  uint32 token, len = 0;
+  bool short_pkt = FALSE;
+
+  for (t = first; t; t = t->sw_next) {
+    token = t->token;
+    if (token & QTD_HALTED)
+      return token & QTD_STATUS;
+    if (token & QTD_ACTIVE) {
+      /* After a short packet the rest of the data is skipped, but a
+       * control transfer still runs its status stage. */
+      if (short_pkt && !(control && t == last))
+        continue;
+      return EHCI_PENDING;
+    }
+    if (t->len) {
+      len += t->len - QTD_BYTES (token);
+      if (QTD_BYTES (token) != 0)
+        short_pkt = TRUE;
+    }
+  }
+
+  *act_len = len;
+  return 0;
+}
+
+/* Hand the chain from first to last to q and wait for it. */
+static int
+ehci_transfer (EHCI_QH *q, EHCI_QTD *first, EHCI_QTD *last, bool control,
+               uint32 *act_len)
+{
+  int status;
+  uint32 len = 0;
+
+  last->token |= QTD_IOC;
+
+  while (q->busy) {
+    if (mp_enabled) {
+      queue_append (&ehci_waitq, str ());
+      schedule ();
+    }
+  }
+  q->busy = TRUE;
+
+  /* The controller may still be stepping from a short packet onto the
+   * terminator; wait until it has left the QH idle. */
+  while ((q->token & QTD_ACTIVE) || !(q->next & EHCI_TERMINATE))
+    tsc_delay_usec (1);
+
+  q->next = QTD_V2P (first);
+
+  while ((status = ehci_check_qtds (first, last, control, &len))
+         == EHCI_PENDING) {
+    /* wait for IRQ if interrupts enabled */
+    if (mp_enabled && ehci_irq) {
+      queue_append (&ehci_waitq, str ());
+      schedule ();
+    }
+  }
+
+  if (status != 0) {
+    DLOG ("transfer halted: addr=%d ep=%d status=0x%x",
+          q->ep_char & 0x7F, (q->ep_char >> 8) & 0xF, status);
+    /* clear the halt, keeping the data toggle */
+    q->next = q->alt_next = EHCI_TERMINATE;
+    q->token &= QTD_TOGGLE;
+  }
+
+  if (act_len)
+    *act_len = len;
+  ehci_free_chain (first);
+
+  q->busy = FALSE;
+  wakeup_queue (&ehci_waitq);
+
+  return status;
+}
+
+int
+ehci_control_transfer (
+    uint8_t address,
+    addr_t setup_req,    /* Use virtual address here */
+    int setup_len,
+    addr_t setup_data,   /* Use virtual address here */
+    int data_len,
+    int packet_len)
+{
+  EHCI_QH *q;
+  EHCI_QTD *setup_td, *data_td = NULL, *data_tail = NULL, *status_td;
+  uint32 pid, act_len;
+
+  q = ehci_get_qh (address, 0, DIR_OUT, packet_len, TRUE, FALSE);
+  if (q == NULL)
+    return -1;
+
+  /* Constructing the setup packet, always DATA0 */
+  setup_td = ehci_alloc_qtd ();
+  if (setup_td == NULL)
+    return -1;
+  setup_td->token = QTD_ACTIVE | QTD_PID_SETUP | QTD_CERR (3) |
+    (setup_len << 16);
+  ehci_qtd_buffer (setup_td, setup_req, setup_len);
+
+  /* Constructing the handshake packet, always DATA1 */
+  status_td = ehci_alloc_qtd ();
+  if (status_td == NULL) {
+    ehci_free_chain (setup_td);
+    return -1;
+  }
+  pid = (*((uint8 *) setup_req) & 0x80) ? QTD_PID_IN : QTD_PID_OUT;
+  status_td->token = QTD_ACTIVE | QTD_CERR (3) | QTD_TOGGLE |
+    ((data_len > 0 && pid == QTD_PID_IN) ? QTD_PID_OUT : QTD_PID_IN);
+
+  /* Constructing the data packets, starting with DATA1; a short
+   * packet skips straight to the handshake */
+  if (data_len > 0) {
+    data_td = ehci_build_chain (setup_data, data_len, pid, packet_len, 1,
+                                QTD_V2P (status_td), &data_tail);
+    if (data_td == NULL) {
+      ehci_free_chain (setup_td);
+      ehci_free_chain (status_td);
+      return -1;
+    }
+    ehci_link_qtd (setup_td, data_td);
+    ehci_link_qtd (data_tail, status_td);
+  } else
+    ehci_link_qtd (setup_td, status_td);
+
+  return ehci_transfer (q, setup_td, status_td, TRUE, &act_len);
+}
+
+static int
+ehci_data_transfer (uint8_t address, uint8_t endpoint, addr_t data,
+                    uint32_t len, uint16_t packet_len, uint8_t dir,
+                    uint32_t *act_len, bool periodic)
+{
+  EHCI_QH *q;
+  EHCI_QTD *first, *last;
+
+  DLOGV ("%s: %d %d %d %c", periodic ? "intr" : "bulk",
+         address, endpoint, len, dir == DIR_IN ? 'I' : 'O');
+
+  q = ehci_get_qh (address, endpoint, dir, packet_len, FALSE, periodic);
+  if (q == NULL)
+    return -1;
+
+  /* the QH keeps the data toggle; a short packet ends the transfer */
+  first = ehci_build_chain (data, len,
+                            dir == DIR_IN ? QTD_PID_IN : QTD_PID_OUT,
+                            packet_len, 0, QTD_V2P (terminator), &last);
+  if (first == NULL)
+    return -1;
+
+  return ehci_transfer (q, first, last, FALSE, act_len);
+}
+
+int
+ehci_bulk_transfer (uint8_t address, uint8_t endpoint, addr_t data,
+                    uint32_t len, uint16_t packet_len, uint8_t dir,
+                    uint32_t *act_len)
+{
+  return ehci_data_transfer (address, endpoint, data, len, packet_len, dir,
+                             act_len, FALSE);
+}
+
+int
+ehci_interrupt_transfer (uint8_t address, uint8_t endpoint, addr_t data,
+                         uint32_t len, uint16_t packet_len, uint8_t dir,
+                         uint32_t *act_len)
+{
+  return ehci_data_transfer (address, endpoint, data, len, packet_len, dir,
+                             act_len, TRUE);
+}
+
+/* A configuration event puts every bulk and interrupt endpoint of the
+ * device back to DATA0. */
+static void
+ehci_reset_toggles (uint8_t addr)
+{
+  uint i;
+
+  for (i = 0; i < num_qhs; i++) {
+    EHCI_QH *q = &ehci_qh[i];
+    if (q->key && (q->key & 0x7F) == addr && !(q->ep_char & QH_DTC) &&
+        !q->busy)
+      q->token &= ~QTD_TOGGLE;
+  }
+}
+
+int
+ehci_get_descriptor (
+    uint8_t address,
+    uint16_t dtype,   /* Descriptor type */
+    uint16_t dindex,   /* Descriptor index */
+    uint16_t index,    /* Zero or Language ID */
+    uint16_t length,   /* Descriptor length */
+    addr_t desc,
+    uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x80;
+  setup_req.bRequest = USB_GET_DESCRIPTOR;
+  setup_req.wValue = (dtype << 8) + dindex;
+  setup_req.wIndex = index;
+  setup_req.wLength = length;
+
+  return ehci_control_transfer (address,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      desc, length, packet_size);
+}
+
+int
+ehci_set_address (uint8_t old_addr, uint8_t new_addr, uint8_t packet_size)
+{
+  sint status;
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x0;
+  setup_req.bRequest = USB_SET_ADDRESS;
+  setup_req.wValue = new_addr;
+  setup_req.wIndex = 0;
+  setup_req.wLength = 0;
+
+  status = ehci_control_transfer (old_addr,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ), 0,
+      0, packet_size);
+  if (status == 0)
+    ehci_reset_toggles (new_addr);
+  return status;
+}
+
+int
+ehci_get_configuration (uint8_t addr, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  uint8_t num = -1;
+  setup_req.bmRequestType = 0x80;
+  setup_req.bRequest = USB_GET_CONFIGURATION;
+  setup_req.wValue = 0;
+  setup_req.wIndex = 0;
+  setup_req.wLength = 1;
+
+  ehci_control_transfer (addr, (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      (addr_t) & num, 1, packet_size);
+
+  return num;
+}
+
+int
+ehci_set_configuration (uint8_t addr, uint8_t conf, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x0;
+  setup_req.bRequest = USB_SET_CONFIGURATION;
+  setup_req.wValue = conf;
+  setup_req.wIndex = 0;
+  setup_req.wLength = 0;
+
+  ehci_reset_toggles (addr);
+
+  return ehci_control_transfer (addr,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ), 0,
+      0, packet_size);
+}
+
+int
+ehci_set_interface (uint8_t addr, uint16_t alt, uint16_t interface,
+    uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x01;
+  setup_req.bRequest = USB_SET_INTERFACE;
+  setup_req.wValue = alt;
+  setup_req.wIndex = interface;
+  setup_req.wLength = 0;
+
+  ehci_reset_toggles (addr);
+
+  return ehci_control_transfer (addr,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ), 0,
+      0, packet_size);
+}
+
+int
+ehci_get_interface (uint8_t addr, uint16_t interface, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  uint8_t alt = -1;
+  setup_req.bmRequestType = 0x81;
+  setup_req.bRequest = USB_GET_INTERFACE;
+  setup_req.wValue = 0;
+  setup_req.wIndex = interface;
+  setup_req.wLength = 1;
+
+  ehci_control_transfer (addr, (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      (addr_t) & alt, 1, packet_size);
+
+  return alt;
+}
+
+static uint32
+ehci_irq_handler (uint8 vec)
+{
+  uint32 status;
+
+  lock_kernel ();
+
+  status = ehci_read (EHCI_USBSTS) & 0x3F;
+  if (status == 0)
+    goto finish;
+
+  /* Clear the interrupts by writing 1s to them */
+  ehci_write (EHCI_USBSTS, status);
+
+  if (status & EHCI_STS_HSE)
+    DLOG ("Host System Error detected!");
+
+  if (status & EHCI_STS_USBERRINT)
+    DLOGV ("USB Error Interrupt detected!");
+
+  if (status & (EHCI_STS_USBINT | EHCI_STS_USBERRINT))
+    /* wake-up any waiting threads */
+    wakeup_queue (&ehci_waitq);
+
+ finish:
+  unlock_kernel ();
+  return 0;
+}
+
+/* Reset a root port with a high-speed device on it.  Anything slower
+ * is given to the companion controller.  Returns TRUE if the port is
+ * enabled and ours. */
+static bool
+ehci_port_reset (uint port)
+{
+  uint32 sc = ehci_read (EHCI_PORTSC (port));
+  uint i;
+
+  if (!(sc & EHCI_PORT_CCS))
+    return FALSE;
+
+  if ((sc & EHCI_PORT_LS_MASK) == EHCI_PORT_LS_K) {
+    DLOG ("port %d: low-speed device, releasing to companion", port);
+    ehci_write (EHCI_PORTSC (port),
+                (sc & ~EHCI_PORT_WC) | EHCI_PORT_OWNER);
+    return FALSE;
+  }
+
+  sc &= ~(EHCI_PORT_WC | EHCI_PORT_PE);
+  ehci_write (EHCI_PORTSC (port), sc | EHCI_PORT_PR);
+  delay (50);
+  ehci_write (EHCI_PORTSC (port), sc);
+  for (i = 0; i < 20; i++) {
+    if (!(ehci_read (EHCI_PORTSC (port)) & EHCI_PORT_PR))
+      break;
+    tsc_delay_usec (100);
+  }
+  delay (10);
+
+  sc = ehci_read (EHCI_PORTSC (port));
+  if (!(sc & EHCI_PORT_PE)) {
+    DLOG ("port %d: full-speed device, releasing to companion", port);
+    ehci_write (EHCI_PORTSC (port),
+                (sc & ~EHCI_PORT_WC) | EHCI_PORT_OWNER);
+    return FALSE;
+  }
+
+  /* acknowledge the status changes caused by the reset */
+  ehci_write (EHCI_PORTSC (port), sc);
+  return TRUE;
+}
+
+bool
+ehci_do_enumeration (void)
+{
+  uint i;
+
+  if (!ehci_operational) return FALSE;
+  DLOG ("begin enumeration");
+
+  for (i = 0; i < num_ports; i++) {
+    if (ehci_port_reset (i))
+      usb_enumerate (USB_TYPE_HC_EHCI);
+  }
+  DLOG ("end enumeration");
+  return TRUE;
+}
+
+bool
+ehci_is_operational (void)
+{
+  return ehci_operational;
+}
+
+/* Take the controller over from the BIOS through the USB legacy
+ * support capability, then turn off its SMIs. */
+static void
+ehci_bios_handoff (pci_device *pdev, uint eecp)
+{
+  uint timeout;
+
+  while (eecp >= 0x40) {
+    uint32 cap = pci_read_dword (pci_addr (pdev->bus, pdev->slot, pdev->func,
+                                           eecp));
+    if ((cap & 0xFF) == EHCI_LEGSUP_ID) {
+      DLOG ("HC BIOS SEM: %d", (cap >> 16) & 1);
+      pci_write_byte (pci_addr (pdev->bus, pdev->slot, pdev->func,
+                                eecp + EHCI_LEGSUP_OS_SEM), 0x01);
+      for (timeout = 0; timeout < 1000; timeout++) {
+        if (!(pci_read_byte (pci_addr (pdev->bus, pdev->slot, pdev->func,
+                                       eecp + EHCI_LEGSUP_BIOS_SEM)) & 1))
+          break;
+        tsc_delay_usec (1000);
+      }
+      if (timeout == 1000)
+        DLOG ("BIOS did not release the controller");
+      pci_write_dword (pci_addr (pdev->bus, pdev->slot, pdev->func,
+                                 eecp + EHCI_LEGCTLSTS), 0);
+      return;
+    }
+    eecp = (cap >> 8) & 0xFF;
+  }
+}
+
+static bool
+ehci_reset (void)
+{
+  uint i;
+
+  ehci_write (EHCI_USBCMD, ehci_read (EHCI_USBCMD) & ~EHCI_CMD_RS);
+  for (i = 0; i < 100; i++) {
+    if (ehci_read (EHCI_USBSTS) & EHCI_STS_HALTED)
+      break;
+    tsc_delay_usec (1000);
+  }
+
+  ehci_write (EHCI_USBCMD, EHCI_CMD_HCRESET);
+  for (i = 0; i < 100; i++) {
+    if (!(ehci_read (EHCI_USBCMD) & EHCI_CMD_HCRESET))
+      return TRUE;
+    tsc_delay_usec (1000);
+  }
+  return FALSE;
+}
+
+static void
+init_schedule (void)
+{
+  uint i;
+
+  qtd_phys = (uint32) get_phys_addr ((void *) ehci_qtd);
+  qh_phys = (uint32) get_phys_addr ((void *) ehci_qh);
+
+  free_qtds = NULL;
+  for (i = EHCI_QTD_POOL_SIZE; i > 0; i--) {
+    ehci_qtd[i-1].sw_next = free_qtds;
+    free_qtds = &ehci_qtd[i-1];
+  }
+  terminator = ehci_alloc_qtd ();
+
+  /* The async ring starts as the reclamation head alone */
+  num_qhs = 0;
+  async_head = &ehci_qh[num_qhs++];
+  memset (async_head, 0, sizeof (EHCI_QH));
+  async_head->link = QH_V2P (async_head) | EHCI_TYPE_QH;
+  async_head->ep_char = QH_HEAD | QH_EPS_HIGH | QH_MAXPKT (64);
+  async_head->ep_caps = QH_MULT (1);
+  async_head->next = async_head->alt_next = EHCI_TERMINATE;
+  async_head->token = QTD_HALTED;
+
+  /* Every frame polls the interrupt QHs queued behind the anchor */
+  periodic_head = &ehci_qh[num_qhs++];
+  memset (periodic_head, 0, sizeof (EHCI_QH));
+  periodic_head->link = EHCI_TERMINATE;
+  periodic_head->ep_char = QH_EPS_HIGH | QH_MAXPKT (64);
+  periodic_head->ep_caps = QH_MULT (1) | QH_SMASK (0x01);
+  periodic_head->next = periodic_head->alt_next = EHCI_TERMINATE;
+
+  for (i = 0; i < 1024; i++)
+    ehci_frame_list[i] = QH_V2P (periodic_head) | EHCI_TYPE_QH;
+}
+
+bool
+ehci_init (void)
+{
+  uint i, device_index, irq_line, irq_pin, mem_addr;
+  uint32 hcsparams, hccparams;
+  pci_device ehci_device;
+  pci_irq_t irq;
+
+  if (mp_ISA_PC) {
+    DLOG ("Cannot operate without PCI");
+    return FALSE;
+  }
+
+  /* Find the EHCI device on the PCI bus */
+  device_index = ~0;
+  i=0;
+  while (pci_find_device (0xFFFF, 0xFFFF, 0x0C, 0x03, i, &i)) {
+    if (pci_get_device (i, &ehci_device)) {
+      if (ehci_device.progIF == 0x20) {
+        device_index = i;
+        break;
+      }
+      i++;
+    } else break;
+  }
+
+  if (device_index == ~0) {
+    DLOG ("Unable to find compatible device on PCI bus");
+    return FALSE;
+  }
+
+  if (!pci_decode_bar (device_index, 0, &mem_addr, NULL, NULL) ||
+      mem_addr == 0) {
+    DLOG ("unable to decode BAR0");
+    return FALSE;
+  }
+
+  DLOG ("Using PCI bus=%x dev=%x func=%x BAR0=%p",
+        ehci_device.bus, ehci_device.slot, ehci_device.func, mem_addr);
+
+  /* enable memory mapped I/O and bus mastering */
+  pci_write_word (pci_addr (ehci_device.bus, ehci_device.slot,
+                            ehci_device.func, 0x04), 0x0006);
+
+  cap_regs = map_virtual_page ((mem_addr & ~0xFFF) | 3);
+  if (cap_regs == NULL) {
+    DLOG ("Unable to map registers at phys=%p", mem_addr);
+    return FALSE;
+  }
+  cap_regs += mem_addr & 0xFFF;
+  op_regs = cap_regs + *cap_regs;
+
+  hcsparams = *((volatile uint32 *) (cap_regs + EHCI_HCSPARAMS));
+  hccparams = *((volatile uint32 *) (cap_regs + EHCI_HCCPARAMS));
+  num_ports = EHCI_HCS_N_PORTS (hcsparams);
+  DLOG ("HCSPARAMS=%p HCCPARAMS=%p ports=%d", hcsparams, hccparams, num_ports);
+
+  ehci_bios_handoff (&ehci_device, EHCI_HCC_EECP (hccparams));
+
+  if (!ehci_reset ()) {
+    DLOG ("Controller did not reset");
+    goto abort;
+  }
+
+  init_schedule ();
+
+  if (pci_get_interrupt (device_index, &irq_line, &irq_pin) &&
+      pci_irq_find (ehci_device.bus, ehci_device.slot, irq_pin, &irq) &&
+      pci_irq_map_handler (&irq, ehci_irq_handler, 0x01,
+                           IOAPIC_DESTINATION_LOGICAL,
+                           IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+    ehci_irq = TRUE;
+  } else
+    DLOG ("No IRQ routing; polling for completions");
+
+  if (hccparams & EHCI_HCC_64BIT)
+    ehci_write (EHCI_CTRLDSSEGMENT, 0);
+  ehci_write (EHCI_PERIODICLISTBASE,
+              (uint32) get_phys_addr ((void *) ehci_frame_list));
+  ehci_write (EHCI_ASYNCLISTADDR, QH_V2P (async_head));
+  ehci_write (EHCI_USBSTS, 0x3F);
+  ehci_write (EHCI_USBINTR, ehci_irq ?
+              (EHCI_STS_USBINT | EHCI_STS_USBERRINT | EHCI_STS_HSE) : 0);
+  ehci_write (EHCI_USBCMD, EHCI_CMD_ITC (1) | EHCI_CMD_ASE | EHCI_CMD_PSE |
+              EHCI_CMD_RS);
+
+  for (i = 0; i < 100; i++) {
+    if (!(ehci_read (EHCI_USBSTS) & EHCI_STS_HALTED))
+      break;
+    tsc_delay_usec (1000);
+  }
+  if (i == 100) {
+    DLOG ("Controller did not start");
+    goto abort;
+  }
+
+  /* Route all ports to this controller, and power them */
+  ehci_write (EHCI_CONFIGFLAG, 1);
+  if (hcsparams & EHCI_HCS_PPC) {
+    for (i = 0; i < num_ports; i++)
+      ehci_write (EHCI_PORTSC (i),
+                  (ehci_read (EHCI_PORTSC (i)) & ~EHCI_PORT_WC) |
+                  EHCI_PORT_PP);
+  }
+  tsc_delay_usec (20000);
+
+  ehci_operational = TRUE;
+  return TRUE;
+
+ abort:
+  unmap_virtual_page ((void *) ((uint32) cap_regs & ~0xFFF));
+  return FALSE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = ehci_init
+};
+
+DEF_MODULE (usb___ehci, "EHCI driver", &mod_ops, {"usb", "pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -18,6 +18,7 @@
 #include <smp/apic.h>
 #include <drivers/usb/usb.h>
 #include <drivers/usb/uhci.h>
+#include <drivers/usb/ehci.h>
 #include <util/printf.h>
 #include <mem/virtual.h>
 #include <mem/pow2.h>
@@ -69,6 +70,22 @@ uint32 td_phys, qh_phys;
 #define QH_P2V(ty,p) ((ty)((((uint) (p)) - qh_phys)+((uint) qh)))
 
 static task_id uhci_waitq = 0;  /* Tasks waiting for IRQ */
+static bool uhci_irq = FALSE;   /* completions are signalled by IRQ */
+
+#define UHCI_MAX_BULK_EPS 16
+/* Largest request uhci_bulk_transfer queues at once, in packets, and
+ * how many of them it keeps queued */
+#define UHCI_BULK_REQ_TDS 64
+#define UHCI_BULK_PIPELINE 4
+
+/* Transfers queued on a bulk endpoint */
+typedef struct {
+  UHCI_QH *qh;
+  uint8_t address, endpoint, direction;
+  UHCI_BULK_REQ *head, *tail;
+} uhci_bulk_ep_t;
+
+static uhci_bulk_ep_t bulk_eps[UHCI_MAX_BULK_EPS];
 
 #define TERMINATE 1
 #define SELECT_TD 0
@@ -77,32 +94,52 @@ static task_id uhci_waitq = 0;  /* Tasks waiting for IRQ */
 #define LINK_MASK (~0xFL)
 
 
-/*
- * This is non-reentrant! Fortunately, we do not have concurrency yet:-)
- * This function returns the available Queue Head or Transfer Descriptor.
- * It will probably be removed later.
- */
+/* Free descriptors are kept on singly-linked lists threaded through
+ * their software fields.  A free TD also has link_ptr == 0, and a free
+ * QH has qh_ptr == qe_ptr == 0.  Callers hold the kernel lock. */
+static UHCI_TD *td_free_list = NULL;
+static UHCI_QH *qh_free_list = NULL;
+
+static void
+init_free_lists (void)
+{
+  int i;
+
+  td_free_list = NULL;
+  for (i = TD_POOL_SIZE - 1; i >= 0; i--) {
+    td[i].sw_next = td_free_list;
+    td_free_list = &td[i];
+  }
+  qh_free_list = NULL;
+  for (i = QH_POOL_SIZE - 1; i >= 0; i--) {
+    qh[i].sw_next = qh_free_list;
+    qh_free_list = &qh[i];
+  }
+}
+
+/* Returns an available Queue Head or Transfer Descriptor. */
 static void *
 sched_alloc (int type)
 {
-  int i = 0;
+  UHCI_TD *t;
+  UHCI_QH *q;
 
   switch (type) {
     case TYPE_TD:
-      for (i = 0; i < TD_POOL_SIZE; i++) {
-        if (td[i].link_ptr == 0) {
-          td[i].link_ptr = TERMINATE;
-          return &td[i];
-        }
+      if ((t = td_free_list) != NULL) {
+        td_free_list = t->sw_next;
+        t->sw_next = NULL;
+        t->link_ptr = TERMINATE;
+        return t;
       }
       break;
 
     case TYPE_QH:
-      for (i = 0; i < QH_POOL_SIZE; i++) {
-        if (qh[i].qh_ptr == 0 && qh[i].qe_ptr == 0) {
-          qh[i].qh_ptr = qh[i].qe_ptr = TERMINATE;
-          return &qh[i];
-        }
+      if ((q = qh_free_list) != NULL) {
+        qh_free_list = q->sw_next;
+        q->sw_next = NULL;
+        q->qh_ptr = q->qe_ptr = TERMINATE;
+        return q;
       }
       break;
 
@@ -132,12 +169,16 @@ sched_free (int type, void *res)
       res_td->buf_ptr = 0;
       res_td->buf_vptr = 0;
       res_td->call_back = 0;
+      res_td->sw_next = td_free_list;
+      td_free_list = res_td;
       break;
 
     case TYPE_QH:
       res_qh = (UHCI_QH *) res;
       res_qh->qh_ptr = 0;
       res_qh->qe_ptr = 0;
+      res_qh->sw_next = qh_free_list;
+      qh_free_list = res_qh;
       break;
 
     default:
@@ -238,6 +279,7 @@ init_schedule (void)
 
   memset ((void *) td, 0, 32 * TD_POOL_SIZE);
   memset ((void *) qh, 0, 16 * QH_POOL_SIZE);
+  init_free_lists ();
 
   int_qh = sched_alloc (TYPE_QH);
   ctl_qh = sched_alloc (TYPE_QH);
@@ -496,237 +538,16 @@ uhci_reset (void)
   return 0;
 }
 
-#define USB_MAX_DEVICES 32
-static USB_DEVICE_INFO devinfo[USB_MAX_DEVICES+1];
-static uint next_address = 1;
-
-#define USB_MAX_DEVICE_DRIVERS 32
-static USB_DRIVER drivers[USB_MAX_DEVICE_DRIVERS];
-static uint num_drivers = 0;
-
-void
-find_device_driver (USB_DEVICE_INFO *info, USB_CFG_DESC *cfgd, USB_IF_DESC *ifd)
-{
-  int d;
-  for (d=0; d<num_drivers; d++) {
-    if (drivers[d].probe (info, cfgd, ifd))
-      return;
-  }
-}
-
-void
-dlog_devd (USB_DEV_DESC *devd)
-{
-  DLOG ("DEVICE DESCRIPTOR len=%d type=%d bcdUSB=0x%x",
-        devd->bLength, devd->bDescriptorType, devd->bcdUSB);
-  DLOG ("  class=0x%x subclass=0x%x proto=0x%x maxpkt0=%d",
-        devd->bDeviceClass, devd->bDeviceSubClass, devd->bDeviceProtocol,
-        devd->bMaxPacketSize0);
-  DLOG ("  vendor=0x%x product=0x%x bcdDevice=0x%x numcfgs=%d",
-        devd->idVendor, devd->idProduct, devd->bcdDevice,
-        devd->bNumConfigurations);
-}
-
-void
-dlog_info (USB_DEVICE_INFO *info)
-{
-  DLOG ("ADDRESS %d", info->address);
-  dlog_devd (&info->devd);
-
-#if 0
-  uint8 strbuf[64];
-  uint8 str[32];
-#define do_str(slot,label)                                              \
-  if (info->devd.slot != 0 &&                                           \
-      uhci_get_string (info->address, info->devd.slot, 0,               \
-                       sizeof (strbuf), strbuf,                         \
-                       info->devd.bMaxPacketSize0)                      \
-      == 0) {                                                           \
-    memset (str, 0, sizeof (str));                                      \
-    if (uhci_interp_string ((USB_STR_DESC *)strbuf, sizeof (strbuf), 0, \
-                            str, sizeof (str)-1) > 0) {                 \
-      DLOG ("  "label": %s", str);                                      \
-    }                                                                   \
-  }
-
-  do_str (iManufacturer, "Manufacturer");
-  do_str (iProduct, "Product");
-#undef do_str
-#endif
-}
-
 /* figures out what device is attached as address 0 */
 bool
 uhci_enumerate (void)
 {
-  USB_DEV_DESC devd;
-  USB_CFG_DESC *cfgd;
-  USB_IF_DESC *ifd;
-#define TEMPSZ 256
-  uint8 temp[TEMPSZ], *ptr;
-  uint curdev = next_address;
-  sint status, c, i, total_length=0;
-  USB_DEVICE_INFO *info;
-
-  if (curdev > USB_MAX_DEVICES) {
-    DLOG ("uhci_enumerate: too many devices");
-    return FALSE;
-  }
-
-  DLOG ("uhci_enumerate: curdev=%d", curdev);
-
-  /* clear device info */
-  info = &devinfo[curdev];
-  memset (info, 0, sizeof (USB_DEVICE_INFO));
-  info->address = 0;
-  info->host_type = USB_TYPE_HC_UHCI;
-
-  /* OK, here is the deal. The spec says you should use the maximum
-   * packet size in the data phase of control transfer if the data
-   * is larger than one packet. Since we do not want to support low
-   * speed device for now, the bMaxPacketSize0 is always set to 64
-   * bytes for full speed device. So, do not be surprised if your USB
-   * mouse does not work in Quest!
-   */
-  info->devd.bMaxPacketSize0 = 64;
-
-  memset (&devd, 0, sizeof (USB_DEV_DESC));
-
-  /* get device descriptor */
-  status = usb_get_descriptor (info, USB_TYPE_DEV_DESC, 0, 0,
-                               sizeof (USB_DEV_DESC), &devd);
-  if (status != 0)
-    goto abort;
-
-  if (devd.bMaxPacketSize0 == 8) {
-    /* get device descriptor */
-    info->devd.bMaxPacketSize0 = 8;
-    status = usb_get_descriptor (info, USB_TYPE_DEV_DESC, 0, 0,
-                                 sizeof (USB_DEV_DESC), &devd);
-    if (status != 0)
-      goto abort;
-  }
-
-  if (devd.bNumConfigurations == 255)
-    devd.bNumConfigurations = 1; /* hack */
-
-  /* Update device info structure. Put it in USB core might be better */
-  memcpy (&info->devd, &devd, sizeof (USB_DEV_DESC));
-
-  /* assign an address */
-  if (usb_set_address (info, curdev) != 0)
-    goto abort;
-  DLOG ("uhci_enumerate: set (0x%x, 0x%x, 0x%x) to addr %d",
-        devd.bDeviceClass, devd.idVendor, devd.idProduct, curdev);
-  delay (2);
-
-  DLOG ("uhci_enumerate: num configs=%d", devd.bNumConfigurations);
-
-  /* Update device info structure for new address. */
-  info->address = curdev;
-
-  dlog_info (info);
-
-  for (c=0; c<devd.bNumConfigurations; c++) {
-    /* get a config descriptor for size field */
-    memset (temp, 0, TEMPSZ);
-    status = usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0,
-                                 sizeof (USB_CFG_DESC), temp);
-    if (status != 0) {
-      DLOG ("uhci_enumerate: failed to get config descriptor for c=%d", c);
-      goto abort;
-    }
-
-    cfgd = (USB_CFG_DESC *)temp;
-    DLOG ("uhci_enumerate: c=%d cfgd->wTotalLength=%d", c, cfgd->wTotalLength);
-    total_length += cfgd->wTotalLength;
-  }
-
-  DLOG ("uhci_enumerate: total_length=%d", total_length);
-
-  /* allocate memory to hold everything */
-  pow2_alloc (total_length, &info->raw);
-  if (!info->raw) {
-    DLOG ("uhci_enumerate: pow2_alloc (%d) failed", total_length);
-    goto abort;
-  }
-
-  /* read all cfg, if, and endpoint descriptors */
-  ptr = info->raw;
-  for (c=0; c<devd.bNumConfigurations; c++) {
-    /* obtain precise size info */
-    memset (temp, 0, TEMPSZ);
-    status = usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0,
-                                 sizeof (USB_CFG_DESC), temp);
-    if (status != 0) {
-      DLOG ("uhci_enumerate: failed to get config descriptor for c=%d", c);
-      goto abort_mem;
-    }
-    cfgd = (USB_CFG_DESC *)temp;
-
-    /* get cfg, if, and endp descriptors */
-    status =
-      usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0, cfgd->wTotalLength, ptr);
-    if (status != 0)
-      goto abort_mem;
-
-    cfgd = (USB_CFG_DESC *)ptr;
-    DLOG ("uhci_enumerate: cfg %d has num_if=%d", c, cfgd->bNumInterfaces);
-    ptr += cfgd->wTotalLength;
-  }
-
-  /* incr this here because hub drivers may recursively invoke enumerate */
-  next_address++;
-
-  /* parse cfg and if descriptors */
-  ptr = info->raw;
-  for (c=0; c<devd.bNumConfigurations; c++) {
-    cfgd = (USB_CFG_DESC *) ptr;
-    ptr += cfgd->bLength;
-    for (i=0; i<cfgd->bNumInterfaces; i++) {
-      /* find the next if descriptor, skipping any class-specific stuff */
-      for (ifd = (USB_IF_DESC *) ptr;
-           ifd->bDescriptorType != USB_TYPE_IF_DESC;
-           ifd = (USB_IF_DESC *)((uint8 *)ifd + ifd->bLength)) {
-        //DLOG ("ifd=%p len=%d type=0x%x", ifd, ifd->bLength, ifd->bDescriptorType);
-      }
-      ptr = (uint8 *) ifd;
-      DLOG ("uhci_enumerate: examining (%d, %d) if_class=0x%X sub=0x%X proto=0x%X #endp=%d",
-            c, i, ifd->bInterfaceClass,
-            ifd->bInterfaceSubClass,
-            ifd->bInterfaceProtocol,
-            ifd->bNumEndpoints);
-
-      /* find a device driver interested in this interface */
-      find_device_driver (info, cfgd, ifd);
-
-      ptr += ifd->bLength;
-    }
-    ptr = ((uint8 *)cfgd) + cfgd->wTotalLength;
-  }
-
-  /* --??-- what happens if more than one driver matches more than one config? */
-
-  return TRUE;
-
- abort_mem:
-  pow2_free (info->raw);
- abort:
-  return FALSE;
-}
-
-bool
-usb_register_driver (USB_DRIVER *driver)
-{
-  if (num_drivers >= USB_MAX_DEVICE_DRIVERS) return FALSE;
-  memcpy (&drivers[num_drivers], driver, sizeof (USB_DRIVER));
-  num_drivers++;
-  return TRUE;
+  return usb_enumerate (USB_TYPE_HC_UHCI);
 }
 
 static bool uhci_operational = FALSE;
 bool
-usb_do_enumeration (void)
+uhci_do_enumeration (void)
 {
   int i;
 #include <drivers/usb/usb_tests.h>
@@ -753,6 +574,7 @@ uhci_init (void)
   pci_irq_t irq;
 
   memset (toggles, 0, sizeof (toggles));
+  memset (bulk_eps, 0, sizeof (bulk_eps));
 
   if (mp_ISA_PC) {
     DLOG ("Cannot operate without PCI");
@@ -805,6 +627,7 @@ uhci_init (void)
       return FALSE;
     }
     irq_line = irq.gsi;
+    uhci_irq = TRUE;
   }
 
   td_phys = (uint32) get_phys_addr ((void *) td);
@@ -813,7 +636,8 @@ uhci_init (void)
         td, td_phys, qh, qh_phys);
 
 
-  if (uhci_device.device != 0x7020)
+  /* keep the ports routed to EHCI when it drives them itself */
+  if (uhci_device.device != 0x7020 && !ehci_is_operational ())
     disable_ehci ();
 
   /* Disable USB Legacy Support, set PIRQ */
@@ -908,136 +732,363 @@ uhci_isochronous_transfer (
   return 0;
 }
 
-/* find a free QH to queue up the TDs, or alloc a new one */
-static UHCI_QH *
-link_td_to_free_qh (UHCI_QH *q, UHCI_TD *t)
+/* Bulk endpoints each get a QH of their own in the bulk list.  The TD
+ * chains of the requests queued on an endpoint are linked one after
+ * the other, so the controller moves on to the next transfer as soon
+ * as one finishes; completions are picked up by uhci_process_bulk,
+ * called from the IRQ handler. */
+
+static uhci_bulk_ep_t *
+bulk_ep_find (uint8_t address, uint8_t endpoint, uint8_t direction)
 {
-  for (;;) {
-    //DLOG ("examining QH: %p qe=%p qh=%p", q, q->qe_ptr, q->qh_ptr);
-    if (q->qe_ptr & TERMINATE) {
-      q->qe_ptr = TD_V2P (uint32, t) & LINK_MASK;
-      //DLOG ("using existing QH %p", q);
-      return q;
+  uhci_bulk_ep_t *ep, *avail = NULL;
+  UHCI_QH *q;
+  int i;
+
+  for (i = 0; i < UHCI_MAX_BULK_EPS; i++) {
+    ep = &bulk_eps[i];
+    if (ep->qh == NULL) {
+      if (avail == NULL) avail = ep;
+    } else if (ep->address == address && ep->endpoint == endpoint &&
+               ep->direction == direction)
+      return ep;
+  }
+
+  if (avail == NULL) {
+    DLOG ("Error! Too many bulk endpoints!");
+    return NULL;
+  }
+  q = sched_alloc (TYPE_QH);
+  if (q == NULL)
+    return NULL;
+  avail->qh = q;
+  avail->address = address;
+  avail->endpoint = endpoint;
+  avail->direction = direction;
+  avail->head = avail->tail = NULL;
+
+  /* append to the end of the bulk list */
+  q->qh_ptr = TERMINATE;
+  q->qe_ptr = TERMINATE;
+  for (q = blk_qh; !(q->qh_ptr & TERMINATE);
+       q = QH_P2V (UHCI_QH *, q->qh_ptr & LINK_MASK));
+  q->qh_ptr = (QH_V2P (uint32, avail->qh) & LINK_MASK) | SELECT_QH;
+  return avail;
+}
+
+static inline uint
+bulk_tog_idx (uhci_bulk_ep_t *ep)
+{
+  return ep->address * 32 + (ep->endpoint + ((ep->direction == DIR_IN) << 4));
+}
+
+/* The queue halted on TD t of the head request: a short packet or an
+ * error.  The TDs queued after it were built assuming every packet
+ * before them would be sent, so give them the toggles they should
+ * have had, and record the toggle the next request starts with. */
+static void
+bulk_fix_toggles (uhci_bulk_ep_t *ep, uint toggle)
+{
+  UHCI_BULK_REQ *req;
+  UHCI_TD *t;
+  uint i;
+
+  for (req = ep->head; req; req = req->next) {
+    for (i = 0, t = req->first; i < req->ntds; i++) {
+      t->toggle = toggle;
+      toggle ^= 1;
+      t = TD_P2V (UHCI_TD *, t->link_ptr & LINK_MASK);
+    }
+  }
+  if (toggle)
+    BITMAP_SET (toggles, bulk_tog_idx (ep));
+  else
+    BITMAP_CLR (toggles, bulk_tog_idx (ep));
+}
+
+/* Look at the TDs of a request.  Returns NULL while it is in
+ * progress; otherwise fills in status and act_len and returns the TD
+ * on which the controller stopped, or the last TD. */
+static UHCI_TD *
+bulk_check (UHCI_BULK_REQ *req, bool *halted)
+{
+  UHCI_TD *t = req->first;
+  uint i, len = 0;
+
+  for (i = 0; ; i++) {
+    if (t->status & 0x80)
+      return NULL;
+
+    /* If the TD is STALLED or timed out, we report the error */
+    if (t->status & 0x44) {
+      req->status = t->status & 0x7F;
+      req->act_len = len;
+      *halted = TRUE;
+      return t;
+    }
+
+    len += (t->act_len + 1) & 0x7FF;
+    /* Check for short packet */
+    if (t->act_len != t->max_len) {
+      DLOGV ("Short Packet! after %d bytes", len);
+      req->act_len = len;
+      *halted = TRUE;
+      return t;
     }
-    if (q->qh_ptr & TERMINATE) {
-      UHCI_QH *newq = sched_alloc (TYPE_QH);
-      if (newq == NULL) return NULL;
-      newq->qe_ptr = (TD_V2P (uint32, t) & LINK_MASK) | SELECT_TD;
-      newq->qh_ptr = TERMINATE;
-      q->qh_ptr = (QH_V2P (uint32, newq) & LINK_MASK) | SELECT_QH;
-      //DLOG ("created new QH %p", newq);
-      return newq;
+
+    if (i == req->ntds - 1)
+      break;
+    t = TD_P2V (UHCI_TD *, t->link_ptr & LINK_MASK);
+  }
+  req->act_len = len;
+  *halted = FALSE;
+  return t;
+}
+
+static void
+bulk_complete (UHCI_BULK_REQ *req)
+{
+  free_tds (req->first, req->ntds);
+  req->first = req->last = NULL;
+  req->done = TRUE;
+  if (req->complete)
+    req->complete (req);
+}
+
+/* Retire finished requests on every bulk endpoint and keep the
+ * controller working on the ones behind them. */
+static void
+uhci_process_bulk (void)
+{
+  uhci_bulk_ep_t *ep;
+  UHCI_BULK_REQ *req;
+  UHCI_TD *t;
+  bool halted;
+  int i;
+
+  for (i = 0; i < UHCI_MAX_BULK_EPS; i++) {
+    ep = &bulk_eps[i];
+    while ((req = ep->head) != NULL) {
+      t = bulk_check (req, &halted);
+      if (t == NULL)
+        break;
+      ep->head = req->next;
+      if (ep->head == NULL)
+        ep->tail = NULL;
+
+      /* The controller leaves the QH pointing at the TD it stopped
+       * on, so skip what is left of the request and the
+       * continuations of it. */
+      if (halted && (ep->qh->qe_ptr & LINK_MASK) == TD_V2P (uint32, t)) {
+        while (ep->head && ep->head->cont) {
+          UHCI_BULK_REQ *skip = ep->head;
+          ep->head = skip->next;
+          if (ep->head == NULL)
+            ep->tail = NULL;
+          skip->status = req->status;
+          skip->act_len = 0;
+          bulk_complete (skip);
+        }
+        /* a short packet completed its TD, a failed one did not */
+        bulk_fix_toggles (ep, req->status ? t->toggle : t->toggle ^ 1);
+        ep->qh->qe_ptr = (ep->head ?
+                          TD_V2P (uint32, ep->head->first) & LINK_MASK :
+                          TERMINATE);
+      }
+      bulk_complete (req);
     }
 
-    /* advance to next qh in list */
-    q = QH_P2V (UHCI_QH *, q->qh_ptr & LINK_MASK);
+    /* The controller may have fetched the last TD of a chain before
+     * the next request was linked to it, and stopped at its stale
+     * terminate bit.  Restart the queue at the first active TD. */
+    if (ep->head && (ep->qh->qe_ptr & TERMINATE)) {
+      for (t = ep->head->first; !(t->status & 0x80);
+           t = TD_P2V (UHCI_TD *, t->link_ptr & LINK_MASK));
+      ep->qh->qe_ptr = TD_V2P (uint32, t) & LINK_MASK;
+    }
   }
 }
 
+/* Build the TDs of a bulk request and queue them on its endpoint.
+ * Returns 0, or -1 if out of descriptors. */
 int
-uhci_bulk_transfer(
-    uint8_t address,
-    uint8_t endpoint,
-    addr_t data,
-    int data_len,
-    int packet_len,
-    uint8_t direction,
-    uint32 *act_len)
+uhci_bulk_submit (UHCI_BULK_REQ *req)
 {
-  UHCI_TD *tx_tds = 0;
-  UHCI_TD *data_td = 0;
-  UHCI_TD *idx_td = 0;
-  UHCI_QH *act_qh;
-  int max_packet_len = ((packet_len - 1) >= USB_MAX_LEN) ? USB_MAX_LEN : packet_len - 1;
-  int i = 0, num_data_packets = 0, data_left = 0, return_status = 0, tog_idx;
+  UHCI_TD *data_td = 0, *first = 0, *last = 0;
+  uhci_bulk_ep_t *ep;
+  addr_t data = req->data;
+  int max_packet_len = ((req->packet_len - 1) >= USB_MAX_LEN) ?
+    USB_MAX_LEN : req->packet_len - 1;
+  int i = 0, num_data_packets = 0, data_left = 0, tog_idx;
+
+  DLOGV ("bulk: %d %d %d %c", req->address, req->endpoint, req->len,
+         req->direction == DIR_IN ? 'I' : 'O');
+
+  ep = bulk_ep_find (req->address, req->endpoint, req->direction);
+  if (ep == NULL)
+    return -1;
 
-  DLOGV ("bulk: %d %d %d %c", address, endpoint, data_len,
-         direction == DIR_IN ? 'I' : 'O');
-  num_data_packets = (data_len + max_packet_len) / (max_packet_len + 1);
-  data_left = data_len;
+  num_data_packets = (req->len + max_packet_len) / (max_packet_len + 1);
+  if (num_data_packets == 0)
+    num_data_packets = 1;       /* zero-length packet */
+  data_left = req->len;
+  tog_idx = bulk_tog_idx (ep);
 
-  for(i = 0; i < num_data_packets; i++) {
-    data_td = sched_alloc(TYPE_TD);
-    data_td->link_ptr = TERMINATE;
-    if(tx_tds == 0)
-      tx_tds = data_td;
+  for (i = 0; i < num_data_packets; i++) {
+    data_td = sched_alloc (TYPE_TD);
+    if (data_td == NULL) {
+      if (first)
+        free_tds (first, i);
+      return -1;
+    }
+    if (first == 0)
+      first = data_td;
     else
-      idx_td->link_ptr = (((uint32_t)get_phys_addr((void*)data_td)) & LINK_MASK) + DEPTH_FIRST;
+      last->link_ptr = (TD_V2P (uint32, data_td) & LINK_MASK) + DEPTH_FIRST;
+    last = data_td;
 
-    idx_td = data_td;
+    data_td->link_ptr = TERMINATE;
     data_td->status = 0x80;
     data_td->c_err = 3;
     data_td->ioc = data_td->iso = 0;
-    data_td->spd = (direction == DIR_IN ? 1 : 0);
+    data_td->spd = (req->direction == DIR_IN ? 1 : 0);
 
-    data_td->pid = (direction == DIR_IN) ? UHCI_PID_IN : UHCI_PID_OUT;
-    data_td->addr = address;
-    data_td->endp = endpoint;
+    data_td->pid = (req->direction == DIR_IN) ? UHCI_PID_IN : UHCI_PID_OUT;
+    data_td->addr = req->address;
+    data_td->endp = req->endpoint;
 
-    tog_idx = (address * 32 + (endpoint + ((direction == DIR_IN) << 4)));
     data_td->toggle = (BITMAP_TST (toggles, tog_idx) ? 1 : 0);
     if (data_td->toggle)
       BITMAP_CLR (toggles, tog_idx);
     else
       BITMAP_SET (toggles, tog_idx);
 
-    data_td->max_len = (data_left > (max_packet_len + 1)) ? max_packet_len : data_left - 1;
-    data_td->buf_ptr = (uint32_t)get_phys_addr((void*)data);
+    data_td->max_len = (data_left > (max_packet_len + 1)) ?
+      max_packet_len : data_left - 1;
+    data_td->buf_ptr = (uint32_t) get_phys_addr ((void *) data);
     data_td->buf_vptr = data;
 
-    if(data_left <= (max_packet_len + 1)) {
-      data_td->ioc = 1;
-      break;
-    } else {
-      data += (data_td->max_len + 1);
-      data_left -= (data_td->max_len + 1);
-    }
-
-    /* set last packet IOC */
-    if (i == num_data_packets - 1)
-      data_td->ioc = 1;
+    data += (data_td->max_len + 1) & 0x7FF;
+    data_left -= (data_td->max_len + 1) & 0x7FF;
+  }
+  /* set last packet IOC */
+  last->ioc = 1;
+
+  req->first = first;
+  req->last = last;
+  req->ntds = num_data_packets;
+  req->status = 0;
+  req->act_len = 0;
+  req->done = FALSE;
+  req->next = NULL;
+
+  /* Queue behind the pending requests, the controller follows the
+   * link from their last TD */
+  if (ep->tail) {
+    ep->tail->last->link_ptr = (TD_V2P (uint32, first) & LINK_MASK) +
+      DEPTH_FIRST;
+    ep->tail->next = req;
+    ep->tail = req;
+    /* restarts the queue if the controller got to the end of it */
+    uhci_process_bulk ();
+  } else {
+    ep->head = ep->tail = req;
+    ep->qh->qe_ptr = TD_V2P (uint32, first) & LINK_MASK;
   }
 
+  return 0;
+}
 
-#if 0
-  DLOG ("Dumping tx_tds...");
-  debug_dump_sched (tx_tds);
-  DLOG ("... done");
-#endif
-
-  /* Initiate our bulk transactions */
-  act_qh = link_td_to_free_qh (blk_qh, tx_tds);
-
-  if (act_qh == NULL) {
-    DLOG ("act_qh == NULL");
-    return -1;
+/* Sleep until a submitted request has finished; returns its status */
+int
+uhci_bulk_wait (UHCI_BULK_REQ *req)
+{
+  for (;;) {
+    uhci_process_bulk ();
+    if (req->done)
+      break;
+    /* wait for IRQ if interrupts enabled */
+    if (mp_enabled && uhci_irq) {
+      queue_append (&uhci_waitq, str ());
+      schedule ();
+    }
   }
+  return req->status;
+}
 
+/* Synchronous bulk transfer.  Large transfers are split into several
+ * requests queued back to back, so the controller never waits for
+ * the CPU between them. */
+int
+uhci_bulk_transfer(
+    uint8_t address,
+    uint8_t endpoint,
+    addr_t data,
+    int data_len,
+    int packet_len,
+    uint8_t direction,
+    uint32 *act_len)
+{
+  UHCI_BULK_REQ reqs[UHCI_BULK_PIPELINE];
+  int max_packet_len = ((packet_len - 1) >= USB_MAX_LEN) ? USB_MAX_LEN : packet_len - 1;
+  uint32 chunk = (max_packet_len + 1) * UHCI_BULK_REQ_TDS;
+  uint32 queued = 0, total = 0;
+  uint head = 0, n = 0;
+  int return_status = 0;
+  bool stop = FALSE;
   u64 start, finish;
 
   RDTSC (start);
 
-  /* Check the status of all the packets in the transaction */
-  return_status = check_tds(act_qh, tx_tds, act_len);
+  do {
+    /* keep the pipeline full */
+    while (!stop && n < UHCI_BULK_PIPELINE &&
+           (queued < (uint32) data_len || (queued == 0 && data_len == 0))) {
+      UHCI_BULK_REQ *req = &reqs[(head + n) % UHCI_BULK_PIPELINE];
+      memset (req, 0, sizeof (UHCI_BULK_REQ));
+      req->address = address;
+      req->endpoint = endpoint;
+      req->direction = direction;
+      req->packet_len = packet_len;
+      req->data = (uint8 *) data + queued;
+      req->len = (data_len - queued > chunk ? chunk : data_len - queued);
+      req->cont = (queued > 0);
+      if (uhci_bulk_submit (req) != 0) {
+        if (n == 0) {
+          DLOG ("bulk: unable to queue transfer");
+          return -1;
+        }
+        break;                  /* wait for descriptors to come back */
+      }
+      queued += req->len;
+      n++;
+      if (req->len == 0)
+        break;
+    }
+
+    if (uhci_bulk_wait (&reqs[head]) != 0 && return_status == 0) {
+      return_status = reqs[head].status;
+      stop = TRUE;
+    }
+    total += reqs[head].act_len;
+    /* a short packet ends the transfer */
+    if (reqs[head].act_len != reqs[head].len)
+      stop = TRUE;
+    head = (head + 1) % UHCI_BULK_PIPELINE;
+    n--;
+  } while (n > 0 || (!stop && queued < (uint32) data_len));
+
+  RDTSC (finish);
+
+  *act_len = total;
   if (return_status != 0) {
     DLOG ("bulk: return_status != 0");
   } else {
     DLOGV ("complete: %d len %d", return_status, *act_len);
-  }
-
-  RDTSC (finish);
-
-  if (return_status == 0) {
     uhci_bytes += *act_len;
     uhci_timestamps += finish - start;
   }
 
-  /* unlink any remaining active TDs if short packet was detected */
-  if (*act_len != data_len)
-    act_qh->qe_ptr = TERMINATE;
-
-  free_tds(tx_tds, num_data_packets);
-
   return return_status;
 }
 
@@ -1357,6 +1408,7 @@ uhci_irq_handler (uint8 vec)
     DLOG("USB Error Interrupt detected!");
     status |= 0x02; /* Clear the interrupt by writing a 1 to it */
 
+    uhci_process_bulk ();
     /* wake-up any waiting threads */
     wakeup_queue (&uhci_waitq);
   }
@@ -1370,6 +1422,7 @@ uhci_irq_handler (uint8 vec)
      */
     status |= 0x01; /* Clear the interrupt by writing a 1 to it */
 
+    uhci_process_bulk ();
     /* wake-up any waiting threads */
     wakeup_queue (&uhci_waitq);
 
@@ -63,7 +63,8 @@ struct umsc_csw {
 } PACKED;
 typedef struct umsc_csw UMSC_CSW;
 
-static uint testaddr, testepout, testepin;
+static USB_DEVICE_INFO *testdev;
+static uint testepout, testepin;
 
 typedef struct {
   USB_DEVICE_INFO *devinfo;
@@ -74,15 +75,25 @@ typedef struct {
 static umsc_device_t umsc_devs[UMSC_MAX_DEVICES];
 static uint num_umsc_devs=0;
 
-sint
-umsc_bulk_scsi (uint addr, uint ep_out, uint ep_in,
-                uint8 cmd[16], uint dir, uint8* data,
-                uint data_len, uint maxpkt)
+/* Largest data stage of a single READ(10)/WRITE(10). */
+#define UMSC_MAX_XFER 0x10000
+
+/* Run one command through the bulk-only transport.  If moved is not
+ * NULL it receives the number of data bytes the device actually
+ * transferred, which is less than data_len when the device ends the
+ * data stage early with a short packet. */
+static sint
+_umsc_bulk_scsi (USB_DEVICE_INFO *dev, uint ep_out, uint ep_in,
+                 uint8 cmd[16], uint dir, uint8* data,
+                 uint data_len, uint maxpkt, uint *moved)
 {
   UMSC_CBW cbw;
   UMSC_CSW csw;
   sint status;
-  uint32 act_len;
+  uint32 act_len, data_act = 0;
+
+  if (moved)
+    *moved = 0;
 
   DLOG ("cmd: %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X",
         cmd[0], cmd[1], cmd[2], cmd[3],
@@ -99,27 +110,31 @@ umsc_bulk_scsi (uint addr, uint ep_out, uint ep_in,
   cbw.bCBWCBLength = 16;            /* cmd length */
   memcpy (cbw.CBWCB, cmd, 16);
 
-  status = uhci_bulk_transfer (addr, ep_out, &cbw, 0x1f, maxpkt, DIR_OUT, &act_len);
+  status = usb_bulk_transfer (dev, ep_out, &cbw, 0x1f, maxpkt, DIR_OUT, &act_len);
 
   DLOG ("status=%d", status);
 
   if (data_len > 0) {
+    /* The host controller driver takes the whole data stage at once */
     if (dir) {
-      status = uhci_bulk_transfer (addr, ep_in, data, data_len, maxpkt, DIR_IN, &act_len);
+      status = usb_bulk_transfer (dev, ep_in, data, data_len, maxpkt, DIR_IN, &act_len);
     }
     else {
-      status = uhci_bulk_transfer (addr, ep_out, data, data_len, maxpkt, DIR_OUT, &act_len);
+      status = usb_bulk_transfer (dev, ep_out, data, data_len, maxpkt, DIR_OUT, &act_len);
     }
 
     DLOG ("status=%d", status);
 
     if (status != 0) return status;
 
+    /* a short packet ends the data stage, the CSW follows it */
+    data_act = act_len;
+
     DLOG ("data=%.02X %.02X %.02X %.02X", data[0], data[1], data[2], data[3]);
 
   }
 
-  status = uhci_bulk_transfer (addr, ep_in, (addr_t) &csw, 0x0d, maxpkt, DIR_IN, &act_len);
+  status = usb_bulk_transfer (dev, ep_in, (addr_t) &csw, 0x0d, maxpkt, DIR_IN, &act_len);
 
   DLOG ("status=%d", status);
 
@@ -128,95 +143,239 @@ umsc_bulk_scsi (uint addr, uint ep_out, uint ep_in,
   DLOG ("csw sig=%p tag=%p res=%d status=%d",
         csw.dCSWSignature, csw.dCSWTag, csw.dCSWDataResidue, csw.bCSWStatus);
 
+  if (moved) {
+    /* only trust data the device vouches for: the command passed and
+     * the residue does not contradict what arrived */
+    if (csw.dCSWSignature != UMSC_CSW_SIGNATURE || csw.bCSWStatus != 0)
+      return -1;
+    if (csw.dCSWDataResidue <= data_len &&
+        data_len - csw.dCSWDataResidue < data_act)
+      data_act = data_len - csw.dCSWDataResidue;
+    *moved = data_act;
+  }
+
   return status;
 }
 
 sint
-_umsc_read_sector (uint dev_index, uint32 lba, uint8 *sector, uint len)
+umsc_bulk_scsi (USB_DEVICE_INFO *dev, uint ep_out, uint ep_in,
+                uint8 cmd[16], uint dir, uint8* data,
+                uint data_len, uint maxpkt)
+{
+  return _umsc_bulk_scsi (dev, ep_out, ep_in, cmd, dir, data, data_len,
+                          maxpkt, NULL);
+}
+
+#define UMSC_DIR_OUT 0
+#define UMSC_DIR_IN  1
+
+/* Transfer count sectors starting at lba to or from buf with one
+ * READ(10) or WRITE(10).  Returns the number of bytes moved in whole
+ * sectors, which may be fewer than asked for, or 0. */
+static sint
+_umsc_xfer_sectors (uint dev_index, uint dir, uint32 lba, uint count,
+                    uint8 *buf)
 {
   umsc_device_t *umsc;
-  uint8 cmd[16] = { [0] = 0x28,
+  uint moved;
+  uint8 cmd[16] = { [0] = (dir == UMSC_DIR_IN ? 0x28 : 0x2A),
                     [2] = (lba >> 0x18) & 0xFF,
                     [3] = (lba >> 0x10) & 0xFF,
                     [4] = (lba >> 0x08) & 0xFF,
                     [5] = (lba >> 0x00) & 0xFF,
-                    [8] = 1 };
+                    [7] = (count >> 0x08) & 0xFF,
+                    [8] = (count >> 0x00) & 0xFF };
   if (dev_index >= num_umsc_devs) return 0;
   umsc = &umsc_devs[dev_index];
-  if (len < umsc->sector_size) return 0;
+  if (count == 0 || count * umsc->sector_size > UMSC_MAX_XFER) return 0;
 
-  if (umsc_bulk_scsi (umsc->devinfo->address,
-                      umsc->ep_out, umsc->ep_in, cmd, 1, sector,
-                      umsc->sector_size, umsc->maxpkt) != 0)
+  if (_umsc_bulk_scsi (umsc->devinfo,
+                       umsc->ep_out, umsc->ep_in, cmd, dir, buf,
+                       count * umsc->sector_size, umsc->maxpkt, &moved) != 0)
     return 0;
-  return umsc->sector_size;
+  return moved - moved % umsc->sector_size;
 }
 
+/* Requests are queued for umsc_thread in a ring of slots.  A slot
+ * is reused only once its submitter has collected the result. */
+#define UMSC_MAX_REQS 8
+
+enum { UMSC_REQ_FREE = 0, UMSC_REQ_PENDING, UMSC_REQ_DONE };
 
-/* bit of a hack here since we don't have IPC yet */
-static task_id umsc_cur_task = 0, umsc_waitq = 0, umsc_thread_id = 0;
-static u32 umsc_cur_dev_index, umsc_cur_lba, umsc_cur_len;
-static u8 umsc_cur_sector[512];
-static sint umsc_cur_res;
+typedef struct {
+  uint state;
+  task_id task;
+  uint dev_index, dir, lba, count;
+  uint8 *buf;
+  sint res;
+} umsc_req_t;
+
+static umsc_req_t umsc_reqs[UMSC_MAX_REQS];
+static uint umsc_req_head = 0, umsc_req_tail = 0;
+static task_id umsc_waitq = 0, umsc_thread_id = 0;
 static u32 umsc_stack[1024] ALIGNED (0x1000);
 
+/* Buffers that the host controller cannot reach directly are staged
+ * through here, by one submitter at a time. */
+static u8 umsc_bounce[UMSC_MAX_XFER] ALIGNED (0x1000);
+static bool umsc_bounce_busy = FALSE;
+static task_id umsc_bounce_waitq = 0;
+
 static void
 umsc_thread (void)
 {
+  umsc_req_t *r;
+
   logger_printf ("umsc_thread: hello from 0x%x\n", str ());
   for (;;) {
-    if (umsc_cur_task) {
-      DLOG ("thread: read_sector for 0x%x (%d, %d, %p, %d)", umsc_cur_task,
-            umsc_cur_dev_index, umsc_cur_lba, umsc_cur_sector,
-            umsc_cur_len);
-      umsc_cur_res = _umsc_read_sector (umsc_cur_dev_index, umsc_cur_lba,
-                                        umsc_cur_sector, umsc_cur_len);
-      wakeup (umsc_cur_task);
-      umsc_cur_task = 0;
+    while (umsc_req_head != umsc_req_tail) {
+      r = &umsc_reqs[umsc_req_head % UMSC_MAX_REQS];
+      DLOG ("thread: %s for 0x%x (%d, %d, %d, %p)",
+            r->dir == UMSC_DIR_IN ? "read" : "write", r->task,
+            r->dev_index, r->lba, r->count, r->buf);
+      r->res = _umsc_xfer_sectors (r->dev_index, r->dir, r->lba,
+                                   r->count, r->buf);
+      r->state = UMSC_REQ_DONE;
+      umsc_req_head++;
+      wakeup (r->task);
     }
     iovcpu_job_completion ();
   }
 }
 
-sint
-umsc_read_sector (uint dev_index, u32 lba, u8 *sector, uint len)
+/* Hand one command to umsc_thread and sleep until it completes. */
+static sint
+umsc_submit (uint dev_index, uint dir, uint32 lba, uint count, uint8 *buf)
 {
+  umsc_req_t *r;
+  bool idle;
   sint res;
 
-  if (dev_index >= num_umsc_devs) return 0;
-  if (len < umsc_devs[dev_index].sector_size) return 0;
-
-  if (!mp_enabled || !umsc_thread_id) {
-    return _umsc_read_sector (dev_index, lba, sector, len);
-  }
-
-  while (umsc_cur_task) {
+  while (umsc_reqs[umsc_req_tail % UMSC_MAX_REQS].state != UMSC_REQ_FREE) {
     queue_append (&umsc_waitq, str ());
     schedule ();
   }
 
-  umsc_cur_dev_index = dev_index;
-  umsc_cur_lba = lba;
-  umsc_cur_len = len;
+  r = &umsc_reqs[umsc_req_tail % UMSC_MAX_REQS];
+  r->task = str ();
+  r->dev_index = dev_index;
+  r->dir = dir;
+  r->lba = lba;
+  r->count = count;
+  r->buf = buf;
+  r->state = UMSC_REQ_PENDING;
 
-  umsc_cur_task = str ();
-
-  iovcpu_job_wakeup_for_me (umsc_thread_id);
+  idle = (umsc_req_head == umsc_req_tail);
+  umsc_req_tail++;
+  if (idle)
+    iovcpu_job_wakeup_for_me (umsc_thread_id);
 
   schedule ();
 
-  memcpy (sector, umsc_cur_sector, sizeof (umsc_cur_sector));
-  res = umsc_cur_res;
-
+  res = r->res;
+  r->state = UMSC_REQ_FREE;
   wakeup_queue (&umsc_waitq);
 
   return res;
 }
 
+/* Transfer count sectors between the device and buf, which must hold
+ * len bytes, in commands of up to UMSC_MAX_XFER.  Data moves directly
+ * to or from buf when the controller can address it: packet-aligned
+ * and, if the thread does the work, in the kernel's shared mapping.
+ * Returns the number of bytes moved, or 0 on error. */
+static sint
+umsc_xfer (uint dev_index, uint dir, u32 lba, uint count, u8 *buf, uint len)
+{
+  extern uint32 _kernelstart;
+  umsc_device_t *umsc;
+  uint n, total = 0;
+  bool threaded, direct;
+  sint res;
+
+  if (dev_index >= num_umsc_devs) return 0;
+  umsc = &umsc_devs[dev_index];
+  if (count == 0 || len < count * umsc->sector_size) return 0;
+
+  threaded = mp_enabled && umsc_thread_id;
+  direct = ((uint) buf & (umsc->maxpkt - 1)) == 0 &&
+    (!threaded || (uint) buf >= (uint) &_kernelstart);
+
+  if (!direct) {
+    while (umsc_bounce_busy) {
+      queue_append (&umsc_bounce_waitq, str ());
+      schedule ();
+    }
+    umsc_bounce_busy = TRUE;
+  }
+
+  while (count > 0) {
+    u8 *xbuf = direct ? buf + total : umsc_bounce;
+
+    n = count;
+    if (n * umsc->sector_size > UMSC_MAX_XFER)
+      n = UMSC_MAX_XFER / umsc->sector_size;
+
+    if (!direct && dir == UMSC_DIR_OUT)
+      memcpy (umsc_bounce, buf + total, n * umsc->sector_size);
+
+    if (threaded)
+      res = umsc_submit (dev_index, dir, lba, n, xbuf);
+    else
+      res = _umsc_xfer_sectors (dev_index, dir, lba, n, xbuf);
+
+    if (res <= 0) {
+      total = 0;
+      break;
+    }
+
+    if (!direct && dir == UMSC_DIR_IN)
+      memcpy (buf + total, umsc_bounce, res);
+
+    total += res;
+    /* the device ended early: report what it did move */
+    if (res < n * umsc->sector_size)
+      break;
+    lba += n;
+    count -= n;
+  }
+
+  if (!direct) {
+    umsc_bounce_busy = FALSE;
+    wakeup_queue (&umsc_bounce_waitq);
+  }
+
+  return total;
+}
+
+sint
+umsc_read_sectors (uint dev_index, u32 lba, uint count, u8 *buf, uint len)
+{
+  return umsc_xfer (dev_index, UMSC_DIR_IN, lba, count, buf, len);
+}
+
+sint
+umsc_write_sectors (uint dev_index, u32 lba, uint count, u8 *buf, uint len)
+{
+  return umsc_xfer (dev_index, UMSC_DIR_OUT, lba, count, buf, len);
+}
+
+sint
+umsc_read_sector (uint dev_index, u32 lba, u8 *sector, uint len)
+{
+  return umsc_read_sectors (dev_index, lba, 1, sector, len);
+}
+
+sint
+umsc_write_sector (uint dev_index, u32 lba, u8 *sector, uint len)
+{
+  return umsc_write_sectors (dev_index, lba, 1, sector, len);
+}
+
 static bool
 umsc_probe (USB_DEVICE_INFO *info, USB_CFG_DESC *cfgd, USB_IF_DESC *ifd)
 {
-  uint i, addr = info->address, ep_in=0, ep_out=0;
+  uint i, ep_in=0, ep_out=0;
   USB_EPT_DESC *ep;
   uint last_lba, sector_size, maxpkt=64;
   uint8 conf[512];
@@ -246,54 +405,54 @@ umsc_probe (USB_DEVICE_INFO *info, USB_CFG_DESC *cfgd, USB_IF_DESC *ifd)
     return FALSE;
 
   DLOG ("detected device=%d ep_in=%d ep_out=%d maxpkt=%d",
-        addr, ep_in, ep_out, maxpkt);
+        info->address, ep_in, ep_out, maxpkt);
 
   usb_set_configuration (info, cfgd->bConfigurationValue);
   delay (50);
 
-  testaddr = addr;
+  testdev = info;
   testepin = ep_in;
   testepout = ep_out;
 
   {
     uint8 cmd[16] = {0x12,0,0,0,0x24,0,0,0,0,0,0,0};
     DLOG ("SENDING INQUIRY");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
       return FALSE;
   }
 
   {
     uint8 cmd[16] = {0,0,0,0,0,0,0,0,0,0,0,0};
     DLOG ("SENDING TEST UNIT READY");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0, maxpkt) != 0)
       return FALSE;
   }
 
   {
     uint8 cmd[16] = {0x03,0,0,0,0x24,0,0,0,0,0,0,0};
     DLOG ("SENDING REQUEST SENSE");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
       return FALSE;
   }
 
   {
     uint8 cmd[16] = {0,0,0,0,0,0,0,0,0,0,0,0};
     DLOG ("SENDING TEST UNIT READY");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0, maxpkt) != 0)
       return FALSE;
   }
 
   {
     uint8 cmd[16] = {0x03,0,0,0,0x24,0,0,0,0,0,0,0};
     DLOG ("SENDING REQUEST SENSE");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0x24, maxpkt) != 0)
       return FALSE;
   }
 
   {
     uint8 cmd[16] = {0x25,0,0,0,0,0,0,0,0,0,0,0};
     DLOG ("SENDING READ CAPACITY");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0x8, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 0x8, maxpkt) != 0)
       return FALSE;
     last_lba = conf[3] | conf[2] << 8 | conf[1] << 16 | conf[0] << 24;
     sector_size = conf[7] | conf[6] << 8 | conf[5] << 16 | conf[4] << 24;
@@ -305,7 +464,7 @@ umsc_probe (USB_DEVICE_INFO *info, USB_CFG_DESC *cfgd, USB_IF_DESC *ifd)
   {
     uint8 cmd[16] = { [0] = 0x28, [8] = 1 };
     DLOG ("SENDING READ (10)");
-    if (umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 512, maxpkt) != 0)
+    if (umsc_bulk_scsi (info, ep_out, ep_in, cmd, 1, conf, 512, maxpkt) != 0)
       return FALSE;
     DLOG ("read from sector 0: %.02X %.02X %.02X %.02X",
           conf[0], conf[1], conf[2], conf[3]);
@@ -347,12 +506,12 @@ umsc_tmr_test (void)
 {
   void uhci_show_regs (void);
   uint8 conf[16];
-  uint addr = testaddr, ep_out = testepout, ep_in = testepin, maxpkt=64;
+  uint ep_out = testepout, ep_in = testepin, maxpkt=64;
   uint last_lba, sector_size;
   {
     uint8 cmd[16] = {0x25,0,0,0,0,0,0,0,0,0,0,0};
     DLOG ("SENDING READ CAPACITY");
-    umsc_bulk_scsi (addr, ep_out, ep_in, cmd, 1, conf, 0x8, maxpkt);
+    umsc_bulk_scsi (testdev, ep_out, ep_in, cmd, 1, conf, 0x8, maxpkt);
     last_lba = conf[3] | conf[2] << 8 | conf[1] << 16 | conf[0] << 24;
     sector_size = conf[7] | conf[6] << 8 | conf[5] << 16 | conf[4] << 24;
     DLOG ("sector_size=0x%x last_lba=0x%x total_size=%d bytes",
@@ -17,9 +17,13 @@
 
 #include <drivers/usb/usb.h>
 #include <drivers/usb/uhci.h>
+#include <drivers/usb/ehci.h>
+#include <drivers/usb/xhci.h>
+#include <mem/pow2.h>
 #include <arch/i386.h>
 #include <util/printf.h>
 #include <kernel.h>
+#include "sched/sched.h"
 
 #define DEBUG_USB
 
@@ -29,6 +33,33 @@
 #define DLOG(fmt,...) ;
 #endif
 
+/* Find the descriptor of endpoint number endp in direction dir among
+ * the configurations read during enumeration. */
+static USB_EPT_DESC *
+usb_find_endpoint (USB_DEVICE_INFO *dev, uint8_t endp, uint8_t dir)
+{
+  USB_CFG_DESC *cfgd;
+  USB_EPT_DESC *ept;
+  uint8 *ptr = dev->raw, *end;
+  uint c;
+
+  if (ptr == NULL)
+    return NULL;
+  for (c=0; c<(dev->devd).bNumConfigurations; c++) {
+    cfgd = (USB_CFG_DESC *) ptr;
+    end = ptr + cfgd->wTotalLength;
+    for (ptr += cfgd->bLength; ptr < end && ptr[0] != 0; ptr += ptr[0]) {
+      ept = (USB_EPT_DESC *) ptr;
+      if (ept->bDescriptorType == USB_TYPE_EPT_DESC &&
+          (ept->bEndpointAddress & 0xF) == endp &&
+          ((ept->bEndpointAddress & 0x80) ? DIR_IN : DIR_OUT) == dir)
+        return ept;
+    }
+    ptr = end;
+  }
+  return NULL;
+}
+
 int
 usb_control_transfer(
     USB_DEVICE_INFO * dev,
@@ -49,8 +80,22 @@ usb_control_transfer(
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_control_transfer(dev->address, setup_req,
+            req_len, data, data_len, (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_control_transfer(dev->address, setup_req,
+            req_len, data, data_len, (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -68,11 +113,13 @@ usb_bulk_transfer(
     USB_DEVICE_INFO * dev,
     uint8_t endp,
     addr_t data,
-    uint16_t len,
-    uint8_t packet_len,
+    uint32_t len,
+    uint16_t packet_len,
     uint8_t dir,
     uint32_t *act_len)
 {
+  USB_EPT_DESC *ept;
+
   switch (dev->host_type)
   {
     case USB_TYPE_HC_UHCI :
@@ -85,8 +132,35 @@ usb_bulk_transfer(
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        /* the endpoint descriptor knows the real packet size, and
+         * whether the endpoint belongs in the periodic schedule */
+        ept = usb_find_endpoint (dev, endp, dir);
+        if (ept)
+          packet_len = ept->wMaxPacketSize & 0x7FF;
+        if (ept && (ept->bmAttributes & 0x3) == 0x3)
+          return ehci_interrupt_transfer(dev->address, endp, data,
+                                         len, packet_len, dir, act_len);
+        return ehci_bulk_transfer(dev->address, endp, data,
+                                  len, packet_len, dir, act_len);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        /* the controller configures endpoints from their descriptors */
+        ept = usb_find_endpoint (dev, endp, dir);
+        if (ept == NULL) {
+          DLOG("No descriptor for endpoint %d", endp);
+          return -1;
+        }
+        return xhci_bulk_transfer(dev->address, ept, data, len, act_len);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -120,8 +194,22 @@ usb_get_descriptor (
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_get_descriptor(dev->address, dtype, dindex,
+            index, length, desc, (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_get_descriptor(dev->address, dtype, dindex,
+            index, length, desc, (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -149,8 +237,22 @@ usb_set_address (USB_DEVICE_INFO * dev, uint8_t new_addr)
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_set_address(dev->address, new_addr,
+            (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_set_address(dev->address, new_addr,
+            (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -178,8 +280,22 @@ usb_get_configuration(USB_DEVICE_INFO * dev)
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_get_configuration(dev->address,
+            (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_get_configuration(dev->address,
+            (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -207,8 +323,22 @@ usb_set_configuration(USB_DEVICE_INFO * dev, uint8_t conf)
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_set_configuration(dev->address, conf,
+            (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_set_configuration(dev->address, conf,
+            (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -236,8 +366,22 @@ usb_get_interface(USB_DEVICE_INFO * dev, uint16_t interface)
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_get_interface(dev->address, interface,
+            (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_get_interface(dev->address, interface,
+            (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -265,8 +409,22 @@ usb_set_interface(USB_DEVICE_INFO * dev, uint16_t alt, uint16_t interface)
       }
 
     case USB_TYPE_HC_EHCI :
-      DLOG("EHCI Host Controller is not supported now!");
-      return -1;
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return ehci_set_interface(dev->address, alt, interface,
+            (dev->devd).bMaxPacketSize0);
+      }
+
+    case USB_TYPE_HC_XHCI :
+      if ((dev->devd).bMaxPacketSize0 == 0) {
+        DLOG("USB_DEVICE_INFO is probably not initialized!");
+        return -1;
+      } else {
+        return xhci_set_interface(dev->address, alt, interface,
+            (dev->devd).bMaxPacketSize0);
+      }
 
     case USB_TYPE_HC_OHCI :
       DLOG("OHCI Host Controller is not supported now!");
@@ -279,6 +437,249 @@ usb_set_interface(USB_DEVICE_INFO * dev, uint16_t alt, uint16_t interface)
   return -1;
 }
 
+#define USB_MAX_DEVICES 32
+static USB_DEVICE_INFO devinfo[USB_MAX_DEVICES+1];
+static uint next_address = 1;
+
+#define USB_MAX_DEVICE_DRIVERS 32
+static USB_DRIVER drivers[USB_MAX_DEVICE_DRIVERS];
+static uint num_drivers = 0;
+
+void
+find_device_driver (USB_DEVICE_INFO *info, USB_CFG_DESC *cfgd, USB_IF_DESC *ifd)
+{
+  int d;
+  for (d=0; d<num_drivers; d++) {
+    if (drivers[d].probe (info, cfgd, ifd))
+      return;
+  }
+}
+
+void
+dlog_devd (USB_DEV_DESC *devd)
+{
+  DLOG ("DEVICE DESCRIPTOR len=%d type=%d bcdUSB=0x%x",
+        devd->bLength, devd->bDescriptorType, devd->bcdUSB);
+  DLOG ("  class=0x%x subclass=0x%x proto=0x%x maxpkt0=%d",
+        devd->bDeviceClass, devd->bDeviceSubClass, devd->bDeviceProtocol,
+        devd->bMaxPacketSize0);
+  DLOG ("  vendor=0x%x product=0x%x bcdDevice=0x%x numcfgs=%d",
+        devd->idVendor, devd->idProduct, devd->bcdDevice,
+        devd->bNumConfigurations);
+}
+
+void
+dlog_info (USB_DEVICE_INFO *info)
+{
+  DLOG ("ADDRESS %d", info->address);
+  dlog_devd (&info->devd);
+
+#if 0
+  uint8 strbuf[64];
+  uint8 str[32];
+#define do_str(slot,label)                                              \
+  if (info->devd.slot != 0 &&                                           \
+      uhci_get_string (info->address, info->devd.slot, 0,               \
+                       sizeof (strbuf), strbuf,                         \
+                       info->devd.bMaxPacketSize0)                      \
+      == 0) {                                                           \
+    memset (str, 0, sizeof (str));                                      \
+    if (uhci_interp_string ((USB_STR_DESC *)strbuf, sizeof (strbuf), 0, \
+                            str, sizeof (str)-1) > 0) {                 \
+      DLOG ("  "label": %s", str);                                      \
+    }                                                                   \
+  }
+
+  do_str (iManufacturer, "Manufacturer");
+  do_str (iProduct, "Product");
+#undef do_str
+#endif
+}
+
+/* figures out what device is attached as address 0 on a root port or
+ * hub port of the given host controller */
+bool
+usb_enumerate (uint8 host_type)
+{
+  USB_DEV_DESC devd;
+  USB_CFG_DESC *cfgd;
+  USB_IF_DESC *ifd;
+#define TEMPSZ 256
+  uint8 temp[TEMPSZ], *ptr;
+  uint curdev = next_address;
+  sint status, c, i, total_length=0;
+  USB_DEVICE_INFO *info;
+
+  if (curdev > USB_MAX_DEVICES) {
+    DLOG ("usb_enumerate: too many devices");
+    return FALSE;
+  }
+
+  DLOG ("usb_enumerate: curdev=%d", curdev);
+
+  /* clear device info */
+  info = &devinfo[curdev];
+  memset (info, 0, sizeof (USB_DEVICE_INFO));
+  info->address = 0;
+  info->host_type = host_type;
+
+  /* OK, here is the deal. The spec says you should use the maximum
+   * packet size in the data phase of control transfer if the data
+   * is larger than one packet. Since we do not want to support low
+   * speed device for now, the bMaxPacketSize0 is always set to 64
+   * bytes for full speed device. So, do not be surprised if your USB
+   * mouse does not work in Quest!
+   */
+  info->devd.bMaxPacketSize0 = 64;
+
+  memset (&devd, 0, sizeof (USB_DEV_DESC));
+
+  /* get device descriptor */
+  status = usb_get_descriptor (info, USB_TYPE_DEV_DESC, 0, 0,
+                               sizeof (USB_DEV_DESC), &devd);
+  if (status != 0)
+    goto abort;
+
+  if (devd.bMaxPacketSize0 == 8) {
+    /* get device descriptor */
+    info->devd.bMaxPacketSize0 = 8;
+    status = usb_get_descriptor (info, USB_TYPE_DEV_DESC, 0, 0,
+                                 sizeof (USB_DEV_DESC), &devd);
+    if (status != 0)
+      goto abort;
+  }
+
+  if (devd.bNumConfigurations == 255)
+    devd.bNumConfigurations = 1; /* hack */
+
+  /* Update device info structure. Put it in USB core might be better */
+  memcpy (&info->devd, &devd, sizeof (USB_DEV_DESC));
+
+  /* assign an address */
+  if (usb_set_address (info, curdev) != 0)
+    goto abort;
+  DLOG ("usb_enumerate: set (0x%x, 0x%x, 0x%x) to addr %d",
+        devd.bDeviceClass, devd.idVendor, devd.idProduct, curdev);
+  delay (2);
+
+  DLOG ("usb_enumerate: num configs=%d", devd.bNumConfigurations);
+
+  /* Update device info structure for new address. */
+  info->address = curdev;
+
+  dlog_info (info);
+
+  for (c=0; c<devd.bNumConfigurations; c++) {
+    /* get a config descriptor for size field */
+    memset (temp, 0, TEMPSZ);
+    status = usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0,
+                                 sizeof (USB_CFG_DESC), temp);
+    if (status != 0) {
+      DLOG ("usb_enumerate: failed to get config descriptor for c=%d", c);
+      goto abort;
+    }
+
+    cfgd = (USB_CFG_DESC *)temp;
+    DLOG ("usb_enumerate: c=%d cfgd->wTotalLength=%d", c, cfgd->wTotalLength);
+    total_length += cfgd->wTotalLength;
+  }
+
+  DLOG ("usb_enumerate: total_length=%d", total_length);
+
+  /* allocate memory to hold everything */
+  pow2_alloc (total_length, &info->raw);
+  if (!info->raw) {
+    DLOG ("usb_enumerate: pow2_alloc (%d) failed", total_length);
+    goto abort;
+  }
+
+  /* read all cfg, if, and endpoint descriptors */
+  ptr = info->raw;
+  for (c=0; c<devd.bNumConfigurations; c++) {
+    /* obtain precise size info */
+    memset (temp, 0, TEMPSZ);
+    status = usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0,
+                                 sizeof (USB_CFG_DESC), temp);
+    if (status != 0) {
+      DLOG ("usb_enumerate: failed to get config descriptor for c=%d", c);
+      goto abort_mem;
+    }
+    cfgd = (USB_CFG_DESC *)temp;
+
+    /* get cfg, if, and endp descriptors */
+    status =
+      usb_get_descriptor (info, USB_TYPE_CFG_DESC, c, 0, cfgd->wTotalLength, ptr);
+    if (status != 0)
+      goto abort_mem;
+
+    cfgd = (USB_CFG_DESC *)ptr;
+    DLOG ("usb_enumerate: cfg %d has num_if=%d", c, cfgd->bNumInterfaces);
+    ptr += cfgd->wTotalLength;
+  }
+
+  /* incr this here because hub drivers may recursively invoke enumerate */
+  next_address++;
+
+  /* parse cfg and if descriptors */
+  ptr = info->raw;
+  for (c=0; c<devd.bNumConfigurations; c++) {
+    cfgd = (USB_CFG_DESC *) ptr;
+    ptr += cfgd->bLength;
+    for (i=0; i<cfgd->bNumInterfaces; i++) {
+      /* find the next if descriptor, skipping any class-specific stuff */
+      for (ifd = (USB_IF_DESC *) ptr;
+           ifd->bDescriptorType != USB_TYPE_IF_DESC;
+           ifd = (USB_IF_DESC *)((uint8 *)ifd + ifd->bLength)) {
+        //DLOG ("ifd=%p len=%d type=0x%x", ifd, ifd->bLength, ifd->bDescriptorType);
+      }
+      ptr = (uint8 *) ifd;
+      DLOG ("usb_enumerate: examining (%d, %d) if_class=0x%X sub=0x%X proto=0x%X #endp=%d",
+            c, i, ifd->bInterfaceClass,
+            ifd->bInterfaceSubClass,
+            ifd->bInterfaceProtocol,
+            ifd->bNumEndpoints);
+
+      /* find a device driver interested in this interface */
+      find_device_driver (info, cfgd, ifd);
+
+      ptr += ifd->bLength;
+    }
+    ptr = ((uint8 *)cfgd) + cfgd->wTotalLength;
+  }
+
+  /* --??-- what happens if more than one driver matches more than one config? */
+
+  return TRUE;
+
+ abort_mem:
+  pow2_free (info->raw);
+ abort:
+  return FALSE;
+}
+
+bool
+usb_register_driver (USB_DRIVER *driver)
+{
+  if (num_drivers >= USB_MAX_DEVICE_DRIVERS) return FALSE;
+  memcpy (&drivers[num_drivers], driver, sizeof (USB_DRIVER));
+  num_drivers++;
+  return TRUE;
+}
+
+/* Enumerate the devices on every host controller.  EHCI goes before
+ * UHCI: it hands full- and low-speed devices over to its companion
+ * UHCI controllers, which find them on their own ports afterwards. */
+bool
+usb_do_enumeration (void)
+{
+  extern bool ehci_do_enumeration (void), uhci_do_enumeration (void);
+  bool found = FALSE;
+  found |= xhci_do_enumeration ();
+  found |= ehci_do_enumeration ();
+  found |= uhci_do_enumeration ();
+  return found;
+}
+
 bool
 usb_init (void)
 {
@@ -0,0 +1,1228 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* xHCI (USB 3) host controller driver.
+ *
+ * Devices on the root ports are given a slot with Enable Slot and put
+ * in the Default state with Address Device (BSR=1), so the generic
+ * enumeration in usb.c can talk to "address 0"; its SET_ADDRESS
+ * becomes a second Address Device, and the controller picks the bus
+ * address.  USB addresses handed out by usb.c are mapped to slots.
+ * Bulk and interrupt endpoints are added to the slot with Configure
+ * Endpoint the first time they are used, each with its own one-page
+ * transfer ring.  A transfer is one TD of scatter-gather TRBs, one
+ * per physically contiguous run of the buffer; the submitter sleeps
+ * until the event ring reports it finished. */
+
+#include <smp/apic.h>
+#include <drivers/pci/pci.h>
+#include <drivers/usb/usb.h>
+#include <drivers/usb/xhci.h>
+#include <util/printf.h>
+#include <mem/physical.h>
+#include <mem/virtual.h>
+#include <kernel.h>
+#include "sched/sched.h"
+
+#define DEBUG_XHCI
+//#define DEBUG_XHCI_VERBOSE
+
+#ifdef DEBUG_XHCI
+#define DLOG(fmt,...) DLOG_PREFIX("XHCI",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#ifdef DEBUG_XHCI_VERBOSE
+#define DLOGV(fmt,...) DLOG_PREFIX("XHCI",fmt,##__VA_ARGS__)
+#else
+#define DLOGV(fmt,...) ;
+#endif
+
+#define XHCI_MMIO_PAGES 16
+
+static uint32 xhci_irq_handler (uint8 vec);
+static void xhci_process_events (void);
+
+static volatile uint8 *cap_regs, *op_regs, *rt_regs;
+static volatile uint32 *db_regs;
+static uint mmio_pages;
+static uint max_slots, num_ports, ctx_size;
+static bool xhci_operational = FALSE;
+static bool xhci_irq = FALSE;   /* events are signalled by IRQ */
+
+static uint64 dcbaa[256] ALIGNED(0x1000);
+static uint64 scratchpads[XHCI_MAX_SCRATCHPADS] ALIGNED(0x1000);
+static XHCI_TRB cmd_trbs[XHCI_RING_TRBS] ALIGNED(0x1000);
+static XHCI_TRB event_trbs[XHCI_RING_TRBS] ALIGNED(0x1000);
+static XHCI_ERST erst ALIGNED(0x40);
+static uint8 input_ctx[0x1000] ALIGNED(0x1000);
+static uint8 dev_ctx[XHCI_MAX_SLOTS][0x800] ALIGNED(0x1000);
+static uint32 input_phys, event_phys;
+static uint event_deq;
+static uint32 event_cycle;
+
+static XHCI_RING cmd_ring;
+static XHCI_RING rings[XHCI_MAX_RINGS];
+
+typedef struct {
+  bool used;
+  uint8 speed, port, address;
+  uint16 maxpkt0;
+  XHCI_RING *ep[32];            /* by device context index */
+} xhci_slot_t;
+
+static xhci_slot_t slots[XHCI_MAX_SLOTS+1];
+static uint8 slot_of_addr[128];
+static uint pending_slot = 0;   /* device at "address 0" */
+
+static task_id xhci_waitq = 0;  /* Tasks waiting for IRQ */
+
+static inline uint32
+xhci_read (volatile uint8 *base, uint reg)
+{
+  return *((volatile uint32 *) (base + reg));
+}
+
+static inline void
+xhci_write (volatile uint8 *base, uint reg, uint32 v)
+{
+  *((volatile uint32 *) (base + reg)) = v;
+}
+
+static inline void
+xhci_write64 (volatile uint8 *base, uint reg, uint32 v)
+{
+  xhci_write (base, reg, v);
+  xhci_write (base, reg + 4, 0);
+}
+
+/* Device context index of an endpoint address */
+static inline uint
+xhci_dci (uint8 ept_addr)
+{
+  return ((ept_addr & 0xF) << 1) + ((ept_addr & 0x80) ? 1 : 0);
+}
+
+static inline uint32 *
+xhci_ctx (uint8 *ctx, uint index)
+{
+  return (uint32 *) (ctx + index * ctx_size);
+}
+
+/* ************************************************** */
+
+static void
+xhci_ring_init (XHCI_RING *r, XHCI_TRB *trbs, uint32 phys)
+{
+  XHCI_TRB *link = &trbs[XHCI_RING_TRBS - 1];
+
+  memset (r, 0, sizeof (XHCI_RING));
+  memset (trbs, 0, XHCI_RING_TRBS * sizeof (XHCI_TRB));
+  r->trbs = trbs;
+  r->phys = phys;
+  r->cycle = 1;
+  link->param_lo = phys;
+  link->control = TRB_TYPE (TRB_LINK) | TRB_TC;
+}
+
+static XHCI_RING *
+xhci_ring_alloc (void)
+{
+  uint i;
+  uint32 phys;
+  XHCI_TRB *trbs;
+
+  for (i = 0; i < XHCI_MAX_RINGS; i++) {
+    if (rings[i].trbs == NULL) {
+      phys = alloc_phys_frame ();
+      if (phys == -1)
+        return NULL;
+      trbs = map_virtual_page (phys | 3);
+      if (trbs == NULL) {
+        free_phys_frame (phys);
+        return NULL;
+      }
+      xhci_ring_init (&rings[i], trbs, phys);
+      return &rings[i];
+    }
+  }
+  DLOG ("Error! Not enough transfer rings!");
+  return NULL;
+}
+
+static void
+xhci_ring_free (XHCI_RING *r)
+{
+  unmap_virtual_page (r->trbs);
+  free_phys_frame (r->phys);
+  r->trbs = NULL;
+}
+
+/* Dequeue pointer that resumes the ring at its enqueue position */
+static inline uint32
+xhci_ring_deq (XHCI_RING *r)
+{
+  return (r->phys + (r->enq << 4)) | r->cycle;
+}
+
+/* Write one TRB at the enqueue pointer and return its physical
+ * address.  A held TRB gets the wrong cycle bit, so the controller
+ * stops there until xhci_td_ring flips it. */
+static uint32
+xhci_ring_put (XHCI_RING *r, uint32 lo, uint32 hi, uint32 status,
+               uint32 control, bool hold)
+{
+  XHCI_TRB *t = &r->trbs[r->enq];
+  uint32 phys = r->phys + (r->enq << 4);
+
+  t->param_lo = lo;
+  t->param_hi = hi;
+  t->status = status;
+  t->control = control | (hold ? r->cycle ^ 1 : r->cycle);
+
+  if (++r->enq == XHCI_RING_TRBS - 1) {
+    /* a TD that continues past the end is chained through the link */
+    r->trbs[r->enq].control = TRB_TYPE (TRB_LINK) | TRB_TC |
+      (control & TRB_CH) | r->cycle;
+    r->enq = 0;
+    r->cycle ^= 1;
+  }
+  return phys;
+}
+
+static void
+xhci_td_begin (XHCI_RING *r, bool control)
+{
+  r->done = r->short_pkt = FALSE;
+  r->control = control;
+  r->cc = XHCI_CC_SUCCESS;
+  r->act_len = 0;
+  r->ntrbs = 0;
+}
+
+static void
+xhci_td_add (XHCI_RING *r, uint32 phys, uint32 len)
+{
+  r->trb_phys[r->ntrbs] = phys;
+  r->trb_len[r->ntrbs] = len;
+  r->ntrbs++;
+}
+
+/* Release the first TRB of the TD and ring the doorbell */
+static void
+xhci_td_ring (XHCI_RING *r, uint slot_id, uint target)
+{
+  XHCI_TRB *first = &r->trbs[(r->trb_phys[0] - r->phys) >> 4];
+
+  first->control ^= TRB_CYCLE;
+  db_regs[slot_id] = target;
+}
+
+/* Queue len bytes at data as scatter-gather TRBs, one per physically
+ * contiguous run that does not cross a 64 KB boundary.  The first is
+ * of the given type, the rest are Normal TRBs chained to it.  Returns
+ * FALSE, having queued nothing, if the buffer is too fragmented. */
+static bool
+xhci_queue_data (XHCI_RING *r, uint8 *data, uint32 len, uint maxpkt,
+                 uint type, bool in, bool ioc, bool hold)
+{
+  uint32 seg_phys[XHCI_MAX_TD_TRBS], seg_len[XHCI_MAX_TD_TRBS];
+  uint32 left, phys, n, limit, packets;
+  uint nsegs = 0, i;
+  uint32 control;
+
+  for (left = len; left > 0 || nsegs == 0; left -= n) {
+    if (nsegs + r->ntrbs + 1 >= XHCI_MAX_TD_TRBS) {
+      DLOG ("buffer at %p too fragmented for one TD", data);
+      return FALSE;
+    }
+    if (left == 0) {
+      /* zero-length packet */
+      seg_phys[nsegs] = seg_len[nsegs] = 0;
+      nsegs++;
+      break;
+    }
+    phys = (uint32) get_phys_addr (data);
+    limit = 0x10000 - (phys & 0xFFFF);
+    if (limit > left)
+      limit = left;
+    n = 0x1000 - (phys & 0xFFF);
+    while (n < limit &&
+           (uint32) get_phys_addr (data + n) == phys + n)
+      n += 0x1000;
+    if (n > limit)
+      n = limit;
+    seg_phys[nsegs] = phys;
+    seg_len[nsegs] = n;
+    nsegs++;
+    data += n;
+  }
+
+  for (i = 0, left = len; i < nsegs; i++) {
+    left -= seg_len[i];
+    /* TD Size: packets still to come after this TRB */
+    packets = (left + maxpkt - 1) / maxpkt;
+    if (packets > 31)
+      packets = 31;
+    control = TRB_TYPE (i == 0 ? type : TRB_NORMAL) | TRB_ISP;
+    if (i == 0 && type == TRB_DATA && in)
+      control |= TRB_DIR_IN;
+    if (i < nsegs - 1)
+      control |= TRB_CH;
+    else if (ioc)
+      control |= TRB_IOC;
+    xhci_td_add (r, xhci_ring_put (r, seg_phys[i], 0,
+                                   TRB_LEN (seg_len[i]) |
+                                   TRB_TD_SIZE (packets),
+                                   control, hold && i == 0),
+                 seg_len[i]);
+  }
+  return TRUE;
+}
+
+static void
+xhci_wait (XHCI_RING *r)
+{
+  while (!r->done) {
+    /* wait for IRQ if interrupts enabled */
+    if (mp_enabled && xhci_irq) {
+      queue_append (&xhci_waitq, str ());
+      schedule ();
+    } else
+      xhci_process_events ();
+  }
+}
+
+static void
+xhci_acquire (XHCI_RING *r)
+{
+  while (r->busy) {
+    if (mp_enabled) {
+      queue_append (&xhci_waitq, str ());
+      schedule ();
+    }
+  }
+  r->busy = TRUE;
+}
+
+static void
+xhci_release (XHCI_RING *r)
+{
+  r->busy = FALSE;
+  wakeup_queue (&xhci_waitq);
+}
+
+/* ************************************************** */
+
+/* Issue a command and wait for its completion, with the command ring
+ * already held.  Returns 0, or the completion code. */
+static int
+_xhci_command (uint32 lo, uint32 control, uint *slot_id)
+{
+  int status;
+
+  xhci_td_begin (&cmd_ring, FALSE);
+  xhci_td_add (&cmd_ring, xhci_ring_put (&cmd_ring, lo, 0, 0, control, TRUE),
+               0);
+  xhci_td_ring (&cmd_ring, 0, 0);
+  xhci_wait (&cmd_ring);
+
+  status = (cmd_ring.cc == XHCI_CC_SUCCESS ? 0 : cmd_ring.cc);
+  if (status != 0)
+    DLOG ("command type %d failed: cc=%d", TRB_GET_TYPE (control), status);
+  if (slot_id)
+    *slot_id = cmd_ring.act_len;
+  return status;
+}
+
+static int
+xhci_command (uint32 lo, uint32 control, uint *slot_id)
+{
+  int status;
+
+  xhci_acquire (&cmd_ring);
+  status = _xhci_command (lo, control, slot_id);
+  xhci_release (&cmd_ring);
+  return status;
+}
+
+/* The commands below pass input_ctx, which there is one of: whoever
+ * holds the command ring owns it, so fill it only after taking the
+ * ring. */
+
+static int
+xhci_address_device (uint slot_id, bool bsr)
+{
+  xhci_slot_t *s = &slots[slot_id];
+  uint32 *ctx;
+  int status;
+
+  xhci_acquire (&cmd_ring);
+  memset (input_ctx, 0, sizeof (input_ctx));
+  xhci_ctx (input_ctx, 0)[1] = 0x3;     /* add slot and EP0 */
+  ctx = xhci_ctx (input_ctx, 1);
+  ctx[0] = SLOT_CTX_SPEED (s->speed) | SLOT_CTX_ENTRIES (1);
+  ctx[1] = SLOT_CTX_PORT (s->port + 1);
+  ctx = xhci_ctx (input_ctx, 2);
+  ctx[1] = EP_CTX_CERR (3) | EP_CTX_TYPE (EP_TYPE_CONTROL) |
+    EP_CTX_MAXPKT (s->maxpkt0);
+  ctx[2] = xhci_ring_deq (s->ep[1]);
+  ctx[4] = EP_CTX_AVG_TRB (8);
+
+  status = _xhci_command (input_phys, TRB_TYPE (TRB_ADDRESS_DEV) |
+                          TRB_SLOT (slot_id) | (bsr ? TRB_BSR : 0), NULL);
+  xhci_release (&cmd_ring);
+  return status;
+}
+
+/* Only full-speed devices have a default pipe packet size that must
+ * be discovered; tell the controller once it is known. */
+static void
+xhci_update_maxpkt0 (uint slot_id, uint maxpkt)
+{
+  xhci_slot_t *s = &slots[slot_id];
+  uint32 *ctx;
+
+  if (s->speed != XHCI_SPEED_FULL || maxpkt == s->maxpkt0)
+    return;
+  xhci_acquire (&cmd_ring);
+  memset (input_ctx, 0, sizeof (input_ctx));
+  xhci_ctx (input_ctx, 0)[1] = 0x2;
+  ctx = xhci_ctx (input_ctx, 2);
+  ctx[1] = EP_CTX_CERR (3) | EP_CTX_TYPE (EP_TYPE_CONTROL) |
+    EP_CTX_MAXPKT (maxpkt);
+  if (_xhci_command (input_phys, TRB_TYPE (TRB_EVAL_CTX) | TRB_SLOT (slot_id),
+                     NULL) == 0)
+    s->maxpkt0 = maxpkt;
+  xhci_release (&cmd_ring);
+}
+
+/* Add a bulk or interrupt endpoint to a slot, with a new ring */
+static XHCI_RING *
+xhci_add_endpoint (uint slot_id, USB_EPT_DESC *ept)
+{
+  xhci_slot_t *s = &slots[slot_id];
+  uint dci = xhci_dci (ept->bEndpointAddress);
+  uint type = ept->bmAttributes & 0x3;
+  uint maxpkt = ept->wMaxPacketSize & 0x7FF, burst = 0, interval = 0;
+  bool in = (ept->bEndpointAddress & 0x80) != 0;
+  uint8 *comp = (uint8 *) ept + ept->bLength;
+  uint32 *ctx;
+  XHCI_RING *r;
+  int status;
+
+  if (type != 0x2 && type != 0x3) {
+    DLOG ("endpoint 0x%x: unsupported type %d", ept->bEndpointAddress, type);
+    return NULL;
+  }
+
+  if (s->speed == XHCI_SPEED_SUPER && comp[1] == 0x30)
+    burst = comp[2];            /* SuperSpeed endpoint companion */
+  else if (s->speed == XHCI_SPEED_HIGH && type == 0x3)
+    burst = (ept->wMaxPacketSize >> 11) & 0x3;
+
+  if (type == 0x3) {
+    if (s->speed == XHCI_SPEED_HIGH || s->speed == XHCI_SPEED_SUPER)
+      interval = (ept->bInterval ? ept->bInterval - 1 : 0);
+    else
+      /* frames to a power of two in microframes */
+      for (interval = 3;
+           interval < 10 && (1 << (interval + 1)) <= ept->bInterval * 8;
+           interval++);
+  }
+
+  r = xhci_ring_alloc ();
+  if (r == NULL)
+    return NULL;
+
+  xhci_acquire (&cmd_ring);
+  memset (input_ctx, 0, sizeof (input_ctx));
+  xhci_ctx (input_ctx, 0)[1] = 0x1 | (1 << dci);
+  ctx = xhci_ctx (input_ctx, 1);
+  memcpy (ctx, xhci_ctx (dev_ctx[slot_id - 1], 0), ctx_size);
+  if ((ctx[0] >> 27) < dci)
+    ctx[0] = (ctx[0] & ~SLOT_CTX_ENTRIES (0x1F)) | SLOT_CTX_ENTRIES (dci);
+  ctx[3] = 0;
+  ctx = xhci_ctx (input_ctx, 1 + dci);
+  ctx[0] = EP_CTX_INTERVAL (interval);
+  ctx[1] = EP_CTX_CERR (3) | EP_CTX_BURST (burst) | EP_CTX_MAXPKT (maxpkt) |
+    EP_CTX_TYPE (type == 0x2 ? (in ? EP_TYPE_BULK_IN : EP_TYPE_BULK_OUT)
+                 : (in ? EP_TYPE_INTR_IN : EP_TYPE_INTR_OUT));
+  ctx[2] = xhci_ring_deq (r);
+  if (type == 0x3)
+    ctx[4] = EP_CTX_AVG_TRB (maxpkt) | EP_CTX_MAX_ESIT (maxpkt * (burst + 1));
+  else
+    ctx[4] = EP_CTX_AVG_TRB (0xC00);
+
+  status = _xhci_command (input_phys,
+                          TRB_TYPE (TRB_CONFIG_EP) | TRB_SLOT (slot_id), NULL);
+  xhci_release (&cmd_ring);
+  if (status != 0) {
+    xhci_ring_free (r);
+    return NULL;
+  }
+  DLOGV ("slot %d: added endpoint 0x%x dci=%d maxpkt=%d burst=%d",
+         slot_id, ept->bEndpointAddress, dci, maxpkt, burst);
+  s->ep[dci] = r;
+  return r;
+}
+
+/* A configuration or interface change invalidates the endpoints;
+ * they are added again as they are used. */
+static void
+xhci_drop_endpoints (uint slot_id)
+{
+  xhci_slot_t *s = &slots[slot_id];
+  uint dci;
+  bool any = FALSE;
+
+  for (dci = 2; dci < 32; dci++)
+    if (s->ep[dci]) any = TRUE;
+  if (!any)
+    return;
+
+  xhci_command (0, TRB_TYPE (TRB_CONFIG_EP) | TRB_SLOT (slot_id) | TRB_DC,
+                NULL);
+  for (dci = 2; dci < 32; dci++) {
+    if (s->ep[dci]) {
+      xhci_ring_free (s->ep[dci]);
+      s->ep[dci] = NULL;
+    }
+  }
+}
+
+/* Clear a halted endpoint and skip whatever is left of the failed TD */
+static void
+xhci_reset_endpoint (uint slot_id, uint dci, XHCI_RING *r)
+{
+  xhci_command (0, TRB_TYPE (TRB_RESET_EP) | TRB_SLOT (slot_id) |
+                TRB_EP (dci), NULL);
+  xhci_command (xhci_ring_deq (r), TRB_TYPE (TRB_SET_DEQ) |
+                TRB_SLOT (slot_id) | TRB_EP (dci), NULL);
+}
+
+static int
+xhci_td_finish (XHCI_RING *r, uint slot_id, uint dci, uint32 *act_len)
+{
+  int status = 0;
+
+  if (r->cc != XHCI_CC_SUCCESS) {
+    status = r->cc;
+    DLOG ("transfer failed: slot=%d dci=%d cc=%d", slot_id, dci, status);
+    xhci_reset_endpoint (slot_id, dci, r);
+  }
+  if (act_len)
+    *act_len = r->act_len;
+  xhci_release (r);
+  return status;
+}
+
+/* ************************************************** */
+
+static void
+xhci_transfer_event (XHCI_TRB *ev)
+{
+  uint slot_id = TRB_GET_SLOT (ev->control), dci = TRB_GET_EP (ev->control);
+  uint32 cc = TRB_GET_CC (ev->status), residual = TRB_GET_LEN (ev->status);
+  uint32 len = 0;
+  XHCI_RING *r;
+  uint i;
+
+  if (slot_id == 0 || slot_id > XHCI_MAX_SLOTS)
+    return;
+  r = slots[slot_id].ep[dci];
+  if (r == NULL || !r->busy || r->done)
+    return;
+
+  /* find the TRB within the TD in flight */
+  for (i = 0; i < r->ntrbs; i++) {
+    if (r->trb_phys[i] == ev->param_lo)
+      break;
+    len += r->trb_len[i];
+  }
+  if (i == r->ntrbs)
+    return;
+
+  if (cc == XHCI_CC_SHORT) {
+    r->act_len = len + r->trb_len[i] - residual;
+    r->short_pkt = TRUE;
+    /* a control transfer goes on with its status stage */
+    if (!r->control || i == r->ntrbs - 1)
+      r->done = TRUE;
+  } else if (cc == XHCI_CC_SUCCESS) {
+    if (i == r->ntrbs - 1) {
+      if (!r->short_pkt)
+        r->act_len = len + r->trb_len[i] - residual;
+      r->done = TRUE;
+    }
+  } else {
+    r->cc = cc;
+    r->done = TRUE;
+  }
+}
+
+static void
+xhci_process_events (void)
+{
+  XHCI_TRB *ev;
+  bool any = FALSE;
+
+  for (;;) {
+    ev = &event_trbs[event_deq];
+    if ((ev->control & TRB_CYCLE) != event_cycle)
+      break;
+
+    switch (TRB_GET_TYPE (ev->control)) {
+    case TRB_COMMAND_EV:
+      if (cmd_ring.busy && !cmd_ring.done &&
+          ev->param_lo == cmd_ring.trb_phys[0]) {
+        cmd_ring.cc = TRB_GET_CC (ev->status);
+        cmd_ring.act_len = TRB_GET_SLOT (ev->control);
+        cmd_ring.done = TRUE;
+      }
+      break;
+    case TRB_TRANSFER_EV:
+      xhci_transfer_event (ev);
+      break;
+    case TRB_PORT_EV:
+      DLOGV ("port %d status change", ev->param_lo >> 24);
+      break;
+    default:
+      break;
+    }
+
+    any = TRUE;
+    if (++event_deq == XHCI_RING_TRBS) {
+      event_deq = 0;
+      event_cycle ^= 1;
+    }
+  }
+
+  if (any)
+    xhci_write64 (rt_regs, XHCI_ERDP (0),
+                  (event_phys + (event_deq << 4)) | XHCI_ERDP_EHB);
+}
+
+static uint32
+xhci_irq_handler (uint8 vec)
+{
+  uint32 status;
+
+  lock_kernel ();
+
+  status = xhci_read (op_regs, XHCI_USBSTS);
+  /* Clear the interrupts by writing 1s to them */
+  xhci_write (op_regs, XHCI_USBSTS,
+              status & (XHCI_STS_HSE | XHCI_STS_EINT | XHCI_STS_PCD));
+  xhci_write (rt_regs, XHCI_IMAN (0), XHCI_IMAN_IP | XHCI_IMAN_IE);
+
+  if (status & XHCI_STS_HSE)
+    DLOG ("Host System Error detected!");
+
+  xhci_process_events ();
+
+  /* wake-up any waiting threads */
+  wakeup_queue (&xhci_waitq);
+
+  unlock_kernel ();
+  return 0;
+}
+
+/* ************************************************** */
+
+static uint
+xhci_slot_of (uint8_t address)
+{
+  if (address == 0)
+    return pending_slot;
+  return (address < 128 ? slot_of_addr[address] : 0);
+}
+
+int
+xhci_control_transfer (
+    uint8_t address,
+    addr_t setup_req,    /* Use virtual address here */
+    int setup_len,
+    addr_t setup_data,   /* Use virtual address here */
+    int data_len,
+    int packet_len)
+{
+  uint slot_id = xhci_slot_of (address);
+  uint32 lo, hi, act_len;
+  bool in;
+  XHCI_RING *r;
+
+  if (slot_id == 0 || (r = slots[slot_id].ep[1]) == NULL)
+    return -1;
+
+  xhci_update_maxpkt0 (slot_id, packet_len);
+
+  memcpy (&lo, setup_req, 4);
+  memcpy (&hi, (uint8 *) setup_req + 4, 4);
+  in = (*((uint8 *) setup_req) & 0x80) != 0;
+
+  xhci_acquire (r);
+  xhci_td_begin (r, TRUE);
+
+  /* Setup stage, with the request as immediate data */
+  xhci_td_add (r, xhci_ring_put (r, lo, hi, TRB_LEN (8),
+                                 TRB_TYPE (TRB_SETUP) | TRB_IDT |
+                                 TRB_TRT (data_len == 0 ? 0 : in ? 3 : 2),
+                                 TRUE), 0);
+
+  /* Data stage */
+  if (data_len > 0 &&
+      !xhci_queue_data (r, setup_data, data_len, slots[slot_id].maxpkt0,
+                        TRB_DATA, in, FALSE, FALSE)) {
+    /* take back the held setup TRB */
+    uint first = (r->trb_phys[0] - r->phys) >> 4;
+    if (first > r->enq)
+      r->cycle ^= 1;
+    r->enq = first;
+    xhci_release (r);
+    return -1;
+  }
+
+  /* Status stage, in the opposite direction */
+  xhci_td_add (r, xhci_ring_put (r, 0, 0, 0,
+                                 TRB_TYPE (TRB_STATUS) | TRB_IOC |
+                                 ((data_len > 0 && in) ? 0 : TRB_DIR_IN),
+                                 FALSE), 0);
+
+  xhci_td_ring (r, slot_id, 1);
+  xhci_wait (r);
+
+  return xhci_td_finish (r, slot_id, 1, &act_len);
+}
+
+/* Bulk or interrupt transfer, as the endpoint descriptor says */
+int
+xhci_bulk_transfer (uint8_t address, USB_EPT_DESC *ept, addr_t data,
+                    uint32_t len, uint32_t *act_len)
+{
+  uint slot_id = xhci_slot_of (address);
+  uint dci = xhci_dci (ept->bEndpointAddress);
+  XHCI_RING *r;
+
+  DLOGV ("bulk: %d 0x%x %d", address, ept->bEndpointAddress, len);
+
+  if (slot_id == 0)
+    return -1;
+  r = slots[slot_id].ep[dci];
+  if (r == NULL && (r = xhci_add_endpoint (slot_id, ept)) == NULL)
+    return -1;
+
+  xhci_acquire (r);
+  xhci_td_begin (r, FALSE);
+  if (!xhci_queue_data (r, data, len, ept->wMaxPacketSize & 0x7FF,
+                        TRB_NORMAL, (ept->bEndpointAddress & 0x80) != 0,
+                        TRUE, TRUE)) {
+    xhci_release (r);
+    return -1;
+  }
+  xhci_td_ring (r, slot_id, dci);
+  xhci_wait (r);
+
+  return xhci_td_finish (r, slot_id, dci, act_len);
+}
+
+int
+xhci_get_descriptor (
+    uint8_t address,
+    uint16_t dtype,   /* Descriptor type */
+    uint16_t dindex,   /* Descriptor index */
+    uint16_t index,    /* Zero or Language ID */
+    uint16_t length,   /* Descriptor length */
+    addr_t desc,
+    uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x80;
+  setup_req.bRequest = USB_GET_DESCRIPTOR;
+  setup_req.wValue = (dtype << 8) + dindex;
+  setup_req.wIndex = index;
+  setup_req.wLength = length;
+
+  return xhci_control_transfer (address,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      desc, length, packet_size);
+}
+
+/* The controller sends SET_ADDRESS itself, choosing the bus address;
+ * new_addr only names the slot from now on. */
+int
+xhci_set_address (uint8_t old_addr, uint8_t new_addr, uint8_t packet_size)
+{
+  uint slot_id = xhci_slot_of (old_addr);
+  sint status;
+
+  if (slot_id == 0 || old_addr != 0 || new_addr == 0 || new_addr >= 128)
+    return -1;
+
+  xhci_update_maxpkt0 (slot_id, packet_size);
+  status = xhci_address_device (slot_id, FALSE);
+  if (status == 0) {
+    slot_of_addr[new_addr] = slot_id;
+    slots[slot_id].address = new_addr;
+    pending_slot = 0;
+  }
+  return status;
+}
+
+int
+xhci_get_configuration (uint8_t addr, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  uint8_t num = -1;
+  setup_req.bmRequestType = 0x80;
+  setup_req.bRequest = USB_GET_CONFIGURATION;
+  setup_req.wValue = 0;
+  setup_req.wIndex = 0;
+  setup_req.wLength = 1;
+
+  xhci_control_transfer (addr, (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      (addr_t) & num, 1, packet_size);
+
+  return num;
+}
+
+int
+xhci_set_configuration (uint8_t addr, uint8_t conf, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x0;
+  setup_req.bRequest = USB_SET_CONFIGURATION;
+  setup_req.wValue = conf;
+  setup_req.wIndex = 0;
+  setup_req.wLength = 0;
+
+  if (xhci_slot_of (addr))
+    xhci_drop_endpoints (xhci_slot_of (addr));
+
+  return xhci_control_transfer (addr,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ), 0,
+      0, packet_size);
+}
+
+int
+xhci_set_interface (uint8_t addr, uint16_t alt, uint16_t interface,
+    uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  setup_req.bmRequestType = 0x01;
+  setup_req.bRequest = USB_SET_INTERFACE;
+  setup_req.wValue = alt;
+  setup_req.wIndex = interface;
+  setup_req.wLength = 0;
+
+  if (xhci_slot_of (addr))
+    xhci_drop_endpoints (xhci_slot_of (addr));
+
+  return xhci_control_transfer (addr,
+      (addr_t) & setup_req, sizeof (USB_DEV_REQ), 0,
+      0, packet_size);
+}
+
+int
+xhci_get_interface (uint8_t addr, uint16_t interface, uint8_t packet_size)
+{
+  USB_DEV_REQ setup_req;
+  uint8_t alt = -1;
+  setup_req.bmRequestType = 0x81;
+  setup_req.bRequest = USB_GET_INTERFACE;
+  setup_req.wValue = 0;
+  setup_req.wIndex = interface;
+  setup_req.wLength = 1;
+
+  xhci_control_transfer (addr, (addr_t) & setup_req, sizeof (USB_DEV_REQ),
+      (addr_t) & alt, 1, packet_size);
+
+  return alt;
+}
+
+/* ************************************************** */
+
+/* Reset a root port if it has not enabled itself (USB 3 ports train
+ * their link on connect).  Returns TRUE with the port speed if a
+ * device is ready behind it. */
+static bool
+xhci_port_reset (uint port, uint *speed)
+{
+  uint32 sc = xhci_read (op_regs, XHCI_PORTSC (port));
+  uint i;
+
+  if (!(sc & XHCI_PORT_CCS))
+    return FALSE;
+
+  if (!(sc & XHCI_PORT_PED)) {
+    xhci_write (op_regs, XHCI_PORTSC (port),
+                (sc & XHCI_PORT_PRESERVE) | XHCI_PORT_PR);
+    for (i = 0; i < 100; i++) {
+      if (xhci_read (op_regs, XHCI_PORTSC (port)) & XHCI_PORT_PRC)
+        break;
+      tsc_delay_usec (1000);
+    }
+    delay (10);
+  }
+
+  /* acknowledge the status changes */
+  sc = xhci_read (op_regs, XHCI_PORTSC (port));
+  xhci_write (op_regs, XHCI_PORTSC (port),
+              (sc & XHCI_PORT_PRESERVE) | (sc & XHCI_PORT_CHANGES));
+
+  if (!(sc & XHCI_PORT_PED)) {
+    DLOG ("port %d: not enabled after reset (PORTSC=%p)", port, sc);
+    return FALSE;
+  }
+  *speed = XHCI_PORT_SPEED (sc);
+  return TRUE;
+}
+
+static void
+xhci_free_slot (uint slot_id)
+{
+  xhci_slot_t *s = &slots[slot_id];
+  uint dci;
+
+  xhci_command (0, TRB_TYPE (TRB_DISABLE_SLOT) | TRB_SLOT (slot_id), NULL);
+  for (dci = 1; dci < 32; dci++)
+    if (s->ep[dci])
+      xhci_ring_free (s->ep[dci]);
+  memset (s, 0, sizeof (xhci_slot_t));
+  dcbaa[slot_id] = 0;
+}
+
+static void
+xhci_enumerate_port (uint port, uint speed)
+{
+  uint slot_id;
+  xhci_slot_t *s;
+
+  if (xhci_command (0, TRB_TYPE (TRB_ENABLE_SLOT), &slot_id) != 0 ||
+      slot_id == 0 || slot_id > XHCI_MAX_SLOTS) {
+    DLOG ("port %d: no device slot", port);
+    return;
+  }
+
+  s = &slots[slot_id];
+  memset (s, 0, sizeof (xhci_slot_t));
+  s->used = TRUE;
+  s->speed = speed;
+  s->port = port;
+  s->maxpkt0 = (speed == XHCI_SPEED_SUPER ? 512 :
+                speed == XHCI_SPEED_LOW ? 8 : 64);
+  s->ep[1] = xhci_ring_alloc ();
+  if (s->ep[1] == NULL)
+    goto abort;
+
+  memset (dev_ctx[slot_id - 1], 0, sizeof (dev_ctx[0]));
+  dcbaa[slot_id] = (uint32) get_phys_addr (dev_ctx[slot_id - 1]);
+
+  if (xhci_address_device (slot_id, TRUE) != 0)
+    goto abort;
+
+  DLOG ("port %d: speed %d device in slot %d", port, speed, slot_id);
+  pending_slot = slot_id;
+  usb_enumerate (USB_TYPE_HC_XHCI);
+  if (pending_slot == slot_id) {
+    /* never got an address */
+    pending_slot = 0;
+    goto abort;
+  }
+  return;
+
+ abort:
+  xhci_free_slot (slot_id);
+}
+
+bool
+xhci_do_enumeration (void)
+{
+  uint i, speed;
+
+  if (!xhci_operational) return FALSE;
+  DLOG ("begin enumeration");
+
+  for (i = 0; i < num_ports; i++) {
+    if (xhci_port_reset (i, &speed))
+      xhci_enumerate_port (i, speed);
+  }
+  DLOG ("end enumeration");
+  return TRUE;
+}
+
+/* ************************************************** */
+
+/* Take the controller over from the BIOS through the USB legacy
+ * support capability, then turn off its SMIs. */
+static void
+xhci_bios_handoff (uint off)
+{
+  uint32 cap, timeout;
+
+  while (off && off + 8 <= (mmio_pages << 12)) {
+    cap = xhci_read (cap_regs, off);
+    if ((cap & 0xFF) == XHCI_XCAP_LEGACY) {
+      xhci_write (cap_regs, off, cap | XHCI_LEGACY_OS);
+      for (timeout = 0; timeout < 1000; timeout++) {
+        if (!(xhci_read (cap_regs, off) & XHCI_LEGACY_BIOS))
+          break;
+        tsc_delay_usec (1000);
+      }
+      if (timeout == 1000)
+        DLOG ("BIOS did not release the controller");
+      xhci_write (cap_regs, off + 4,
+                  (xhci_read (cap_regs, off + 4) & ~0x0001E011) | 0xE0000000);
+      return;
+    }
+    if (((cap >> 8) & 0xFF) == 0)
+      return;
+    off += ((cap >> 8) & 0xFF) << 2;
+  }
+}
+
+static bool
+xhci_reset (void)
+{
+  uint i;
+
+  xhci_write (op_regs, XHCI_USBCMD,
+              xhci_read (op_regs, XHCI_USBCMD) & ~XHCI_CMD_RS);
+  for (i = 0; i < 100; i++) {
+    if (xhci_read (op_regs, XHCI_USBSTS) & XHCI_STS_HCH)
+      break;
+    tsc_delay_usec (1000);
+  }
+
+  xhci_write (op_regs, XHCI_USBCMD, XHCI_CMD_HCRST);
+  for (i = 0; i < 1000; i++) {
+    if (!(xhci_read (op_regs, XHCI_USBCMD) & XHCI_CMD_HCRST) &&
+        !(xhci_read (op_regs, XHCI_USBSTS) & XHCI_STS_CNR))
+      return TRUE;
+    tsc_delay_usec (1000);
+  }
+  return FALSE;
+}
+
+/* The controller keeps its private state in scratchpad pages */
+static bool
+xhci_init_scratchpads (uint count)
+{
+  uint i;
+  uint32 phys;
+  void *page;
+
+  if (count > XHCI_MAX_SCRATCHPADS) {
+    DLOG ("%d scratchpad buffers requested", count);
+    return FALSE;
+  }
+  for (i = 0; i < count; i++) {
+    phys = alloc_phys_frame ();
+    if (phys == -1)
+      return FALSE;
+    page = map_virtual_page (phys | 3);
+    if (page == NULL) {
+      free_phys_frame (phys);
+      return FALSE;
+    }
+    memset (page, 0, 0x1000);
+    unmap_virtual_page (page);
+    scratchpads[i] = phys;
+  }
+  if (count)
+    dcbaa[0] = (uint32) get_phys_addr (scratchpads);
+  return TRUE;
+}
+
+bool
+xhci_init (void)
+{
+  uint i, device_index, irq_line, irq_pin, mem_addr, mask;
+  uint32 hcs1, hcs2, hcc1, rtsoff, dboff;
+  pci_device xhci_device;
+  pci_irq_t irq;
+
+  if (mp_ISA_PC) {
+    DLOG ("Cannot operate without PCI");
+    return FALSE;
+  }
+
+  /* Find the xHCI device on the PCI bus */
+  device_index = ~0;
+  i=0;
+  while (pci_find_device (0xFFFF, 0xFFFF, 0x0C, 0x03, i, &i)) {
+    if (pci_get_device (i, &xhci_device)) {
+      if (xhci_device.progIF == 0x30) {
+        device_index = i;
+        break;
+      }
+      i++;
+    } else break;
+  }
+
+  if (device_index == ~0) {
+    DLOG ("Unable to find compatible device on PCI bus");
+    return FALSE;
+  }
+
+  if (!pci_decode_bar (device_index, 0, &mem_addr, NULL, &mask) ||
+      mem_addr == 0) {
+    DLOG ("unable to decode BAR0");
+    return FALSE;
+  }
+
+  DLOG ("Using PCI bus=%x dev=%x func=%x BAR0=%p",
+        xhci_device.bus, xhci_device.slot, xhci_device.func, mem_addr);
+
+  /* enable memory mapped I/O and bus mastering */
+  pci_write_word (pci_addr (xhci_device.bus, xhci_device.slot,
+                            xhci_device.func, 0x04), 0x0006);
+
+  mmio_pages = ((~(mask & ~0xF)) + 1) >> 12;
+  if (mmio_pages == 0 || mmio_pages > XHCI_MMIO_PAGES)
+    mmio_pages = XHCI_MMIO_PAGES;
+  cap_regs = map_contiguous_virtual_pages (mem_addr | 3, mmio_pages);
+  if (cap_regs == NULL) {
+    DLOG ("Unable to map registers at phys=%p", mem_addr);
+    return FALSE;
+  }
+
+  hcs1 = xhci_read (cap_regs, XHCI_HCSPARAMS1);
+  hcs2 = xhci_read (cap_regs, XHCI_HCSPARAMS2);
+  hcc1 = xhci_read (cap_regs, XHCI_HCCPARAMS1);
+  rtsoff = xhci_read (cap_regs, XHCI_RTSOFF) & ~0x1F;
+  dboff = xhci_read (cap_regs, XHCI_DBOFF) & ~0x3;
+  max_slots = XHCI_HCS1_MAX_SLOTS (hcs1);
+  if (max_slots > XHCI_MAX_SLOTS)
+    max_slots = XHCI_MAX_SLOTS;
+  num_ports = XHCI_HCS1_MAX_PORTS (hcs1);
+  ctx_size = (hcc1 & XHCI_HCC1_CSZ) ? 64 : 32;
+  DLOG ("HCSPARAMS1=%p HCCPARAMS1=%p ports=%d slots=%d",
+        hcs1, hcc1, num_ports, max_slots);
+
+  if (rtsoff + XHCI_ERDP (0) + 8 > (mmio_pages << 12) ||
+      dboff + 4 * (max_slots + 1) > (mmio_pages << 12)) {
+    DLOG ("registers lie outside the mapped BAR");
+    goto abort;
+  }
+  op_regs = cap_regs + *cap_regs;
+  rt_regs = cap_regs + rtsoff;
+  db_regs = (volatile uint32 *) (cap_regs + dboff);
+
+  xhci_bios_handoff (XHCI_HCC1_XECP (hcc1));
+
+  if (!xhci_reset ()) {
+    DLOG ("Controller did not reset");
+    goto abort;
+  }
+
+  if (!(xhci_read (op_regs, XHCI_PAGESIZE) & 0x1)) {
+    DLOG ("4 KB pages not supported");
+    goto abort;
+  }
+
+  memset (dcbaa, 0, sizeof (dcbaa));
+  memset (slots, 0, sizeof (slots));
+  memset (slot_of_addr, 0, sizeof (slot_of_addr));
+  input_phys = (uint32) get_phys_addr (input_ctx);
+  if (!xhci_init_scratchpads (XHCI_HCS2_SCRATCHPADS (hcs2)))
+    goto abort;
+
+  xhci_write (op_regs, XHCI_CONFIG, max_slots);
+  xhci_write64 (op_regs, XHCI_DCBAAP, (uint32) get_phys_addr (dcbaa));
+
+  xhci_ring_init (&cmd_ring, cmd_trbs, (uint32) get_phys_addr (cmd_trbs));
+  xhci_write64 (op_regs, XHCI_CRCR, cmd_ring.phys | cmd_ring.cycle);
+
+  /* A single event ring segment on interrupter 0 */
+  memset (event_trbs, 0, sizeof (event_trbs));
+  event_phys = (uint32) get_phys_addr (event_trbs);
+  event_deq = 0;
+  event_cycle = 1;
+  erst.base_lo = event_phys;
+  erst.base_hi = 0;
+  erst.size = XHCI_RING_TRBS;
+  xhci_write (rt_regs, XHCI_ERSTSZ (0), 1);
+  xhci_write64 (rt_regs, XHCI_ERDP (0), event_phys);
+  xhci_write64 (rt_regs, XHCI_ERSTBA (0), (uint32) get_phys_addr (&erst));
+  xhci_write (rt_regs, XHCI_IMOD (0), 160); /* at most one IRQ per 40us */
+
+  if (pci_irq_map_msi_handler (xhci_device.bus, xhci_device.slot,
+                               xhci_device.func, xhci_irq_handler, 0x01)) {
+    DLOG ("Using MSI");
+    xhci_irq = TRUE;
+  } else if (pci_get_interrupt (device_index, &irq_line, &irq_pin) &&
+             pci_irq_find (xhci_device.bus, xhci_device.slot, irq_pin, &irq) &&
+             pci_irq_map_handler (&irq, xhci_irq_handler, 0x01,
+                                  IOAPIC_DESTINATION_LOGICAL,
+                                  IOAPIC_DELIVERY_FIXED)) {
+    DLOG ("Using IRQ gsi=0x%x", irq.gsi);
+    xhci_irq = TRUE;
+  } else
+    DLOG ("No IRQ routing; polling for events");
+
+  if (xhci_irq)
+    xhci_write (rt_regs, XHCI_IMAN (0), XHCI_IMAN_IP | XHCI_IMAN_IE);
+  xhci_write (op_regs, XHCI_USBCMD, XHCI_CMD_RS | XHCI_CMD_HSEE |
+              (xhci_irq ? XHCI_CMD_INTE : 0));
+
+  for (i = 0; i < 100; i++) {
+    if (!(xhci_read (op_regs, XHCI_USBSTS) & XHCI_STS_HCH))
+      break;
+    tsc_delay_usec (1000);
+  }
+  if (i == 100) {
+    DLOG ("Controller did not start");
+    goto abort;
+  }
+
+  /* Power the ports */
+  for (i = 0; i < num_ports; i++) {
+    uint32 sc = xhci_read (op_regs, XHCI_PORTSC (i));
+    if (!(sc & XHCI_PORT_PP))
+      xhci_write (op_regs, XHCI_PORTSC (i),
+                  (sc & XHCI_PORT_PRESERVE) | XHCI_PORT_PP);
+  }
+  tsc_delay_usec (20000);
+
+  xhci_operational = TRUE;
+  return TRUE;
+
+ abort:
+  unmap_virtual_pages ((void *) cap_regs, mmio_pages);
+  return FALSE;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = xhci_init
+};
+
+DEF_MODULE (usb___xhci, "xHCI driver", &mod_ops, {"usb", "pci"});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
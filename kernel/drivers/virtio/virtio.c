@@ -0,0 +1,534 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Virtio over PCI, legacy (I/O port) and modern (capability-based)
+ * transports, and split virtqueues with indirect descriptors and
+ * event-index notification suppression.  Shared by the virtio device
+ * drivers, which serialise calls under the kernel lock. */
+
+#include "drivers/virtio/virtio.h"
+#include "arch/i386.h"
+#include "util/printf.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "kernel.h"
+
+//#define DEBUG_VIRTIO
+
+#ifdef DEBUG_VIRTIO
+#define DLOG(fmt,...) DLOG_PREFIX("virtio",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+/* Legacy I/O port layout */
+#define VIRTIO_LEG_HOST_FEATURES  0x00
+#define VIRTIO_LEG_GUEST_FEATURES 0x04
+#define VIRTIO_LEG_QUEUE_PFN      0x08
+#define VIRTIO_LEG_QUEUE_NUM      0x0C
+#define VIRTIO_LEG_QUEUE_SEL      0x0E
+#define VIRTIO_LEG_QUEUE_NOTIFY   0x10
+#define VIRTIO_LEG_STATUS         0x12
+#define VIRTIO_LEG_ISR            0x13
+#define VIRTIO_LEG_CONFIG         0x14
+
+/* Modern common configuration layout */
+#define VIRTIO_COM_DFSELECT   0x00
+#define VIRTIO_COM_DF         0x04
+#define VIRTIO_COM_GFSELECT   0x08
+#define VIRTIO_COM_GF         0x0C
+#define VIRTIO_COM_NUM_QUEUES 0x12
+#define VIRTIO_COM_STATUS     0x14
+#define VIRTIO_COM_Q_SELECT   0x16
+#define VIRTIO_COM_Q_SIZE     0x18
+#define VIRTIO_COM_Q_ENABLE   0x1C
+#define VIRTIO_COM_Q_NOFF     0x1E
+#define VIRTIO_COM_Q_DESC     0x20
+#define VIRTIO_COM_Q_AVAIL    0x28
+#define VIRTIO_COM_Q_USED     0x30
+
+/* Vendor capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define PCI_CAP_ID_VNDR 0x09
+
+#define COM8(v,r)  (*(volatile u8 *) ((v)->common + (r)))
+#define COM16(v,r) (*(volatile u16 *) ((v)->common + (r)))
+#define COM32(v,r) (*(volatile u32 *) ((v)->common + (r)))
+
+/* Order ring updates against the device.  x86 only reorders a load
+ * ahead of an older store, which the locked add prevents. */
+#define virtio_mb()  asm volatile ("lock; addl $0,0(%%esp)":::"memory")
+#define virtio_wmb() asm volatile ("":::"memory")
+#define virtio_rmb() asm volatile ("":::"memory")
+
+/* Map the part of a BAR a capability points at. */
+static volatile u8 *
+virtio_map_cap (virtio_device *vdev, uint bar, u32 offset, u32 length)
+{
+  uint mem_addr, pages;
+  u32 phys;
+  u8 *virt;
+
+  if (!pci_decode_bar (vdev->index, bar, &mem_addr, NULL, NULL) ||
+      mem_addr == 0)
+    return NULL;
+  phys = mem_addr + offset;
+  pages = ((phys & 0xFFF) + length + 0xFFF) >> 12;
+  virt = map_contiguous_virtual_pages ((phys & ~0xFFF) | 3, pages);
+  if (!virt)
+    return NULL;
+  return virt + (phys & 0xFFF);
+}
+
+/* Walk the capability list for the modern transport's regions. */
+static bool
+virtio_find_modern (virtio_device *vdev)
+{
+  pci_device *d = &vdev->pci;
+  u8 ptr, type, bar;
+  u32 offset, length;
+
+  if (!(pci_read_word (pci_addr (d->bus, d->slot, d->func, 0x06)) & 0x10))
+    return FALSE;
+
+  for (ptr = pci_read_byte (pci_addr (d->bus, d->slot, d->func, 0x34)) & 0xFC;
+       ptr;
+       ptr = pci_read_byte (pci_addr (d->bus, d->slot, d->func, ptr + 1))
+         & 0xFC) {
+    if (pci_read_byte (pci_addr (d->bus, d->slot, d->func, ptr)) !=
+        PCI_CAP_ID_VNDR)
+      continue;
+    type = pci_read_byte (pci_addr (d->bus, d->slot, d->func, ptr + 3));
+    bar = pci_read_byte (pci_addr (d->bus, d->slot, d->func, ptr + 4));
+    offset = pci_read_dword (pci_addr (d->bus, d->slot, d->func, ptr + 8));
+    length = pci_read_dword (pci_addr (d->bus, d->slot, d->func, ptr + 12));
+    DLOG ("cap type=%d bar=%d offset=0x%x length=0x%x",
+          type, bar, offset, length);
+
+    switch (type) {
+    case VIRTIO_PCI_CAP_COMMON_CFG:
+      if (!vdev->common)
+        vdev->common = virtio_map_cap (vdev, bar, offset, length);
+      break;
+    case VIRTIO_PCI_CAP_NOTIFY_CFG:
+      if (!vdev->notify_base) {
+        vdev->notify_mult =
+          pci_read_dword (pci_addr (d->bus, d->slot, d->func, ptr + 16));
+        vdev->notify_base = virtio_map_cap (vdev, bar, offset, length);
+      }
+      break;
+    case VIRTIO_PCI_CAP_ISR_CFG:
+      if (!vdev->isr)
+        vdev->isr = virtio_map_cap (vdev, bar, offset, length);
+      break;
+    case VIRTIO_PCI_CAP_DEVICE_CFG:
+      if (!vdev->device)
+        vdev->device = virtio_map_cap (vdev, bar, offset, length);
+      break;
+    }
+  }
+
+  return vdev->common && vdev->notify_base && vdev->isr && vdev->device;
+}
+
+/* Find the first virtio device with either PCI device ID and set up
+ * its transport, preferring the modern one when both are offered. */
+bool
+virtio_pci_find (u16 legacy_id, u16 modern_id, virtio_device *vdev)
+{
+  uint device_index, io_addr;
+
+  memset (vdev, 0, sizeof (virtio_device));
+
+  if (!pci_find_device (VIRTIO_PCI_VENDOR, modern_id, 0xFF, 0xFF,
+                        0, &device_index) &&
+      !pci_find_device (VIRTIO_PCI_VENDOR, legacy_id, 0xFF, 0xFF,
+                        0, &device_index))
+    return FALSE;
+
+  if (!pci_get_device (device_index, &vdev->pci))
+    return FALSE;
+  vdev->index = device_index;
+
+  DLOG ("Using PCI bus=%x dev=%x func=%x device=0x%x",
+        vdev->pci.bus, vdev->pci.slot, vdev->pci.func, vdev->pci.device);
+
+  /* enable I/O and memory decoding and bus mastering */
+  pci_write_word (pci_addr (vdev->pci.bus, vdev->pci.slot, vdev->pci.func,
+                            0x04), 0x0007);
+
+  if (virtio_find_modern (vdev)) {
+    vdev->modern = TRUE;
+    return TRUE;
+  }
+
+  if (vdev->pci.device != legacy_id ||
+      !pci_decode_bar (device_index, 0, NULL, &io_addr, NULL) ||
+      io_addr == 0) {
+    DLOG ("No usable transport");
+    return FALSE;
+  }
+  vdev->io_base = io_addr;
+  return TRUE;
+}
+
+void
+virtio_reset (virtio_device *vdev)
+{
+  if (vdev->modern) {
+    COM8 (vdev, VIRTIO_COM_STATUS) = 0;
+    while (COM8 (vdev, VIRTIO_COM_STATUS) != 0)
+      asm volatile ("pause");
+  } else
+    outb (0, vdev->io_base + VIRTIO_LEG_STATUS);
+}
+
+void
+virtio_add_status (virtio_device *vdev, u8 status)
+{
+  if (vdev->modern)
+    COM8 (vdev, VIRTIO_COM_STATUS) |= status;
+  else
+    outb (inb (vdev->io_base + VIRTIO_LEG_STATUS) | status,
+          vdev->io_base + VIRTIO_LEG_STATUS);
+}
+
+/* Accept the offered subset of wanted features.  The modern
+ * transport also requires VERSION_1 and the FEATURES_OK handshake. */
+bool
+virtio_negotiate (virtio_device *vdev, u64 wanted)
+{
+  u64 offered;
+
+  if (vdev->modern) {
+    COM32 (vdev, VIRTIO_COM_DFSELECT) = 0;
+    offered = COM32 (vdev, VIRTIO_COM_DF);
+    COM32 (vdev, VIRTIO_COM_DFSELECT) = 1;
+    offered |= (u64) COM32 (vdev, VIRTIO_COM_DF) << 32;
+
+    vdev->features = offered & (wanted | VIRTIO_FEATURE (VIRTIO_F_VERSION_1));
+    if (!virtio_has_feature (vdev, VIRTIO_F_VERSION_1))
+      return FALSE;
+    COM32 (vdev, VIRTIO_COM_GFSELECT) = 0;
+    COM32 (vdev, VIRTIO_COM_GF) = (u32) vdev->features;
+    COM32 (vdev, VIRTIO_COM_GFSELECT) = 1;
+    COM32 (vdev, VIRTIO_COM_GF) = (u32) (vdev->features >> 32);
+
+    virtio_add_status (vdev, VIRTIO_STATUS_FEATURES_OK);
+    if (!(COM8 (vdev, VIRTIO_COM_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+      return FALSE;
+  } else {
+    offered = inl (vdev->io_base + VIRTIO_LEG_HOST_FEATURES);
+    vdev->features = offered & wanted;
+    outl ((u32) vdev->features, vdev->io_base + VIRTIO_LEG_GUEST_FEATURES);
+  }
+
+  DLOG ("features offered=0x%llx negotiated=0x%llx", offered, vdev->features);
+  return TRUE;
+}
+
+/* Read and acknowledge the interrupt status. */
+u8
+virtio_isr (virtio_device *vdev)
+{
+  if (vdev->modern)
+    return *vdev->isr;
+  else
+    return inb (vdev->io_base + VIRTIO_LEG_ISR);
+}
+
+u8
+virtio_config_read8 (virtio_device *vdev, uint offset)
+{
+  if (vdev->modern)
+    return *(volatile u8 *) (vdev->device + offset);
+  else
+    return inb (vdev->io_base + VIRTIO_LEG_CONFIG + offset);
+}
+
+u16
+virtio_config_read16 (virtio_device *vdev, uint offset)
+{
+  if (vdev->modern)
+    return *(volatile u16 *) (vdev->device + offset);
+  else
+    return inw (vdev->io_base + VIRTIO_LEG_CONFIG + offset);
+}
+
+u32
+virtio_config_read32 (virtio_device *vdev, uint offset)
+{
+  if (vdev->modern)
+    return *(volatile u32 *) (vdev->device + offset);
+  else
+    return inl (vdev->io_base + VIRTIO_LEG_CONFIG + offset);
+}
+
+u64
+virtio_config_read64 (virtio_device *vdev, uint offset)
+{
+  return virtio_config_read32 (vdev, offset) |
+    ((u64) virtio_config_read32 (vdev, offset + 4) << 32);
+}
+
+/* ************************************************** */
+
+/* Bytes in the legacy ring layout: descriptors and avail ring, then
+ * the used ring on the next page. */
+#define VRING_AVAIL_END(n) (16 * (n) + 6 + 2 * (n))
+#define VRING_USED_OFFSET(n) ((VRING_AVAIL_END (n) + 0xFFF) & ~0xFFF)
+#define VRING_PAGES(n) ((VRING_USED_OFFSET (n) + 6 + 8 * (n) + 0xFFF) >> 12)
+#define VRING_INDIRECT_PAGES \
+  ((VIRTIO_INDIRECT_TABLES * VIRTIO_INDIRECT_MAX * \
+    sizeof (struct vring_desc) + 0xFFF) >> 12)
+
+#define vring_used_event(vq) ((vq)->avail->ring[(vq)->num])
+#define vring_avail_event(vq) (*(volatile u16 *) &(vq)->used->ring[(vq)->num])
+
+bool
+virtqueue_init (virtio_device *vdev, uint index, virtqueue *vq)
+{
+  u16 num;
+  u32 phys;
+  u8 *mem;
+  uint i;
+
+  memset (vq, 0, sizeof (virtqueue));
+
+  if (vdev->modern) {
+    COM16 (vdev, VIRTIO_COM_Q_SELECT) = index;
+    num = COM16 (vdev, VIRTIO_COM_Q_SIZE);
+    if (num > VIRTIO_QUEUE_MAX)
+      num = VIRTIO_QUEUE_MAX;
+  } else {
+    outw (index, vdev->io_base + VIRTIO_LEG_QUEUE_SEL);
+    num = inw (vdev->io_base + VIRTIO_LEG_QUEUE_NUM);
+    /* the legacy interface cannot shrink a queue */
+    if (num > VIRTIO_QUEUE_MAX) {
+      DLOG ("queue %d: size %d unsupported", index, num);
+      return FALSE;
+    }
+  }
+  if (num == 0)
+    return FALSE;
+
+  vq->pages = VRING_PAGES (num) + VRING_INDIRECT_PAGES;
+  phys = alloc_phys_frames (vq->pages);
+  if (phys == -1)
+    return FALSE;
+  mem = map_contiguous_virtual_pages (phys | 3, vq->pages);
+  if (!mem) {
+    free_phys_frames (phys, vq->pages);
+    return FALSE;
+  }
+  memset (mem, 0, vq->pages << 12);
+
+  vq->vdev = vdev;
+  vq->index = index;
+  vq->num = num;
+  vq->phys = phys;
+  vq->desc = (struct vring_desc *) mem;
+  vq->avail = (struct vring_avail *) (mem + 16 * num);
+  vq->used = (struct vring_used *) (mem + VRING_USED_OFFSET (num));
+  vq->indirect = (struct vring_desc *) (mem + (VRING_PAGES (num) << 12));
+  vq->indirect_phys = phys + (VRING_PAGES (num) << 12);
+
+  for (i = 0; i < num; i++) {
+    vq->desc[i].next = i + 1;
+    vq->table[i] = -1;
+  }
+  vq->free_head = 0;
+  vq->num_free = num;
+
+  if (vdev->modern) {
+    COM16 (vdev, VIRTIO_COM_Q_SIZE) = num;
+    COM32 (vdev, VIRTIO_COM_Q_DESC) = phys;
+    COM32 (vdev, VIRTIO_COM_Q_DESC + 4) = 0;
+    COM32 (vdev, VIRTIO_COM_Q_AVAIL) = phys + 16 * num;
+    COM32 (vdev, VIRTIO_COM_Q_AVAIL + 4) = 0;
+    COM32 (vdev, VIRTIO_COM_Q_USED) = phys + VRING_USED_OFFSET (num);
+    COM32 (vdev, VIRTIO_COM_Q_USED + 4) = 0;
+    vq->notify = COM16 (vdev, VIRTIO_COM_Q_NOFF) * vdev->notify_mult;
+    COM16 (vdev, VIRTIO_COM_Q_ENABLE) = 1;
+  } else {
+    outl (phys >> 12, vdev->io_base + VIRTIO_LEG_QUEUE_PFN);
+    vq->notify = vdev->io_base + VIRTIO_LEG_QUEUE_NOTIFY;
+  }
+
+  DLOG ("queue %d: %d entries at phys=%p", index, num, phys);
+  return TRUE;
+}
+
+/* Expose a buffer of out device-readable pieces followed by in
+ * device-writable ones.  Several pieces go through one indirect
+ * table when the device supports it and a table is free.  Returns 0,
+ * or -1 if the ring is full. */
+sint
+virtqueue_add (virtqueue *vq, virtio_sg *sg, uint out, uint in, void *data)
+{
+  uint total = out + in, i, t;
+  u16 head, idx;
+  struct vring_desc *d;
+
+  if (total == 0 || vq->num_free == 0)
+    return -1;
+
+  head = vq->free_head;
+
+  if (total > 1 && total <= VIRTIO_INDIRECT_MAX &&
+      virtio_has_feature (vq->vdev, VIRTIO_F_INDIRECT_DESC) &&
+      vq->indirect_busy != ~0U) {
+    t = ffs (~vq->indirect_busy);
+    vq->indirect_busy |= 1 << t;
+    d = &vq->indirect[t * VIRTIO_INDIRECT_MAX];
+    for (i = 0; i < total; i++) {
+      d[i].addr = sg[i].addr;
+      d[i].len = sg[i].len;
+      d[i].flags = (i >= out ? VRING_DESC_F_WRITE : 0) |
+        (i + 1 < total ? VRING_DESC_F_NEXT : 0);
+      d[i].next = i + 1;
+    }
+    d = &vq->desc[head];
+    vq->free_head = d->next;
+    vq->num_free--;
+    d->addr = vq->indirect_phys +
+      t * VIRTIO_INDIRECT_MAX * sizeof (struct vring_desc);
+    d->len = total * sizeof (struct vring_desc);
+    d->flags = VRING_DESC_F_INDIRECT;
+    vq->table[head] = t;
+  } else {
+    if (vq->num_free < total)
+      return -1;
+    for (i = 0, idx = head; i < total; i++) {
+      d = &vq->desc[idx];
+      d->addr = sg[i].addr;
+      d->len = sg[i].len;
+      d->flags = (i >= out ? VRING_DESC_F_WRITE : 0) |
+        (i + 1 < total ? VRING_DESC_F_NEXT : 0);
+      idx = d->next;
+    }
+    vq->free_head = idx;
+    vq->num_free -= total;
+  }
+
+  vq->data[head] = data;
+  vq->avail->ring[vq->avail->idx & (vq->num - 1)] = head;
+  virtio_wmb ();
+  vq->avail->idx++;
+  return 0;
+}
+
+/* Notify the device of new buffers, unless it has said (through the
+ * avail event index, or the NO_NOTIFY flag) that it will find them
+ * anyway.  Buffers added since the last kick share one notification. */
+void
+virtqueue_kick (virtqueue *vq)
+{
+  u16 new, old, event;
+  bool notify;
+
+  virtio_mb ();
+  new = vq->avail->idx;
+  old = vq->kicked_avail;
+  vq->kicked_avail = new;
+
+  if (virtio_has_feature (vq->vdev, VIRTIO_F_EVENT_IDX)) {
+    event = vring_avail_event (vq);
+    notify = (u16) (new - event - 1) < (u16) (new - old);
+  } else
+    notify = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+
+  if (!notify)
+    return;
+  if (vq->vdev->modern)
+    *(volatile u16 *) (vq->vdev->notify_base + vq->notify) = vq->index;
+  else
+    outw (vq->index, vq->notify);
+}
+
+/* Take the next buffer the device has finished with, or NULL. */
+void *
+virtqueue_get_buf (virtqueue *vq, u32 *len)
+{
+  struct vring_used_elem *e;
+  u16 head, idx;
+  uint n = 1;
+  void *data;
+
+  if (vq->last_used == vq->used->idx)
+    return NULL;
+  virtio_rmb ();
+
+  e = (struct vring_used_elem *) &vq->used->ring[vq->last_used & (vq->num - 1)];
+  vq->last_used++;
+  head = e->id;
+  if (len)
+    *len = e->len;
+  data = vq->data[head];
+  vq->data[head] = NULL;
+
+  /* return the chain to the free list */
+  idx = head;
+  if (vq->table[head] >= 0) {
+    vq->indirect_busy &= ~(1 << vq->table[head]);
+    vq->table[head] = -1;
+  } else {
+    while (vq->desc[idx].flags & VRING_DESC_F_NEXT) {
+      idx = vq->desc[idx].next;
+      n++;
+    }
+  }
+  vq->desc[idx].next = vq->free_head;
+  vq->free_head = head;
+  vq->num_free += n;
+
+  return data;
+}
+
+void
+virtqueue_disable_cb (virtqueue *vq)
+{
+  vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+/* Ask for an interrupt at the next completion.  Returns FALSE if
+ * buffers are already waiting, in which case the caller should
+ * collect them rather than wait. */
+bool
+virtqueue_enable_cb (virtqueue *vq)
+{
+  vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+  if (virtio_has_feature (vq->vdev, VIRTIO_F_EVENT_IDX))
+    vring_used_event (vq) = vq->last_used;
+  virtio_mb ();
+  return vq->last_used == vq->used->idx;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -42,12 +42,18 @@
 #include "fs/filesys.h"
 #include "arch/i386.h"
 #include "util/printf.h"
+#include "util/cassert.h"
+#include "mem/pow2.h"
 
 extern void ReadSector (void *offset, int cylinder, int head, int sector);
 extern void WriteSector (void *offset, int cylinder, int head, int sector);
 extern void ReadSectorLBA (void *offset, uint32 lba);
 extern void WriteSectorLBA (void *offset, uint32 lba);
 
+/* Disk holding the filesystem; NULL means the legacy primary-master
+ * path through ReadSectorLBA. */
+static block_device *ext2_dev = NULL;
+
 static int mapblock1, mapblock2;
 static int errnum;
 static char fsys_buf[0x8000];
@@ -111,8 +117,41 @@ struct ext2_super_block
   __u32 s_rev_level;            /* Revision level */
   __u16 s_def_resuid;           /* Default uid for reserved blocks */
   __u16 s_def_resgid;           /* Default gid for reserved blocks */
-  __u32 s_reserved[235];        /* Padding to the end of the block */
+  /* These fields are only valid for EXT2_DYNAMIC_REV superblocks */
+  __u32 s_first_ino;            /* First non-reserved inode */
+  __u16 s_inode_size;           /* size of inode structure */
+  __u16 s_block_group_nr;       /* block group # of this superblock */
+  __u32 s_feature_compat;       /* compatible feature set */
+  __u32 s_feature_incompat;     /* incompatible feature set */
+  __u32 s_feature_ro_compat;    /* readonly-compatible feature set */
+  __u8 s_uuid[16];              /* 128-bit uuid for volume */
+  char s_volume_name[16];       /* volume name */
+  char s_last_mounted[64];      /* directory where last mounted */
+  __u32 s_algorithm_usage_bitmap;       /* For compression */
+  __u8 s_prealloc_blocks;       /* Nr of blocks to try to preallocate */
+  __u8 s_prealloc_dir_blocks;   /* Nr to preallocate for dirs */
+  __u16 s_reserved_gdt_blocks;  /* Per group table for online growth */
+  __u8 s_journal_uuid[16];      /* uuid of journal superblock */
+  __u32 s_journal_inum;         /* inode number of journal file */
+  __u32 s_journal_dev;          /* device number of journal file */
+  __u32 s_last_orphan;          /* start of list of inodes to delete */
+  __u32 s_hash_seed[4];         /* HTREE hash seed */
+  __u8 s_def_hash_version;      /* Default hash version to use */
+  __u8 s_jnl_backup_type;
+  __u16 s_desc_size;
+  __u32 s_default_mount_opts;
+  __u32 s_first_meta_bg;        /* First metablock group */
+  __u32 s_mkfs_time;            /* When the filesystem was created */
+  __u32 s_jnl_blocks[17];       /* Backup of the journal inode */
+  __u32 s_blocks_count_hi;
+  __u32 s_r_blocks_count_hi;
+  __u32 s_free_blocks_count_hi;
+  __u16 s_min_extra_isize;
+  __u16 s_want_extra_isize;
+  __u32 s_flags;                /* Miscellaneous flags */
+  __u32 s_reserved[167];        /* Padding to the end of the block */
 };
+CASSERT (sizeof (struct ext2_super_block) == BLOCK_SIZE, ext2_super_block);
 
 struct ext2_group_desc
 {
@@ -223,6 +262,53 @@ struct ext2_dir_entry
 #define EXT2_DIR_REC_LEN(name_len)      (((name_len) + 8 + EXT2_DIR_ROUND) & \
                                          ~EXT2_DIR_ROUND)
 
+/* linux/ext2_fs.h */
+#define EXT2_GOOD_OLD_REV               0
+#define EXT2_GOOD_OLD_INODE_SIZE        128
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020
+#define EXT2_INDEX_FL                   0x00001000 /* hash-indexed directory */
+#define EXT2_FLAGS_UNSIGNED_HASH        0x0002
+
+/* fs/ext3/namei.c: the hashed directory (htree) index.  Block 0 of an
+ * indexed directory holds "." and ".." followed by a dx_root_info and
+ * an array of dx_entry; interior index blocks hold a single empty
+ * directory entry spanning the block followed by the dx_entry array.
+ * The first dx_entry of each array overlays its hash field with the
+ * count/limit of the array. */
+struct ext2_dx_root_info
+{
+  __u32 reserved_zero;
+  __u8 hash_version;
+  __u8 info_length;             /* 8 */
+  __u8 indirect_levels;
+  __u8 unused_flags;
+};
+
+struct ext2_dx_entry
+{
+  __u32 hash;
+  __u32 block;
+};
+
+struct ext2_dx_countlimit
+{
+  __u16 limit;
+  __u16 count;
+};
+
+#define EXT2_DX_ROOT_INFO_OFFSET  (EXT2_DIR_REC_LEN (1) + EXT2_DIR_REC_LEN (2))
+#define EXT2_DX_NODE_OFFSET       EXT2_DIR_REC_LEN (0)
+#define EXT2_DX_MAX_LEVELS        2
+#define EXT2_DX_BLOCK_MASK        0x0FFFFFFF
+
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+#define DX_HASH_EOF               0x7FFFFFFF
+
 
 /* ext2/super.c */
 #define log2(n) ffz(~(n))
@@ -257,6 +343,11 @@ struct ext2_dir_entry
 /* linux/ext2fs.h */
 #define EXT2_DESC_PER_BLOCK(s) \
      (EXT2_BLOCK_SIZE(s) / sizeof (struct ext2_group_desc))
+#define EXT2_INODE_SIZE(s) \
+     ((s)->s_rev_level == EXT2_GOOD_OLD_REV ? \
+      EXT2_GOOD_OLD_INODE_SIZE : (s)->s_inode_size)
+#define EXT2_INODES_PER_BLOCK(s) \
+     (EXT2_BLOCK_SIZE(s) / EXT2_INODE_SIZE(s))
 /* linux/stat.h */
 #define S_IFMT  00170000
 #define S_IFLNK  0120000
@@ -438,16 +529,49 @@ LBAtoCHS (int LBA, int *cylinder, int *head, int *sector)
 }
 
 
-int
-devread (int sector, int byte_offset, int byte_len, char *buf)
+void
+ext2fs_set_device (block_device *dev)
 {
+  ext2_dev = dev;
+}
 
-  char sector_buf[SECTOR_SIZE]; /* Temporary sector buffer */
-  int partial_bytes;
+/* Read count whole sectors into buf. */
+static int
+ext2_read_sectors (int sector, int count, char *buf)
+{
   int cyl, hd, sect;
 
   int CHS = 0;                  /* --??-- Set to non-zero for CHS mode */
 
+  if (ext2_dev) {
+    if (block_read (ext2_dev, sector, count, (uint8 *) buf) !=
+        count * SECTOR_SIZE) {
+      errnum = ERR_READ;
+      return 0;
+    }
+    return 1;
+  }
+
+  for (; count > 0; count--) {
+    if (CHS) {
+      LBAtoCHS (sector, &cyl, &hd, &sect);
+      ReadSector (buf, cyl, hd, sect);
+    } else
+      ReadSectorLBA (buf, sector);
+
+    buf += SECTOR_SIZE;
+    sector++;
+  }
+  return 1;
+}
+
+int
+devread (int sector, int byte_offset, int byte_len, char *buf)
+{
+
+  char sector_buf[SECTOR_SIZE]; /* Temporary sector buffer */
+  int partial_bytes, count;
+
   /* Hard-code the size of the disk in sectors */
   /* int part_length = ( ( 60 * 63 + 16 ) * 63 ) + 63 - 1; */
 
@@ -487,12 +611,11 @@ devread (int sector, int byte_offset, int byte_len, char *buf)
    */
   if (byte_offset) {
     partial_bytes = SECTOR_SIZE - byte_offset;
+    if (partial_bytes > byte_len)
+      partial_bytes = byte_len;
 
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (sector_buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (sector_buf, sector);
+    if (!ext2_read_sectors (sector, 1, sector_buf))
+      return 0;
 
     memcpy (buf, sector_buf + byte_offset, partial_bytes);
     buf += partial_bytes;
@@ -500,23 +623,20 @@ devread (int sector, int byte_offset, int byte_len, char *buf)
     sector++;
   }
 
-  for (; byte_len >= SECTOR_SIZE; byte_len -= SECTOR_SIZE) {
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (buf, sector);
-
-    buf += SECTOR_SIZE;
-    sector++;
+  /* Whole sectors go straight into the caller's buffer in one
+   * request. */
+  count = byte_len >> SECTOR_BITS;
+  if (count > 0) {
+    if (!ext2_read_sectors (sector, count, buf))
+      return 0;
+    buf += count * SECTOR_SIZE;
+    byte_len -= count * SECTOR_SIZE;
+    sector += count;
   }
 
   if (byte_len) {
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (sector_buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (sector_buf, sector);
+    if (!ext2_read_sectors (sector, 1, sector_buf))
+      return 0;
 
     memcpy (buf, sector_buf, byte_len);
   }
@@ -744,6 +864,579 @@ ext2_is_fast_symlink (void)
   return INODE->i_blocks == ea_blocks;
 }
 
+/* ************************************************** */
+/* Directory name hashing (fs/ext3/hash.c) */
+
+static __u32
+dx_hack_hash (const char *name, int len, int unsigned_char)
+{
+  __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  int c;
+
+  while (len--) {
+    c = unsigned_char ? (int) *(const __u8 *) name : (int) *name;
+    name++;
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+static void
+str2hashbuf (const char *msg, int len, __u32 * buf, int num,
+             int unsigned_char)
+{
+  __u32 pad, val;
+  int i, c;
+
+  pad = (__u32) len | ((__u32) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4)
+    len = num * 4;
+  for (i = 0; i < len; i++) {
+    c = unsigned_char ? (int) ((const __u8 *) msg)[i] : (int) msg[i];
+    val = c + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) \
+  (a += f (b, c, d) + (x), a = ROL32 (a, s))
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+/* Cut-down version of the MD4 compression function */
+static void
+half_md4_transform (__u32 buf[4], const __u32 in[8])
+{
+  __u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  /* Round 1 */
+  MD4_ROUND (MD4_F, a, b, c, d, in[0], 3);
+  MD4_ROUND (MD4_F, d, a, b, c, in[1], 7);
+  MD4_ROUND (MD4_F, c, d, a, b, in[2], 11);
+  MD4_ROUND (MD4_F, b, c, d, a, in[3], 19);
+  MD4_ROUND (MD4_F, a, b, c, d, in[4], 3);
+  MD4_ROUND (MD4_F, d, a, b, c, in[5], 7);
+  MD4_ROUND (MD4_F, c, d, a, b, in[6], 11);
+  MD4_ROUND (MD4_F, b, c, d, a, in[7], 19);
+
+  /* Round 2 */
+  MD4_ROUND (MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+  MD4_ROUND (MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+  MD4_ROUND (MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+  MD4_ROUND (MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+  MD4_ROUND (MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+  MD4_ROUND (MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+  MD4_ROUND (MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+  MD4_ROUND (MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+  /* Round 3 */
+  MD4_ROUND (MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+  MD4_ROUND (MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+  MD4_ROUND (MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+  MD4_ROUND (MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+  MD4_ROUND (MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+  MD4_ROUND (MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+  MD4_ROUND (MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+  MD4_ROUND (MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+#define TEA_DELTA 0x9E3779B9
+
+static void
+tea_transform (__u32 buf[4], const __u32 in[4])
+{
+  __u32 sum = 0;
+  __u32 b0 = buf[0], b1 = buf[1];
+  __u32 a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do {
+    sum += TEA_DELTA;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  } while (--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* Compute the major hash of NAME as used by the htree index.  Returns
+ * 0 and stores the hash in *HASH, or -1 for an unknown hash
+ * version. */
+static int
+ext2fs_dirhash (const char *name, int len, int version, __u32 * hash)
+{
+  __u32 buf[4], in[8];
+  int i, uc = 0;
+
+  buf[0] = 0x67452301;
+  buf[1] = 0xefcdab89;
+  buf[2] = 0x98badcfe;
+  buf[3] = 0x10325476;
+  for (i = 0; i < 4; i++) {
+    if (SUPERBLOCK->s_hash_seed[i]) {
+      memcpy (buf, SUPERBLOCK->s_hash_seed, sizeof (buf));
+      break;
+    }
+  }
+
+  switch (version) {
+  case DX_HASH_LEGACY_UNSIGNED:
+    uc = 1;
+  case DX_HASH_LEGACY:
+    *hash = dx_hack_hash (name, len, uc);
+    break;
+  case DX_HASH_HALF_MD4_UNSIGNED:
+    uc = 1;
+  case DX_HASH_HALF_MD4:
+    for (; len > 0; len -= 32, name += 32) {
+      str2hashbuf (name, len, in, 8, uc);
+      half_md4_transform (buf, in);
+    }
+    *hash = buf[1];
+    break;
+  case DX_HASH_TEA_UNSIGNED:
+    uc = 1;
+  case DX_HASH_TEA:
+    for (; len > 0; len -= 16, name += 16) {
+      str2hashbuf (name, len, in, 4, uc);
+      tea_transform (buf, in);
+    }
+    *hash = buf[0];
+    break;
+  default:
+    return -1;
+  }
+
+  *hash &= ~1;
+  if (*hash == (DX_HASH_EOF << 1))
+    *hash = (DX_HASH_EOF - 1) << 1;
+  return 0;
+}
+
+/* ************************************************** */
+/* Directory lookup */
+
+static int
+ext2fs_name_match (struct ext2_dir_entry *dp, const char *name, int len)
+{
+  int i;
+  if (dp->name_len != len)
+    return 0;
+  for (i = 0; i < len; i++)
+    if (dp->name[i] != name[i])
+      return 0;
+  return 1;
+}
+
+/* Scan the directory entries of the fs block held in BLOCK for NAME.
+ * Returns the inode number, 0 if NAME is not present, or -1 if the
+ * block is corrupt. */
+static int
+ext2fs_search_block (char *block, const char *name, int len)
+{
+  int off = 0;
+  struct ext2_dir_entry *dp;
+
+  while (off < EXT2_BLOCK_SIZE (SUPERBLOCK)) {
+    dp = (struct ext2_dir_entry *) (block + off);
+    if (dp->rec_len < EXT2_DIR_REC_LEN (0) || (dp->rec_len & EXT2_DIR_ROUND))
+      return -1;
+    if (dp->inode && ext2fs_name_match (dp, name, len))
+      return dp->inode;
+    off += dp->rec_len;
+  }
+  return 0;
+}
+
+/* Read logical block LBLK of the directory in INODE into DATABLOCK2. */
+static int
+ext2fs_read_dir_block (int lblk)
+{
+  long map = ext2fs_block_map (lblk);
+  mapblock2 = -1;
+  if (map <= 0 || !ext2_rdfsb (map, DATABLOCK2)) {
+    errnum = ERR_FSYS_CORRUPT;
+    return 0;
+  }
+  return 1;
+}
+
+/* Plain linear scan of the directory in INODE, one fs block at a
+ * time.  Returns the inode number of NAME or -1 with errnum set. */
+static int
+ext2fs_linear_lookup (const char *name, int len)
+{
+  int blk, nblks, ino;
+
+  nblks = INODE->i_size >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK);
+  for (blk = 0; blk < nblks; blk++) {
+    if (!ext2fs_read_dir_block (blk))
+      return -1;
+    ino = ext2fs_search_block ((char *) DATABLOCK2, name, len);
+    if (ino < 0) {
+      errnum = ERR_FSYS_CORRUPT;
+      return -1;
+    }
+    if (ino > 0)
+      return ino;
+  }
+  errnum = ERR_FILE_NOT_FOUND;
+  return -1;
+}
+
+/* Read the index node at logical block LBLK of the directory in INODE
+ * and return its dx_entry array, or NULL if it does not look like an
+ * index node. */
+static struct ext2_dx_entry *
+ext2fs_dx_node (int lblk, struct ext2_dx_root_info **info)
+{
+  struct ext2_dx_entry *entries;
+  struct ext2_dx_countlimit *cl;
+
+  if (!ext2fs_read_dir_block (lblk))
+    return NULL;
+  if (info) {
+    *info = (struct ext2_dx_root_info *)
+      (DATABLOCK2 + EXT2_DX_ROOT_INFO_OFFSET);
+    entries = (struct ext2_dx_entry *)
+      ((char *) *info + (*info)->info_length);
+  } else
+    entries = (struct ext2_dx_entry *) (DATABLOCK2 + EXT2_DX_NODE_OFFSET);
+
+  cl = (struct ext2_dx_countlimit *) entries;
+  if (cl->count == 0 || cl->count > cl->limit ||
+      (char *) &entries[cl->limit] > (char *) DATABLOCK2 +
+      EXT2_BLOCK_SIZE (SUPERBLOCK))
+    return NULL;
+  return entries;
+}
+
+/* Look NAME up through the htree index of the directory in INODE.
+ * Returns the inode number, 0 if the index proves NAME absent, or -1
+ * if the index cannot be used and the caller should fall back to a
+ * linear scan. */
+static int
+ext2fs_htree_lookup (const char *name, int len)
+{
+  struct ext2_dx_root_info *info;
+  struct ext2_dx_entry *entries, *p, *q, *at;
+  __u32 hash, next_hash;
+  int version, levels, count, node, idx, leaf, ino;
+
+  if ((entries = ext2fs_dx_node (0, &info)) == NULL)
+    return -1;
+  if (info->reserved_zero || info->info_length != 8 ||
+      info->indirect_levels >= EXT2_DX_MAX_LEVELS)
+    return -1;
+
+  version = info->hash_version;
+  if (version <= DX_HASH_TEA &&
+      (SUPERBLOCK->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+    version += DX_HASH_LEGACY_UNSIGNED;
+  if (ext2fs_dirhash (name, len, version, &hash) < 0)
+    return -1;
+
+  /* descend the index: find the last entry with hash <= our hash */
+  node = 0;
+  for (levels = info->indirect_levels;; levels--) {
+    count = ((struct ext2_dx_countlimit *) entries)->count;
+    p = entries + 1;
+    q = entries + count - 1;
+    while (p <= q) {
+      struct ext2_dx_entry *m = p + (q - p) / 2;
+      if (m->hash > hash)
+        q = m - 1;
+      else
+        p = m + 1;
+    }
+    at = p - 1;
+    if (levels == 0)
+      break;
+    node = at->block & EXT2_DX_BLOCK_MASK;
+    if ((entries = ext2fs_dx_node (node, NULL)) == NULL)
+      return -1;
+  }
+
+  /* search the leaf, and its successors for as long as they continue
+   * a run of colliding hashes */
+  for (idx = at - entries;;) {
+    leaf = entries[idx].block & EXT2_DX_BLOCK_MASK;
+    if (idx + 1 < count)
+      next_hash = entries[idx + 1].hash;
+    else if (node != 0)
+      /* the run may continue in the next index node */
+      next_hash = hash | 1;
+    else
+      next_hash = 0;
+
+    if (!ext2fs_read_dir_block (leaf))
+      return -1;
+    ino = ext2fs_search_block ((char *) DATABLOCK2, name, len);
+    if (ino != 0)
+      return ino;
+
+    if (!(next_hash & 1) || (next_hash & ~1) != hash)
+      return 0;
+    if (idx + 1 >= count)
+      return -1;
+
+    /* the leaf overwrote the index node; fetch it again */
+    if ((entries = ext2fs_dx_node (node, node ? NULL : &info)) == NULL)
+      return -1;
+    idx++;
+  }
+}
+
+/* In-memory name index for directories without an htree.  The first
+ * lookup in a directory of at least EXT2_DCACHE_MIN_BLOCKS blocks
+ * scans the whole directory once and hashes every entry; subsequent
+ * lookups in that directory touch no directory blocks at all. */
+#define EXT2_DCACHE_DIRS        8
+#define EXT2_DCACHE_MIN_BLOCKS  2
+#define EXT2_DCACHE_MIN_BUCKETS 64
+#define EXT2_DCACHE_MAX_BUCKETS 8192    /* 32 KiB of chain heads */
+
+struct ext2_dcache_entry
+{
+  struct ext2_dcache_entry *next;
+  __u32 hash;
+  __u32 inode;
+  __u8 name_len;
+  char name[0];
+};
+
+/* The chain heads and entries of a directory are carved out of an
+ * arena sized from the directory, so building and evicting it is one
+ * allocation and one free.  pow2 blocks stop at 64 KiB; very large
+ * directories take a few of them. */
+#define EXT2_DCACHE_CHUNK       65536
+
+struct ext2_dcache_chunk
+{
+  struct ext2_dcache_chunk *next;
+  __u32 used, size;
+};
+
+#define EXT2_DCACHE_CHUNK_ROOM \
+  (EXT2_DCACHE_CHUNK - sizeof (struct ext2_dcache_chunk))
+
+/* the bucket array is carved like anything else, so it must fit */
+CASSERT (EXT2_DCACHE_MAX_BUCKETS * sizeof (struct ext2_dcache_entry *) <=
+         EXT2_DCACHE_CHUNK_ROOM, ext2_dcache_buckets);
+
+struct ext2_dcache_dir
+{
+  __u32 ino;                    /* 0 if slot unused */
+  __u32 mtime;
+  __u32 size;
+  __u32 nbuckets;
+  struct ext2_dcache_entry **buckets;
+  struct ext2_dcache_chunk *arena;
+  __u32 left;                   /* estimate of what is still to come */
+};
+
+static struct ext2_dcache_dir ext2_dcache[EXT2_DCACHE_DIRS];
+static int ext2_dcache_victim = 0;
+
+static void
+ext2_dcache_evict (struct ext2_dcache_dir *d)
+{
+  struct ext2_dcache_chunk *c, *n;
+
+  if (!d->ino)
+    return;
+  for (c = d->arena; c; c = n) {
+    n = c->next;
+    pow2_free ((uint8 *) c);
+  }
+  d->arena = NULL;
+  d->ino = 0;
+  d->buckets = NULL;
+}
+
+/* LEN zeroed bytes from D's arena, or NULL */
+static void *
+ext2_dcache_carve (struct ext2_dcache_dir *d, __u32 len)
+{
+  struct ext2_dcache_chunk *c = d->arena;
+  void *p;
+  __u32 size;
+
+  len = (len + 3) & ~3;
+  if (len > EXT2_DCACHE_CHUNK_ROOM)
+    return NULL;
+  if (!c || c->used + len > c->size) {
+    size = sizeof (struct ext2_dcache_chunk) + (d->left > len ? d->left : len);
+    if (size > EXT2_DCACHE_CHUNK)
+      size = EXT2_DCACHE_CHUNK;
+    c = NULL;
+    pow2_alloc (size, (uint8 **) & c);
+    if (!c)
+      return NULL;
+    c->size = size;
+    c->used = sizeof (struct ext2_dcache_chunk);
+    c->next = d->arena;
+    d->arena = c;
+  }
+  p = (char *) c + c->used;
+  c->used += len;
+  d->left = d->left > len ? d->left - len : 0;
+  return p;
+}
+
+/* Hash every entry of the directory in INODE (inode number INO). */
+static struct ext2_dcache_dir *
+ext2_dcache_build (int ino)
+{
+  struct ext2_dcache_dir *d;
+  struct ext2_dcache_entry *e;
+  struct ext2_dir_entry *dp;
+  int blk, nblks, off;
+  __u32 n;
+
+  d = &ext2_dcache[ext2_dcache_victim];
+  ext2_dcache_victim = (ext2_dcache_victim + 1) % EXT2_DCACHE_DIRS;
+  ext2_dcache_evict (d);
+
+  /* roughly one bucket per minimal-size (32 byte) directory entry */
+  for (n = EXT2_DCACHE_MIN_BUCKETS;
+       n < EXT2_DCACHE_MAX_BUCKETS && n < (INODE->i_size >> 5); n <<= 1);
+  d->nbuckets = n;
+  /* each on-disk entry (12 bytes at least) grows by at most 8 here */
+  d->left = n * sizeof (struct ext2_dcache_entry *) +
+    INODE->i_size + (INODE->i_size / 12) * 8;
+  d->buckets = ext2_dcache_carve (d, n * sizeof (struct ext2_dcache_entry *));
+  if (!d->buckets)
+    return NULL;
+  d->ino = ino;
+  d->mtime = INODE->i_mtime;
+  d->size = INODE->i_size;
+
+  nblks = INODE->i_size >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK);
+  for (blk = 0; blk < nblks; blk++) {
+    if (!ext2fs_read_dir_block (blk))
+      goto fail;
+    for (off = 0; off < EXT2_BLOCK_SIZE (SUPERBLOCK); off += dp->rec_len) {
+      dp = (struct ext2_dir_entry *) (DATABLOCK2 + off);
+      if (dp->rec_len < EXT2_DIR_REC_LEN (0) ||
+          (dp->rec_len & EXT2_DIR_ROUND)) {
+        errnum = ERR_FSYS_CORRUPT;
+        goto fail;
+      }
+      if (!dp->inode)
+        continue;
+      e = ext2_dcache_carve (d, sizeof (struct ext2_dcache_entry) +
+                             dp->name_len);
+      if (!e)
+        goto fail;
+      e->hash = dx_hack_hash (dp->name, dp->name_len, 1);
+      e->inode = dp->inode;
+      e->name_len = dp->name_len;
+      memcpy (e->name, dp->name, dp->name_len);
+      e->next = d->buckets[e->hash & (n - 1)];
+      d->buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  return d;
+
+ fail:
+  ext2_dcache_evict (d);
+  return NULL;
+}
+
+static struct ext2_dcache_dir *
+ext2_dcache_find (int ino)
+{
+  int i;
+  for (i = 0; i < EXT2_DCACHE_DIRS; i++) {
+    struct ext2_dcache_dir *d = &ext2_dcache[i];
+    if (d->ino == ino) {
+      if (d->mtime == INODE->i_mtime && d->size == INODE->i_size)
+        return d;
+      /* directory changed underneath us */
+      ext2_dcache_evict (d);
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static int
+ext2_dcache_lookup (struct ext2_dcache_dir *d, const char *name, int len)
+{
+  struct ext2_dcache_entry *e;
+  __u32 hash = dx_hack_hash (name, len, 1);
+  int i;
+
+  for (e = d->buckets[hash & (d->nbuckets - 1)]; e; e = e->next) {
+    if (e->hash != hash || e->name_len != len)
+      continue;
+    for (i = 0; i < len && e->name[i] == name[i]; i++);
+    if (i == len)
+      return e->inode;
+  }
+  errnum = ERR_FILE_NOT_FOUND;
+  return -1;
+}
+
+/* Find NAME in the directory whose inode (number INO) is loaded in
+ * INODE.  Returns the inode number of the entry, or -1 with errnum
+ * set. */
+static int
+ext2fs_dir_lookup (int ino, const char *name)
+{
+  struct ext2_dcache_dir *d;
+  int len = strlen (name), ret;
+
+  if ((SUPERBLOCK->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+      (INODE->i_flags & EXT2_INDEX_FL)) {
+    ret = ext2fs_htree_lookup (name, len);
+    if (ret > 0)
+      return ret;
+    if (ret == 0) {
+      errnum = ERR_FILE_NOT_FOUND;
+      return -1;
+    }
+    errnum = 0;
+    return ext2fs_linear_lookup (name, len);
+  }
+
+  if ((d = ext2_dcache_find (ino)) == NULL &&
+      (INODE->i_size >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK)) >=
+      EXT2_DCACHE_MIN_BLOCKS)
+    d = ext2_dcache_build (ino);
+  if (d)
+    return ext2_dcache_lookup (d, name, len);
+
+  errnum = 0;
+  return ext2fs_linear_lookup (name, len);
+}
+
 /* preconditions: ext2fs_mount already executed, therefore supblk in buffer
  *   known as SUPERBLOCK
  * returns: 0 if error, nonzero iff we were able to find the file successfully
@@ -760,7 +1453,7 @@ ext2fs_dir (char *dirname)
   int group_desc;               /* fs pointer to that group */
   int desc;                     /* index within that group */
   int ino_blk;                  /* fs pointer of the inode's information */
-  int str_chk = 0;              /* used to hold the results of a string compare */
+  int next_ino;                 /* inode of the component just looked up */
   struct ext2_group_desc *gdp;
   struct ext2_inode *raw_inode; /* inode info corresponding to current_ino */
 
@@ -770,11 +1463,6 @@ ext2fs_dir (char *dirname)
   char *rest;
   char ch;                      /* temp char holder */
 
-  int off;                      /* offset within block of directory entry (off mod blocksize) */
-  int loc;                      /* location within a directory */
-  int blk;                      /* which data blk within dir entry (off div blocksize) */
-  long map;                     /* fs pointer of a particular block from dir entry */
-  struct ext2_dir_entry *dp;    /* pointer to directory entry */
 #ifdef E2DEBUG
   uint8 *i;
 #endif /* E2DEBUG */
@@ -812,7 +1500,7 @@ ext2fs_dir (char *dirname)
     gdp = GROUP_DESC;
     ino_blk = gdp[desc].bg_inode_table +
       (((current_ino - 1) % (SUPERBLOCK->s_inodes_per_group))
-       >> log2 (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)));
+       / EXT2_INODES_PER_BLOCK (SUPERBLOCK));
 #ifdef E2DEBUG
     printf ("inode table fsblock=%d\n", ino_blk);
 #endif /* E2DEBUG */
@@ -823,13 +1511,12 @@ ext2fs_dir (char *dirname)
     /* reset indirect blocks! */
     mapblock2 = mapblock1 = -1;
 
-    raw_inode = INODE + ((current_ino - 1)
-                         & (EXT2_BLOCK_SIZE (SUPERBLOCK) /
-                            sizeof (struct ext2_inode) - 1));
+    raw_inode = (struct ext2_inode *)
+      ((int) INODE + ((current_ino - 1) % EXT2_INODES_PER_BLOCK (SUPERBLOCK))
+       * EXT2_INODE_SIZE (SUPERBLOCK));
 #ifdef E2DEBUG
     printf ("ipb=%d, sizeof(inode)=%d\n",
-            (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)),
-            sizeof (struct ext2_inode));
+            EXT2_INODES_PER_BLOCK (SUPERBLOCK), EXT2_INODE_SIZE (SUPERBLOCK));
     printf ("inode=%x, raw_inode=%x\n", INODE, raw_inode);
     printf ("offset into inode table block=%d\n",
             (int) raw_inode - (int) INODE);
@@ -943,64 +1630,18 @@ ext2fs_dir (char *dirname)
     /* look through this directory and find the next filename component */
     /* invariant: rest points to slash after the next filename component */
     *rest = 0;
-    loc = 0;
-
-    do {
 
 #ifdef E2DEBUG
-      printf ("dirname=%s, rest=%s, loc=%d\n", dirname, rest, loc);
+    printf ("dirname=%s, rest=%s\n", dirname, rest);
 #endif /* E2DEBUG */
 
-      /* if our location/byte offset into the directory exceeds the size,
-         give up */
-      if (loc >= INODE->i_size) {
-        errnum = ERR_FILE_NOT_FOUND;
-        *rest = ch;
-        return -1;
-      }
-
-      /* else, find the (logical) block component of our location */
-      blk = loc >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK);
-
-      /* we know which logical block of the directory entry we are looking
-         for, now we have to translate that to the physical (fs) block on
-         the disk */
-      map = ext2fs_block_map (blk);
-#ifdef E2DEBUG
-      printf ("fs block=%d\n", map);
-#endif /* E2DEBUG */
-      mapblock2 = -1;
-      if ((map < 0) || !ext2_rdfsb (map, DATABLOCK2)) {
-        errnum = ERR_FSYS_CORRUPT;
-        *rest = ch;
-        return -1;
-      }
-      off = loc & (EXT2_BLOCK_SIZE (SUPERBLOCK) - 1);
-      dp = (struct ext2_dir_entry *) (DATABLOCK2 + off);
-      /* advance loc prematurely to next on-disk directory entry  */
-      loc += dp->rec_len;
-
-      /* NOTE: ext2fs filenames are NOT null-terminated */
-
-#ifdef E2DEBUG
-      printf ("directory entry ino=%d\n", dp->inode);
-      if (dp->inode)
-        printf ("entry=%s\n", dp->name);
-#endif /* E2DEBUG */
-
-      if (dp->inode) {
-        int saved_c = dp->name[dp->name_len];
-
-        dp->name[dp->name_len] = 0;
-        str_chk = substring (dirname, dp->name);
-        dp->name[dp->name_len] = saved_c;
-      }
-
-    }
-    while (!dp->inode || (str_chk));
+    next_ino = ext2fs_dir_lookup (current_ino, dirname);
+    *rest = ch;
+    if (next_ino < 0)
+      return -1;
 
-    current_ino = dp->inode;
-    *(dirname = rest) = ch;
+    current_ino = next_ino;
+    dirname = rest;
   }
   /* never get here */
 }
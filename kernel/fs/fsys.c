@@ -19,6 +19,9 @@
 #include"kernel.h"
 #include"util/screen.h"
 #include"util/printf.h"
+#include"util/decompress.h"
+#include"mem/physical.h"
+#include"mem/virtual.h"
 
 static int vfs_root_type = VFS_FSYS_NONE;
 
@@ -28,9 +31,29 @@ static vfs_table_t vfs_table[] = {
   { "cd",   VFS_FSYS_EZISO },
   { "tftp", VFS_FSYS_EZTFTP },
   { "usb",  VFS_FSYS_EZUSB },
+  { "ram",  VFS_FSYS_RAMDISK },
 };
 #define NUM_VFS (sizeof (vfs_table) / sizeof (vfs_table_t))
 
+/* Disks tried, in order, for an ext2 root */
+static char *vfs_ext2_disks[] = { "hd0", "sd0", "nvme0", "vd0" };
+#define NUM_EXT2_DISKS (sizeof (vfs_ext2_disks) / sizeof (char *))
+
+/* A file that is not found is looked for again with each of these
+ * suffixes, and decompressed as it is read in */
+static char *vfs_z_suffixes[] = { ".gz", ".lz4" };
+#define NUM_Z_SUFFIXES (sizeof (vfs_z_suffixes) / sizeof (char *))
+#define VFS_Z_MAX (16 << 20)
+#define VFS_Z_PAGES (VFS_Z_MAX >> 12)
+
+static decomp_stream vfs_z;
+static uint8 vfs_z_window[DECOMP_WINDOW];
+static int vfs_z_fs;                    /* filesystem being decompressed */
+static bool vfs_z_open;                 /* reads come from the frames below */
+static bool vfs_z_error;
+static frame_t vfs_z_frames[VFS_Z_PAGES];
+static uint32 vfs_z_pages, vfs_z_len, vfs_z_pos;
+
 void
 vfs_set_root (int type, ata_info * drive_info)
 {
@@ -61,13 +84,9 @@ parse_pathname (char *pathname, char **filepart)
   }
 }
 
-/* returns file length on success, -1 on failure */
-int
-vfs_dir (char *pathname)
+static int
+vfs_fs_dir (int type, char *filepart)
 {
-  char *filepart;
-  int type = parse_pathname (pathname, &filepart);
-  if (type == -1) return -1;
   switch (type) {
   case VFS_FSYS_EZEXT2:
     return ext2fs_dir (filepart);
@@ -77,19 +96,17 @@ vfs_dir (char *pathname)
     return vfat_dir (filepart);
   case VFS_FSYS_EZTFTP:
     return eztftp_dir (filepart);
+  case VFS_FSYS_RAMDISK:
+    return ramdisk_dir (filepart);
   default:
     print ("Unknown vfs_type");
     return -1;
   }
 }
 
-/* returns number of bytes read */
-int
-vfs_read (char *pathname, char *buf, int len)
+static int
+vfs_fs_read (int type, char *buf, int len)
 {
-  char *filepart;
-  int type = parse_pathname (pathname, &filepart);
-  if (type == -1) return -1;
   switch (type) {
   case VFS_FSYS_EZEXT2:
     return ext2fs_read (buf, len);
@@ -99,27 +116,175 @@ vfs_read (char *pathname, char *buf, int len)
     return vfat_read (buf, len);
   case VFS_FSYS_EZTFTP:
     return eztftp_read (buf, len);
+  case VFS_FSYS_RAMDISK:
+    return ramdisk_read (buf, len);
   default:
     print ("Unknown vfs_type");
     return -1;
   }
 }
 
+static void
+vfs_z_release (void)
+{
+  /* vfs_z_read has already released the pages it finished */
+  uint32 i = (vfs_z_pos == vfs_z_len ? vfs_z_pos + 0xFFF : vfs_z_pos) >> 12;
+  for (; i < vfs_z_pages; i++)
+    free_phys_frame (vfs_z_frames[i]);
+  vfs_z_pages = vfs_z_len = vfs_z_pos = 0;
+  vfs_z_open = FALSE;
+}
+
+/* The decompressor pulls compressed data a chunk at a time ... */
+static sint32
+vfs_z_fill (void *arg, uint8 *buf, uint32 len)
+{
+  return vfs_fs_read (vfs_z_fs, (char *) buf, len);
+}
+
+/* ... and pushes out what it has decompressed, into unmapped frames */
+static void
+vfs_z_flush (void *arg, uint8 *buf, uint32 len)
+{
+  uint8 *page;
+  uint32 amount;
+  frame_t frame;
+
+  while (len > 0 && !vfs_z_error) {
+    if ((vfs_z_len & 0xFFF) == 0) {
+      if (vfs_z_pages == VFS_Z_PAGES ||
+          (frame = alloc_phys_frame ()) == -1) {
+        vfs_z_error = TRUE;
+        return;
+      }
+      vfs_z_frames[vfs_z_pages++] = frame;
+    }
+    amount = 0x1000 - (vfs_z_len & 0xFFF);
+    if (amount > len)
+      amount = len;
+    page = map_virtual_page (vfs_z_frames[vfs_z_len >> 12] | 3);
+    memcpy (page + (vfs_z_len & 0xFFF), buf, amount);
+    unmap_virtual_page (page);
+    vfs_z_len += amount;
+    buf += amount;
+    len -= amount;
+  }
+}
+
+/* Decompress the file just opened on filesystem type.  Returns the
+ * decompressed length, or -1. */
+static int
+vfs_z_decompress (int type)
+{
+  sint32 res = -1;
+
+  vfs_z_fs = type;
+  vfs_z_error = FALSE;
+  decomp_init (&vfs_z, vfs_z_fill, vfs_z_flush, NULL, vfs_z_window);
+  /* peek at the magic number */
+  if (decomp_refill (&vfs_z) < 0)
+    return -1;
+  vfs_z.in_pos = 0;
+  switch (decomp_detect (vfs_z.in, vfs_z.in_len)) {
+  case DECOMP_GZIP:
+    res = gunzip (&vfs_z);
+    break;
+  case DECOMP_LZ4:
+    res = lz4_decompress (&vfs_z);
+    break;
+  }
+  if (res < 0 || vfs_z_error) {
+    printf ("VFS: corrupt or oversized compressed file\n");
+    vfs_z_release ();
+    return -1;
+  }
+  vfs_z_open = TRUE;
+  return vfs_z_len;
+}
+
+static int
+vfs_z_read (char *buf, int len)
+{
+  uint8 *page;
+  int actual = 0;
+  uint32 amount, offset;
+
+  while (len > 0 && vfs_z_pos < vfs_z_len) {
+    offset = vfs_z_pos & 0xFFF;
+    amount = 0x1000 - offset;
+    if (amount > vfs_z_len - vfs_z_pos)
+      amount = vfs_z_len - vfs_z_pos;
+    if (amount > len)
+      amount = len;
+    page = map_virtual_page (vfs_z_frames[vfs_z_pos >> 12] | 3);
+    memcpy (buf + actual, page + offset, amount);
+    unmap_virtual_page (page);
+    actual += amount;
+    len -= amount;
+    vfs_z_pos += amount;
+    /* release each page once it has been read */
+    if ((vfs_z_pos & 0xFFF) == 0 || vfs_z_pos == vfs_z_len)
+      free_phys_frame (vfs_z_frames[(vfs_z_pos - 1) >> 12]);
+  }
+  return actual;
+}
+
+/* returns file length on success, -1 on failure */
+int
+vfs_dir (char *pathname)
+{
+  char *filepart, zname[256];
+  int i, n, res, type = parse_pathname (pathname, &filepart);
+  if (type == -1) return -1;
+  vfs_z_release ();
+  if ((res = vfs_fs_dir (type, filepart)) >= 0)
+    return res;
+
+  /* try for a compressed copy */
+  n = strlen (filepart);
+  for (i = 0; i < NUM_Z_SUFFIXES; i++) {
+    if (n + strlen (vfs_z_suffixes[i]) >= sizeof (zname))
+      continue;
+    memcpy (zname, filepart, n);
+    memcpy (zname + n, vfs_z_suffixes[i], strlen (vfs_z_suffixes[i]) + 1);
+    if (vfs_fs_dir (type, zname) >= 0)
+      return vfs_z_decompress (type);
+  }
+  return -1;
+}
+
+/* returns number of bytes read */
+int
+vfs_read (char *pathname, char *buf, int len)
+{
+  char *filepart;
+  int type = parse_pathname (pathname, &filepart);
+  if (type == -1) return -1;
+  if (vfs_z_open)
+    return vfs_z_read (buf, len);
+  return vfs_fs_read (type, buf, len);
+}
+
 /* ************************************************** */
 
 bool
 vfs_init (void)
 {
   extern u32 root_type, boot_device;
+  block_device *disk = NULL;
   int i;
   switch (root_type) {
   case VFS_FSYS_EZEXT2:
-    if (boot_device == 0x8000FFFF && pata_drives[0].ata_type == ATA_TYPE_PATA) {
-      printf ("ROOT: HARD DISK DRIVE: EXT2\n");
+    for (i = 0; i < NUM_EXT2_DISKS; i++)
+      if ((disk = block_lookup (vfs_ext2_disks[i])))
+        break;
+    if (boot_device == 0x8000FFFF && disk) {
+      printf ("ROOT: HARD DISK DRIVE (%s): EXT2\n", disk->name);
       /* Mount root filesystem */
+      ext2fs_set_device (disk);
       if (!ext2fs_mount ())
         panic ("Filesystem mount failed");
-      vfs_set_root (VFS_FSYS_EZEXT2, &pata_drives[0]);
+      vfs_set_root (VFS_FSYS_EZEXT2, NULL);
     } else {
       printf ("ROOT: unable to find ext2 drive\n");
     }
@@ -149,6 +314,12 @@ vfs_init (void)
       panic ("TFTP mount failed");
     vfs_set_root (VFS_FSYS_EZTFTP, NULL);
     break;
+  case VFS_FSYS_RAMDISK:
+    printf ("ROOT: RAM DISK\n");
+    if (!ramdisk_mounted ())
+      panic ("No RAM disk module");
+    vfs_set_root (VFS_FSYS_RAMDISK, NULL);
+    break;
   }
   return TRUE;
 }
@@ -159,7 +330,7 @@ static const struct module_ops mod_ops = {
   .init = vfs_init
 };
 
-DEF_MODULE (vfs, "virtual filesystem switch", &mod_ops, {"storage___ata|usbenumeration|netsetup"});
+DEF_MODULE (vfs, "virtual filesystem switch", &mod_ops, {"ramdisk|storage___|usbenumeration|netsetup"});
 
 /*
  * Local Variables:
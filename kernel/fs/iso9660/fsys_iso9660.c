@@ -21,6 +21,123 @@
 #include "arch/i386.h"
 #include "util/printf.h"
 #include "drivers/ata/ata.h"
+#include "mem/pow2.h"
+
+/* Largest transfer issued with one READ(12), in sectors.  Bigger
+ * requests are split into commands of this size. */
+#define ISO9660_MAX_XFER_SECTORS 32
+
+/* Directory extents are read whole with a single command and kept
+ * in memory so that repeated lookups do not go back to the drive.
+ * Extents too large for one pow2 block are streamed instead. */
+#define ISO9660_DIR_CACHE_SIZE 16
+#define ISO9660_DIR_CACHE_MAX                                           \
+  (0x10000 - ATAPI_SECTOR_SIZE)
+
+struct iso9660_dir_cache_entry
+{
+  uint32 bus, drive, sector, length;
+  uint32 stamp;                 /* for LRU replacement */
+  uint8 *data;                  /* NULL if slot unused */
+};
+
+static struct iso9660_dir_cache_entry iso9660_dir_cache[ISO9660_DIR_CACHE_SIZE];
+static uint32 iso9660_dir_cache_clock = 0;
+
+/* Bounce page for partial-sector reads, remembering which sector it
+ * holds so small sequential reads do not re-read it. */
+static uint8 *iso9660_bounce = NULL;
+static uint32 iso9660_bounce_bus, iso9660_bounce_drive, iso9660_bounce_sector;
+static bool iso9660_bounce_valid = FALSE;
+
+/* Read count sectors starting at lba, splitting the request into
+ * ISO9660_MAX_XFER_SECTORS commands.  Returns 0 or -1 on error. */
+static int
+iso9660_read_sectors (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+                      uint8 * buf)
+{
+  uint32 n;
+
+  while (count > 0) {
+    n = count > ISO9660_MAX_XFER_SECTORS ? ISO9660_MAX_XFER_SECTORS : count;
+    if (atapi_drive_read_sectors (bus, drive, lba, n, buf) !=
+        n * ATAPI_SECTOR_SIZE)
+      return -1;
+    lba += n;
+    count -= n;
+    buf += n * ATAPI_SECTOR_SIZE;
+  }
+  return 0;
+}
+
+static void
+iso9660_dir_cache_flush (uint32 bus, uint32 drive)
+{
+  int i;
+
+  for (i = 0; i < ISO9660_DIR_CACHE_SIZE; i++) {
+    struct iso9660_dir_cache_entry *e = &iso9660_dir_cache[i];
+    if (e->data && e->bus == bus && e->drive == drive) {
+      pow2_free (e->data);
+      e->data = NULL;
+    }
+  }
+  if (iso9660_bounce_valid && iso9660_bounce_bus == bus &&
+      iso9660_bounce_drive == drive)
+    iso9660_bounce_valid = FALSE;
+}
+
+/* Return the in-memory copy of the directory extent described by d,
+ * reading it in if necessary, or NULL if it cannot be cached. */
+static uint8 *
+iso9660_dir_cache_lookup (iso9660_mounted_info * mi, iso9660_dir_record * d)
+{
+  struct iso9660_dir_cache_entry *e, *victim = NULL;
+  uint32 nsect;
+  uint8 *data;
+  int i;
+
+  if (d->data_length == 0 || d->data_length > ISO9660_DIR_CACHE_MAX)
+    return NULL;
+
+  for (i = 0; i < ISO9660_DIR_CACHE_SIZE; i++) {
+    e = &iso9660_dir_cache[i];
+    if (e->data == NULL) {
+      if (victim == NULL || victim->data)
+        victim = e;
+      continue;
+    }
+    if (e->bus == mi->bus && e->drive == mi->drive &&
+        e->sector == d->first_sector && e->length == d->data_length) {
+      e->stamp = ++iso9660_dir_cache_clock;
+      return e->data;
+    }
+    if (victim == NULL || (victim->data && e->stamp < victim->stamp))
+      victim = e;
+  }
+
+  nsect = (d->data_length + ATAPI_SECTOR_SIZE - 1) / ATAPI_SECTOR_SIZE;
+  /* Leave room past the last sector so that copying out a record
+   * near the end never reads beyond the allocation. */
+  if (pow2_alloc (nsect * ATAPI_SECTOR_SIZE + sizeof (iso9660_dir_record),
+                  &data) < 0 || data == NULL)
+    return NULL;
+  if (iso9660_read_sectors (mi->bus, mi->drive, d->first_sector, nsect,
+                            data) < 0) {
+    pow2_free (data);
+    panic ("CD ROM READ ERROR\n");
+  }
+
+  if (victim->data)
+    pow2_free (victim->data);
+  victim->bus = mi->bus;
+  victim->drive = mi->drive;
+  victim->sector = d->first_sector;
+  victim->length = d->data_length;
+  victim->stamp = ++iso9660_dir_cache_clock;
+  victim->data = data;
+  return data;
+}
 
 void
 iso9660_date_record (uint8 * buf)
@@ -123,6 +240,8 @@ iso9660_mount (uint32 bus, uint32 drive, iso9660_mounted_info * mi)
   uint8 *page = map_virtual_page (frame | 3);
   int len;
 
+  iso9660_dir_cache_flush (bus, drive);
+
   /* The first 16 sectors (0-15) are empty. */
 
   /* Primary Volume descriptor */
@@ -236,61 +355,82 @@ iso9660_filename_compare (char *a, int a_len, char *b, int b_len)
 }
 
 
-static int
-iso9660_search_dir (iso9660_mounted_info * mi,
-                    iso9660_dir_record * d,
-                    char *pathname, int start, int end,
-                    iso9660_dir_record * de)
+/* Scan nbytes of directory records held in memory for the name
+ * pathname[start..end).  Records never straddle a sector boundary;
+ * the tail of each sector is zero padding.  Returns the matching
+ * record or NULL. */
+static iso9660_dir_record *
+iso9660_scan_records (uint8 * data, uint32 nbytes,
+                      char *pathname, int start, int end)
 {
-  uint32 frame;
-  uint8 *page;
+  iso9660_dir_record *d = (iso9660_dir_record *) data;
   int len = end - start;
-
-  frame = alloc_phys_frame ();
-  page = map_virtual_page (frame | 3);
-
-  uint32 secnum = d->first_sector;
-  uint32 num_bytes = d->data_length;
   uint32 count;
 
-  for (count = 0; count < num_bytes;) {
-    if (count % ATAPI_SECTOR_SIZE == 0) {
-      // if 2048-byte aligned get next sector
-      if (atapi_drive_read_sector (mi->bus, mi->drive, secnum, page) < 0) {
-        panic ("CD ROM READ ERROR\n");
-      }
-      secnum++;
-      d = (iso9660_dir_record *) page;
+  for (count = 0; count < nbytes;) {
+    if (d->length == 0) {
+      /* skip zeroes up to the next sector */
+      count = (count + ATAPI_SECTOR_SIZE) & ~(ATAPI_SECTOR_SIZE - 1);
+      d = (iso9660_dir_record *) (data + count);
+      continue;
     }
 
     if (iso9660_filename_compare (pathname + start, len,
                                   (char *) d->identifier,
                                   d->identifier_length) == 0)
-      break;                    /* found it */
-
+      return d;                 /* found it */
 
     count += d->length;
     d = (iso9660_dir_record *) ((uint8 *) d + d->length);
+  }
+  return NULL;
+}
 
-    // skip zeroes
-    while (*((uint8 *)d) == 0 && (count % ATAPI_SECTOR_SIZE) != 0) {
-      d = (iso9660_dir_record *) (((uint8 *)d) + 1);
-      count++;
-    }
+static int
+iso9660_search_dir (iso9660_mounted_info * mi,
+                    iso9660_dir_record * d,
+                    char *pathname, int start, int end,
+                    iso9660_dir_record * de)
+{
+  uint8 *data, *buf;
+  iso9660_dir_record *r = NULL;
+  uint32 secnum, remaining, nsect, chunk;
+
+  if ((data = iso9660_dir_cache_lookup (mi, d))) {
+    if (!(r = iso9660_scan_records (data, d->data_length,
+                                    pathname, start, end)))
+      return -1;
+    *de = *r;
+    return 0;
   }
 
-  if (count >= num_bytes)
-    goto error;
+  /* Extent too large to cache: stream it a command at a time. */
+  chunk = ISO9660_MAX_XFER_SECTORS * ATAPI_SECTOR_SIZE;
+  if (pow2_alloc (chunk, &buf) < 0 || buf == NULL)
+    return -1;
 
-  *de = *d;
+  secnum = d->first_sector;
+  remaining = d->data_length;
 
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
-  return 0;
- error:
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
-  return -1;
+  while (remaining > 0 && r == NULL) {
+    nsect = ISO9660_MAX_XFER_SECTORS;
+    if (remaining < chunk)
+      nsect = (remaining + ATAPI_SECTOR_SIZE - 1) / ATAPI_SECTOR_SIZE;
+    if (iso9660_read_sectors (mi->bus, mi->drive, secnum, nsect, buf) < 0) {
+      panic ("CD ROM READ ERROR\n");
+    }
+    r = iso9660_scan_records (buf,
+                              remaining < chunk ? remaining : chunk,
+                              pathname, start, end);
+    secnum += nsect;
+    remaining -= remaining < chunk ? remaining : chunk;
+  }
+
+  if (r)
+    *de = *r;
+
+  pow2_free (buf);
+  return r ? 0 : -1;
 }
 
 
@@ -334,44 +474,62 @@ iso9660_open (iso9660_mounted_info * mi, char *pathname, iso9660_handle * h)
   }
 }
 
+/* Read len bytes from the current position of h into buf.  Whole
+ * sectors go straight from the drive into buf with multi-sector
+ * commands; only a partial sector at either end is staged through
+ * the bounce page. */
 int
 iso9660_read (iso9660_handle * h, uint8 * buf, uint32 len)
 {
-  int n, count = 0, rem = len, curlen;
   iso9660_mounted_info *mi = h->mount;
-  uint32 frame;
-  uint8 *page;
+  uint32 count = 0, curlen, nsect;
 
-  frame = alloc_phys_frame ();
-  page = map_virtual_page (frame | 3);
+  if (len > h->length)
+    len = h->length;
 
   while (count < len) {
-    n = atapi_drive_read_sector (mi->bus, mi->drive, h->sector, page);
-    if (n < 0)
-      goto error;
+    if (h->offset == 0 && len - count >= ATAPI_SECTOR_SIZE) {
+      /* Aligned run of full sectors: read directly into buf. */
+      nsect = (len - count) / ATAPI_SECTOR_SIZE;
+      if (iso9660_read_sectors (mi->bus, mi->drive, h->sector, nsect,
+                                buf + count) < 0)
+        return -1;
+      curlen = nsect * ATAPI_SECTOR_SIZE;
+      h->sector += nsect;
+    } else {
+      if (iso9660_bounce == NULL)
+        iso9660_bounce = map_virtual_page (alloc_phys_frame () | 3);
+      if (!iso9660_bounce_valid || iso9660_bounce_bus != mi->bus ||
+          iso9660_bounce_drive != mi->drive ||
+          iso9660_bounce_sector != h->sector) {
+        iso9660_bounce_valid = FALSE;
+        if (atapi_drive_read_sector (mi->bus, mi->drive, h->sector,
+                                     iso9660_bounce) < 0)
+          return -1;
+        iso9660_bounce_bus = mi->bus;
+        iso9660_bounce_drive = mi->drive;
+        iso9660_bounce_sector = h->sector;
+        iso9660_bounce_valid = TRUE;
+      }
+
+      curlen = ATAPI_SECTOR_SIZE - h->offset;
+      if (curlen > len - count)
+        curlen = len - count;
 
-    curlen = rem > (n - h->offset) ? (n - h->offset) : rem;
+      memcpy (buf + count, iso9660_bounce + h->offset, curlen);
 
-    memcpy (buf + count, page + h->offset, curlen);
+      h->offset += curlen;
+      if (h->offset == ATAPI_SECTOR_SIZE) {
+        h->sector++;
+        h->offset = 0;
+      }
+    }
 
-    rem -= curlen;
     count += curlen;
-    h->offset += curlen;
     h->length -= curlen;
-    if (h->offset == 2048) {
-      h->sector++;
-      h->offset = 0;
-    }
   }
 
-
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
   return count;
-error:
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
-  return -1;
 }
 
 static iso9660_mounted_info eziso_mount_info;
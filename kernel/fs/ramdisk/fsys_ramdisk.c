@@ -0,0 +1,350 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* RAM disk "filesystem" driver.  The image is a multiboot module
+ * holding a cpio archive (SVR4 "newc" format, as written by
+ * `cpio -H newc`) or a POSIX ustar archive.  Mounting indexes the
+ * regular files; reads copy straight out of the module's physical
+ * pages, mapping one page at a time, so the image needs no kernel
+ * virtual space and nothing is ever staged. */
+
+#include "fs/filesys.h"
+#include "mem/virtual.h"
+#include "kernel.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+//#define DEBUG_RAMDISK
+
+#ifdef DEBUG_RAMDISK
+#define DLOG(fmt,...) DLOG_PREFIX("ramdisk",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define RAMDISK_MAX_FILES 256
+#define RAMDISK_NAME_LEN  64
+
+/*
+ *  offset  field (8 hex digits each after the magic)
+ *     0    magic "070701" or "070702"
+ *     6    ino, mode, uid, gid, nlink, mtime, filesize,
+ *          devmajor, devminor, rdevmajor, rdevminor, namesize, check
+ *   110    name, NUL-terminated, then padding to a multiple of 4
+ *          data, then padding to a multiple of 4
+ *
+ *                  cpio "newc" header
+ */
+#define CPIO_HDR_LEN      110
+#define CPIO_FIELD_MODE   1
+#define CPIO_FIELD_SIZE   6
+#define CPIO_FIELD_NAMESZ 11
+#define CPIO_TRAILER      "TRAILER!!!"
+
+/*
+ *  offset  field
+ *     0    name[100]
+ *   124    size[12], octal
+ *   156    typeflag
+ *   257    magic "ustar"
+ *   345    prefix[155]
+ *
+ *        ustar header, one 512-byte block, data padded to 512
+ */
+#define TAR_BLOCK   512
+#define TAR_SIZE    124
+#define TAR_TYPE    156
+#define TAR_MAGIC   257
+#define TAR_PREFIX  345
+
+#define S_IFMT  0170000
+#define S_IFREG 0100000
+
+typedef struct {
+  char name[RAMDISK_NAME_LEN];
+  uint32 offset, size;          /* within the image */
+} ramdisk_file;
+
+static uint32 image_phys, image_len;
+static ramdisk_file files[RAMDISK_MAX_FILES];
+static uint32 num_files;
+static bool mounted;
+
+/* the open file */
+static ramdisk_file *cur_file;
+static uint32 cur_pos;
+
+/* Copy len bytes at offset in the image to buf. */
+static void
+image_copy (uint8 *buf, uint32 offset, uint32 len)
+{
+  uint8 *page;
+  uint32 phys, amount;
+
+  while (len > 0) {
+    phys = image_phys + offset;
+    amount = 0x1000 - (phys & 0xFFF);
+    if (amount > len)
+      amount = len;
+    page = map_virtual_page ((phys & ~0xFFF) | 3);
+    memcpy (buf, page + (phys & 0xFFF), amount);
+    unmap_virtual_page (page);
+    buf += amount;
+    offset += amount;
+    len -= amount;
+  }
+}
+
+static uint32
+parse_hex (const char *s, int len)
+{
+  uint32 val = 0;
+  for (; len > 0; len--, s++) {
+    val <<= 4;
+    if (*s >= '0' && *s <= '9')
+      val |= *s - '0';
+    else if (*s >= 'a' && *s <= 'f')
+      val |= *s - 'a' + 10;
+    else if (*s >= 'A' && *s <= 'F')
+      val |= *s - 'A' + 10;
+  }
+  return val;
+}
+
+static uint32
+parse_octal (const char *s, int len)
+{
+  uint32 val = 0;
+  for (; len > 0 && *s == ' '; len--, s++);
+  for (; len > 0 && *s >= '0' && *s <= '7'; len--, s++)
+    val = (val << 3) | (*s - '0');
+  return val;
+}
+
+static bool
+name_eq (const char *a, const char *b)
+{
+  while (*a && *a == *b)
+    a++, b++;
+  return *a == *b;
+}
+
+/* Archive members are usually named "./boot/x" or "boot/x"; lookups
+ * come in as "/boot/x".  Strip all of those prefixes. */
+static const char *
+skip_prefix (const char *name)
+{
+  for (;;) {
+    if (name[0] == '/')
+      name++;
+    else if (name[0] == '.' && name[1] == '/')
+      name += 2;
+    else
+      return name;
+  }
+}
+
+static void
+add_file (const char *prefix, const char *name, uint32 offset, uint32 size)
+{
+  ramdisk_file *f;
+  int n = 0;
+
+  if (num_files == RAMDISK_MAX_FILES) {
+    DLOG ("too many files, ignoring %s", name);
+    return;
+  }
+  f = &files[num_files];
+  if (prefix && *prefix) {
+    for (prefix = skip_prefix (prefix);
+         *prefix && n < RAMDISK_NAME_LEN - 2; n++)
+      f->name[n] = *prefix++;
+    f->name[n++] = '/';
+  }
+  for (name = skip_prefix (name); *name && n < RAMDISK_NAME_LEN - 1; n++)
+    f->name[n] = *name++;
+  f->name[n] = '\0';
+  if (*name) {
+    DLOG ("name too long, ignoring %s", f->name);
+    return;
+  }
+  f->offset = offset;
+  f->size = size;
+  num_files++;
+  DLOG ("%s: %d bytes at 0x%X", f->name, size, offset);
+}
+
+static bool
+index_cpio (void)
+{
+  char hdr[CPIO_HDR_LEN], name[RAMDISK_NAME_LEN + 2];
+  uint32 offset = 0, mode, size, namesize;
+
+  while (offset + CPIO_HDR_LEN <= image_len) {
+    image_copy ((uint8 *) hdr, offset, CPIO_HDR_LEN);
+    if (strncmp (hdr, "07070", 5) != 0 || (hdr[5] != '1' && hdr[5] != '2')) {
+      DLOG ("bad cpio header at 0x%X", offset);
+      return FALSE;
+    }
+    mode = parse_hex (hdr + 6 + 8 * CPIO_FIELD_MODE, 8);
+    size = parse_hex (hdr + 6 + 8 * CPIO_FIELD_SIZE, 8);
+    namesize = parse_hex (hdr + 6 + 8 * CPIO_FIELD_NAMESZ, 8);
+    if (namesize > sizeof (name) - 1) {
+      /* only a name we could not store anyway */
+      image_copy ((uint8 *) name, offset + CPIO_HDR_LEN, sizeof (name) - 1);
+      name[sizeof (name) - 1] = '\0';
+    } else {
+      image_copy ((uint8 *) name, offset + CPIO_HDR_LEN, namesize);
+      name[namesize] = '\0';
+    }
+    if (name_eq (name, CPIO_TRAILER))
+      return TRUE;
+
+    offset = (offset + CPIO_HDR_LEN + namesize + 3) & ~3;
+    if (offset + size > image_len) {
+      DLOG ("truncated cpio archive");
+      return FALSE;
+    }
+    if ((mode & S_IFMT) == S_IFREG)
+      add_file (NULL, name, offset, size);
+    offset = (offset + size + 3) & ~3;
+  }
+  return TRUE;
+}
+
+static bool
+index_tar (void)
+{
+  char hdr[TAR_BLOCK];
+  uint32 offset = 0, size;
+
+  while (offset + TAR_BLOCK <= image_len) {
+    image_copy ((uint8 *) hdr, offset, TAR_BLOCK);
+    if (hdr[0] == '\0')
+      /* end-of-archive marker */
+      return TRUE;
+    if (strncmp (hdr + TAR_MAGIC, "ustar", 5) != 0) {
+      DLOG ("bad tar header at 0x%X", offset);
+      return FALSE;
+    }
+    size = parse_octal (hdr + TAR_SIZE, 12);
+    offset += TAR_BLOCK;
+    if (offset + size > image_len) {
+      DLOG ("truncated tar archive");
+      return FALSE;
+    }
+    if (hdr[TAR_TYPE] == '0' || hdr[TAR_TYPE] == '\0') {
+      /* name and prefix need not be NUL-terminated */
+      hdr[TAR_TYPE] = '\0';
+      hdr[TAR_PREFIX + 155] = '\0';
+      hdr[100] = '\0';
+      add_file (hdr + TAR_PREFIX, hdr, offset, size);
+    }
+    offset += (size + TAR_BLOCK - 1) & ~(TAR_BLOCK - 1);
+  }
+  return TRUE;
+}
+
+/* Called from init with a boot module that is not an ELF program. */
+void
+ramdisk_set_image (uint32 phys, uint32 len)
+{
+  image_phys = phys;
+  image_len = len;
+}
+
+bool
+ramdisk_mounted (void)
+{
+  return mounted;
+}
+
+static bool
+ramdisk_mount (void)
+{
+  char magic[6];
+
+  if (!image_len)
+    return FALSE;
+
+  image_copy ((uint8 *) magic, 0, sizeof (magic));
+  if (strncmp (magic, "07070", 5) == 0) {
+    if (!index_cpio ())
+      return FALSE;
+  } else if (image_len >= TAR_BLOCK) {
+    image_copy ((uint8 *) magic, TAR_MAGIC, 5);
+    if (strncmp (magic, "ustar", 5) != 0 || !index_tar ())
+      return FALSE;
+  } else
+    return FALSE;
+
+  printf ("RAM DISK: %d files, %d bytes\n", num_files, image_len);
+  mounted = TRUE;
+  return TRUE;
+}
+
+/* returns file length on success, -1 on failure */
+int
+ramdisk_dir (char *pathname)
+{
+  const char *name = skip_prefix (pathname);
+  int i;
+
+  DLOG ("dir (%s)", pathname);
+  for (i = 0; i < num_files; i++) {
+    if (name_eq (files[i].name, name)) {
+      cur_file = &files[i];
+      cur_pos = 0;
+      return cur_file->size;
+    }
+  }
+  return -1;
+}
+
+int
+ramdisk_read (char *buf, int len)
+{
+  uint32 amount;
+
+  if (!cur_file || len <= 0)
+    return 0;
+  amount = cur_file->size - cur_pos;
+  if (amount > len)
+    amount = len;
+  image_copy ((uint8 *) buf, cur_file->offset + cur_pos, amount);
+  cur_pos += amount;
+  return amount;
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = ramdisk_mount
+};
+
+DEF_MODULE (ramdisk, "RAM disk from a boot module", &mod_ops, {});
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -15,7 +15,10 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* TFTP "filesystem" driver.  TFTP is specified by RFC 1350. */
+/* TFTP "filesystem" driver.  TFTP is specified by RFC 1350, with
+ * option negotiation (RFC 2347) for the block size (RFC 2348),
+ * transfer size (RFC 2349) and window size (RFC 7440).  Servers that
+ * ignore or refuse the options get plain 512-byte stop-and-wait. */
 
 #include "lwip/ip.h"
 #include "lwip/netif.h"
@@ -31,8 +34,15 @@
 
 #define TFTP_PORT 69
 #define TFTP_BLOCK_SIZE 512
-#define BLOCKS_PER_NODE 7       /* 7 * 512 + 8 < 4096 */
-#define TFTP_RING_LEN 4
+/* Largest block we ask for: a 9000-byte jumbo frame less IP, UDP and
+ * TFTP headers.  On a standard Ethernet MTU this comes to 1468. */
+#define TFTP_MAX_BLKSIZE 8960
+#define TFTP_HDR_LEN (20 + 8 + 4)
+/* Blocks in flight per ACK; the ring must hold a whole window. */
+#define TFTP_WINDOWSIZE 16
+#define TFTP_RING_LEN 32
+/* Largest file we will cache */
+#define TFTP_MAX_TSIZE (16 << 20)
 
 /*
  *         opcode  operation
@@ -41,6 +51,7 @@
  *           3     Data (DATA)
  *           4     Acknowledgment (ACK)
  *           5     Error (ERROR)
+ *           6     Option acknowledgment (OACK)
  */
 
 enum {
@@ -48,9 +59,13 @@ enum {
   TFTP_OP_WRQ,
   TFTP_OP_DATA,
   TFTP_OP_ACK,
-  TFTP_OP_ERR
+  TFTP_OP_ERR,
+  TFTP_OP_OACK
 };
 
+/* ERROR code for refused options (RFC 2347) */
+#define TFTP_ERR_OPTION 8
+
 /*
  *           2 bytes     string    1 byte     string   1 byte
  *           ------------------------------------------------
@@ -79,6 +94,14 @@ enum {
  *                        Figure 5-3: ACK packet
  */
 
+/*
+ *  +-------+---~~---+---+---~~---+---+---~~---+---+---~~---+---+
+ *  |  opc  |  opt1  | 0 | value1 | 0 |  optN  | 0 | valueN | 0 |
+ *  +-------+---~~---+---+---~~---+---+---~~---+---+---~~---+---+
+ *
+ *                 RFC 2347: OACK packet
+ */
+
 #ifdef DEBUG_TFTP
 #define DLOG(fmt,...) DLOG_PREFIX("tftp",fmt,##__VA_ARGS__)
 #else
@@ -92,28 +115,110 @@ static struct udp_pcb *pcb;
 static struct pbuf *incoming_buf[TFTP_RING_LEN];
 static circular incoming;
 
-struct _blocklist {
-  struct _blocklist *next;
-  uint32 len, start;
-  uint8 blocks[TFTP_BLOCK_SIZE * BLOCKS_PER_NODE];
-};
-typedef struct _blocklist blocklist_t;
+/* The file is cached in physical frames -- one contiguous run when
+ * the server tells us tsize -- and never kept mapped: each copy in or
+ * out maps the one page it touches. */
+#define TFTP_CACHE_PAGES (TFTP_MAX_TSIZE >> 12)
+static frame_t cache_frames[TFTP_CACHE_PAGES];
+static uint32 cache_pages;      /* frames held */
+static uint32 cache_len;        /* bytes received */
+static uint32 cache_pos;        /* bytes consumed by eztftp_read */
+
+/* requests and control replies; DATA payloads stay in their pbufs */
+static uint8 packet[TFTP_BLOCK_SIZE + 4];
+
+/* append a NUL-terminated string */
+static int
+append_str (uint8 *buf, int pos, int len, const char *str)
+{
+  int n = strlen (str) + 1;
+  if (pos < 0 || pos + n > len)
+    return -1;
+  memcpy (buf + pos, str, n);
+  return pos + n;
+}
 
-blocklist_t *curbuf, *curend;
+static int
+append_num (uint8 *buf, int pos, int len, uint32 val)
+{
+  char digits[11], *p = &digits[10];
+  *p = '\0';
+  do {
+    *--p = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  return append_str (buf, pos, len, p);
+}
 
-/* format a read request */
+/* format a read request, with options if blksize is non-zero */
 static int
-format_rrq (uint8 *buf, int len, const char *filename)
+format_rrq (uint8 *buf, int len, const char *filename,
+            uint32 blksize, uint32 windowsize)
 {
-  int filename_len = strlen (filename);
-  if (2+filename_len+1+6 > len)
+  int pos;
+  if (len < 2)
     return 0;
   memset (buf, 0, len);
   buf[1] = TFTP_OP_RRQ;
-  memcpy (buf+2, filename, filename_len);
-  buf[2+filename_len] = 0;
-  memcpy (buf+2+filename_len+1, "octet\0", 6); /* mode=octet */
-  return 2+filename_len+1+6;
+  pos = append_str (buf, 2, len, filename);
+  pos = append_str (buf, pos, len, "octet"); /* mode=octet */
+  if (blksize) {
+    pos = append_str (buf, pos, len, "blksize");
+    pos = append_num (buf, pos, len, blksize);
+    pos = append_str (buf, pos, len, "tsize");
+    pos = append_num (buf, pos, len, 0);
+    pos = append_str (buf, pos, len, "windowsize");
+    pos = append_num (buf, pos, len, windowsize);
+  }
+  return pos < 0 ? 0 : pos;
+}
+
+static bool
+option_eq (const char *a, const char *b)
+{
+  char ca, cb;
+  do {
+    ca = *a++;
+    cb = *b++;
+    if (ca >= 'A' && ca <= 'Z')
+      ca += 'a' - 'A';
+  } while (ca && ca == cb);
+  return ca == cb;
+}
+
+static uint32
+parse_num (const char *s)
+{
+  uint32 val = 0;
+  while (*s >= '0' && *s <= '9')
+    val = val * 10 + (*s++ - '0');
+  return val;
+}
+
+/* Pick the accepted options out of an OACK.  Options the server left
+ * out keep their RFC 1350 defaults. */
+static void
+parse_oack (uint8 *buf, int len, uint32 *blksize, uint32 *tsize,
+            uint32 *windowsize)
+{
+  char *opt, *val, *end = (char *) buf + len;
+
+  *blksize = TFTP_BLOCK_SIZE;
+  *windowsize = 1;
+  *tsize = 0;
+  buf[len - 1] = '\0';         /* in case the server forgot */
+  for (opt = (char *) buf + 2; opt < end; opt = val + strlen (val) + 1) {
+    val = opt + strlen (opt) + 1;
+    if (val >= end)
+      break;
+    DLOG ("OACK %s=%s", opt, val);
+    if (option_eq (opt, "blksize"))
+      *blksize = parse_num (val);
+    else if (option_eq (opt, "tsize"))
+      *tsize = parse_num (val);
+    else if (option_eq (opt, "windowsize"))
+      *windowsize = parse_num (val);
+  }
 }
 
 static int
@@ -152,76 +257,141 @@ send (uint8 *buf, uint32 len)
   return len;
 }
 
-static blocklist_t *
-alloc_node (void)
+/* Make sure the cache has frames for size bytes. */
+static bool
+grow_cache (uint32 size)
 {
-  uint32 frame = alloc_phys_frame ();
-  if (frame == -1) return NULL;
-  return map_virtual_page (frame | 3);
+  frame_t frame;
+  while (cache_pages << 12 < size) {
+    if (cache_pages == TFTP_CACHE_PAGES)
+      return FALSE;
+    if ((frame = alloc_phys_frame ()) == -1)
+      return FALSE;
+    cache_frames[cache_pages++] = frame;
+  }
+  return TRUE;
 }
 
+/* Set aside frames for a file of the given size, physically
+ * contiguous if possible, so the receive loop only copies. */
 static void
-free_node (blocklist_t *bl)
+reserve_cache (uint32 size)
 {
-  uint32 frame = (uint32) get_phys_addr (bl);
-  unmap_virtual_page (bl);
-  free_phys_frame (frame);
+  uint32 i, n = (size + 0xFFF) >> 12;
+  frame_t base = alloc_phys_frames (n);
+
+  if (base == -1) {
+    grow_cache (size);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    cache_frames[i] = base + (i << 12);
+  cache_pages = n;
 }
 
-#define NODE_CAPACITY (BLOCKS_PER_NODE * TFTP_BLOCK_SIZE)
+/* Release frames reserved past the end of the data. */
 static void
-cache (uint8 *buf, uint32 len)
+trim_cache (void)
 {
-  while (len > 0) {
-    if (curend && curend->len < NODE_CAPACITY) {
-      /* can use existing node */
-      uint32 rem = NODE_CAPACITY - curend->len;
-      uint32 amount = len < rem ? len : rem;
-
-      memcpy (&curend->blocks[curend->len], buf, amount);
-      curend->len += amount;
-      len -= amount;
-      buf += amount;
-    } else {
-      /* need new node */
-      blocklist_t *n = alloc_node ();
-      memset (n, 0, sizeof (blocklist_t));
-      n->next = NULL;
-      n->len = len < NODE_CAPACITY ? len : NODE_CAPACITY;
-      memcpy (n->blocks, buf, n->len);
-      if (curend) {
-        /* append to current end of list */
-        curend->next = n;
-        curend = curend->next;
-      } else
-        /* starting new list */
-        curbuf = curend = n;
-      len -= n->len;
-      buf += n->len;
-    }
-  }
+  uint32 used = (cache_len + 0xFFF) >> 12;
+  while (cache_pages > used)
+    free_phys_frame (cache_frames[--cache_pages]);
 }
 
 static void
 free_cache (void)
 {
-  blocklist_t *bl;
-  if (curbuf) {
-    for (bl = curbuf; curbuf;) {
-      bl = bl->next;
-      free_node (curbuf);
-      curbuf = bl;
+  /* eztftp_read has already released the pages it finished */
+  uint32 i = (cache_pos == cache_len ? cache_pos + 0xFFF : cache_pos) >> 12;
+  for (; i < cache_pages; i++)
+    free_phys_frame (cache_frames[i]);
+  cache_pages = cache_len = cache_pos = 0;
+}
+
+/* Append the payload of a DATA packet, straight from the pbuf chain,
+ * to the cache. */
+static bool
+cache (struct pbuf *p, uint32 offset)
+{
+  struct pbuf *q;
+  uint8 *src, *page;
+  uint32 len, amount;
+
+  if (!grow_cache (cache_len + p->tot_len - offset)) {
+    DLOG ("out of memory caching file");
+    return FALSE;
+  }
+
+  for (q = p; q; q = q->next) {
+    if (offset >= q->len) {
+      offset -= q->len;
+      continue;
+    }
+    src = (uint8 *) q->payload + offset;
+    len = q->len - offset;
+    offset = 0;
+    while (len > 0) {
+      amount = 0x1000 - (cache_len & 0xFFF);
+      if (amount > len)
+        amount = len;
+      page = map_virtual_page (cache_frames[cache_len >> 12] | 3);
+      memcpy (page + (cache_len & 0xFFF), src, amount);
+      unmap_virtual_page (page);
+      cache_len += amount;
+      src += amount;
+      len -= amount;
     }
   }
-  curend = curbuf = NULL;
+  return TRUE;
+}
+
+/* Wait for the next packet from the server.  Its first four bytes
+ * (opcode and block number or error code) are copied into hdr; the
+ * rest stays in the pbuf, which the caller frees. */
+static struct pbuf *
+receive (uint8 *hdr)
+{
+  struct pbuf *p;
+
+  do
+    circular_remove (&incoming, &p);
+  while (!p);
+
+  memset (hdr, 0, 4);
+  pbuf_copy_partial (p, hdr, 4, 0);
+  return p;
+}
+
+/* Copy a control packet (OACK or ERROR) into buf, NUL-terminated. */
+static uint32
+receive_control (struct pbuf *p, uint8 *buf, uint32 size)
+{
+  uint32 len = p->tot_len < size ? p->tot_len : size - 1;
+  len = pbuf_copy_partial (p, buf, len, 0);
+  buf[len] = '\0';
+  return len;
+}
+
+static void
+send_ack (uint16 block)
+{
+  uint8 ack[4];
+  ack[0] = 0;
+  ack[1] = TFTP_OP_ACK;
+  ack[2] = block >> 8;
+  ack[3] = block & 0xFF;
+  send (ack, 4);
 }
 
 int
 eztftp_dir (char *pathname)
 {
-  struct pbuf *p, *q;
-  uint8 buf[TFTP_BLOCK_SIZE+4], *ins;
-  uint32 len, rem, filesize=0;
+  uint8 *buf = packet, hdr[4];
+  struct pbuf *p;
+  uint32 len, blksize, tsize, windowsize, want_blksize;
+  uint16 block, expected = 1;
+  uint window_count = 0;
+  bool options = TRUE, resync = FALSE;
 
   circular_init (&incoming, incoming_buf,
                  TFTP_RING_LEN, sizeof (struct pbuf *));
@@ -231,99 +401,136 @@ eztftp_dir (char *pathname)
     /* some servers don't like leading slash */
     pathname++;
 
-  if (curbuf) free_cache ();
+  free_cache ();
+
+  /* largest block that fits one frame on this interface */
+  want_blksize = server_if->mtu > TFTP_HDR_LEN + TFTP_BLOCK_SIZE ?
+    server_if->mtu - TFTP_HDR_LEN : TFTP_BLOCK_SIZE;
+  if (want_blksize > TFTP_MAX_BLKSIZE)
+    want_blksize = TFTP_MAX_BLKSIZE;
+
+ request:
+  blksize = TFTP_BLOCK_SIZE;
+  windowsize = 1;
 
   /* format and send a read request */
-  len = format_rrq (buf, TFTP_BLOCK_SIZE+4, pathname);
+  len = format_rrq (buf, sizeof (packet), pathname,
+                    options ? want_blksize : 0, TFTP_WINDOWSIZE);
   server_port = TFTP_PORT;
-  if (send (buf, len) < 0) {
+  if (len == 0 || send (buf, len) < 0) {
     DLOG ("failed to send request: %d %s", *((u16 *) buf), buf+2);
     return -1;
   }
 
-  /* fetch file loop */
-  rem = TFTP_BLOCK_SIZE+4; len=0; ins=buf;
-  for (;;) {
-    /* wait for incoming data */
-    circular_remove (&incoming, &p);
-    if (!p) continue;
-
-    while (rem > 0) {
-      /* copy data from current pbuf */
-      memcpy (ins, p->payload, p->len);
-
-      /* adjust counters */
-      rem -= p->len;
-      ins += p->len;
-      len += p->len;
-
-      /* chop pbuf off */
-      q = p->next;
-      if (q) pbuf_ref (q);
-      pbuf_free (p);
-      p = q;
-
-      /* if last pbuf in chain */
-      if (!p) break;
+  /* the first reply says whether the options were taken */
+  p = receive (hdr);
+  if (p->tot_len >= 2 && hdr[1] == TFTP_OP_OACK) {
+    len = receive_control (p, buf, sizeof (packet));
+    pbuf_free (p);
+    parse_oack (buf, len, &blksize, &tsize, &windowsize);
+    if (blksize < 8 || blksize > want_blksize || windowsize == 0) {
+      DLOG ("server chose bad options");
+      return -1;
     }
+    DLOG ("blksize=%d tsize=%d windowsize=%d", blksize, tsize, windowsize);
+    if (tsize > TFTP_MAX_TSIZE) {
+      DLOG ("file too large to cache");
+      return -1;
+    }
+    if (tsize > 0)
+      reserve_cache (tsize);
+    send_ack (0);
+    p = receive (hdr);
+  } else if (p->tot_len >= 4 && hdr[1] == TFTP_OP_ERR &&
+             ((hdr[2] << 8) | hdr[3]) == TFTP_ERR_OPTION && options) {
+    DLOG ("server refused options, retrying without");
+    pbuf_free (p);
+    options = FALSE;
+    goto request;
+  }
 
-    /* check for valid DATA packet */
-    if (buf[1] == TFTP_OP_DATA) {
-      DLOG ("received DATA packet num=0x%.04X len=%d bytes",
-            (buf[2] << 8) | buf[3], len-4);
-      /* send ACK the easy way */
-      buf[1] = TFTP_OP_ACK;
-      send (buf, 4);
-      /* now put the data on our cached pbuf chain */
-      cache (buf+4, len-4);
-    } else if (buf[1] == TFTP_OP_ERR) {
+  /* fetch file loop */
+  for (;;) {
+    len = p->tot_len;
+    if (len >= 4 && hdr[1] == TFTP_OP_DATA) {
+      block = (hdr[2] << 8) | hdr[3];
+      if (block == expected) {
+        /* now put the data on the cache */
+        if (!cache (p, 4)) {
+          pbuf_free (p);
+          free_cache ();
+          return -1;
+        }
+        expected++;
+        resync = FALSE;
+        if (++window_count == windowsize || len - 4 < blksize) {
+          send_ack (block);
+          window_count = 0;
+        }
+        if (len - 4 < blksize) {
+          /* that was the last packet */
+          pbuf_free (p);
+          break;
+        }
+      } else if (!resync) {
+        /* a block went missing or the server resent an old window:
+         * ACK the last block received in order, once, and wait for
+         * the server to continue from there (RFC 7440) */
+        DLOG ("got block 0x%.04X, expected 0x%.04X", block, expected);
+        send_ack (expected - 1);
+        window_count = 0;
+        resync = TRUE;
+      }
+    } else if (len >= 2 && hdr[1] == TFTP_OP_OACK && expected == 1) {
+      /* our ACK of the OACK was lost */
+      send_ack (0);
+    } else if (len >= 4 && hdr[1] == TFTP_OP_ERR) {
       /* got error, probably file not found */
+      receive_control (p, buf, sizeof (packet));
       DLOG ("error code=%d str=%s", (buf[2] << 8) | buf[3], &buf[4]);
+      pbuf_free (p);
+      free_cache ();
       return -1;
     } else {
       /* discard buffer */
-      DLOG ("received unexpected packet opcode=%d", buf[1]);
+      DLOG ("received unexpected packet opcode=%d", hdr[1]);
     }
 
-    filesize += len-4;
-
-    if (len - 4 < TFTP_BLOCK_SIZE)
-      /* that was the last packet */
-      break;
-
-    /* reset buffer */
-    rem = TFTP_BLOCK_SIZE+4; len=0; ins=buf;
+    pbuf_free (p);
+    p = receive (hdr);
   }
 
-  DLOG ("opened file size=%d bytes", filesize);
-  return filesize;
+  trim_cache ();
+  DLOG ("opened file size=%d bytes", cache_len);
+  return cache_len;
 }
 
 int
 eztftp_read (char *buf, int len)
 {
-  char *ptr = buf;
+  uint8 *page;
   int actual = 0;
+  uint32 amount, offset;
   DLOG ("read (%p, %d)", buf, len);
-  while (len > 0 && curbuf) {
-    int amount = len < curbuf->len ? len : curbuf->len;
-
-    /* copy data from current node */
-    memcpy (ptr, &curbuf->blocks[curbuf->start], amount);
-    ptr += amount;
+  while (len > 0 && cache_pos < cache_len) {
+    offset = cache_pos & 0xFFF;
+    amount = 0x1000 - offset;
+    if (amount > cache_len - cache_pos)
+      amount = cache_len - cache_pos;
+    if (amount > len)
+      amount = len;
+
+    /* copy data from the current page */
+    page = map_virtual_page (cache_frames[cache_pos >> 12] | 3);
+    memcpy (buf + actual, page + offset, amount);
+    unmap_virtual_page (page);
     actual += amount;
-    curbuf->start += amount;
     len -= amount;
-    curbuf->len -= amount;
-
-    /* check if current node is empty */
-    if (curbuf->len <= 0) {
-      blocklist_t *n = curbuf->next;
-      free_node (curbuf);
-      curbuf = n;
-      if (curbuf == NULL)
-        curend = NULL;
-    }
+    cache_pos += amount;
+
+    /* release each page once it has been read */
+    if ((cache_pos & 0xFFF) == 0 || cache_pos == cache_len)
+      free_phys_frame (cache_frames[(cache_pos - 1) >> 12]);
   }
 
   return actual;
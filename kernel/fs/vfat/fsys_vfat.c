@@ -40,6 +40,8 @@
 #include "drivers/usb/umsc.h"
 #include "arch/i386.h"
 #include "util/printf.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
 #include "types.h"
 
 //#define DEBUG_VFAT
@@ -52,20 +54,47 @@
 #define UMSC_DEVICE_INDEX 0
 #define VFAT_FIRST_PARTITION 63
 
+/* Largest single request handed to the mass-storage driver. */
+#define VFAT_MAX_XFER_SECTORS 128
+
+/* Last sector read for a partial access; directory scans read one
+ * 32-byte entry at a time and would otherwise re-read it each time. */
+static uint8 vfat_sector_buf[SECTOR_SIZE];
+static int vfat_sector_num = -1;
+
 static int
 devread_vfat (int sector, int byte_offset, int byte_len, char *buf)
 {
-  uint8 s[512];
-  int len = byte_len;
+  uint8 *s = vfat_sector_buf;
+  int len = byte_len, n;
+  sector += byte_offset / SECTOR_SIZE;
+  byte_offset %= SECTOR_SIZE;
   sector+=VFAT_FIRST_PARTITION; /* offset into the first partition */
   DLOG ("fsys_vfat: devread_vfat (%d, %d, %d, %p)",
         sector, byte_offset, byte_len, buf);
   while (len > 0) {
-    if (umsc_read_sector (UMSC_DEVICE_INDEX, sector, s, sizeof (s)) != sizeof (s))
-      return 0;
+    if (byte_offset == 0 && len >= SECTOR_SIZE) {
+      /* Run of whole sectors: one bulk read straight into buf. */
+      n = len / SECTOR_SIZE;
+      if (n > VFAT_MAX_XFER_SECTORS)
+        n = VFAT_MAX_XFER_SECTORS;
+      if (umsc_read_sectors (UMSC_DEVICE_INDEX, sector, n, (uint8 *) buf,
+                             n * SECTOR_SIZE) != n * SECTOR_SIZE)
+        return 0;
+      len -= n * SECTOR_SIZE;
+      buf += n * SECTOR_SIZE;
+      sector += n;
+      continue;
+    }
+    if (sector != vfat_sector_num) {
+      vfat_sector_num = -1;
+      if (umsc_read_sector (UMSC_DEVICE_INDEX, sector, s, SECTOR_SIZE) != SECTOR_SIZE)
+        return 0;
+      vfat_sector_num = sector;
+    }
     int seclen;
-    if (len > sizeof (s) - byte_offset)
-      seclen = sizeof (s) - byte_offset;
+    if (len > SECTOR_SIZE - byte_offset)
+      seclen = SECTOR_SIZE - byte_offset;
     else
       seclen = len;
     memcpy (buf, &s[byte_offset], seclen);
@@ -232,8 +261,6 @@ struct fat_superblock
 
   int cached_fat;
   int file_cluster;
-  int current_cluster_num;
-  int current_cluster;
 };
 
 static int errnum;
@@ -250,6 +277,30 @@ static int filemax;
 
 #define FAT_CACHE_SIZE 2048
 
+/* The whole FAT is read into memory at mount time when it fits in
+ * VFAT_FAT_MAX_PAGES; otherwise entries are fetched through the
+ * FAT_CACHE_SIZE window in FAT_BUF. */
+#define VFAT_FAT_MAX_PAGES 64
+static uint8 *vfat_fat = NULL;
+static uint32 vfat_fat_pages = 0;
+
+/* Cluster-run map of the open file: logical clusters
+ * [logical, logical + count) live in clusters [cluster, cluster +
+ * count).  Built when the file is opened; if a file has more than
+ * VFAT_MAX_RUNS runs the map is rebuilt from the next run onward as
+ * reads move past its end. */
+#define VFAT_MAX_RUNS 256
+struct vfat_run
+{
+  int logical, cluster, count;
+};
+static struct vfat_run vfat_runs[VFAT_MAX_RUNS];
+static int vfat_num_runs;
+static int vfat_run_hint;
+static int vfat_runs_next_cluster; /* continuation, or 0 at EOF */
+static int vfat_runs_next_logical;
+static bool vfat_runs_corrupt;  /* chain ended in a bad entry */
+
 static __inline__ unsigned long
 log2 (unsigned long word)
 {
@@ -260,12 +311,60 @@ log2 (unsigned long word)
 }
 
 static bool mounted = FALSE;
+
+/* Read the part of the FAT covering num_clust entries into memory
+ * with bulk reads.  Leaves vfat_fat NULL if it does not fit. */
+static void
+vfat_load_fat (void)
+{
+  uint32 bytes, pages, frames;
+
+  if (vfat_fat)
+    {
+      unmap_virtual_pages (vfat_fat, vfat_fat_pages);
+      free_phys_frames ((uint32) get_phys_addr (vfat_fat), vfat_fat_pages);
+      vfat_fat = NULL;
+    }
+
+  /* 4 spare bytes: entries are fetched with 32-bit loads */
+  bytes = ((FAT_SUPER->num_clust * FAT_SUPER->fat_size + 1) >> 1) + 4;
+  pages = (bytes + 0xFFF) >> 12;
+  if (pages > VFAT_FAT_MAX_PAGES)
+    return;
+
+  frames = alloc_phys_frames (pages);
+  if (frames == -1)
+    return;
+  vfat_fat = map_contiguous_virtual_pages (frames | 3, pages);
+  if (vfat_fat == NULL)
+    {
+      free_phys_frames (frames, pages);
+      return;
+    }
+  vfat_fat_pages = pages;
+  memset (vfat_fat, 0, pages << 12);
+
+  bytes = (bytes + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+  if (bytes > FAT_SUPER->fat_length * SECTOR_SIZE)
+    bytes = FAT_SUPER->fat_length * SECTOR_SIZE;
+  if (!devread_vfat (FAT_SUPER->fat_offset, 0, bytes, (char *) vfat_fat))
+    {
+      unmap_virtual_pages (vfat_fat, pages);
+      free_phys_frames (frames, pages);
+      vfat_fat = NULL;
+    }
+  DLOG ("FAT of %d clusters %s", FAT_SUPER->num_clust,
+        vfat_fat ? "loaded" : "not loaded");
+}
+
 int
 vfat_mount (void)
 {
   struct fat_bpb bpb;
   __u32 magic, first_fat;
 
+  vfat_sector_num = -1;
+
   /* Read bpb */
   if (! devread_vfat (0, 0, sizeof (bpb), (char *) &bpb))
     return 0;
@@ -382,10 +481,149 @@ vfat_mount (void)
     return 0;
 
   FAT_SUPER->cached_fat = - 2 * FAT_CACHE_SIZE;
+  vfat_load_fat ();
   mounted = TRUE;
   return 1;
 }
 
+/* Return the FAT entry for cluster, i.e. the next cluster of the
+ * chain, or -1 on a read error. */
+static int
+vfat_next_cluster (int cluster)
+{
+  int fat_entry = cluster * FAT_SUPER->fat_size;
+  int next_cluster;
+  uint8 *fat;
+
+  if (vfat_fat) {
+    fat = vfat_fat + (fat_entry >> 1);
+  } else {
+    int cached_pos = (fat_entry - FAT_SUPER->cached_fat);
+
+    if (cached_pos < 0 ||
+        (cached_pos + FAT_SUPER->fat_size) > 2*FAT_CACHE_SIZE)
+      {
+        int sector;
+        FAT_SUPER->cached_fat = (fat_entry & ~(2*SECTOR_SIZE - 1));
+        cached_pos = (fat_entry - FAT_SUPER->cached_fat);
+        sector = FAT_SUPER->fat_offset
+          + FAT_SUPER->cached_fat / (2*SECTOR_SIZE);
+        if (!devread_vfat (sector, 0, FAT_CACHE_SIZE, (char*) FAT_BUF))
+          return -1;
+      }
+    fat = (uint8 *) FAT_BUF + (cached_pos >> 1);
+  }
+
+  next_cluster = * (unsigned long *) fat;
+  if (FAT_SUPER->fat_size == 3)
+    {
+      if (fat_entry & 1)
+        next_cluster >>= 4;
+      next_cluster &= 0xFFF;
+    }
+  else if (FAT_SUPER->fat_size == 4)
+    next_cluster &= 0xFFFF;
+  else
+    next_cluster &= 0x0FFFFFFF;
+
+  return next_cluster;
+}
+
+/* Build the run map starting at the given logical cluster of the
+ * file, whose physical cluster is cluster. */
+static void
+vfat_map_runs (int cluster, int logical)
+{
+  struct vfat_run *r = NULL;
+  int next, steps;
+
+  vfat_num_runs = 0;
+  vfat_run_hint = 0;
+  vfat_runs_next_cluster = 0;
+  vfat_runs_corrupt = FALSE;
+
+  if (cluster < 2 || cluster >= FAT_SUPER->num_clust)
+    return;
+
+  /* Bound the walk so a cyclic chain cannot hang us. */
+  for (steps = 0; steps < FAT_SUPER->num_clust; steps++)
+    {
+      if (r && r->cluster + r->count == cluster)
+        r->count++;
+      else
+        {
+          if (vfat_num_runs == VFAT_MAX_RUNS)
+            {
+              vfat_runs_next_cluster = cluster;
+              vfat_runs_next_logical = logical;
+              return;
+            }
+          r = &vfat_runs[vfat_num_runs++];
+          r->logical = logical;
+          r->cluster = cluster;
+          r->count = 1;
+        }
+      logical++;
+
+      next = vfat_next_cluster (cluster);
+      if (next >= FAT_SUPER->clust_eof_marker)
+        return;
+      if (next < 2 || next >= FAT_SUPER->num_clust)
+        break;
+      cluster = next;
+    }
+  vfat_runs_corrupt = TRUE;
+}
+
+/* Make cluster the start of the current file. */
+static void
+vfat_open_cluster (int cluster)
+{
+  FAT_SUPER->file_cluster = cluster;
+  filepos = 0;
+  if (cluster >= 0)
+    vfat_map_runs (cluster, 0);
+}
+
+/* Find the run holding logical cluster, remapping if it lies beyond
+ * a partial map.  Returns NULL at end of file, setting errnum if the
+ * chain ended in a bad entry. */
+static struct vfat_run *
+vfat_find_run (int logical)
+{
+  struct vfat_run *r;
+
+  if (vfat_num_runs == 0 || logical < vfat_runs[0].logical)
+    {
+      /* behind a partial map: rebuild it from the start of the file */
+      if (vfat_num_runs > 0 && vfat_runs[0].logical > 0)
+        vfat_map_runs (FAT_SUPER->file_cluster, 0);
+      if (vfat_num_runs == 0)
+        goto eof;
+    }
+
+  if (vfat_run_hint >= vfat_num_runs
+      || logical < vfat_runs[vfat_run_hint].logical)
+    vfat_run_hint = 0;
+
+  for (;;)
+    {
+      for (; vfat_run_hint < vfat_num_runs; vfat_run_hint++)
+        {
+          r = &vfat_runs[vfat_run_hint];
+          if (logical < r->logical + r->count)
+            return r;
+        }
+      if (!vfat_runs_next_cluster)
+        goto eof;
+      vfat_map_runs (vfat_runs_next_cluster, vfat_runs_next_logical);
+    }
+ eof:
+  if (vfat_runs_corrupt)
+    errnum = ERR_FSYS_CORRUPT;
+  return NULL;
+}
+
 int
 vfat_read (char *buf, int len)
 {
@@ -393,6 +631,7 @@ vfat_read (char *buf, int len)
   int offset;
   int ret = 0;
   int size;
+  struct vfat_run *r;
 
   errnum=0;
 
@@ -408,72 +647,32 @@ vfat_read (char *buf, int len)
       return size;
     }
 
-  logical_clust = filepos >> FAT_SUPER->clustsize_bits;
-  offset = (filepos & ((1 << FAT_SUPER->clustsize_bits) - 1));
-  if (logical_clust < FAT_SUPER->current_cluster_num)
-    {
-      FAT_SUPER->current_cluster_num = 0;
-      FAT_SUPER->current_cluster = FAT_SUPER->file_cluster;
-    }
-
   while (len > 0)
     {
       int sector;
-      while (logical_clust > FAT_SUPER->current_cluster_num)
-        {
-          /* calculate next cluster */
-          int fat_entry =
-            FAT_SUPER->current_cluster * FAT_SUPER->fat_size;
-          int next_cluster;
-          int cached_pos = (fat_entry - FAT_SUPER->cached_fat);
-
-          if (cached_pos < 0 ||
-              (cached_pos + FAT_SUPER->fat_size) > 2*FAT_CACHE_SIZE)
-            {
-              FAT_SUPER->cached_fat = (fat_entry & ~(2*SECTOR_SIZE - 1));
-              cached_pos = (fat_entry - FAT_SUPER->cached_fat);
-              sector = FAT_SUPER->fat_offset
-                + FAT_SUPER->cached_fat / (2*SECTOR_SIZE);
-              if (!devread_vfat (sector, 0, FAT_CACHE_SIZE, (char*) FAT_BUF))
-                return 0;
-            }
-          next_cluster = * (unsigned long *) (FAT_BUF + (cached_pos >> 1));
-          if (FAT_SUPER->fat_size == 3)
-            {
-              if (cached_pos & 1)
-                next_cluster >>= 4;
-              next_cluster &= 0xFFF;
-            }
-          else if (FAT_SUPER->fat_size == 4)
-            next_cluster &= 0xFFFF;
 
-          if (next_cluster >= FAT_SUPER->clust_eof_marker)
-            return ret;
-          if (next_cluster < 2 || next_cluster >= FAT_SUPER->num_clust)
-            {
-              errnum = ERR_FSYS_CORRUPT;
-              return 0;
-            }
+      logical_clust = filepos >> FAT_SUPER->clustsize_bits;
+      offset = (filepos & ((1 << FAT_SUPER->clustsize_bits) - 1));
 
-          FAT_SUPER->current_cluster = next_cluster;
-          FAT_SUPER->current_cluster_num++;
-        }
+      if (!(r = vfat_find_run (logical_clust)))
+        break;
 
+      /* read as far as the run reaches in one go */
       sector = FAT_SUPER->data_offset +
-        ((FAT_SUPER->current_cluster - 2) << (FAT_SUPER->clustsize_bits
-                                              - FAT_SUPER->sectsize_bits));
-      size = (1 << FAT_SUPER->clustsize_bits) - offset;
+        ((r->cluster + (logical_clust - r->logical) - 2)
+         << (FAT_SUPER->clustsize_bits - FAT_SUPER->sectsize_bits));
+      size = ((r->logical + r->count - logical_clust)
+              << FAT_SUPER->clustsize_bits) - offset;
       if (size > len)
         size = len;
 
-      devread_vfat(sector, offset, size, buf);
+      if (!devread_vfat(sector, offset, size, buf))
+        return 0;
 
       len -= size;
       buf += size;
       ret += size;
       filepos += size;
-      logical_clust++;
-      offset = 0;
     }
   return errnum ? 0 : ret;
 }
@@ -495,9 +694,7 @@ vfat_dir (char *dirname)
   int slot = -2;
   int alias_checksum = -1;
 
-  FAT_SUPER->file_cluster = FAT_SUPER->root_cluster;
-  filepos = 0;
-  FAT_SUPER->current_cluster_num = MAXINT;
+  vfat_open_cluster (FAT_SUPER->root_cluster);
 
   /* main loop to find desired directory entry */
  loop:
@@ -632,9 +829,7 @@ vfat_dir (char *dirname)
 
   attrib = FAT_DIRENTRY_ATTRIB (dir_buf);
   filemax = FAT_DIRENTRY_FILELENGTH (dir_buf);
-  filepos = 0;
-  FAT_SUPER->file_cluster = FAT_DIRENTRY_FIRST_CLUSTER (dir_buf);
-  FAT_SUPER->current_cluster_num = MAXINT;
+  vfat_open_cluster (FAT_DIRENTRY_FIRST_CLUSTER (dir_buf));
 
   /* go back to main loop at top of function */
   goto loop;
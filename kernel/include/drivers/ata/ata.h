@@ -28,6 +28,7 @@
 typedef struct
 {
   uint32 ata_type, ata_bus, ata_drive;
+  uint32 ata_sectors;           /* 28-bit LBA addressable sectors */
 } ata_info;
 
 extern ata_info pata_drives[4];
@@ -55,6 +56,7 @@ extern ata_info pata_drives[4];
 #define ATA_DRIVE_MASTER    0xA0
 #define ATA_DRIVE_SLAVE     0xB0
 
+#define ATA_SECTOR_SIZE 512
 /* The default and seemingly universal sector size for CD-ROMs. */
 #define ATAPI_SECTOR_SIZE 2048
 
@@ -65,6 +67,8 @@ int ata_drive_write_sector (uint32 bus, uint32 drive, uint32 lba,
                             uint8 * buffer);
 int atapi_drive_read_sector (uint32 bus, uint32 drive, uint32 lba,
                              uint8 * buffer);
+int atapi_drive_read_sectors (uint32 bus, uint32 drive, uint32 lba,
+                              uint32 count, uint8 * buffer);
 
 #endif
 
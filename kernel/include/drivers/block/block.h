@@ -0,0 +1,66 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#include "types.h"
+
+#define BLOCK_MAX_DEVICES 16
+#define BLOCK_NAME_LEN 8
+
+struct _block_device;
+
+/* Transfer count sectors starting at lba between the device and buf.
+ * Never asked for more than max_sectors at once.  Returns the number
+ * of bytes moved, or -1 on error. */
+typedef sint (*block_xfer_func_t)(struct _block_device *dev, uint32 lba,
+                                  uint count, uint8 *buf);
+
+typedef struct _block_device {
+  /* device name, e.g. "hd0" or "sd0" */
+  char name[BLOCK_NAME_LEN];
+  uint32 sector_size;
+  u64 num_sectors;
+  /* largest request the driver accepts */
+  uint max_sectors;
+  /* required buffer alignment (power of 2); misaligned requests are
+   * bounced by the block layer */
+  uint32 dma_align;
+  block_xfer_func_t read_func;
+  block_xfer_func_t write_func;
+  /* driver-specific field */
+  void *drvdata;
+} block_device;
+
+bool block_register_device (block_device *);
+block_device *block_lookup (char *name);
+sint block_read (block_device *, uint32 lba, uint count, uint8 *buf);
+sint block_write (block_device *, uint32 lba, uint count, uint8 *buf);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
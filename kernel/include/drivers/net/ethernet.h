@@ -21,14 +21,19 @@
 #include "types.h"
 #include "lwip/netif.h"
 
+/* largest frame the copying paths take, and the MTU to go with it */
 #define MAX_FRAME_SIZE 1600
 #define ETH_ADDR_LEN 6
+#define ETH_MTU 1500
 
 struct _ethernet_device;
 
 typedef void (*packet_recv_func_t)(struct _ethernet_device *dev,
                                    uint8* buffer, sint len);
+typedef void (*packet_recv_pbuf_func_t)(struct _ethernet_device *dev,
+                                        struct pbuf *p);
 typedef sint (*packet_send_func_t)(uint8* buffer, sint len);
+typedef sint (*packet_send_pbuf_func_t)(struct pbuf *p);
 typedef bool (*get_hwaddr_func_t)(uint8 addr[ETH_ADDR_LEN]);
 typedef void (*packet_poll_func_t)(void);
 
@@ -38,13 +43,25 @@ typedef struct _ethernet_device {
   /* function that should be invoked by the driver when a packet
    * arrives on its device */
   packet_recv_func_t recv_func;
+  /* same, for a driver that passes up the frame in a pbuf it filled
+   * itself (typically pool pbufs it copied its receive buffers into)
+   * instead of having it copied again */
+  packet_recv_pbuf_func_t recv_pbuf_func;
   /* function that should be invoked by other subsystems to send a
    * packet out on this device */
   packet_send_func_t send_func;
+  /* same, taking the frame as a pbuf chain which the driver points
+   * its descriptors at directly.  The driver holds a reference on the
+   * chain until the hardware is done with it.  Returns the frame
+   * length, or 0 if there is no room at the moment. */
+  packet_send_pbuf_func_t send_pbuf_func;
   /* function that populates a buffer with the hardware address */
   get_hwaddr_func_t  get_hwaddr_func;
   /* function that attempts to poll the network device */
   packet_poll_func_t poll_func;
+  /* largest MTU the driver can send and receive (jumbo frames); 0
+   * means the standard ETH_MTU */
+  uint16 max_mtu;
   /* lwip network interface struct */
   struct netif netif;
   /* driver-specific field */
@@ -56,8 +73,35 @@ bool net_register_device (ethernet_device *);
 bool net_set_default (char *devname);
 bool net_dhcp_start (char *devname);
 bool net_set_up (char *devname);
+bool net_set_mtu (char *devname, uint16 mtu);
 bool net_static_config(char *devname, char *myip_s, char *gwip_s, char *netmask_s);
 
+/* A physically contiguous piece of an outgoing frame */
+typedef struct {
+  uint32 phys;
+  uint16 len;
+} net_tx_seg_t;
+
+uint net_tx_segments (struct pbuf *p, net_tx_seg_t *segs, uint max);
+
+/* Checksum offload for an outgoing frame: frame offsets of the IP and
+ * TCP/UDP headers and their checksum fields, and which of the two
+ * checksums the hardware should insert.  For TCP segmentation
+ * offload, also the payload of each segment to cut and the length of
+ * the headers repeated in front of it. */
+typedef struct {
+  uint8 ipcss, ipcso;
+  uint16 ipcse;                 /* last byte of the IP header */
+  uint8 tucss, tucso;
+  bool tcp;
+  bool ip_csum, l4_csum;
+  uint16 mss;                   /* 0 = no segmentation */
+  uint8 hdrlen;
+} net_tx_csum_t;
+
+bool net_tx_csum (struct pbuf *p, net_tx_csum_t *c);
+bool net_tx_tso (struct pbuf *p, uint16 mss, net_tx_csum_t *c);
+
 
 /* From Linux */
 
@@ -0,0 +1,104 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NET_SOCKET_H_
+#define _NET_SOCKET_H_
+
+#include "kernel.h"
+
+/* Socket syscall interface (int $0x3D).  EAX selects the operation,
+ * EBX/ECX/EDX/ESI carry up to four arguments.  Keep in sync with
+ * libc/include/socket.h. */
+
+#define SOCK_OP_SOCKET        0
+#define SOCK_OP_BIND          1
+#define SOCK_OP_LISTEN        2
+#define SOCK_OP_ACCEPT        3
+#define SOCK_OP_CONNECT       4
+#define SOCK_OP_SEND          5
+#define SOCK_OP_RECV          6
+#define SOCK_OP_CLOSE         7
+#define SOCK_OP_EPOLL_CREATE  8
+#define SOCK_OP_EPOLL_CTL     9
+#define SOCK_OP_EPOLL_WAIT   10
+
+#define SOCK_STREAM   1
+#define SOCK_NONBLOCK 0x800     /* or'd into the type */
+
+/* Number of sockets, system-wide.  Each one needs a TCP PCB, see
+ * MEMP_NUM_TCP_PCB; the PCBs are static and live in the kernel's 4 MB
+ * window, at a couple of hundred bytes apiece.  That window, not
+ * receive data (which is bounded per socket and in total, see
+ * socket.c), is what keeps this in the hundreds. */
+#define SOCK_MAX     256
+/* Number of epoll instances; their descriptors follow the sockets' */
+#define EPOLL_MAX    16
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+/* Events are always edge-triggered: a socket is reported once per
+ * change in its state, not for as long as it stays ready. */
+#define EPOLLIN     0x001
+#define EPOLLOUT    0x004
+#define EPOLLERR    0x008
+#define EPOLLHUP    0x010
+#define EPOLLRDHUP  0x2000
+
+struct epoll_event {
+  uint32 events;
+  uint32 data;
+};
+
+/* Errors come back as negative return values */
+#define SOCK_ENOENT        2
+#define SOCK_EBADF         9
+#define SOCK_EAGAIN       11
+#define SOCK_ENOMEM       12
+#define SOCK_EFAULT       14
+#define SOCK_EEXIST       17
+#define SOCK_EINVAL       22
+#define SOCK_EMFILE       24
+#define SOCK_EPIPE        32
+#define SOCK_EADDRINUSE   98
+#define SOCK_ENETDOWN    100
+#define SOCK_ECONNRESET  104
+#define SOCK_EISCONN     106
+#define SOCK_ENOTCONN    107
+#define SOCK_ETIMEDOUT   110
+#define SOCK_ECONNREFUSED 111
+#define SOCK_EALREADY    114
+#define SOCK_EINPROGRESS 115
+
+extern void sock_init (void);
+extern sint32 _socketcall (uint32 op, uint32 a, uint32 b, uint32 c, uint32 d);
+extern void sock_release_task (task_id owner);
+extern void sock_tmr_process (void);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
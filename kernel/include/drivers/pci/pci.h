@@ -141,6 +141,16 @@ extern bool pci_irq_map_handler (pci_irq_t *irq, vector_handler handler,
                                  IOAPIC_destination_mode_t destmode,
                                  IOAPIC_delivery_mode_t delivmode);
 
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+
+extern uint8 pci_find_capability (uint8 bus, uint8 dev, uint8 func, uint8 id);
+extern bool pci_irq_map_msi_handler (uint8 bus, uint8 dev, uint8 func,
+                                     vector_handler handler, uint8 destmask);
+extern bool pci_irq_map_msix_handler (uint8 bus, uint8 dev, uint8 func,
+                                      uint entry, vector_handler handler,
+                                      uint8 destmask);
+
 /* ************************************************** */
 
 #define PCI_CONFIG_ADDRESS 0xCF8
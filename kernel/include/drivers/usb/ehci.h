@@ -0,0 +1,204 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EHCI_H_
+#define _EHCI_H_
+
+#include <types.h>
+#include <drivers/usb/usb.h>
+
+/* Capability registers */
+#define EHCI_CAPLENGTH  0x00
+#define EHCI_HCSPARAMS  0x04
+#define EHCI_HCCPARAMS  0x08
+
+#define EHCI_HCS_N_PORTS(p)  ((p) & 0xF)
+#define EHCI_HCS_PPC         0x10
+#define EHCI_HCC_64BIT       0x01
+#define EHCI_HCC_EECP(p)     (((p) >> 8) & 0xFF)
+
+/* Operational registers, relative to CAPLENGTH */
+#define EHCI_USBCMD           0x00
+#define EHCI_USBSTS           0x04
+#define EHCI_USBINTR          0x08
+#define EHCI_FRINDEX          0x0C
+#define EHCI_CTRLDSSEGMENT    0x10
+#define EHCI_PERIODICLISTBASE 0x14
+#define EHCI_ASYNCLISTADDR    0x18
+#define EHCI_CONFIGFLAG       0x40
+#define EHCI_PORTSC(n)        (0x44 + ((n) << 2))
+
+#define EHCI_CMD_RS      0x01
+#define EHCI_CMD_HCRESET 0x02
+#define EHCI_CMD_PSE     0x10
+#define EHCI_CMD_ASE     0x20
+#define EHCI_CMD_ITC(n)  ((n) << 16)   /* interrupt threshold, microframes */
+
+#define EHCI_STS_USBINT    0x0001
+#define EHCI_STS_USBERRINT 0x0002
+#define EHCI_STS_PCD       0x0004
+#define EHCI_STS_FLR       0x0008
+#define EHCI_STS_HSE       0x0010
+#define EHCI_STS_IAA       0x0020
+#define EHCI_STS_HALTED    0x1000
+#define EHCI_STS_PSS       0x4000
+#define EHCI_STS_ASS       0x8000
+
+#define EHCI_PORT_CCS      0x0001
+#define EHCI_PORT_CSC      0x0002
+#define EHCI_PORT_PE       0x0004
+#define EHCI_PORT_PEC      0x0008
+#define EHCI_PORT_OCC      0x0020
+#define EHCI_PORT_PR       0x0100
+#define EHCI_PORT_LS_MASK  0x0C00
+#define EHCI_PORT_LS_K     0x0400      /* low-speed device attached */
+#define EHCI_PORT_PP       0x1000
+#define EHCI_PORT_OWNER    0x2000
+#define EHCI_PORT_WC       (EHCI_PORT_CSC | EHCI_PORT_PEC | EHCI_PORT_OCC)
+
+/* USB legacy support extended capability, in PCI configuration space */
+#define EHCI_LEGSUP_ID       0x01
+#define EHCI_LEGSUP_BIOS_SEM 0x02
+#define EHCI_LEGSUP_OS_SEM   0x03
+#define EHCI_LEGCTLSTS       0x04
+
+/* Link pointers */
+#define EHCI_TERMINATE  0x01
+#define EHCI_TYPE_QH    0x02
+#define EHCI_LINK_MASK  (~0x1FL)
+
+/* qTD token */
+#define QTD_PING     0x00000001
+#define QTD_XACTERR  0x00000008
+#define QTD_BABBLE   0x00000010
+#define QTD_BUFERR   0x00000020
+#define QTD_HALTED   0x00000040
+#define QTD_ACTIVE   0x00000080
+#define QTD_STATUS   0x0000007F
+#define QTD_PID_OUT   (0 << 8)
+#define QTD_PID_IN    (1 << 8)
+#define QTD_PID_SETUP (2 << 8)
+#define QTD_CERR(n)  ((n) << 10)
+#define QTD_IOC      0x00008000
+#define QTD_BYTES(t) (((t) >> 16) & 0x7FFF)
+#define QTD_TOGGLE   0x80000000
+
+/* QH endpoint characteristics and capabilities */
+#define QH_ADDR(a)    (a)
+#define QH_ENDPT(e)   ((e) << 8)
+#define QH_EPS_HIGH   (2 << 12)
+#define QH_DTC        0x00004000
+#define QH_HEAD       0x00008000
+#define QH_MAXPKT(m)  ((m) << 16)
+#define QH_RL(n)      ((n) << 28)
+#define QH_SMASK(m)   (m)
+#define QH_MULT(n)    ((n) << 30)
+
+/* One qTD covers at most five pages */
+#define EHCI_QTD_MAX_LEN 0x5000
+
+#define EHCI_QTD_POOL_SIZE 256
+#define EHCI_QH_POOL_SIZE  32
+
+/*
+ * EHCI_QTD : EHCI Queue Element Transfer Descriptor
+ *
+ * Fields  :
+ *     next            Next qTD Pointer
+ *     alt_next        Alternate Next qTD Pointer (taken on a short packet)
+ *     token           qTD Token
+ *     buf, buf_hi     Buffer Page Pointer List (64-bit controllers
+ *                     also read the high words)
+ *
+ * Reference :
+ *     Enhanced Host Controller Interface Specification for USB
+ *     Revision 1.0, Page 40, Intel
+ */
+typedef struct _ehci_qtd
+{
+  uint32_t next;
+  uint32_t alt_next;
+  uint32_t token;
+  uint32_t buf[5];
+  uint32_t buf_hi[5];
+
+  /* Reserved for software */
+  uint32_t len;                 /* bytes requested */
+  struct _ehci_qtd *sw_next;    /* chain or free list */
+  uint32_t reserve;
+} EHCI_QTD;
+
+/*
+ * EHCI_QH : EHCI Queue Head
+ *
+ * Fields  :
+ *     link            Queue Head Horizontal Link Pointer
+ *     ep_char         Endpoint Characteristics
+ *     ep_caps         Endpoint Capabilities
+ *     current         Current qTD Pointer
+ *     overlay         Transfer Overlay
+ *
+ * Reference :
+ *     Enhanced Host Controller Interface Specification for USB
+ *     Revision 1.0, Page 46, Intel
+ */
+typedef struct
+{
+  uint32_t link;
+  uint32_t ep_char;
+  uint32_t ep_caps;
+  uint32_t current;
+  uint32_t next;
+  uint32_t alt_next;
+  uint32_t token;
+  uint32_t buf[5];
+  uint32_t buf_hi[5];
+
+  /* Reserved for software */
+  uint32_t key;                 /* address, endpoint and direction */
+  uint32_t busy;
+  uint32_t reserve[5];
+} EHCI_QH;
+
+extern bool ehci_init (void);
+extern bool ehci_is_operational (void);
+extern bool ehci_do_enumeration (void);
+extern int ehci_control_transfer (uint8_t, addr_t, int, addr_t, int, int);
+extern int ehci_bulk_transfer (uint8_t, uint8_t, addr_t, uint32_t,
+                               uint16_t, uint8_t, uint32_t *);
+extern int ehci_interrupt_transfer (uint8_t, uint8_t, addr_t, uint32_t,
+                                    uint16_t, uint8_t, uint32_t *);
+extern int ehci_get_descriptor (uint8_t, uint16_t, uint16_t, uint16_t,
+                                uint16_t, addr_t, uint8_t);
+extern int ehci_set_address (uint8_t, uint8_t, uint8_t);
+extern int ehci_get_configuration (uint8_t, uint8_t);
+extern int ehci_set_configuration (uint8_t, uint8_t, uint8_t);
+extern int ehci_get_interface (uint8_t, uint16_t, uint8_t);
+extern int ehci_set_interface (uint8_t, uint16_t, uint16_t, uint8_t);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
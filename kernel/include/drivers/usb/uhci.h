@@ -56,12 +56,10 @@
 #define SET_USBINTR(usb_base, intr)    outw(intr, usb_base + 0x04)
 #define GET_USBINTR(usb_base)    inw(usb_base + 0x04)
 
-#define TD_POOL_SIZE 200
-#define QH_POOL_SIZE 16
+#define TD_POOL_SIZE 512
+#define QH_POOL_SIZE 32
 #define TYPE_TD 0
 #define TYPE_QH 1
-#define DIR_IN  0
-#define DIR_OUT 1
 
 /*
  * frm_lst_ptr : UHCI Frame List Pointer
@@ -85,7 +83,7 @@ typedef uint32_t frm_lst_ptr;
  *     Universal Host Controller Interface (UHCI) Design Guide
  *     Revision 1.1, Page 21, Intel
  */
-typedef struct
+typedef struct _uhci_td
 {
   uint32_t link_ptr;
 
@@ -125,7 +123,8 @@ typedef struct
 
   /* --??-- This is problem for 64-bit */
   /* Reserved for software */
-  uint32_t reserve[2];
+  struct _uhci_td *sw_next;     /* free list */
+  uint32_t reserve;
 } UHCI_TD;
 
 /*
@@ -139,13 +138,49 @@ typedef struct
  *     Universal Host Controller Interface (UHCI) Design Guide
  *     Revision 1.1, Page 25, Intel
  */
-typedef struct
+typedef struct _uhci_qh
 {
   uint32_t qh_ptr;
   uint32_t qe_ptr;
-  uint32_t padding[2];          // QH must be aligned on 16-byte boundary
+  /* QH must be aligned on 16-byte boundary */
+  struct _uhci_qh *sw_next;     /* free list */
+  uint32_t padding;
 } UHCI_QH;
 
+/*
+ * UHCI_BULK_REQ : one bulk transfer queued on an endpoint
+ *
+ * The caller fills in the first group of fields and hands the request
+ * to uhci_bulk_submit, which queues it behind any transfers already
+ * pending on the endpoint.  When it finishes, status and act_len are
+ * set, done becomes TRUE and complete (if any) is called from the IRQ
+ * handler with the kernel lock held.  A request with cont set
+ * continues the one before it: if that one ends short or fails, the
+ * continuation is dropped without being sent.
+ */
+typedef struct _uhci_bulk_req
+{
+  uint8_t address;
+  uint8_t endpoint;
+  uint8_t direction;
+  bool cont;
+  uint16_t packet_len;
+  addr_t data;
+  uint32_t len;
+  void (*complete) (struct _uhci_bulk_req *);
+  void *priv;
+
+  /* set on completion */
+  int status;
+  uint32_t act_len;
+  bool done;
+
+  /* private to the driver */
+  UHCI_TD *first, *last;
+  uint ntds;
+  struct _uhci_bulk_req *next;
+} UHCI_BULK_REQ;
+
 extern bool uhci_init (void);
 extern int uhci_reset (void);
 extern int port_reset (uint8_t);
@@ -154,6 +189,8 @@ extern int uhci_isochronous_transfer (uint8_t, uint8_t, addr_t, int, int *,
 extern int uhci_control_transfer (uint8_t, addr_t, int, addr_t, int, int);
 extern int uhci_bulk_transfer (uint8_t, uint8_t, addr_t, int, 
                                int, uint8_t, uint32_t *);
+extern int uhci_bulk_submit (UHCI_BULK_REQ *);
+extern int uhci_bulk_wait (UHCI_BULK_REQ *);
 extern int uhci_get_descriptor (uint8_t, uint16_t, uint16_t, uint16_t,
                                 uint16_t, addr_t, uint8_t);
 extern int uhci_set_address (uint8_t, uint8_t, uint8_t);
@@ -19,11 +19,17 @@
 #define _UMSC_H_
 
 #include <types.h>
+#include <drivers/usb/usb.h>
 
-sint umsc_bulk_scsi (uint addr, uint ep_out, uint ep_in,
+sint umsc_bulk_scsi (USB_DEVICE_INFO *dev, uint ep_out, uint ep_in,
                      uint8 cmd[16], uint dir, uint8* data,
                      uint data_len, uint maxpkt);
 sint umsc_read_sector (uint dev_index, uint32 lba, uint8 *sector, uint len);
+sint umsc_read_sectors (uint dev_index, uint32 lba, uint count,
+                        uint8 *buf, uint len);
+sint umsc_write_sector (uint dev_index, uint32 lba, uint8 *sector, uint len);
+sint umsc_write_sectors (uint dev_index, uint32 lba, uint count,
+                         uint8 *buf, uint len);
 
 #endif
 
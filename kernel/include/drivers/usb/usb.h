@@ -61,9 +61,14 @@
 #define USB_TYPE_SPD_CFG_DESC  0x07
 #define USB_TYPE_IF_PWR_DESC   0x08
 
+/* Transfer direction */
+#define DIR_IN  0
+#define DIR_OUT 1
+
 #define USB_TYPE_HC_UHCI    0x00
 #define USB_TYPE_HC_EHCI    0x01
 #define USB_TYPE_HC_OHCI    0x02
+#define USB_TYPE_HC_XHCI    0x03
 
 /*
  * USB_DEV_REQ : USB Device Request
@@ -226,13 +231,14 @@ typedef struct
 } USB_DRIVER;
 
 bool usb_register_driver (USB_DRIVER *);
+bool usb_enumerate (uint8 host_type);
 
 
 /* Generic USB operations */
 extern int usb_control_transfer(USB_DEVICE_INFO *, addr_t, uint16_t,
     addr_t, uint16_t);
 extern int usb_bulk_transfer(USB_DEVICE_INFO *, uint8_t, addr_t,
-                             uint16_t, uint8_t, uint8_t, uint32_t *);
+                             uint32_t, uint16_t, uint8_t, uint32_t *);
 
 extern int usb_get_descriptor(USB_DEVICE_INFO *, uint16_t, uint16_t,
     uint16_t, uint16_t, addr_t);
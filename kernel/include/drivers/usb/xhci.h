@@ -0,0 +1,222 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XHCI_H_
+#define _XHCI_H_
+
+#include <types.h>
+#include <drivers/usb/usb.h>
+
+/* Capability registers */
+#define XHCI_CAPLENGTH  0x00
+#define XHCI_HCSPARAMS1 0x04
+#define XHCI_HCSPARAMS2 0x08
+#define XHCI_HCCPARAMS1 0x10
+#define XHCI_DBOFF      0x14
+#define XHCI_RTSOFF     0x18
+
+#define XHCI_HCS1_MAX_SLOTS(p) ((p) & 0xFF)
+#define XHCI_HCS1_MAX_PORTS(p) (((p) >> 24) & 0xFF)
+#define XHCI_HCS2_SCRATCHPADS(p) ((((p) >> 16) & 0x3E0) | (((p) >> 27) & 0x1F))
+#define XHCI_HCC1_CSZ          0x04
+#define XHCI_HCC1_XECP(p)      (((p) >> 16) << 2)
+
+/* Operational registers, relative to CAPLENGTH */
+#define XHCI_USBCMD   0x00
+#define XHCI_USBSTS   0x04
+#define XHCI_PAGESIZE 0x08
+#define XHCI_CRCR     0x18
+#define XHCI_DCBAAP   0x30
+#define XHCI_CONFIG   0x38
+#define XHCI_PORTSC(n) (0x400 + ((n) << 4))
+
+#define XHCI_CMD_RS    0x01
+#define XHCI_CMD_HCRST 0x02
+#define XHCI_CMD_INTE  0x04
+#define XHCI_CMD_HSEE  0x08
+
+#define XHCI_STS_HCH  0x0001
+#define XHCI_STS_HSE  0x0004
+#define XHCI_STS_EINT 0x0008
+#define XHCI_STS_PCD  0x0010
+#define XHCI_STS_CNR  0x0800
+
+#define XHCI_PORT_CCS      0x00000001
+#define XHCI_PORT_PED      0x00000002
+#define XHCI_PORT_PR       0x00000010
+#define XHCI_PORT_PP       0x00000200
+#define XHCI_PORT_SPEED(p) (((p) >> 10) & 0xF)
+#define XHCI_PORT_PRC      0x00200000
+#define XHCI_PORT_CHANGES  0x00FE0000
+/* bits that keep their value when written back; the rest are either
+ * write-1-to-clear or commands */
+#define XHCI_PORT_PRESERVE 0x0E00C200
+
+/* Port speeds */
+#define XHCI_SPEED_FULL  1
+#define XHCI_SPEED_LOW   2
+#define XHCI_SPEED_HIGH  3
+#define XHCI_SPEED_SUPER 4
+
+/* Runtime registers: interrupter n */
+#define XHCI_IMAN(n)   (0x20 + ((n) << 5))
+#define XHCI_IMOD(n)   (0x24 + ((n) << 5))
+#define XHCI_ERSTSZ(n) (0x28 + ((n) << 5))
+#define XHCI_ERSTBA(n) (0x30 + ((n) << 5))
+#define XHCI_ERDP(n)   (0x38 + ((n) << 5))
+
+#define XHCI_IMAN_IP   0x01
+#define XHCI_IMAN_IE   0x02
+#define XHCI_ERDP_EHB  0x08
+
+/* USB legacy support extended capability */
+#define XHCI_XCAP_LEGACY   1
+#define XHCI_LEGACY_BIOS   (1 << 16)
+#define XHCI_LEGACY_OS     (1 << 24)
+
+/*
+ * XHCI_TRB : xHCI Transfer Request Block
+ *
+ * Reference :
+ *     eXtensible Host Controller Interface for Universal Serial Bus
+ *     Revision 1.1, Section 6.4, Intel
+ */
+typedef struct
+{
+  uint32_t param_lo;
+  uint32_t param_hi;
+  uint32_t status;
+  uint32_t control;
+} XHCI_TRB;
+
+#define TRB_CYCLE      0x00000001
+#define TRB_TC         0x00000002   /* Link: toggle cycle */
+#define TRB_ISP        0x00000004
+#define TRB_CH         0x00000010
+#define TRB_IOC        0x00000020
+#define TRB_IDT        0x00000040
+#define TRB_BSR        0x00000200   /* Address Device: block SET_ADDRESS */
+#define TRB_DC         0x00000200   /* Configure Endpoint: deconfigure */
+#define TRB_DIR_IN     0x00010000
+#define TRB_TYPE(t)    ((t) << 10)
+#define TRB_GET_TYPE(c) (((c) >> 10) & 0x3F)
+#define TRB_TRT(t)     ((t) << 16)  /* Setup: transfer type */
+#define TRB_EP(e)      ((e) << 16)
+#define TRB_SLOT(s)    ((s) << 24)
+#define TRB_GET_SLOT(c) ((c) >> 24)
+#define TRB_GET_EP(c)  (((c) >> 16) & 0x1F)
+#define TRB_LEN(l)     (l)
+#define TRB_TD_SIZE(n) ((n) << 17)
+#define TRB_GET_LEN(s) ((s) & 0xFFFFFF)
+#define TRB_GET_CC(s)  ((s) >> 24)
+
+#define TRB_NORMAL      1
+#define TRB_SETUP       2
+#define TRB_DATA        3
+#define TRB_STATUS      4
+#define TRB_LINK        6
+#define TRB_ENABLE_SLOT 9
+#define TRB_DISABLE_SLOT 10
+#define TRB_ADDRESS_DEV 11
+#define TRB_CONFIG_EP   12
+#define TRB_EVAL_CTX    13
+#define TRB_RESET_EP    14
+#define TRB_SET_DEQ     16
+#define TRB_TRANSFER_EV 32
+#define TRB_COMMAND_EV  33
+#define TRB_PORT_EV     34
+
+/* Completion codes */
+#define XHCI_CC_SUCCESS 1
+#define XHCI_CC_STALL   6
+#define XHCI_CC_SHORT   13
+
+/* Event ring segment table entry */
+typedef struct
+{
+  uint32_t base_lo;
+  uint32_t base_hi;
+  uint32_t size;
+  uint32_t reserved;
+} XHCI_ERST;
+
+/* Context fields (dword index, value) */
+#define SLOT_CTX_ROUTE(r)    (r)
+#define SLOT_CTX_SPEED(s)    ((s) << 20)
+#define SLOT_CTX_ENTRIES(n)  ((n) << 27)
+#define SLOT_CTX_PORT(p)     ((p) << 16)
+
+#define EP_CTX_INTERVAL(i)   ((i) << 16)
+#define EP_CTX_CERR(c)       ((c) << 1)
+#define EP_CTX_TYPE(t)       ((t) << 3)
+#define EP_CTX_BURST(b)      ((b) << 8)
+#define EP_CTX_MAXPKT(m)     ((m) << 16)
+#define EP_CTX_AVG_TRB(l)    (l)
+#define EP_CTX_MAX_ESIT(l)   ((l) << 16)
+
+#define EP_TYPE_BULK_OUT 2
+#define EP_TYPE_INTR_OUT 3
+#define EP_TYPE_CONTROL  4
+#define EP_TYPE_BULK_IN  6
+#define EP_TYPE_INTR_IN  7
+
+#define XHCI_RING_TRBS     256      /* one page, the last a Link TRB */
+#define XHCI_MAX_TD_TRBS   64
+#define XHCI_MAX_SLOTS     16
+#define XHCI_MAX_RINGS     64
+#define XHCI_MAX_SCRATCHPADS 256
+
+/* A producer ring: the command ring or an endpoint's transfer ring */
+typedef struct
+{
+  XHCI_TRB *trbs;
+  uint32 phys;
+  uint enq;
+  uint32 cycle;
+  /* the TD in flight */
+  bool busy, done, control, short_pkt;
+  uint32 cc, act_len;
+  uint ntrbs;
+  uint32 trb_phys[XHCI_MAX_TD_TRBS];
+  uint32 trb_len[XHCI_MAX_TD_TRBS];
+} XHCI_RING;
+
+extern bool xhci_init (void);
+extern bool xhci_do_enumeration (void);
+extern int xhci_control_transfer (uint8_t, addr_t, int, addr_t, int, int);
+extern int xhci_bulk_transfer (uint8_t, USB_EPT_DESC *, addr_t, uint32_t,
+                               uint32_t *);
+extern int xhci_get_descriptor (uint8_t, uint16_t, uint16_t, uint16_t,
+                                uint16_t, addr_t, uint8_t);
+extern int xhci_set_address (uint8_t, uint8_t, uint8_t);
+extern int xhci_get_configuration (uint8_t, uint8_t);
+extern int xhci_set_configuration (uint8_t, uint8_t, uint8_t);
+extern int xhci_get_interface (uint8_t, uint16_t, uint8_t);
+extern int xhci_set_interface (uint8_t, uint16_t, uint16_t, uint8_t);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
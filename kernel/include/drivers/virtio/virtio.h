@@ -0,0 +1,152 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VIRTIO_H_
+#define _VIRTIO_H_
+
+#include "types.h"
+#include "drivers/pci/pci.h"
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+/* Device status */
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+/* Transport feature bits */
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1     32
+
+#define VIRTIO_FEATURE(f) (1ULL << (f))
+
+/* Split virtqueue layout */
+struct vring_desc {
+  u64 addr;
+  u32 len;
+  u16 flags;
+  u16 next;
+} PACKED;
+
+#define VRING_DESC_F_NEXT     1
+#define VRING_DESC_F_WRITE    2
+#define VRING_DESC_F_INDIRECT 4
+
+struct vring_avail {
+  u16 flags;
+  u16 idx;
+  u16 ring[];                   /* followed by used_event */
+} PACKED;
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+struct vring_used_elem {
+  u32 id;
+  u32 len;
+} PACKED;
+
+struct vring_used {
+  u16 flags;
+  u16 idx;
+  struct vring_used_elem ring[]; /* followed by avail_event */
+} PACKED;
+
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define VIRTIO_QUEUE_MAX 256
+/* Indirect tables per queue, and descriptors per table */
+#define VIRTIO_INDIRECT_TABLES 32
+#define VIRTIO_INDIRECT_MAX    32
+
+/* One piece of a buffer handed to the device */
+typedef struct {
+  u32 addr;                     /* physical */
+  u32 len;
+} virtio_sg;
+
+struct _virtio_device;
+
+typedef struct {
+  struct _virtio_device *vdev;
+  uint index;
+  u16 num;
+  struct vring_desc *desc;
+  volatile struct vring_avail *avail;
+  volatile struct vring_used *used;
+  struct vring_desc *indirect;  /* VIRTIO_INDIRECT_TABLES tables */
+  u32 phys, indirect_phys;
+  uint pages;
+  u16 free_head, num_free;
+  u16 last_used;
+  u16 kicked_avail;             /* avail->idx at the last notification */
+  u32 notify;                   /* notify register (port or offset) */
+  u32 indirect_busy;
+  void *data[VIRTIO_QUEUE_MAX];
+  s8 table[VIRTIO_QUEUE_MAX];   /* indirect table used by a head, or -1 */
+} virtqueue;
+
+typedef struct _virtio_device {
+  uint index;                   /* PCI device index */
+  pci_device pci;
+  bool modern;
+  /* legacy transport */
+  u32 io_base;
+  /* modern transport */
+  volatile u8 *common, *isr, *device, *notify_base;
+  u32 notify_mult;
+  u64 features;                 /* negotiated */
+} virtio_device;
+
+bool virtio_pci_find (u16 legacy_id, u16 modern_id, virtio_device *vdev);
+void virtio_reset (virtio_device *);
+void virtio_add_status (virtio_device *, u8 status);
+bool virtio_negotiate (virtio_device *, u64 wanted);
+u8 virtio_isr (virtio_device *);
+u8 virtio_config_read8 (virtio_device *, uint offset);
+u16 virtio_config_read16 (virtio_device *, uint offset);
+u32 virtio_config_read32 (virtio_device *, uint offset);
+u64 virtio_config_read64 (virtio_device *, uint offset);
+
+bool virtqueue_init (virtio_device *, uint index, virtqueue *vq);
+sint virtqueue_add (virtqueue *vq, virtio_sg *sg, uint out, uint in,
+                    void *data);
+void virtqueue_kick (virtqueue *vq);
+void *virtqueue_get_buf (virtqueue *vq, u32 *len);
+void virtqueue_disable_cb (virtqueue *vq);
+bool virtqueue_enable_cb (virtqueue *vq);
+
+static inline bool
+virtio_has_feature (virtio_device *vdev, uint f)
+{
+  return (vdev->features & VIRTIO_FEATURE (f)) != 0;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
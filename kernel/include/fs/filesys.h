@@ -20,12 +20,14 @@
 
 #include "types.h"
 #include "drivers/ata/ata.h"
+#include "drivers/block/block.h"
 
 #define PATHSEP '/'
 
 int ext2fs_mount (void);
 int ext2fs_read (char *buf, int len);
 int ext2fs_dir (char *dirname);
+void ext2fs_set_device (block_device *dev);
 
 struct _iso9660_dir_record
 {
@@ -85,11 +87,17 @@ bool eztftp_mount (char *ifname);
 int eztftp_dir (char *pathname);
 int eztftp_read (char *buf, int len);
 
+void ramdisk_set_image (uint32 phys, uint32 len);
+bool ramdisk_mounted (void);
+int ramdisk_dir (char *pathname);
+int ramdisk_read (char *buf, int len);
+
 #define VFS_FSYS_NONE   0
 #define VFS_FSYS_EZEXT2 1
 #define VFS_FSYS_EZISO  2
 #define VFS_FSYS_EZUSB  3
 #define VFS_FSYS_EZTFTP 4
+#define VFS_FSYS_RAMDISK 5
 
 void vfs_set_root (int type, ata_info * drive_info);
 int vfs_dir (char *);
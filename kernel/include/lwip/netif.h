@@ -80,6 +80,31 @@ extern "C" {
 #define NETIF_FLAG_ETHARP       0x20U
 /** if set, the netif has IGMP capability */
 #define NETIF_FLAG_IGMP         0x40U
+/** if set, the netif cuts TCP super-segments into segments of
+ *  netif->tso_mss bytes (see LWIP_TCP_TSO) */
+#define NETIF_FLAG_TSO          0x80U
+
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+/** Checksums lwIP generates and checks in software on a netif (see
+ * netif->chksum_flags); a driver clears those its device handles */
+#define NETIF_CHECKSUM_GEN_IP       0x0001U
+#define NETIF_CHECKSUM_GEN_UDP      0x0002U
+#define NETIF_CHECKSUM_GEN_TCP      0x0004U
+#define NETIF_CHECKSUM_CHECK_IP     0x0100U
+#define NETIF_CHECKSUM_CHECK_UDP    0x0200U
+#define NETIF_CHECKSUM_CHECK_TCP    0x0400U
+#define NETIF_CHECKSUM_ENABLE_ALL   0xFFFFU
+#define NETIF_CHECKSUM_DISABLE_ALL  0x0000U
+
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags) \
+  ((netif)->chksum_flags = (chksumflags))
+/** guards software checksum code; a NULL netif means software */
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag) \
+  if (((netif) == NULL) || (((netif)->chksum_flags & (chksumflag)) != 0))
+#else /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags)
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag)
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
 
 /** Generic data structure used for all lwIP network interfaces.
  *  The following fields should be filled in by the initialization
@@ -143,6 +168,15 @@ struct netif {
   char name[2];
   /** number of this interface */
   u8_t num;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  /** checksums done in software (see NETIF_CHECKSUM_ above) */
+  u16_t chksum_flags;
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+#if LWIP_TCP_TSO
+  /** while a super-segment is being output: the TCP payload of each
+   *  segment to cut it into; 0 otherwise */
+  u16_t tso_mss;
+#endif /* LWIP_TCP_TSO */
 #if LWIP_SNMP
   /** link type (from "snmp_ifType" enum from snmp.h) */
   u8_t link_type;
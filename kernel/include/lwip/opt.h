@@ -807,6 +807,16 @@
 #define TCP_CALCULATE_EFF_SEND_MSS      1
 #endif
 
+/**
+ * TCP_MSS_MAX: Upper limit on the MSS of a connection over a netif whose
+ * MTU is larger than TCP_MSS allows for (jumbo frames). With
+ * TCP_CALCULATE_EFF_SEND_MSS, both the MSS advertised and the one used
+ * are derived from the MTU of the netif, up to this.
+ */
+#ifndef TCP_MSS_MAX
+#define TCP_MSS_MAX                     TCP_MSS
+#endif
+
 
 /**
  * TCP_SND_BUF: TCP sender buffer space (bytes). 
@@ -855,12 +865,52 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_WND_SCALE==1: support the TCP window scale option (RFC 1323), so
+ * that TCP_WND can be larger than 0xffff.  TCP_RCV_SCALE is the shift
+ * count announced for the receive window: TCP_WND must fit in 0xffff
+ * shifted left by it.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  0
+#endif
+
+#ifndef TCP_RCV_SCALE
+#define TCP_RCV_SCALE                   0
+#endif
+
+/**
+ * LWIP_TCP_SACK==1: support selective acknowledgments (RFC 2018): tell
+ * the sender which segments are queued out of sequence, and in fast
+ * recovery resend only the segments the receiver has not reported.
+ * Needs TCP_QUEUE_OOSEQ.
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   0
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
  */
 #ifndef TCP_WND_UPDATE_THRESHOLD
-#define TCP_WND_UPDATE_THRESHOLD   (TCP_WND / 4)
+#define TCP_WND_UPDATE_THRESHOLD   LWIP_MIN((TCP_WND / 4), (TCP_MSS * 4))
+#endif
+
+/**
+ * LWIP_TCP_TSO==1: send consecutive segments as one super-segment
+ * on netifs that cut it up again in hardware (NETIF_FLAG_TSO).
+ */
+#ifndef LWIP_TCP_TSO
+#define LWIP_TCP_TSO                    0
+#endif
+
+/**
+ * TCP_TSO_MAX: the most data in one super-segment.  With headers,
+ * it must still fit the 16-bit IP total length.
+ */
+#ifndef TCP_TSO_MAX
+#define TCP_TSO_MAX                     (60 * 1024)
 #endif
 
 /**
@@ -1583,6 +1633,16 @@
 #define CHECKSUM_CHECK_TCP              1
 #endif
 
+/**
+ * LWIP_CHECKSUM_CTRL_PER_NETIF==1: Checksum generation/check can be
+ * enabled/disabled per netif, through netif->chksum_flags, for
+ * devices that do it in hardware.  The CHECKSUM_GEN_* and
+ * CHECKSUM_CHECK_* settings above still apply on top of it.
+ */
+#ifndef LWIP_CHECKSUM_CTRL_PER_NETIF
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    0
+#endif
+
 /*
    ---------------------------------------
    ---------- Debugging options ----------
@@ -49,6 +49,19 @@ extern "C" {
 
 struct tcp_pcb;
 
+/* Windows, and the buffer space and congestion state measured against
+   them, outgrow an u16_t with window scaling */
+#if LWIP_WND_SCALE
+typedef u32_t tcpwnd_size_t;
+#define TCPWNDSIZE_F U32_F
+#else /* LWIP_WND_SCALE */
+typedef u16_t tcpwnd_size_t;
+#define TCPWNDSIZE_F U16_F
+#endif /* LWIP_WND_SCALE */
+
+/* the most of a window that fits in a header field, or a u16_t argument */
+#define TCPWND16(x)             ((u16_t)LWIP_MIN((x), 0xffff))
+
 /* Functions for interfacing with TCP: */
 
 /* Lower layer interface to TCP: */
@@ -77,7 +90,7 @@ void             tcp_err     (struct tcp_pcb *pcb,
                               void (* err)(void *arg, err_t err));
 
 #define          tcp_mss(pcb)      ((pcb)->mss)
-#define          tcp_sndbuf(pcb)   ((pcb)->snd_buf)
+#define          tcp_sndbuf(pcb)   (TCPWND16((pcb)->snd_buf))
 #define          tcp_nagle_disable(pcb)  ((pcb)->flags |= TF_NODELAY)
 #define          tcp_nagle_enable(pcb) ((pcb)->flags &= ~TF_NODELAY)
 #define          tcp_nagle_disabled(pcb) (((pcb)->flags & TF_NODELAY) != 0)
@@ -130,6 +143,9 @@ err_t            tcp_output  (struct tcp_pcb *pcb);
 void             tcp_rexmit  (struct tcp_pcb *pcb);
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+u8_t             tcp_rexmit_sack (struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
 
 /**
@@ -300,22 +316,27 @@ struct tcp_pcb {
   /* ports are in host byte order */
   u16_t remote_port;
   
-  u8_t flags;
-#define TF_ACK_DELAY   ((u8_t)0x01U)   /* Delayed ACK. */
-#define TF_ACK_NOW     ((u8_t)0x02U)   /* Immediate ACK. */
-#define TF_INFR        ((u8_t)0x04U)   /* In fast recovery. */
-#define TF_TIMESTAMP   ((u8_t)0x08U)   /* Timestamp option enabled */
-#define TF_FIN         ((u8_t)0x20U)   /* Connection was closed locally (FIN segment enqueued). */
-#define TF_NODELAY     ((u8_t)0x40U)   /* Disable Nagle algorithm */
-#define TF_NAGLEMEMERR ((u8_t)0x80U)   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
+  u16_t flags;
+#define TF_ACK_DELAY   ((u16_t)0x01U)   /* Delayed ACK. */
+#define TF_ACK_NOW     ((u16_t)0x02U)   /* Immediate ACK. */
+#define TF_INFR        ((u16_t)0x04U)   /* In fast recovery. */
+#define TF_TIMESTAMP   ((u16_t)0x08U)   /* Timestamp option enabled */
+#define TF_FIN         ((u16_t)0x20U)   /* Connection was closed locally (FIN segment enqueued). */
+#define TF_NODELAY     ((u16_t)0x40U)   /* Disable Nagle algorithm */
+#define TF_NAGLEMEMERR ((u16_t)0x80U)   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
+#define TF_WND_SCALE   ((u16_t)0x0100U) /* Window scale option enabled */
+#define TF_SACK        ((u16_t)0x0200U) /* SACK option enabled */
 
   /* the rest of the fields are in host byte order
      as we have to do some math with them */
   /* receiver variables */
   u32_t rcv_nxt;   /* next seqno expected */
-  u16_t rcv_wnd;   /* receiver window available */
-  u16_t rcv_ann_wnd; /* receiver window to announce */
+  tcpwnd_size_t rcv_wnd;   /* receiver window available */
+  tcpwnd_size_t rcv_ann_wnd; /* receiver window to announce */
   u32_t rcv_ann_right_edge; /* announced right edge of window */
+#if LWIP_TCP_SACK
+  u32_t rcv_sack_last; /* seqno of the last segment queued out of sequence */
+#endif /* LWIP_TCP_SACK */
 
   /* Timers */
   u32_t tmr;
@@ -337,21 +358,23 @@ struct tcp_pcb {
   /* fast retransmit/recovery */
   u32_t lastack; /* Highest acknowledged seqno. */
   u8_t dupacks;
+  u32_t recover;  /* snd_nxt when fast recovery began */
+  u32_t high_rxt; /* end of the data resent since then */
   
   /* congestion avoidance/control variables */
-  u16_t cwnd;  
-  u16_t ssthresh;
+  tcpwnd_size_t cwnd;  
+  tcpwnd_size_t ssthresh;
 
   /* sender variables */
   u32_t snd_nxt;   /* next new seqno to be sent */
-  u16_t snd_wnd;   /* sender window */
+  tcpwnd_size_t snd_wnd;   /* sender window */
   u32_t snd_wl1, snd_wl2; /* Sequence and acknowledgement numbers of last
                              window update. */
   u32_t snd_lbb;       /* Sequence number of next byte to be buffered. */
 
-  u16_t acked;
+  tcpwnd_size_t acked;
   
-  u16_t snd_buf;   /* Available buffer space for sending (in bytes). */
+  tcpwnd_size_t snd_buf;   /* Available buffer space for sending (in bytes). */
 #define TCP_SNDQUEUELEN_OVERFLOW (0xffff-3)
   u16_t snd_queuelen; /* Available buffer space for sending (in tcp_segs). */
   
@@ -416,6 +439,11 @@ struct tcp_pcb {
   u32_t ts_recent;
 #endif /* LWIP_TCP_TIMESTAMPS */
 
+#if LWIP_WND_SCALE
+  u8_t snd_scale;  /* shift count of the windows the other end sends */
+  u8_t rcv_scale;  /* shift count of the windows we send */
+#endif /* LWIP_WND_SCALE */
+
   /* idle time before KEEPALIVE is sent */
   u32_t keep_idle;
 #if LWIP_TCP_KEEPALIVE
@@ -529,18 +557,36 @@ struct tcp_seg {
   u8_t  flags;
 #define TF_SEG_OPTS_MSS   (u8_t)0x01U   /* Include MSS option. */
 #define TF_SEG_OPTS_TS    (u8_t)0x02U   /* Include timestamp option. */
+#define TF_SEG_OPTS_WND_SCALE (u8_t)0x04U /* Include window scale option. */
+#define TF_SEG_OPTS_SACK_PERM (u8_t)0x08U /* Include SACK permitted option. */
+#define TF_SEG_SACKED     (u8_t)0x80U   /* Not an option: the receiver has SACKed it. */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
-#define LWIP_TCP_OPT_LENGTH(flags)              \
-  (flags & TF_SEG_OPTS_MSS ? 4  : 0) +          \
-  (flags & TF_SEG_OPTS_TS  ? 12 : 0)
+#define LWIP_TCP_OPT_LENGTH(flags)                      \
+  (((flags) & TF_SEG_OPTS_MSS ? 4  : 0) +               \
+   ((flags) & TF_SEG_OPTS_WND_SCALE ? 4 : 0) +          \
+   ((flags) & TF_SEG_OPTS_SACK_PERM ? 4 : 0) +          \
+   ((flags) & TF_SEG_OPTS_TS  ? 12 : 0))
+
+/* Room for TCP options, after the 20 bytes of the header proper */
+#define TCP_OPT_SPACE 40
+
+#if LWIP_WND_SCALE
+#define TCP_WND_MAX(pcb) ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND)))
+#define SND_WND_SCALE(pcb, wnd) (((tcpwnd_size_t)(wnd) << (pcb)->snd_scale))
+#define RCV_WND_SCALE(pcb, wnd) (TCPWND16((wnd) >> (pcb)->rcv_scale))
+#else /* LWIP_WND_SCALE */
+#define TCP_WND_MAX(pcb) ((tcpwnd_size_t)TCP_WND)
+#define SND_WND_SCALE(pcb, wnd) (wnd)
+#define RCV_WND_SCALE(pcb, wnd) (wnd)
+#endif /* LWIP_WND_SCALE */
 
 /** This returns a TCP header option for MSS in an u32_t */
-#define TCP_BUILD_MSS_OPTION(x) (x) = htonl(((u32_t)2 << 24) |          \
-                                            ((u32_t)4 << 16) |          \
-                                            (((u32_t)TCP_MSS / 256) << 8) | \
-                                            (TCP_MSS & 255))
+#define TCP_BUILD_MSS_OPTION(x, mss) (x) = htonl(((u32_t)2 << 24) |     \
+                                                 ((u32_t)4 << 16) |     \
+                                                 (((u32_t)(mss) / 256) << 8) | \
+                                                 ((mss) & 255))
 
 /* Internal functions and global variables: */
 struct tcp_pcb *tcp_pcb_copy(struct tcp_pcb *pcb);
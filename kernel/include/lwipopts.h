@@ -28,16 +28,59 @@
 #define LWIP_RAW          0
 
 /* MEM_SIZE: the size of the heap memory. If the application will send
-a lot of data that needs to be copied, this should be set high. */
-#define MEM_SIZE                32000
+a lot of data that needs to be copied, this should be set high.  It is
+static, in the kernel's 4 MB window with everything else: it holds a
+few send buffers of copied data, not one per connection. */
+#define MEM_SIZE                (128 * 1024)
 
 /* MEMP_NUM_PBUF: the number of memp struct pbufs. If the application
    sends a lot of data out of ROM (or other static memory), this
    should be set high. */
 #define MEMP_NUM_PBUF           60
 
-/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. */
-#define PBUF_POOL_SIZE          92
+/* MEMP_NUM_TCP_PCB: the number of simultaneously active TCP
+   connections, which bounds what user programs can open through the
+   socket syscalls (SOCK_MAX). */
+#define MEMP_NUM_TCP_PCB        256
+
+/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool.  Received
+   frames wait here until TCP has taken them, so it follows TCP_WND,
+   below: three windows of full-sized segments, about 220 KB. */
+#define PBUF_POOL_SIZE          (3 * (TCP_WND) / (TCP_MSS))
+
+/* Network drivers may compute and verify checksums for lwIP */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
+/* Full-sized Ethernet segments, and enough queued behind them for
+   TCP to send super-segments to devices that do segmentation */
+#define TCP_MSS                 1460
+#define TCP_SND_QUEUELEN        (4 * (TCP_SND_BUF) / (TCP_MSS))
+#define MEMP_NUM_TCP_SEG        TCP_SND_QUEUELEN
+#define LWIP_TCP_TSO            1
+
+/* Jumbo frames: a netif with a 9000-byte MTU (see net_set_mtu) gets
+   segments to match */
+#define TCP_MSS_MAX             (9000 - 40)
+
+/* Windows and send buffers sized to the buffering behind them: a
+   receive window is a third of the pbuf pool that arriving segments
+   wait in, and a send buffer a third of the heap.  Window scaling lets
+   either side announce more than 64 KB, so our receive side only gains
+   from it while TCP_WND is above 0xFFFF; the pool grows with TCP_WND.
+   Timestamps time every round trip and tell wrapped sequence numbers
+   apart (PAWS), and SACK recovers from more than one loss per round
+   trip. */
+#define LWIP_WND_SCALE          1
+#define TCP_RCV_SCALE           3
+#define TCP_WND                 (48 * TCP_MSS)
+#define TCP_SND_BUF             (32 * TCP_MSS)
+#define TCP_SNDLOWAT            (8 * TCP_MSS)
+#define LWIP_TCP_TIMESTAMPS     1
+#define LWIP_TCP_SACK           1
+
+#if LWIP_WND_SCALE && TCP_WND <= 0xFFFF
+#error "TCP_WND does not need window scaling; raise it or drop LWIP_WND_SCALE"
+#endif
 
 #if 0
 #define LWIP_DEBUG
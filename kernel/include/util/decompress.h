@@ -0,0 +1,111 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DECOMPRESS_H_
+#define _DECOMPRESS_H_
+#include "types.h"
+
+/* Streaming decompression.  Input is pulled through fill(), which
+ * returns the number of bytes it placed in buf (0 at end of input);
+ * output is pushed through flush() in pieces of up to
+ * DECOMP_WINDOW bytes.  The window doubles as the back-reference
+ * history: 32 KB for DEFLATE, 64 KB for LZ4. */
+
+#define DECOMP_WINDOW (64 << 10)
+#define DECOMP_INBUF  4096
+
+typedef struct _decomp_stream
+{
+  sint32 (*fill) (void *arg, uint8 *buf, uint32 len);
+  void (*flush) (void *arg, uint8 *buf, uint32 len);
+  void *arg;
+  /* input */
+  uint8 in[DECOMP_INBUF];
+  uint32 in_pos, in_len;
+  bool eof;
+  /* bit reader, LSB first */
+  uint32 bitbuf, bitcnt;
+  /* output */
+  uint8 *window;                /* DECOMP_WINDOW bytes, caller-supplied */
+  uint32 wpos;                  /* next byte in window */
+  uint32 wflushed;              /* window bytes already flushed */
+  uint32 total;                 /* bytes produced */
+  uint32 crc;                   /* running CRC-32 of output (gzip) */
+} decomp_stream;
+
+/* Which format, if any, a file starts with */
+#define DECOMP_NONE 0
+#define DECOMP_GZIP 1
+#define DECOMP_LZ4  2
+
+int decomp_detect (uint8 *buf, uint32 len);
+
+void decomp_init (decomp_stream *,
+                  sint32 (*fill) (void *, uint8 *, uint32),
+                  void (*flush) (void *, uint8 *, uint32),
+                  void *arg, uint8 *window);
+
+/* Return bytes produced, or -1 on corrupt input */
+sint32 gunzip (decomp_stream *);
+sint32 lz4_decompress (decomp_stream *);
+
+/* For the decoders */
+sint32 decomp_refill (decomp_stream *);
+void decomp_flush (decomp_stream *);
+
+/* next input byte, or -1 at end of input */
+static inline sint32
+decomp_getc (decomp_stream *s)
+{
+  if (s->in_pos < s->in_len)
+    return s->in[s->in_pos++];
+  return decomp_refill (s);
+}
+
+static inline void
+decomp_putc (decomp_stream *s, uint8 c)
+{
+  s->window[s->wpos++] = c;
+  if (s->wpos == DECOMP_WINDOW)
+    decomp_flush (s);
+}
+
+/* copy len bytes from dist bytes back; FALSE if that is before the
+ * start of the output */
+static inline bool
+decomp_copy (decomp_stream *s, uint32 dist, uint32 len)
+{
+  if (dist == 0 || dist > s->total + s->wpos - s->wflushed ||
+      dist > DECOMP_WINDOW)
+    return FALSE;
+  while (len-- > 0)
+    decomp_putc (s, s->window[(s->wpos - dist) & (DECOMP_WINDOW - 1)]);
+  return TRUE;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -35,6 +35,7 @@
 #include "util/debug.h"
 #include "drivers/input/keymap.h"
 #include "drivers/input/keyboard.h"
+#include "drivers/net/socket.h"
 #include "sched/sched.h"
 #include "sched/vcpu.h"
 
@@ -1048,6 +1049,9 @@ __exit (int status)
 
   lock_kernel ();
 
+  /* Close the sockets the process left open */
+  sock_release_task (str ());
+
   /* For now, simply free up memory used by calling process address
      space.  We will pass the exit status to the parent process in the
      future. */
@@ -98,8 +98,17 @@
 #if (LWIP_TCP && (MEMP_NUM_TCP_PCB<=0))
   #error "If you want to use TCP, you have to define MEMP_NUM_TCP_PCB>=1 in your lwipopts.h"
 #endif
-#if (LWIP_TCP && (TCP_WND > 0xffff))
-  #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_TCP && !LWIP_WND_SCALE && (TCP_WND > 0xffff))
+  #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable LWIP_WND_SCALE)"
+#endif
+#if (LWIP_TCP && !LWIP_WND_SCALE && (TCP_SND_BUF > 0xffff))
+  #error "If you want to use TCP, TCP_SND_BUF must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable LWIP_WND_SCALE)"
+#endif
+#if (LWIP_TCP && LWIP_WND_SCALE && ((TCP_RCV_SCALE > 14) || ((TCP_WND >> TCP_RCV_SCALE) > 0xffff)))
+  #error "If you want to use TCP window scaling, TCP_RCV_SCALE must be at most 14, and TCP_WND must fit in an u16_t shifted left by it"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SACK && !TCP_QUEUE_OOSEQ)
+  #error "If you want to use TCP SACK, you have to define TCP_QUEUE_OOSEQ=1 in your lwipopts.h"
 #endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
   #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
@@ -211,12 +220,16 @@ lwip_sanity_check(void)
 #if LWIP_TCP
   if (MEMP_NUM_TCP_SEG < TCP_SND_QUEUELEN)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: MEMP_NUM_TCP_SEG should be at least as big as TCP_SND_QUEUELEN\n"));
+  if (TCP_MSS_MAX < TCP_MSS)
+    LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_MSS_MAX must be at least as much as TCP_MSS\n"));
   if (TCP_SND_BUF < 2 * TCP_MSS)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SND_BUF must be at least as much as (2 * TCP_MSS) for things to work smoothly\n"));
   if (TCP_SND_QUEUELEN < (2 * (TCP_SND_BUF/TCP_MSS)))
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SND_QUEUELEN must be at least as much as (2 * TCP_SND_BUF/TCP_MSS) for things to work\n"));
   if (TCP_SNDLOWAT > TCP_SND_BUF)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SNDLOWAT must be less than or equal to TCP_SND_BUF.\n"));
+  if (TCP_SNDLOWAT >= 0xffff)
+    LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SNDLOWAT must be less than 0xffff, where tcp_sndbuf() tops out.\n"));
   if (TCP_WND > (PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE))
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_WND is larger than space provided by PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE\n"));
   if (TCP_WND < TCP_MSS)
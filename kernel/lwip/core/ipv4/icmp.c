@@ -200,6 +200,7 @@ icmp_input(struct pbuf *p, struct netif *inp)
     IPH_TTL_SET(iphdr, ICMP_TTL);
     IPH_CHKSUM_SET(iphdr, 0);
 #if CHECKSUM_GEN_IP
+    IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_GEN_IP)
     IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
 #endif /* CHECKSUM_GEN_IP */
 
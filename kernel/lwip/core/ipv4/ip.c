@@ -240,6 +240,7 @@ ip_input(struct pbuf *p, struct netif *inp)
 
   /* verify checksum */
 #if CHECKSUM_CHECK_IP
+  IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_IP)
   if (inet_chksum(iphdr, iphdr_hlen) != 0) {
 
     LWIP_DEBUGF(IP_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
@@ -563,6 +564,12 @@ err_t ip_output_if_opt(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest
     IPH_OFFSET_SET(iphdr, 0);
     IPH_ID_SET(iphdr, htons(ip_id));
     ++ip_id;
+#if LWIP_TCP_TSO
+    /* the netif numbers each segment it cuts from a super-segment */
+    if (netif->tso_mss != 0) {
+      ip_id += (p->tot_len - 1) / netif->tso_mss;
+    }
+#endif /* LWIP_TCP_TSO */
 
     if (ip_addr_isany(src)) {
       ip_addr_set(&(iphdr->src), &(netif->ip_addr));
@@ -572,6 +579,7 @@ err_t ip_output_if_opt(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest
 
     IPH_CHKSUM_SET(iphdr, 0);
 #if CHECKSUM_GEN_IP
+    IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_IP)
     IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, ip_hlen));
 #endif
   } else {
@@ -593,8 +601,13 @@ err_t ip_output_if_opt(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest
   }
 #endif /* ENABLE_LOOPBACK */
 #if IP_FRAG
-  /* don't fragment if interface has mtu set to 0 [loopif] */
-  if (netif->mtu && (p->tot_len > netif->mtu)) {
+  /* don't fragment if interface has mtu set to 0 [loopif], or if it
+     cuts up a TCP super-segment itself */
+  if (netif->mtu && (p->tot_len > netif->mtu)
+#if LWIP_TCP_TSO
+      && (netif->tso_mss == 0)
+#endif /* LWIP_TCP_TSO */
+      ) {
     return ip_frag(p,netif,dest);
   }
 #endif
@@ -102,6 +102,10 @@ netif_add(struct netif *netif, struct ip_addr *ipaddr, struct ip_addr *netmask,
   netif->netmask.addr = 0;
   netif->gw.addr = 0;
   netif->flags = 0;
+  NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL);
+#if LWIP_TCP_TSO
+  netif->tso_mss = 0;
+#endif /* LWIP_TCP_TSO */
 #if LWIP_DHCP
   /* netif not under DHCP control by default */
   netif->dhcp = NULL;
@@ -70,6 +70,12 @@ static u16_t tcplen;
 static u8_t recv_flags;
 static struct pbuf *recv_data;
 
+#if LWIP_TCP_TIMESTAMPS
+/* The timestamp option of the segment, if it has one (opt_ts) */
+static u8_t opt_ts;
+static u32_t opt_tsval, opt_tsecr;
+#endif /* LWIP_TCP_TIMESTAMPS */
+
 struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
@@ -132,6 +138,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
 
 #if CHECKSUM_CHECK_TCP
   /* Verify TCP checksum. */
+  IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_TCP)
   if (inet_chksum_pseudo(p, (struct ip_addr *)&(iphdr->src),
       (struct ip_addr *)&(iphdr->dest),
       IP_PROTO_TCP, p->tot_len) != 0) {
@@ -312,7 +319,17 @@ tcp_input(struct pbuf *p, struct netif *inp)
            called when new send buffer space is available, we call it
            now. */
         if (pcb->acked > 0) {
+#if LWIP_WND_SCALE
+          /* the callback takes an u16_t, and an ACK for a scaled
+             window may well cover more */
+          tcpwnd_size_t acked = pcb->acked;
+          while (acked > 0 && err != ERR_ABRT) {
+            TCP_EVENT_SENT(pcb, TCPWND16(acked), err);
+            acked -= TCPWND16(acked);
+          }
+#else /* LWIP_WND_SCALE */
           TCP_EVENT_SENT(pcb, pcb->acked, err);
+#endif /* LWIP_WND_SCALE */
         }
       
         if (recv_data != NULL) {
@@ -455,6 +472,13 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 #if LWIP_TCP_TIMESTAMPS
       /* and maybe include the TIMESTAMP option */
      | (npcb->flags & TF_TIMESTAMP ? TF_SEG_OPTS_TS : 0)
+#endif
+#if LWIP_WND_SCALE
+      /* and the window scale and SACK permitted options, if offered */
+     | (npcb->flags & TF_WND_SCALE ? TF_SEG_OPTS_WND_SCALE : 0)
+#endif
+#if LWIP_TCP_SACK
+     | (npcb->flags & TF_SACK ? TF_SEG_OPTS_SACK_PERM : 0)
 #endif
       );
     if (rc != ERR_OK) {
@@ -571,6 +595,19 @@ tcp_process(struct tcp_pcb *pcb)
 
   tcp_parseopt(pcb);
 
+#if LWIP_TCP_TIMESTAMPS
+  /* PAWS (RFC 1323, section 4.2): a segment stamped earlier than the
+     last one in sequence is an old duplicate, maybe from before the
+     sequence numbers wrapped.  Acknowledge it, and drop it. */
+  if ((pcb->flags & TF_TIMESTAMP) && opt_ts && !(flags & TCP_SYN) &&
+      TCP_SEQ_LT(opt_tsval, pcb->ts_recent)) {
+    LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_process: PAWS drop tsval %"U32_F" ts_recent %"U32_F"\n",
+                                  opt_tsval, pcb->ts_recent));
+    tcp_ack_now(pcb);
+    return ERR_OK;
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+
   /* Do different things depending on the TCP state. */
   switch (pcb->state) {
   case SYN_SENT:
@@ -629,7 +666,7 @@ tcp_process(struct tcp_pcb *pcb)
     if (flags & TCP_ACK) {
       /* expected ACK number? */
       if (TCP_SEQ_BETWEEN(ackno, pcb->lastack+1, pcb->snd_nxt)) {
-        u16_t old_cwnd;
+        tcpwnd_size_t old_cwnd;
         pcb->state = ESTABLISHED;
         LWIP_DEBUGF(TCP_DEBUG, ("TCP connection established %"U16_F" -> %"U16_F".\n", inseg.tcphdr->src, inseg.tcphdr->dest));
 #if LWIP_CALLBACK_API
@@ -800,24 +837,31 @@ tcp_receive(struct tcp_pcb *pcb)
   u32_t right_wnd_edge;
   u16_t new_tot_len;
   int found_dupack = 0;
+  int partial_ack = 0;
+#if TCP_QUEUE_OOSEQ
+  int had_ooseq;
+#endif
 
   if (flags & TCP_ACK) {
+    /* the window the segment announces, unscaled */
+    tcpwnd_size_t wnd = SND_WND_SCALE(pcb, tcphdr->wnd);
+
     right_wnd_edge = pcb->snd_wnd + pcb->snd_wl2;
 
     /* Update window. */
     if (TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
        (pcb->snd_wl1 == seqno && TCP_SEQ_LT(pcb->snd_wl2, ackno)) ||
-       (pcb->snd_wl2 == ackno && tcphdr->wnd > pcb->snd_wnd)) {
-      pcb->snd_wnd = tcphdr->wnd;
+       (pcb->snd_wl2 == ackno && wnd > pcb->snd_wnd)) {
+      pcb->snd_wnd = wnd;
       pcb->snd_wl1 = seqno;
       pcb->snd_wl2 = ackno;
       if (pcb->snd_wnd > 0 && pcb->persist_backoff > 0) {
           pcb->persist_backoff = 0;
       }
-      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"U16_F"\n", pcb->snd_wnd));
+      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"TCPWNDSIZE_F"\n", pcb->snd_wnd));
 #if TCP_WND_DEBUG
     } else {
-      if (pcb->snd_wnd != tcphdr->wnd) {
+      if (pcb->snd_wnd != wnd) {
         LWIP_DEBUGF(TCP_WND_DEBUG, 
                     ("tcp_receive: no window update lastack %"U32_F" ackno %"
                      U32_F" wl1 %"U32_F" seqno %"U32_F" wl2 %"U32_F"\n",
@@ -863,9 +907,15 @@ tcp_receive(struct tcp_pcb *pcb)
               if (pcb->dupacks > 3) {
                 /* Inflate the congestion window, but not if it means that
                    the value overflows. */
-                if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+                if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
                   pcb->cwnd += pcb->mss;
                 }
+#if LWIP_TCP_SACK
+                /* and fill the next hole the receiver reports */
+                if ((pcb->flags & (TF_SACK | TF_INFR)) == (TF_SACK | TF_INFR)) {
+                  tcp_rexmit_sack(pcb);
+                }
+#endif /* LWIP_TCP_SACK */
               } else if (pcb->dupacks == 3) {
                 /* Do fast retransmit */
                 tcp_rexmit_fast(pcb);
@@ -884,10 +934,16 @@ tcp_receive(struct tcp_pcb *pcb)
 
       /* Reset the "IN Fast Retransmit" flag, since we are no longer
          in fast retransmit. Also reset the congestion window to the
-         slow start threshold. */
+         slow start threshold.  An ACK short of what was out when
+         fast recovery began shows the next loss instead (RFC 6582):
+         stay in fast recovery to resend it, below. */
       if (pcb->flags & TF_INFR) {
-        pcb->flags &= ~TF_INFR;
-        pcb->cwnd = pcb->ssthresh;
+        if (TCP_SEQ_LT(ackno, pcb->recover)) {
+          partial_ack = 1;
+        } else {
+          pcb->flags &= ~TF_INFR;
+          pcb->cwnd = pcb->ssthresh;
+        }
       }
 
       /* Reset the number of retransmissions. */
@@ -896,29 +952,38 @@ tcp_receive(struct tcp_pcb *pcb)
       /* Reset the retransmission time-out. */
       pcb->rto = (pcb->sa >> 3) + pcb->sv;
 
-      /* Update the send buffer space. Diff between the two can never exceed 64K? */
-      pcb->acked = (u16_t)(ackno - pcb->lastack);
+      /* Update the send buffer space. */
+      pcb->acked = (tcpwnd_size_t)(ackno - pcb->lastack);
 
       pcb->snd_buf += pcb->acked;
 
-      /* Reset the fast retransmit variables. */
-      pcb->dupacks = 0;
+      /* Reset the fast retransmit variables, but for the count that
+         keeps inflating the window in fast recovery. */
+      if (!partial_ack) {
+        pcb->dupacks = 0;
+      }
       pcb->lastack = ackno;
 
       /* Update the congestion control variables (cwnd and
          ssthresh). */
-      if (pcb->state >= ESTABLISHED) {
+      if (partial_ack) {
+        /* deflate by what left the network, leaving room for the
+           segment resent below */
+        pcb->cwnd = (pcb->cwnd > pcb->acked) ? pcb->cwnd - pcb->acked : 0;
+        pcb->cwnd += pcb->mss;
+        LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: partial ACK cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
+      } else if (pcb->state >= ESTABLISHED) {
         if (pcb->cwnd < pcb->ssthresh) {
-          if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+          if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
             pcb->cwnd += pcb->mss;
           }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"U16_F"\n", pcb->cwnd));
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
         } else {
-          u16_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+          tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
           if (new_cwnd > pcb->cwnd) {
             pcb->cwnd = new_cwnd;
           }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"U16_F"\n", pcb->cwnd));
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
         }
       }
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
@@ -966,6 +1031,18 @@ tcp_receive(struct tcp_pcb *pcb)
         pcb->rtime = 0;
 
       pcb->polltmr = 0;
+
+      if (partial_ack && pcb->unacked != NULL) {
+        /* resend the next hole, with SACK; without, or when the
+           receiver has reported nothing beyond it yet, the segment
+           now first in line, unless it already went again */
+#if LWIP_TCP_SACK
+        if (!(pcb->flags & TF_SACK) || !tcp_rexmit_sack(pcb))
+#endif /* LWIP_TCP_SACK */
+        if (TCP_SEQ_GEQ(ntohl(pcb->unacked->tcphdr->seqno), pcb->high_rxt)) {
+          tcp_rexmit(pcb);
+        }
+      }
     } else {
       /* Fix bug bug #21582: out of sequence ACK, didn't really ack anything */
       pcb->acked = 0;
@@ -1008,11 +1085,23 @@ tcp_receive(struct tcp_pcb *pcb)
     /* RTT estimation calculations. This is done by checking if the
        incoming segment acknowledges the segment we use to take a
        round-trip time measurement. */
+    m = -1;
+#if LWIP_TCP_TIMESTAMPS
+    /* With timestamps (RTTM, RFC 1323 section 3.3), any ACK for new
+       data echoes when what it acknowledges was sent, resent or not */
+    if ((pcb->flags & TF_TIMESTAMP) && opt_ts && opt_tsecr != 0 &&
+        pcb->acked > 0) {
+      m = (s16_t)LWIP_MIN((sys_now() - opt_tsecr) / TCP_SLOW_INTERVAL, 0x7fff);
+      pcb->rttest = 0;
+    } else
+#endif /* LWIP_TCP_TIMESTAMPS */
     if (pcb->rttest && TCP_SEQ_LT(pcb->rtseq, ackno)) {
       /* diff between this shouldn't exceed 32K since this are tcp timer ticks
          and a round-trip shouldn't be that long... */
       m = (s16_t)(tcp_ticks - pcb->rttest);
-
+      pcb->rttest = 0;
+    }
+    if (m >= 0) {
       LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: experienced rtt %"U16_F" ticks (%"U16_F" msec).\n",
                                   m, m * TCP_SLOW_INTERVAL));
 
@@ -1028,8 +1117,6 @@ tcp_receive(struct tcp_pcb *pcb)
 
       LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: RTO %"U16_F" (%"U16_F" milliseconds)\n",
                                   pcb->rto, pcb->rto * TCP_SLOW_INTERVAL));
-
-      pcb->rttest = 0;
     }
   }
 
@@ -1139,6 +1226,9 @@ tcp_receive(struct tcp_pcb *pcb)
            we have to trim the end of the segment and update rcv_nxt
            and pass the data to the application. */
         tcplen = TCP_TCPLEN(&inseg);
+#if TCP_QUEUE_OOSEQ
+        had_ooseq = (pcb->ooseq != NULL);
+#endif
 
         if (tcplen > pcb->rcv_wnd) {
           LWIP_DEBUGF(TCP_INPUT_DEBUG, 
@@ -1151,7 +1241,7 @@ tcp_receive(struct tcp_pcb *pcb)
             TCPH_FLAGS_SET(inseg.tcphdr, TCPH_FLAGS(inseg.tcphdr) &~ TCP_FIN);
           }
           /* Adjust length of segment to fit in the window. */
-          inseg.len = pcb->rcv_wnd;
+          inseg.len = (u16_t)pcb->rcv_wnd;
           if (TCPH_FLAGS(inseg.tcphdr) & TCP_SYN) {
             inseg.len -= 1;
           }
@@ -1290,12 +1380,17 @@ tcp_receive(struct tcp_pcb *pcb)
 #endif /* TCP_QUEUE_OOSEQ */
 
 
-        /* Acknowledge the segment(s). */
+        /* Acknowledge the segment(s), at once if it fills (part of)
+           a gap (RFC 5681, section 4.2). */
+#if TCP_QUEUE_OOSEQ
+        if (had_ooseq) {
+          tcp_ack_now(pcb);
+        } else
+#endif
         tcp_ack(pcb);
 
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
-        tcp_send_empty_ack(pcb);
 #if TCP_QUEUE_OOSEQ
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
@@ -1400,7 +1495,11 @@ tcp_receive(struct tcp_pcb *pcb)
           }
         }
 #endif /* TCP_QUEUE_OOSEQ */
-
+#if LWIP_TCP_SACK
+        pcb->rcv_sack_last = seqno;
+#endif /* LWIP_TCP_SACK */
+        /* ACK at once, SACKing what is queued now */
+        tcp_send_empty_ack(pcb);
       }
     } else {
       /* The incoming segment is not withing the window. */
@@ -1417,11 +1516,55 @@ tcp_receive(struct tcp_pcb *pcb)
   }
 }
 
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK
+/* An option field of 32 bits, in host byte order */
+static u32_t
+tcp_opt32(const u8_t *p)
+{
+  return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) |
+         ((u32_t)p[2] << 8) | (u32_t)p[3];
+}
+#endif /* LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK */
+
+#if LWIP_TCP_SACK
+/**
+ * Mark the unacked segments a SACK block of the incoming segment
+ * covers, so that fast recovery does not send them again.
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ * @param left the first seqno of the block
+ * @param right the seqno right after the block
+ */
+static void
+tcp_sack_mark(struct tcp_pcb *pcb, u32_t left, u32_t right)
+{
+  struct tcp_seg *seg;
+  u32_t seg_seqno;
+
+  /* ignore blocks that are bogus, or at or below the cumulative ACK
+     (a D-SACK, RFC 2883) */
+  if (!TCP_SEQ_LT(left, right) || TCP_SEQ_LEQ(right, ackno)) {
+    return;
+  }
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    seg_seqno = ntohl(seg->tcphdr->seqno);
+    if (TCP_SEQ_GEQ(seg_seqno, right)) {
+      break;
+    }
+    if (TCP_SEQ_GEQ(seg_seqno, left) &&
+        TCP_SEQ_LEQ(seg_seqno + TCP_TCPLEN(seg), right)) {
+      seg->flags |= TF_SEG_SACKED;
+    }
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
 /**
  * Parses the options contained in the incoming segment. 
  *
  * Called from tcp_listen_input() and tcp_process().
- * Currently, only the MSS option is supported!
+ * MSS, window scale, SACK permitted, SACK and timestamp options are
+ * supported, as configured.
  *
  * @param pcb the tcp_pcb for which a segment arrived
  */
@@ -1434,8 +1577,14 @@ tcp_parseopt(struct tcp_pcb *pcb)
 #if LWIP_TCP_TIMESTAMPS
   u32_t tsval;
 #endif
+#if LWIP_TCP_SACK
+  u16_t i;
+#endif
 
   opts = (u8_t *)tcphdr + TCP_HLEN;
+#if LWIP_TCP_TIMESTAMPS
+  opt_ts = 0;
+#endif
 
   /* Parse the TCP MSS option, if present. */
   if(TCPH_HDRLEN(tcphdr) > 0x5) {
@@ -1461,11 +1610,63 @@ tcp_parseopt(struct tcp_pcb *pcb)
         }
         /* An MSS option with the right option length. */
         mss = (opts[c + 2] << 8) | opts[c + 3];
-        /* Limit the mss to the configured TCP_MSS and prevent division by zero */
-        pcb->mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
+        /* Limit the mss to the configured TCP_MSS_MAX and prevent division by zero */
+        pcb->mss = ((mss > TCP_MSS_MAX) || (mss == 0)) ? TCP_MSS_MAX : mss;
         /* Advance to next option */
         c += 0x04;
         break;
+#if LWIP_WND_SCALE
+      case 0x03:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: WS\n"));
+        if (opts[c + 1] != 0x03 || c + 0x03 > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        /* Only a SYN turns scaling on, and not again when retransmitted */
+        if ((flags & TCP_SYN) && !(pcb->flags & TF_WND_SCALE)) {
+          pcb->snd_scale = LWIP_MIN(opts[c + 2], 14);
+          pcb->rcv_scale = TCP_RCV_SCALE;
+          pcb->flags |= TF_WND_SCALE;
+          /* now the whole window can be announced */
+          pcb->rcv_wnd = TCP_WND;
+          pcb->rcv_ann_wnd = TCP_WND;
+        }
+        /* Advance to next option */
+        c += 0x03;
+        break;
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK
+      case 0x04:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK permitted\n"));
+        if (opts[c + 1] != 0x02 || c + 0x02 > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if (flags & TCP_SYN) {
+          pcb->flags |= TF_SACK;
+        }
+        /* Advance to next option */
+        c += 0x02;
+        break;
+      case 0x05:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK\n"));
+        if (opts[c + 1] < 0x0A || (opts[c + 1] - 2) % 8 != 0 ||
+            c + opts[c + 1] > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if ((pcb->flags & TF_SACK) && (flags & TCP_ACK)) {
+          for (i = c + 2; i < c + opts[c + 1]; i += 8) {
+            tcp_sack_mark(pcb, tcp_opt32(&opts[i]), tcp_opt32(&opts[i + 4]));
+          }
+        }
+        /* Advance to next option */
+        c += opts[c + 1];
+        break;
+#endif /* LWIP_TCP_SACK */
 #if LWIP_TCP_TIMESTAMPS
       case 0x08:
         LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: TS\n"));
@@ -1475,14 +1676,19 @@ tcp_parseopt(struct tcp_pcb *pcb)
           return;
         }
         /* TCP timestamp option with valid length */
-        tsval = (opts[c+2]) | (opts[c+3] << 8) | 
-          (opts[c+4] << 16) | (opts[c+5] << 24);
+        tsval = tcp_opt32(&opts[c + 2]);
         if (flags & TCP_SYN) {
-          pcb->ts_recent = ntohl(tsval);
+          pcb->ts_recent = tsval;
           pcb->flags |= TF_TIMESTAMP;
-        } else if (TCP_SEQ_BETWEEN(pcb->ts_lastacksent, seqno, seqno+tcplen)) {
-          pcb->ts_recent = ntohl(tsval);
+        } else if (TCP_SEQ_GEQ(tsval, pcb->ts_recent) &&
+                   TCP_SEQ_BETWEEN(pcb->ts_lastacksent, seqno, seqno+tcplen)) {
+          /* the newest stamp of the segment last ACKed (RFC 1323,
+             section 4.3); older ones are for PAWS to drop */
+          pcb->ts_recent = tsval;
         }
+        opt_ts = 1;
+        opt_tsval = tsval;
+        opt_tsecr = tcp_opt32(&opts[c + 6]);
         /* Advance to next option */
         c += 0x0A;
         break;
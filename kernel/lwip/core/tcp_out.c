@@ -57,7 +57,13 @@
 #include <string.h>
 
 /* Forward declarations.*/
-static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+static err_t tcp_seg_unshare(struct tcp_seg *seg);
+static void tcp_output_segment(struct tcp_seg *seg, struct tcp_seg *last,
+                               struct tcp_pcb *pcb);
+#if LWIP_TCP_TSO
+static struct tcp_seg *tcp_tso_last(struct tcp_pcb *pcb, struct tcp_seg *seg,
+                                    u32_t wnd);
+#endif /* LWIP_TCP_TSO */
 
 static struct tcp_hdr *
 tcp_output_set_header(struct tcp_pcb *pcb, struct pbuf *p, int optlen,
@@ -69,7 +75,7 @@ tcp_output_set_header(struct tcp_pcb *pcb, struct pbuf *p, int optlen,
   tcphdr->seqno = seqno_be;
   tcphdr->ackno = htonl(pcb->rcv_nxt);
   TCPH_FLAGS_SET(tcphdr, TCP_ACK);
-  tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  tcphdr->wnd = htons(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
   tcphdr->urgp = 0;
   TCPH_HDRLEN_SET(tcphdr, (5 + optlen / 4));
   tcphdr->chksum = 0;
@@ -90,8 +96,13 @@ tcp_output_set_header(struct tcp_pcb *pcb, struct pbuf *p, int optlen,
 err_t
 tcp_send_ctrl(struct tcp_pcb *pcb, u8_t flags)
 {
-  /* no data, no length, flags, copy=1, no optdata */
+  /* no data, no length, flags, copy=1, no optdata but a timestamp */
+#if LWIP_TCP_TIMESTAMPS
+  return tcp_enqueue(pcb, NULL, 0, flags, TCP_WRITE_FLAG_COPY,
+                     pcb->flags & TF_TIMESTAMP ? TF_SEG_OPTS_TS : 0);
+#else
   return tcp_enqueue(pcb, NULL, 0, flags, TCP_WRITE_FLAG_COPY, 0);
+#endif
 }
 
 /**
@@ -175,7 +186,7 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
   /* fail on too much data */
   if (len > pcb->snd_buf) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_LEVEL_WARNING,
-      ("tcp_enqueue: too much data (len=%"U16_F" > snd_buf=%"U16_F")\n", len, pcb->snd_buf));
+      ("tcp_enqueue: too much data (len=%"U16_F" > snd_buf=%"TCPWNDSIZE_F")\n", len, pcb->snd_buf));
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
   }
@@ -454,6 +465,75 @@ tcp_build_timestamp_option(struct tcp_pcb *pcb, u32_t *opts)
 }
 #endif
 
+#if LWIP_WND_SCALE
+/* Build a window scale option (3 bytes, after a NOP) announcing
+ * TCP_RCV_SCALE, which takes effect once the other end sends one too
+ *
+ * @param opts option pointer where to store the window scale option
+ */
+static void
+tcp_build_wnd_scale_option(u32_t *opts)
+{
+  opts[0] = htonl(0x01030300 | TCP_RCV_SCALE);
+}
+#endif /* LWIP_WND_SCALE */
+
+#if LWIP_TCP_SACK
+/* Find the run of segments on the ooseq queue that starts with seg,
+ * i.e. the data up to the next gap.
+ *
+ * @return the first segment after the run, NULL if none
+ */
+static struct tcp_seg *
+tcp_sack_block(struct tcp_seg *seg, u32_t *left, u32_t *right)
+{
+  *left = seg->tcphdr->seqno;
+  *right = *left + TCP_TCPLEN(seg);
+  for (seg = seg->next;
+       seg != NULL && TCP_SEQ_LEQ(seg->tcphdr->seqno, *right);
+       seg = seg->next) {
+    if (TCP_SEQ_GT(seg->tcphdr->seqno + TCP_TCPLEN(seg), *right)) {
+      *right = seg->tcphdr->seqno + TCP_TCPLEN(seg);
+    }
+  }
+  return seg;
+}
+
+/* Build a SACK option (after two NOPs) with up to max blocks for the
+ * segments queued out of sequence, the block holding the one that
+ * arrived last going first (RFC 2018, section 4).  With opts NULL,
+ * only count the blocks.
+ *
+ * @return the number of blocks
+ */
+static u8_t
+tcp_build_sack_option(struct tcp_pcb *pcb, u32_t *opts, u8_t max)
+{
+  struct tcp_seg *seg, *next;
+  u32_t left, right;
+  u8_t n = 0, pass;
+
+  /* first the block with rcv_sack_last, then the others in order */
+  for (pass = 0; pass < 2; pass++) {
+    for (seg = pcb->ooseq; seg != NULL && n < max; seg = next) {
+      next = tcp_sack_block(seg, &left, &right);
+      if (TCP_SEQ_BETWEEN(pcb->rcv_sack_last, left, right - 1) != (pass == 0)) {
+        continue;
+      }
+      if (opts != NULL) {
+        opts[1 + 2 * n] = htonl(left);
+        opts[2 + 2 * n] = htonl(right);
+      }
+      n++;
+    }
+  }
+  if (opts != NULL && n > 0) {
+    opts[0] = htonl(0x01010500 | (2 + 8 * n));
+  }
+  return n;
+}
+#endif /* LWIP_TCP_SACK */
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -463,12 +543,28 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+#if CHECKSUM_GEN_TCP
+  struct netif *netif;
+#endif
   u8_t optlen = 0;
+#if LWIP_TCP_SACK
+  u8_t sack_blocks = 0;
+#endif
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
+#endif
+#if LWIP_TCP_SACK
+  if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+    /* as many blocks as fit in the rest of the option space */
+    sack_blocks = tcp_build_sack_option(pcb, NULL,
+                                        (TCP_OPT_SPACE - optlen - 4) / 8);
+    if (sack_blocks > 0) {
+      optlen += 4 + 8 * sack_blocks;
+    }
+  }
 #endif
   p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
   if (p == NULL) {
@@ -490,8 +586,18 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
     tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
   }
 #endif 
+#if LWIP_TCP_SACK
+  if (sack_blocks > 0) {
+    /* after the timestamp, if any */
+    tcp_build_sack_option(pcb, (u32_t *)((u8_t *)(tcphdr + 1) + optlen -
+                                         (4 + 8 * sack_blocks)),
+                          sack_blocks);
+  }
+#endif
 
 #if CHECKSUM_GEN_TCP
+  netif = ip_route(&(pcb->remote_ip));
+  IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)
   tcphdr->chksum = inet_chksum_pseudo(p, &(pcb->local_ip), &(pcb->remote_ip),
         IP_PROTO_TCP, p->tot_len);
 #endif
@@ -517,7 +623,7 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
 err_t
 tcp_output(struct tcp_pcb *pcb)
 {
-  struct tcp_seg *seg, *useg;
+  struct tcp_seg *seg, *useg, *last;
   u32_t wnd, snd_nxt;
 #if TCP_CWND_DEBUG
   s16_t i = 0;
@@ -561,19 +667,21 @@ tcp_output(struct tcp_pcb *pcb)
 #endif /* TCP_OUTPUT_DEBUG */
 #if TCP_CWND_DEBUG
   if (seg == NULL) {
-    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F
-                                 ", cwnd %"U16_F", wnd %"U32_F
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F
+                                 ", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
                                  ", seg == NULL, ack %"U32_F"\n",
                                  pcb->snd_wnd, pcb->cwnd, wnd, pcb->lastack));
   } else {
     LWIP_DEBUGF(TCP_CWND_DEBUG, 
-                ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F
+                ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
                  ", effwnd %"U32_F", seq %"U32_F", ack %"U32_F"\n",
                  pcb->snd_wnd, pcb->cwnd, wnd,
                  ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len,
                  ntohl(seg->tcphdr->seqno), pcb->lastack));
   }
 #endif /* TCP_CWND_DEBUG */
+  /* last segment of what went out with an earlier one, if any */
+  last = NULL;
   /* data available and window allows it to be sent? */
   while (seg != NULL &&
          ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len <= wnd) {
@@ -585,13 +693,14 @@ tcp_output(struct tcp_pcb *pcb)
      * - if FIN was already enqueued for this PCB (SYN is always alone in a segment -
      *   either seg->next != NULL or pcb->unacked == NULL;
      *   RST is no sent using tcp_enqueue/tcp_output.
+     * - if the segment already went out as part of a super-segment
      */
-    if((tcp_do_output_nagle(pcb) == 0) &&
+    if((last == NULL) && (tcp_do_output_nagle(pcb) == 0) &&
       ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)){
       break;
     }
 #if TCP_CWND_DEBUG
-    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
                             pcb->snd_wnd, pcb->cwnd, wnd,
                             ntohl(seg->tcphdr->seqno) + seg->len -
                             pcb->lastack,
@@ -606,7 +715,17 @@ tcp_output(struct tcp_pcb *pcb)
       pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
     }
 
-    tcp_output_segment(seg, pcb);
+    if (last == NULL) {
+#if LWIP_TCP_TSO
+      last = tcp_tso_last(pcb, seg, wnd);
+#else /* LWIP_TCP_TSO */
+      last = seg;
+#endif /* LWIP_TCP_TSO */
+      tcp_output_segment(seg, last, pcb);
+    }
+    if (seg == last) {
+      last = NULL;
+    }
     snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_nxt, snd_nxt)) {
       pcb->snd_nxt = snd_nxt;
@@ -656,19 +775,156 @@ tcp_output(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+#if LWIP_TCP_TSO
+/**
+ * Called by tcp_output() to find how many unsent segments can go out
+ * with seg as one super-segment, for the netif to cut up again.  They
+ * stay segments of their own on the unacked queue, so retransmission
+ * and RTT estimation see them as before.
+ *
+ * @param pcb the tcp_pcb for the TCP connection
+ * @param seg the first unsent segment, which the window allows
+ * @param wnd the send window
+ * @return the last segment to go out with seg
+ */
+static struct tcp_seg *
+tcp_tso_last(struct tcp_pcb *pcb, struct tcp_seg *seg, u32_t wnd)
+{
+  struct netif *netif;
+  struct tcp_seg *last, *next;
+  u32_t len;
+
+  if ((seg->len == 0) || (TCPH_FLAGS(seg->tcphdr) & (TCP_SYN | TCP_FIN))) {
+    return seg;
+  }
+  netif = ip_route(&(pcb->remote_ip));
+  if ((netif == NULL) || !(netif->flags & NETIF_FLAG_TSO)) {
+    return seg;
+  }
+
+  last = seg;
+  len = seg->len;
+  while ((next = last->next) != NULL &&
+         /* same options, and data right after the last one's */
+         (next->len > 0) && (next->flags == seg->flags) &&
+         !(TCPH_FLAGS(next->tcphdr) & TCP_SYN) &&
+         (ntohl(next->tcphdr->seqno) == ntohl(last->tcphdr->seqno) + last->len) &&
+         (len + next->len <= TCP_TSO_MAX) &&
+         (ntohl(next->tcphdr->seqno) - pcb->lastack + next->len <= wnd) &&
+         /* Nagle would hold back the last unsent segment */
+         ((next->next != NULL) ||
+          (pcb->flags & (TF_NODELAY | TF_NAGLEMEMERR | TF_FIN)))) {
+    len += next->len;
+    last = next;
+    if (TCPH_FLAGS(next->tcphdr) & TCP_FIN) {
+      break;
+    }
+  }
+  return last;
+}
+
+/**
+ * Chain the payloads of the segments after seg, up to last, onto
+ * seg's pbufs, making one super-segment under seg's header.
+ */
+static void
+tcp_tso_link(struct tcp_seg *seg, struct tcp_seg *last)
+{
+  struct tcp_seg *s;
+
+  for (s = seg->next; ; s = s->next) {
+    /* drop the header, and whatever lower layers left in front of it */
+    pbuf_header(s->p, -(s16_t)(((u8_t *)s->tcphdr - (u8_t *)s->p->payload) +
+                               TCPH_HDRLEN(s->tcphdr) * 4));
+    pbuf_cat(seg->p, s->p);
+    if (s == last) {
+      break;
+    }
+  }
+}
+
+/**
+ * Undo tcp_tso_link(), giving each segment back its own pbufs.  The
+ * netif may still hold on to seg->p, but not to the chain behind it.
+ */
+static void
+tcp_tso_unlink(struct tcp_seg *seg, struct tcp_seg *last)
+{
+  struct tcp_seg *s;
+  struct pbuf *q;
+
+  for (s = seg; s != last; s = s->next) {
+    u16_t rest = s->next->p->tot_len;
+
+    for (q = s->p; q->next != s->next->p; q = q->next) {
+      q->tot_len -= rest;
+    }
+    q->tot_len -= rest;
+    q->next = NULL;
+  }
+  for (s = seg->next; ; s = s->next) {
+    pbuf_header(s->p, TCPH_HDRLEN(s->tcphdr) * 4);
+    if (s == last) {
+      break;
+    }
+  }
+}
+#endif /* LWIP_TCP_TSO */
+
+/**
+ * A netif that transmits straight from the pbufs holds a reference
+ * on seg->p until the frame is on the wire.  Before a retransmission
+ * rewrites the headers, move the segment to a private copy and leave
+ * the old pbufs to the netif.
+ *
+ * @param seg the tcp_seg about to go out again
+ * @return ERR_OK, or ERR_MEM if there is no memory for the copy
+ */
+static err_t
+tcp_seg_unshare(struct tcp_seg *seg)
+{
+  struct pbuf *p;
+  u16_t off, len;
+
+  off = (u16_t)((u8_t *)seg->tcphdr - (u8_t *)seg->p->payload);
+  len = seg->p->tot_len - off;
+  p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+  if (p == NULL) {
+    return ERR_MEM;
+  }
+  pbuf_copy_partial(seg->p, p->payload, len, off);
+  pbuf_free(seg->p);
+  seg->p = p;
+  seg->tcphdr = (struct tcp_hdr *)p->payload;
+  seg->dataptr = (u8_t *)p->payload + TCPH_HDRLEN(seg->tcphdr) * 4;
+  return ERR_OK;
+}
+
 /**
  * Called by tcp_output() to actually send a TCP segment over IP.
  *
  * @param seg the tcp_seg to send
+ * @param last the last tcp_seg to send with seg as one super-segment,
+ *        or seg itself (see tcp_tso_last())
  * @param pcb the tcp_pcb for the TCP connection used to send the segment
  */
 static void
-tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
+tcp_output_segment(struct tcp_seg *seg, struct tcp_seg *last,
+                   struct tcp_pcb *pcb)
 {
   u16_t len;
   struct netif *netif;
   u32_t *opts;
 
+  /* still in flight from an earlier transmission */
+  if ((seg->p->ref > 1) && (tcp_seg_unshare(seg) != ERR_OK)) {
+    /* the retransmission timer will have another go */
+    if (pcb->rtime == -1) {
+      pcb->rtime = 0;
+    }
+    return;
+  }
+
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
 
@@ -676,8 +932,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
    wnd fields remain. */
   seg->tcphdr->ackno = htonl(pcb->rcv_nxt);
 
-  /* advertise our receive window size in this TCP segment */
-  seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  /* advertise our receive window size in this TCP segment; the
+     window of a SYN is never scaled */
+  if (TCPH_FLAGS(seg->tcphdr) & TCP_SYN) {
+    seg->tcphdr->wnd = htons(TCPWND16(pcb->rcv_ann_wnd));
+  } else {
+    seg->tcphdr->wnd = htons(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
+  }
 
   pcb->rcv_ann_right_edge = pcb->rcv_nxt + pcb->rcv_ann_wnd;
 
@@ -685,9 +946,27 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
      packets, so ignore it here */
   opts = (u32_t *)(seg->tcphdr + 1);
   if (seg->flags & TF_SEG_OPTS_MSS) {
-    TCP_BUILD_MSS_OPTION(*opts);
+#if TCP_CALCULATE_EFF_SEND_MSS
+    /* what the MTU of the outgoing netif allows */
+    TCP_BUILD_MSS_OPTION(*opts, tcp_eff_send_mss(TCP_MSS_MAX, &pcb->remote_ip));
+#else /* TCP_CALCULATE_EFF_SEND_MSS */
+    TCP_BUILD_MSS_OPTION(*opts, TCP_MSS);
+#endif /* TCP_CALCULATE_EFF_SEND_MSS */
+    opts += 1;
+  }
+#if LWIP_WND_SCALE
+  if (seg->flags & TF_SEG_OPTS_WND_SCALE) {
+    tcp_build_wnd_scale_option(opts);
+    opts += 1;
+  }
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    /* SACK permitted, after two NOPs */
+    *opts = htonl(0x01010402);
     opts += 1;
   }
+#endif /* LWIP_TCP_SACK */
 #if LWIP_TCP_TIMESTAMPS
   pcb->ts_lastacksent = pcb->rcv_nxt;
 
@@ -728,8 +1007,22 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 
   seg->p->payload = seg->tcphdr;
 
+#if CHECKSUM_GEN_TCP || LWIP_TCP_TSO
+  netif = ip_route(&(pcb->remote_ip));
+#endif
+#if LWIP_TCP_TSO
+  if (last != seg) {
+    /* the netif sends the options of seg with every segment it cuts */
+    tcp_tso_link(seg, last);
+    netif->tso_mss = pcb->mss - LWIP_TCP_OPT_LENGTH(seg->flags);
+  }
+#else /* LWIP_TCP_TSO */
+  LWIP_UNUSED_ARG(last);
+#endif /* LWIP_TCP_TSO */
+
   seg->tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
+  IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)
   seg->tcphdr->chksum = inet_chksum_pseudo(seg->p,
              &(pcb->local_ip),
              &(pcb->remote_ip),
@@ -744,6 +1037,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   ip_output(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl, pcb->tos,
       IP_PROTO_TCP);
 #endif /* LWIP_NETIF_HWADDRHINT*/
+
+#if LWIP_TCP_TSO
+  if (last != seg) {
+    netif->tso_mss = 0;
+    tcp_tso_unlink(seg, last);
+  }
+#endif /* LWIP_TCP_TSO */
 }
 
 /**
@@ -773,6 +1073,9 @@ tcp_rst(u32_t seqno, u32_t ackno,
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+#if CHECKSUM_GEN_TCP
+  struct netif *netif;
+#endif
   p = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
   if (p == NULL) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_rst: could not allocate memory for pbuf\n"));
@@ -787,12 +1090,14 @@ tcp_rst(u32_t seqno, u32_t ackno,
   tcphdr->seqno = htonl(seqno);
   tcphdr->ackno = htonl(ackno);
   TCPH_FLAGS_SET(tcphdr, TCP_RST | TCP_ACK);
-  tcphdr->wnd = htons(TCP_WND);
+  tcphdr->wnd = htons(TCPWND16(TCP_WND));
   tcphdr->urgp = 0;
   TCPH_HDRLEN_SET(tcphdr, 5);
 
   tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
+  netif = ip_route(remote_ip);
+  IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)
   tcphdr->chksum = inet_chksum_pseudo(p, local_ip, remote_ip,
               IP_PROTO_TCP, p->tot_len);
 #endif
@@ -820,8 +1125,14 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
     return;
   }
 
-  /* Move all unacked segments to the head of the unsent queue */
-  for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
+  /* Move all unacked segments to the head of the unsent queue; the
+     receiver may since have dropped what it SACKed, so all go again */
+  for (seg = pcb->unacked; ; seg = seg->next) {
+    seg->flags &= ~TF_SEG_SACKED;
+    if (seg->next == NULL) {
+      break;
+    }
+  }
   /* concatenate unsent queue after unacked queue */
   seg->next = pcb->unsent;
   /* unsent queue is the concatenated queue (of unacked, unsent) */
@@ -832,6 +1143,9 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
   /* increment number of retransmissions */
   ++pcb->nrtx;
 
+  /* A timeout ends fast recovery: start over from slow start */
+  pcb->flags &= ~TF_INFR;
+
   /* Don't take any RTT measurements after retransmitting. */
   pcb->rttest = 0;
 
@@ -840,26 +1154,21 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
 }
 
 /**
- * Requeue the first unacked segment for retransmission
- *
- * Called by tcp_receive() for fast retramsmit.
+ * Move an unacked segment to the unsent queue for retransmission
  *
- * @param pcb the tcp_pcb for which to retransmit the first unacked segment
+ * @param pcb the tcp_pcb for which to retransmit the segment
+ * @param pseg the link to the segment on the unacked queue
  */
-void
-tcp_rexmit(struct tcp_pcb *pcb)
+static void
+tcp_rexmit_unacked(struct tcp_pcb *pcb, struct tcp_seg **pseg)
 {
   struct tcp_seg *seg;
   struct tcp_seg **cur_seg;
 
-  if (pcb->unacked == NULL) {
-    return;
-  }
-
-  /* Move the first unacked segment to the unsent queue */
+  /* Move the segment to the unsent queue */
   /* Keep the unsent queue sorted. */
-  seg = pcb->unacked;
-  pcb->unacked = seg->next;
+  seg = *pseg;
+  *pseg = seg->next;
 
   cur_seg = &(pcb->unsent);
   while (*cur_seg &&
@@ -869,7 +1178,9 @@ tcp_rexmit(struct tcp_pcb *pcb)
   seg->next = *cur_seg;
   *cur_seg = seg;
 
-  ++pcb->nrtx;
+  if (TCP_SEQ_LT(pcb->high_rxt, ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg))) {
+    pcb->high_rxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
+  }
 
   /* Don't take any rtt measurements after retransmitting. */
   pcb->rttest = 0;
@@ -880,6 +1191,72 @@ tcp_rexmit(struct tcp_pcb *pcb)
      and thus tcp_output directly returns. */
 }
 
+/**
+ * Requeue the first unacked segment for retransmission
+ *
+ * Called by tcp_receive() for fast retramsmit.
+ *
+ * @param pcb the tcp_pcb for which to retransmit the first unacked segment
+ */
+void
+tcp_rexmit(struct tcp_pcb *pcb)
+{
+  if (pcb->unacked == NULL) {
+    return;
+  }
+
+  tcp_rexmit_unacked(pcb, &pcb->unacked);
+
+  ++pcb->nrtx;
+}
+
+#if LWIP_TCP_SACK
+/**
+ * Requeue the next hole for retransmission: the first unacked segment
+ * that the receiver has not SACKed, but has SACKed data beyond, and
+ * that has not been sent again since fast recovery began (RFC 6675,
+ * NextSeg() rule 1, with any SACKed data above taken as proof of loss).
+ *
+ * Called by tcp_receive() in fast recovery.  This does not count as a
+ * retransmission towards TCP_MAXRTX: there may be many holes, and
+ * every ACK that reports one shows the connection is alive.
+ *
+ * @param pcb the tcp_pcb for which to retransmit a hole
+ * @return 1 if a segment was requeued, 0 if there is no hole to fill
+ */
+u8_t
+tcp_rexmit_sack(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  struct tcp_seg **pseg;
+  u32_t high_sacked = 0;
+  u8_t sacked = 0;
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      high_sacked = ntohl(seg->tcphdr->seqno);
+      sacked = 1;
+    }
+  }
+  if (!sacked) {
+    return 0;
+  }
+  for (pseg = &pcb->unacked; (seg = *pseg) != NULL; pseg = &seg->next) {
+    if (TCP_SEQ_GEQ(ntohl(seg->tcphdr->seqno), high_sacked)) {
+      break;
+    }
+    if (!(seg->flags & TF_SEG_SACKED) &&
+        TCP_SEQ_GEQ(ntohl(seg->tcphdr->seqno), pcb->high_rxt)) {
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rexmit_sack: hole at %"U32_F"\n",
+                                 ntohl(seg->tcphdr->seqno)));
+      tcp_rexmit_unacked(pcb, pseg);
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif /* LWIP_TCP_SACK */
+
 
 /**
  * Handle retransmission after three dupacks received
@@ -896,6 +1273,9 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  "), fast retransmit %"U32_F"\n",
                  (u16_t)pcb->dupacks, pcb->lastack,
                  ntohl(pcb->unacked->tcphdr->seqno)));
+    /* recovery lasts until all that is out now has been ACKed */
+    pcb->recover = pcb->snd_nxt;
+    pcb->high_rxt = pcb->lastack;
     tcp_rexmit(pcb);
 
     /* Set ssthresh to half of the minimum of the current
@@ -908,7 +1288,7 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
     /* The minimum value for ssthresh should be 2 MSS */
     if (pcb->ssthresh < 2*pcb->mss) {
       LWIP_DEBUGF(TCP_FR_DEBUG, 
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
+                  ("tcp_receive: The minimum value for ssthresh %"TCPWNDSIZE_F
                    " should be min 2 mss %"U16_F"...\n",
                    pcb->ssthresh, 2*pcb->mss));
       pcb->ssthresh = 2*pcb->mss;
@@ -933,6 +1313,9 @@ tcp_keepalive(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+#if CHECKSUM_GEN_TCP
+  struct netif *netif;
+#endif
 
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_keepalive: sending KEEPALIVE probe to %"U16_F".%"U16_F".%"U16_F".%"U16_F"\n",
                           ip4_addr1(&pcb->remote_ip), ip4_addr2(&pcb->remote_ip),
@@ -954,6 +1337,8 @@ tcp_keepalive(struct tcp_pcb *pcb)
   tcphdr = tcp_output_set_header(pcb, p, 0, htonl(pcb->snd_nxt - 1));
 
 #if CHECKSUM_GEN_TCP
+  netif = ip_route(&pcb->remote_ip);
+  IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)
   tcphdr->chksum = inet_chksum_pseudo(p, &pcb->local_ip, &pcb->remote_ip,
                                       IP_PROTO_TCP, p->tot_len);
 #endif
@@ -987,6 +1372,9 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+#if CHECKSUM_GEN_TCP
+  struct netif *netif;
+#endif
   struct tcp_seg *seg;
   u16_t len;
   u8_t is_fin;
@@ -1032,6 +1420,8 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
   }
 
 #if CHECKSUM_GEN_TCP
+  netif = ip_route(&pcb->remote_ip);
+  IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)
   tcphdr->chksum = inet_chksum_pseudo(p, &pcb->local_ip, &pcb->remote_ip,
                                       IP_PROTO_TCP, p->tot_len);
 #endif
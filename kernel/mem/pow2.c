@@ -106,6 +106,8 @@ pow2_get_free_block (uint8 index)
          * bytes of stack worst-case.  Should be acceptable, for
          * now. */
         ptr1 = pow2_get_free_block (index + 1);
+        if (ptr1 == NULL)
+          return NULL;
         ptr2 = ptr1 + (1 << (index));
 
         pow2_add_free_block (ptr1, index);
@@ -120,7 +122,11 @@ pow2_get_free_block (uint8 index)
         int i;
         for (i = 0; i < POW2_MAX_POW_FRAMES; i++)
           pow2_tmp_phys_frames[i] = alloc_phys_frame () | 3;
-        return map_virtual_pages (pow2_tmp_phys_frames, POW2_MAX_POW_FRAMES);
+        ptr = map_virtual_pages (pow2_tmp_phys_frames, POW2_MAX_POW_FRAMES);
+        if (ptr == NULL)
+          for (i = 0; i < POW2_MAX_POW_FRAMES; i++)
+            free_phys_frame (pow2_tmp_phys_frames[i] & ~0xFFF);
+        return ptr;
       }
     } else if (hdr->count < POW2_MAX_COUNT || hdr->next == NULL) {
       /* There are free blocks ready to go */
@@ -197,6 +203,11 @@ pow2_alloc (uint32 size, uint8 ** ptr)
   uint8 index = pow2_compute_index (size);
   spinlock_lock (&pow2_lock);
   *ptr = pow2_get_free_block (index);
+  if (*ptr == NULL) {
+    /* out of kernel virtual space */
+    spinlock_unlock (&pow2_lock);
+    return -1;
+  }
   pow2_insert_used_table (*ptr, index);
   spinlock_unlock (&pow2_lock);
   memset (*ptr, 0, size);
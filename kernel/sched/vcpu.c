@@ -452,6 +452,10 @@ vcpu_dump_stats (void)
   extern u32 atapi_req_count, ata_irq_count;
   extern u32 e1000_packet_count;
   extern u64 e1000_packet_bytes;
+  extern u32 e1000_irq_count, e1000_rx_drops, e1000_tx_drops;
+  extern u32 vnet_packet_count;
+  extern u64 vnet_packet_bytes;
+  extern u32 vnet_irq_count, vnet_rx_drops, vnet_tx_drops;
   if (ata_irq_count && atapi_req_count)
     logger_printf ("  response=0x%llX responsemax=0x%llX responsemin=0x%llX\n"
                    "  readtime=0x%llX readvcpu=0x%llX"
@@ -474,8 +478,28 @@ vcpu_dump_stats (void)
   logger_printf ("  e1000pps=0x%llX e1000bps=0x%llX\n",
                  div64_64 ((u64) e1000_packet_count * tsc_freq, now),
                  div64_64 (e1000_packet_bytes * tsc_freq, now));
+  logger_printf ("  e1000ips=0x%llX e1000ppi=0x%X"
+                 " e1000rxdrop=0x%X e1000txdrop=0x%X\n",
+                 div64_64 ((u64) e1000_irq_count * tsc_freq, now),
+                 e1000_irq_count ? e1000_packet_count / e1000_irq_count : 0,
+                 e1000_rx_drops, e1000_tx_drops);
   e1000_packet_bytes = 0;
   e1000_packet_count = 0;
+  e1000_irq_count = e1000_rx_drops = e1000_tx_drops = 0;
+
+  if (vnet_packet_count) {
+    logger_printf ("  vnetpps=0x%llX vnetbps=0x%llX\n",
+                   div64_64 ((u64) vnet_packet_count * tsc_freq, now),
+                   div64_64 (vnet_packet_bytes * tsc_freq, now));
+    logger_printf ("  vnetips=0x%llX vnetppi=0x%X"
+                   " vnetrxdrop=0x%X vnettxdrop=0x%X\n",
+                   div64_64 ((u64) vnet_irq_count * tsc_freq, now),
+                   vnet_irq_count ? vnet_packet_count / vnet_irq_count : 0,
+                   vnet_rx_drops, vnet_tx_drops);
+  }
+  vnet_packet_bytes = 0;
+  vnet_packet_count = 0;
+  vnet_irq_count = vnet_rx_drops = vnet_tx_drops = 0;
 
   /* 5-sec window */
   ata_irq_count = 0;
@@ -0,0 +1,88 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Open-latency benchmark for large directories.  Populate the image
+ * with tools/mkdirbench.sh first. */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define BENCH_DIR "/bench/f"
+#define BENCH_FILES 10000
+#define BENCH_PASSES 2
+
+static inline unsigned
+rdtsc_lo (void)
+{
+  unsigned lo, hi;
+  asm volatile ("rdtsc":"=a" (lo), "=d" (hi));
+  return lo;
+}
+
+static void
+bench_name (char *buf, int n)
+{
+  char *p = buf;
+  const char *s = BENCH_DIR;
+  int d;
+
+  while (*s)
+    *p++ = *s++;
+  for (d = 10000; d > 0; d /= 10)
+    *p++ = '0' + (n / d) % 10;
+  *p = '\0';
+}
+
+int
+main ()
+{
+  char path[32];
+  int pass, i, misses;
+  unsigned start, cycles, total, max;
+
+  for (pass = 0; pass < BENCH_PASSES; pass++) {
+    misses = 0;
+    total = max = 0;
+    for (i = 0; i < BENCH_FILES; i++) {
+      /* stride through the directory rather than walking it in order */
+      bench_name (path, (i * 7919) % BENCH_FILES);
+      start = rdtsc_lo ();
+      if (open (path, 0) < 0)
+        misses++;
+      cycles = rdtsc_lo () - start;
+      /* keep the sum within 32 bits */
+      total += cycles >> 8;
+      if (cycles > max)
+        max = cycles;
+    }
+    printf ("dirbench: pass %d: %d opens %d misses avg %d max %d cycles\n",
+            pass, BENCH_FILES, misses, (total / BENCH_FILES) << 8, max);
+  }
+
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
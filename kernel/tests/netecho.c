@@ -0,0 +1,159 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Echo server on port 2007 in a single process: non-blocking sockets
+ * and one edge-triggered epoll instance, no thread per connection.
+ * Forward the port (QEMU -netdev user,...,hostfwd=tcp::2007-:2007)
+ * and open many connections from the host, e.g.
+ *
+ *   for i in $(seq 250); do (echo hello; sleep 30) | nc host 2007 & done
+ */
+
+#include <stdio.h>
+#include <socket.h>
+
+#define ECHO_PORT 2007
+#define MAX_CONN 256            /* indexed by socket, see SOCK_MAX */
+#define CONN_BUF 256
+#define MAX_EVENTS 64
+
+struct conn {
+  int len, off;                 /* received, not yet echoed */
+  char buf[CONN_BUF];
+};
+
+static struct conn conns[MAX_CONN];
+static struct epoll_event events[MAX_EVENTS];
+static int nconn, maxconn;
+
+static void
+drop (int fd)
+{
+  close (fd);
+  nconn--;
+}
+
+/* Edge-triggered: keep going until the socket says EAGAIN, or there
+ * will be no further event for what is left. */
+static void
+serve (int fd)
+{
+  struct conn *c = &conns[fd];
+  int n;
+
+  for (;;) {
+    if (c->off < c->len) {
+      n = send (fd, c->buf + c->off, c->len - c->off);
+      if (n == -EAGAIN)
+        return;                 /* wait for EPOLLOUT */
+      if (n < 0) {
+        drop (fd);
+        return;
+      }
+      c->off += n;
+      continue;
+    }
+    n = recv (fd, c->buf, CONN_BUF);
+    if (n == -EAGAIN)
+      return;                   /* wait for EPOLLIN */
+    if (n <= 0) {
+      drop (fd);
+      return;
+    }
+    c->len = n;
+    c->off = 0;
+  }
+}
+
+static void
+accept_all (int ep, int lsock)
+{
+  struct epoll_event ev;
+  int fd;
+
+  while ((fd = accept (lsock, NULL, NULL)) >= 0) {
+    if (fd >= MAX_CONN) {
+      close (fd);
+      continue;
+    }
+    conns[fd].len = conns[fd].off = 0;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data = fd;
+    if (epoll_ctl (ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close (fd);
+      continue;
+    }
+    if (++nconn > maxconn) {
+      maxconn = nconn;
+      if (maxconn % 100 == 0)
+        printf ("netecho: %d connections\n", maxconn);
+    }
+  }
+}
+
+int
+main ()
+{
+  struct epoll_event ev;
+  int lsock, ep, n, i, err;
+
+  lsock = socket (SOCK_STREAM | SOCK_NONBLOCK);
+  if (lsock < 0) {
+    printf ("netecho: socket: %d\n", lsock);
+    return 1;
+  }
+  if ((err = bind (lsock, INADDR_ANY, ECHO_PORT)) < 0 ||
+      (err = listen (lsock, 128)) < 0) {
+    printf ("netecho: bind/listen: %d\n", err);
+    return 1;
+  }
+
+  ep = epoll_create ();
+  ev.events = EPOLLIN;
+  ev.data = lsock;
+  epoll_ctl (ep, EPOLL_CTL_ADD, lsock, &ev);
+  printf ("netecho: listening on port %d\n", ECHO_PORT);
+
+  for (;;) {
+    n = epoll_wait (ep, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      printf ("netecho: epoll_wait: %d\n", n);
+      return 1;
+    }
+    for (i = 0; i < n; i++) {
+      if (events[i].data == lsock)
+        accept_all (ep, lsock);
+      else if (events[i].events & EPOLLERR)
+        drop (events[i].data);
+      else
+        serve (events[i].data);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,82 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sequential read throughput of the root filesystem's disk.  Put a
+ * large file on the image with tools/mkseqbench.sh, then boot the same
+ * image once per disk type (e.g. QEMU -hda, -device virtio-blk-pci,
+ * -device nvme) and compare. */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define BENCH_FILE "/bench/seq"
+#define BENCH_CHUNK 65536
+#define BENCH_PASSES 2
+
+static char buf[BENCH_CHUNK];
+
+static inline unsigned long long
+rdtsc (void)
+{
+  unsigned long long t;
+  asm volatile ("rdtsc":"=A" (t));
+  return t;
+}
+
+int
+main ()
+{
+  int pass, len, n, total;
+  unsigned long long start;
+  unsigned units;
+
+  for (pass = 0; pass < BENCH_PASSES; pass++) {
+    len = open (BENCH_FILE, 0);
+    if (len < 0) {
+      printf ("seqread: %s not found\n", BENCH_FILE);
+      return 1;
+    }
+    total = 0;
+    start = rdtsc ();
+    while (total < len) {
+      n = read (BENCH_FILE, buf, BENCH_CHUNK);
+      if (n <= 0)
+        break;
+      total += n;
+    }
+    /* in units of 64K cycles, to stay within 32 bits */
+    units = (unsigned) ((rdtsc () - start) >> 16);
+    if (units == 0)
+      units = 1;
+    /* 16 units is about a million cycles */
+    printf ("seqread: pass %d: %d KB in %d x64K cycles, %d KB/Mcycle\n",
+            pass, total >> 10, units, ((total >> 10) * 16) / units);
+  }
+
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Bandwidth-delay-product test for a single TCP connection in each
+# direction, against the discard (port 9) and chargen (port 19)
+# servers of a kernel built with -DNET_BDP_TEST.
+#
+# Given a boot image, starts QEMU with user networking and the two
+# ports forwarded to PORT and PORT+10 on the host; without one, tests
+# a Quest that is already running with them forwarded (or reachable
+# over a tap device, where RTT can be added with
+# "tc qdisc add dev tap0 root netem delay 25ms").
+#
+# Prints the rate each way.  With window scaling, one connection
+# should come close to min(link rate, TCP_WND / RTT).
+
+IMG=
+HOST=127.0.0.1
+PORT=5009
+SIZE=64                         # MB each way
+QEMU=${QEMU:-qemu-system-i386}
+
+usage () {
+  echo "Usage: $0 [-h host] [-p port] [-s size in MB] [boot image]"
+  exit 1
+}
+
+while getopts "h:p:s:" opt; do
+  case $opt in
+    h) HOST=$OPTARG ;;
+    p) PORT=$OPTARG ;;
+    s) SIZE=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+IMG="$1"
+[ -n "$IMG" -a ! -f "$IMG" ] && usage
+
+BYTES=$((SIZE * 1024 * 1024))
+
+if [ -n "$IMG" ]; then
+  case "$IMG" in
+    *.iso) DRIVE="-cdrom $IMG" ;;
+    *) DRIVE="-hda $IMG" ;;
+  esac
+  $QEMU -m 512 $DRIVE -display none \
+    -netdev user,id=n0,hostfwd=tcp:$HOST:$PORT-:9,hostfwd=tcp:$HOST:$((PORT + 10))-:19 \
+    -device e1000,netdev=n0 &
+  QPID=$!
+  trap "kill $QPID 2> /dev/null" EXIT
+fi
+
+# wait for chargen to answer; QEMU accepts forwarded connections
+# before the guest does, so look for data rather than a connection
+for i in $(seq 60); do
+  if exec 3<> /dev/tcp/$HOST/$((PORT + 10)) 2> /dev/null; then
+    timeout 2 head -c 1 <&3 > /dev/null 2>&1 && OK=1
+    exec 3>&-
+    [ -n "$OK" ] && break
+  fi
+  sleep 1
+done
+[ -z "$OK" ] && echo "bdptest: no chargen on $HOST:$((PORT + 10))" && exit 1
+
+now_ms () {
+  echo $(($(date +%s%N) / 1000000))
+}
+
+report () {
+  local ms=$(($2 > 0 ? $2 : 1))
+  echo "$1: $BYTES bytes in $ms ms, $((BYTES / ms)) KB/s"
+}
+
+# host to guest
+exec 3<> /dev/tcp/$HOST/$PORT || exit 1
+T=$(now_ms)
+head -c $BYTES /dev/zero >&3 || exit 1
+exec 3>&-
+report "to Quest (discard)" $(($(now_ms) - T))
+
+# guest to host
+exec 3<> /dev/tcp/$HOST/$((PORT + 10)) || exit 1
+T=$(now_ms)
+N=$(head -c $BYTES <&3 | wc -c)
+exec 3>&-
+[ "$N" -ne $BYTES ] && echo "bdptest: chargen stopped after $N bytes" && exit 1
+report "from Quest (chargen)" $(($(now_ms) - T))
+exit 0
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Populate /bench on the ext2 root partition of a Quest disk image
+# with COUNT empty files named f00000, f00001, ... for tests/dirbench.
+# With "index" the directory is rebuilt as an htree (dir_index);
+# with "linear" the feature is cleared so lookups exercise the
+# in-memory directory index instead.
+
+IMG="$1"
+COUNT="${2:-10000}"
+MODE="${3:-index}"
+OFFSET=32256                    # partition start, see README
+
+[ -z "$IMG" -o ! -f "$IMG" ] && \
+  echo "Usage: $0 <disk image> [count] [index|linear]" && exit 1
+
+DEV="$IMG?offset=$OFFSET"
+CMDS=$(mktemp)
+trap "rm -f $CMDS" EXIT
+
+echo "mkdir bench" > $CMDS
+for i in $(seq 0 $((COUNT - 1))); do
+  printf "write /dev/null bench/f%05d\n" $i >> $CMDS
+done
+
+debugfs -w -f $CMDS "$DEV" > /dev/null 2>&1 || exit 1
+
+if [ "$MODE" = "index" ]; then
+  tune2fs -O dir_index "$DEV" > /dev/null || exit 1
+  e2fsck -fyD "$DEV" > /dev/null 2>&1
+else
+  tune2fs -O ^dir_index "$DEV" > /dev/null || exit 1
+fi
+
+debugfs -R "stat bench" "$DEV" 2> /dev/null | grep Flags
+exit 0
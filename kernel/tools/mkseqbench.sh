@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Put a SIZE-megabyte file of random data at /bench/seq on the ext2
+# root partition of a Quest disk image, for tests/seqread.
+
+IMG="$1"
+SIZE="${2:-32}"
+OFFSET=32256                    # partition start, see README
+
+[ -z "$IMG" -o ! -f "$IMG" ] && \
+  echo "Usage: $0 <disk image> [size in MB]" && exit 1
+
+DEV="$IMG?offset=$OFFSET"
+DATA=$(mktemp)
+trap "rm -f $DATA" EXIT
+
+dd if=/dev/urandom of=$DATA bs=1M count=$SIZE 2> /dev/null || exit 1
+
+debugfs -w -R "mkdir bench" "$DEV" > /dev/null 2>&1
+debugfs -w -R "rm bench/seq" "$DEV" > /dev/null 2>&1
+debugfs -w -R "write $DATA bench/seq" "$DEV" > /dev/null 2>&1 || exit 1
+
+debugfs -R "stat bench/seq" "$DEV" 2> /dev/null | grep Size
+exit 0
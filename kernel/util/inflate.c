@@ -0,0 +1,499 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* DEFLATE (RFC 1951) decoder with the gzip (RFC 1952) wrapper, and
+ * the stream plumbing shared with the LZ4 decoder.  Huffman codes of
+ * up to INFLATE_FAST_BITS bits are decoded with one table lookup;
+ * longer codes fall back to the canonical bit-at-a-time walk. */
+
+#include "arch/i386.h"
+#include "kernel.h"
+#include "util/crc32.h"
+#include "util/decompress.h"
+#include "util/debug.h"
+
+//#define DEBUG_INFLATE
+
+#ifdef DEBUG_INFLATE
+#define DLOG(fmt,...) DLOG_PREFIX("inflate",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define INFLATE_MAXBITS   15
+#define INFLATE_FAST_BITS 9
+#define INFLATE_NLEN      288   /* literal/length symbols */
+#define INFLATE_NDIST     30
+
+typedef struct {
+  uint16 count[INFLATE_MAXBITS + 1];  /* codes of each length */
+  uint16 symbol[INFLATE_NLEN];        /* symbols in canonical order */
+  uint16 fast[1 << INFLATE_FAST_BITS]; /* symbol | length << 9, or 0 */
+} huffman;
+
+static const uint16 len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8 len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16 dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577
+};
+static const uint8 dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+/* order of code length code lengths */
+static const uint8 clen_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* the decoder tables are too big for a kernel stack */
+static huffman lencode, distcode;
+
+void
+decomp_init (decomp_stream *s,
+             sint32 (*fill) (void *, uint8 *, uint32),
+             void (*flush) (void *, uint8 *, uint32),
+             void *arg, uint8 *window)
+{
+  memset (s, 0, sizeof (decomp_stream));
+  s->fill = fill;
+  s->flush = flush;
+  s->arg = arg;
+  s->window = window;
+  s->crc = ~0;
+}
+
+int
+decomp_detect (uint8 *buf, uint32 len)
+{
+  if (len >= 3 && buf[0] == 0x1F && buf[1] == 0x8B && buf[2] == 8)
+    return DECOMP_GZIP;
+  if (len >= 4 && buf[0] == 0x04 && buf[1] == 0x22 &&
+      buf[2] == 0x4D && buf[3] == 0x18)
+    return DECOMP_LZ4;
+  return DECOMP_NONE;
+}
+
+sint32
+decomp_refill (decomp_stream *s)
+{
+  sint32 n;
+  if (s->eof)
+    return -1;
+  n = s->fill (s->arg, s->in, DECOMP_INBUF);
+  if (n <= 0) {
+    s->eof = TRUE;
+    s->in_pos = s->in_len = 0;
+    return -1;
+  }
+  s->in_len = n;
+  s->in_pos = 1;
+  return s->in[0];
+}
+
+/* Pass window bytes not yet flushed to the consumer */
+void
+decomp_flush (decomp_stream *s)
+{
+  uint32 len = s->wpos - s->wflushed;
+  if (len > 0) {
+    s->crc = crc32_le (s->crc, s->window + s->wflushed, len);
+    s->flush (s->arg, s->window + s->wflushed, len);
+    s->total += len;
+  }
+  if (s->wpos == DECOMP_WINDOW)
+    s->wpos = 0;
+  s->wflushed = s->wpos;
+}
+
+/* Ensure at least n bits in the bit buffer; FALSE at end of input */
+static inline bool
+need_bits (decomp_stream *s, uint32 n)
+{
+  sint32 c;
+  while (s->bitcnt < n) {
+    if ((c = decomp_getc (s)) < 0)
+      return FALSE;
+    s->bitbuf |= (uint32) c << s->bitcnt;
+    s->bitcnt += 8;
+  }
+  return TRUE;
+}
+
+static inline uint32
+drop_bits (decomp_stream *s, uint32 n)
+{
+  uint32 v = s->bitbuf & ((1 << n) - 1);
+  s->bitbuf >>= n;
+  s->bitcnt -= n;
+  return v;
+}
+
+/* Read n bits, or -1 at end of input */
+static inline sint32
+get_bits (decomp_stream *s, uint32 n)
+{
+  if (!need_bits (s, n))
+    return -1;
+  return drop_bits (s, n);
+}
+
+/* Build a decoding table from code lengths.  Returns FALSE for an
+ * over-subscribed set; incomplete sets are allowed, as zlib does for
+ * the single-code distance tree. */
+static bool
+build (huffman *h, const uint8 *length, uint32 n)
+{
+  uint16 offs[INFLATE_MAXBITS + 1];
+  uint32 sym, len, code, rev, i;
+  sint32 left = 1;
+
+  memset (h->count, 0, sizeof (h->count));
+  memset (h->fast, 0, sizeof (h->fast));
+  for (sym = 0; sym < n; sym++)
+    h->count[length[sym]]++;
+  for (len = 1; len <= INFLATE_MAXBITS; len++) {
+    left = (left << 1) - h->count[len];
+    if (left < 0)
+      return FALSE;
+  }
+
+  offs[1] = 0;
+  for (len = 1; len < INFLATE_MAXBITS; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (sym = 0; sym < n; sym++)
+    if (length[sym])
+      h->symbol[offs[length[sym]]++] = sym;
+
+  /* fast table: canonical codes are sent MSB first, so index by the
+   * bit-reversed code, with every filler above it */
+  code = 0;
+  i = 0;
+  for (len = 1; len <= INFLATE_FAST_BITS; len++) {
+    uint32 k;
+    for (k = 0; k < h->count[len]; k++, i++, code++) {
+      uint32 b, fill;
+      for (rev = 0, b = 0; b < len; b++)
+        rev |= ((code >> b) & 1) << (len - 1 - b);
+      for (fill = rev; fill < (1 << INFLATE_FAST_BITS); fill += 1 << len)
+        h->fast[fill] = h->symbol[i] | (len << 9);
+    }
+    code <<= 1;
+  }
+  return TRUE;
+}
+
+/* Decode one symbol, or -1 on bad input */
+static sint32
+decode (decomp_stream *s, huffman *h)
+{
+  sint32 code = 0, first = 0, index = 0, count;
+  uint32 len, entry;
+
+  /* near the end of input fewer than FAST_BITS may be left */
+  need_bits (s, INFLATE_FAST_BITS);
+  entry = h->fast[s->bitbuf & ((1 << INFLATE_FAST_BITS) - 1)];
+  if (entry && (entry >> 9) <= s->bitcnt) {
+    drop_bits (s, entry >> 9);
+    return entry & 0x1FF;
+  }
+
+  for (len = 1; len <= INFLATE_MAXBITS; len++) {
+    sint32 bit = get_bits (s, 1);
+    if (bit < 0)
+      return -1;
+    code |= bit;
+    count = h->count[len];
+    if (code - count < first)
+      return h->symbol[index + (code - first)];
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static bool
+stored (decomp_stream *s)
+{
+  sint32 c;
+  uint32 len, nlen;
+
+  /* discard to a byte boundary; whole bytes left in the bit buffer
+   * are still data */
+  drop_bits (s, s->bitcnt & 7);
+  if ((c = get_bits (s, 16)) < 0)
+    return FALSE;
+  len = c;
+  if ((c = get_bits (s, 16)) < 0)
+    return FALSE;
+  nlen = c;
+  if (len != (~nlen & 0xFFFF))
+    return FALSE;
+  while (len > 0 && s->bitcnt > 0) {
+    decomp_putc (s, drop_bits (s, 8));
+    len--;
+  }
+  while (len-- > 0) {
+    if ((c = decomp_getc (s)) < 0)
+      return FALSE;
+    decomp_putc (s, c);
+  }
+  return TRUE;
+}
+
+static bool
+codes (decomp_stream *s)
+{
+  sint32 sym, e;
+  uint32 len, dist;
+
+  for (;;) {
+    if ((sym = decode (s, &lencode)) < 0)
+      return FALSE;
+    if (sym < 256) {
+      decomp_putc (s, sym);
+      continue;
+    }
+    if (sym == 256)
+      return TRUE;
+    sym -= 257;
+    if (sym >= 29)
+      return FALSE;
+    if ((e = get_bits (s, len_extra[sym])) < 0)
+      return FALSE;
+    len = len_base[sym] + e;
+
+    if ((sym = decode (s, &distcode)) < 0 || sym >= 30)
+      return FALSE;
+    if ((e = get_bits (s, dist_extra[sym])) < 0)
+      return FALSE;
+    dist = dist_base[sym] + e;
+    if (!decomp_copy (s, dist, len))
+      return FALSE;
+  }
+}
+
+static bool
+fixed (decomp_stream *s)
+{
+  uint8 length[INFLATE_NLEN];
+  uint32 sym;
+
+  for (sym = 0; sym < 144; sym++)
+    length[sym] = 8;
+  for (; sym < 256; sym++)
+    length[sym] = 9;
+  for (; sym < 280; sym++)
+    length[sym] = 7;
+  for (; sym < INFLATE_NLEN; sym++)
+    length[sym] = 8;
+  build (&lencode, length, INFLATE_NLEN);
+  for (sym = 0; sym < INFLATE_NDIST; sym++)
+    length[sym] = 5;
+  build (&distcode, length, INFLATE_NDIST);
+  return codes (s);
+}
+
+static bool
+dynamic (decomp_stream *s)
+{
+  uint8 length[INFLATE_NLEN + INFLATE_NDIST];
+  sint32 nlen, ndist, ncode, sym, len, rep;
+  uint32 index;
+
+  if ((nlen = get_bits (s, 5)) < 0 || (ndist = get_bits (s, 5)) < 0 ||
+      (ncode = get_bits (s, 4)) < 0)
+    return FALSE;
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if (nlen > INFLATE_NLEN || ndist > INFLATE_NDIST)
+    return FALSE;
+
+  memset (length, 0, sizeof (length));
+  for (index = 0; index < ncode; index++) {
+    if ((len = get_bits (s, 3)) < 0)
+      return FALSE;
+    length[clen_order[index]] = len;
+  }
+  if (!build (&lencode, length, 19))
+    return FALSE;
+
+  /* literal/length and distance code lengths, as one sequence */
+  for (index = 0; index < nlen + ndist;) {
+    if ((sym = decode (s, &lencode)) < 0)
+      return FALSE;
+    if (sym < 16) {
+      length[index++] = sym;
+      continue;
+    }
+    len = 0;
+    if (sym == 16) {
+      if (index == 0)
+        return FALSE;
+      len = length[index - 1];
+      rep = get_bits (s, 2);
+      rep = rep < 0 ? -1 : rep + 3;
+    } else if (sym == 17) {
+      rep = get_bits (s, 3);
+      rep = rep < 0 ? -1 : rep + 3;
+    } else {
+      rep = get_bits (s, 7);
+      rep = rep < 0 ? -1 : rep + 11;
+    }
+    if (rep < 0 || index + rep > nlen + ndist)
+      return FALSE;
+    while (rep-- > 0)
+      length[index++] = len;
+  }
+  if (length[256] == 0)
+    return FALSE;
+
+  if (!build (&lencode, length, nlen) ||
+      !build (&distcode, length + nlen, ndist))
+    return FALSE;
+  return codes (s);
+}
+
+static bool
+inflate (decomp_stream *s)
+{
+  sint32 last, type;
+  bool ok;
+
+  do {
+    if ((last = get_bits (s, 1)) < 0 || (type = get_bits (s, 2)) < 0)
+      return FALSE;
+    switch (type) {
+    case 0:
+      ok = stored (s);
+      break;
+    case 1:
+      ok = fixed (s);
+      break;
+    case 2:
+      ok = dynamic (s);
+      break;
+    default:
+      ok = FALSE;
+    }
+    if (!ok) {
+      DLOG ("bad block type=%d at output %d", type, s->total + s->wpos);
+      return FALSE;
+    }
+  } while (!last);
+  return TRUE;
+}
+
+/* Skip n bytes of input */
+static bool
+skip (decomp_stream *s, uint32 n)
+{
+  while (n-- > 0)
+    if (decomp_getc (s) < 0)
+      return FALSE;
+  return TRUE;
+}
+
+/* Skip a NUL-terminated string */
+static bool
+skip_str (decomp_stream *s)
+{
+  sint32 c;
+  while ((c = decomp_getc (s)) > 0);
+  return c == 0;
+}
+
+static bool
+get_le32 (decomp_stream *s, uint32 *val)
+{
+  sint32 i, c;
+  *val = 0;
+  for (i = 0; i < 4; i++) {
+    if ((c = get_bits (s, 8)) < 0)
+      return FALSE;
+    *val |= (uint32) c << (i * 8);
+  }
+  return TRUE;
+}
+
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+sint32
+gunzip (decomp_stream *s)
+{
+  uint8 hdr[10];
+  uint32 i, crc, isize;
+  sint32 c;
+
+  for (i = 0; i < sizeof (hdr); i++) {
+    if ((c = decomp_getc (s)) < 0)
+      return -1;
+    hdr[i] = c;
+  }
+  if (decomp_detect (hdr, sizeof (hdr)) != DECOMP_GZIP)
+    return -1;
+  if (hdr[3] & GZIP_FEXTRA) {
+    sint32 lo = decomp_getc (s), hi = decomp_getc (s);
+    if (lo < 0 || hi < 0 || !skip (s, lo | (hi << 8)))
+      return -1;
+  }
+  if ((hdr[3] & GZIP_FNAME) && !skip_str (s))
+    return -1;
+  if ((hdr[3] & GZIP_FCOMMENT) && !skip_str (s))
+    return -1;
+  if ((hdr[3] & GZIP_FHCRC) && !skip (s, 2))
+    return -1;
+
+  if (!inflate (s))
+    return -1;
+  decomp_flush (s);
+
+  /* trailer, byte aligned, possibly partly in the bit buffer */
+  drop_bits (s, s->bitcnt & 7);
+  if (!get_le32 (s, &crc) || !get_le32 (s, &isize))
+    return -1;
+  if (crc != ~s->crc || isize != s->total) {
+    DLOG ("checksum mismatch crc=0x%X/0x%X size=%d/%d",
+          crc, ~s->crc, isize, s->total);
+    return -1;
+  }
+  return s->total;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
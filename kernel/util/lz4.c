@@ -0,0 +1,180 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* LZ4 frame format decoder.  Blocks may depend on earlier ones (the
+ * default for `lz4`), which the 64 KB window covers.  Block and
+ * content checksums (xxHash32) are skipped, not verified. */
+
+#include "arch/i386.h"
+#include "kernel.h"
+#include "util/decompress.h"
+#include "util/debug.h"
+
+//#define DEBUG_LZ4
+
+#ifdef DEBUG_LZ4
+#define DLOG(fmt,...) DLOG_PREFIX("lz4",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define LZ4_FLG_VERSION      0xC0
+#define LZ4_FLG_BLOCK_CHKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHKSUM 0x04
+#define LZ4_FLG_DICT_ID      0x01
+#define LZ4_BLOCK_RAW        0x80000000
+#define LZ4_MIN_MATCH        4
+
+static bool
+skip (decomp_stream *s, uint32 n)
+{
+  while (n-- > 0)
+    if (decomp_getc (s) < 0)
+      return FALSE;
+  return TRUE;
+}
+
+static bool
+get_le32 (decomp_stream *s, uint32 *val)
+{
+  sint32 i, c;
+  *val = 0;
+  for (i = 0; i < 4; i++) {
+    if ((c = decomp_getc (s)) < 0)
+      return FALSE;
+    *val |= (uint32) c << (i * 8);
+  }
+  return TRUE;
+}
+
+/* Extend a 4-bit length field with 255-continued bytes.  Consumed
+ * input is counted against the block size in *left. */
+static sint32
+get_length (decomp_stream *s, uint32 len, uint32 *left)
+{
+  sint32 c;
+  if (len != 15)
+    return len;
+  do {
+    if (*left == 0 || (c = decomp_getc (s)) < 0)
+      return -1;
+    (*left)--;
+    len += c;
+  } while (c == 255);
+  return len;
+}
+
+static bool
+block (decomp_stream *s, uint32 left)
+{
+  sint32 token, len, c, lo, hi;
+
+  while (left > 0) {
+    if ((token = decomp_getc (s)) < 0)
+      return FALSE;
+    left--;
+
+    /* literals */
+    if ((len = get_length (s, token >> 4, &left)) < 0 || len > left)
+      return FALSE;
+    left -= len;
+    while (len-- > 0) {
+      if ((c = decomp_getc (s)) < 0)
+        return FALSE;
+      decomp_putc (s, c);
+    }
+    if (left == 0)
+      /* the last sequence has no match */
+      return TRUE;
+
+    /* match */
+    if (left < 2 || (lo = decomp_getc (s)) < 0 || (hi = decomp_getc (s)) < 0)
+      return FALSE;
+    left -= 2;
+    if ((len = get_length (s, token & 0xF, &left)) < 0)
+      return FALSE;
+    if (!decomp_copy (s, lo | (hi << 8), len + LZ4_MIN_MATCH))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+sint32
+lz4_decompress (decomp_stream *s)
+{
+  uint8 hdr[4];
+  uint32 i, size;
+  sint32 flg, bd, c;
+
+  for (i = 0; i < sizeof (hdr); i++) {
+    if ((c = decomp_getc (s)) < 0)
+      return -1;
+    hdr[i] = c;
+  }
+  if (decomp_detect (hdr, sizeof (hdr)) != DECOMP_LZ4)
+    return -1;
+  if ((flg = decomp_getc (s)) < 0 || (bd = decomp_getc (s)) < 0)
+    return -1;
+  if ((flg & LZ4_FLG_VERSION) != 0x40) {
+    DLOG ("unsupported frame version flg=0x%X", flg);
+    return -1;
+  }
+  if (flg & LZ4_FLG_DICT_ID) {
+    DLOG ("preset dictionaries unsupported");
+    return -1;
+  }
+  /* content size, if present, then the header checksum */
+  if (!skip (s, ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + 1))
+    return -1;
+
+  for (;;) {
+    if (!get_le32 (s, &size))
+      return -1;
+    if (size == 0)
+      break;                    /* end mark */
+    if (size & LZ4_BLOCK_RAW) {
+      size &= ~LZ4_BLOCK_RAW;
+      while (size-- > 0) {
+        if ((c = decomp_getc (s)) < 0)
+          return -1;
+        decomp_putc (s, c);
+      }
+    } else if (!block (s, size)) {
+      DLOG ("corrupt block at output %d", s->total + s->wpos);
+      return -1;
+    }
+    if ((flg & LZ4_FLG_BLOCK_CHKSUM) && !skip (s, 4))
+      return -1;
+  }
+  if ((flg & LZ4_FLG_CONTENT_CHKSUM) && !skip (s, 4))
+    return -1;
+
+  decomp_flush (s);
+  return s->total;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
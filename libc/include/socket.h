@@ -0,0 +1,164 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2010  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SOCKET_H_
+#define _SOCKET_H_
+
+/* TCP sockets, via int $0x3D.  Must match the kernel's
+ * include/drivers/net/socket.h.  Calls return a negative error code
+ * (-EAGAIN etc.) on failure. */
+
+#define SOCK_STREAM   1
+#define SOCK_NONBLOCK 0x800
+
+#define INADDR_ANY 0
+/* a.b.c.d in network byte order */
+#define INADDR(a,b,c,d) \
+  ((unsigned) (a) | (unsigned) (b) << 8 | (unsigned) (c) << 16 | \
+   (unsigned) (d) << 24)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+/* always edge-triggered */
+#define EPOLLIN     0x001
+#define EPOLLOUT    0x004
+#define EPOLLERR    0x008
+#define EPOLLHUP    0x010
+#define EPOLLRDHUP  0x2000
+
+struct epoll_event {
+  unsigned events;
+  unsigned data;
+};
+
+#define ENOENT        2
+#define EBADF         9
+#define EAGAIN       11
+#define ENOMEM       12
+#define EFAULT       14
+#define EEXIST       17
+#define EINVAL       22
+#define EMFILE       24
+#define EPIPE        32
+#define EADDRINUSE   98
+#define ENETDOWN    100
+#define ECONNRESET  104
+#define EISCONN     106
+#define ENOTCONN    107
+#define ETIMEDOUT   110
+#define ECONNREFUSED 111
+#define EALREADY    114
+#define EINPROGRESS 115
+
+static inline int
+socketcall (int op, unsigned a, unsigned b, unsigned c, unsigned d)
+{
+  int ret;
+
+  /* EDX comes back clobbered */
+  asm volatile ("int $0x3D\n":"=a" (ret), "+d" (c):"a" (op), "b" (a),
+                "c" (b), "S" (d):"memory", "cc");
+
+  return ret;
+}
+
+/* type: SOCK_STREAM, optionally | SOCK_NONBLOCK */
+static inline int
+socket (int type)
+{
+  return socketcall (0, type, 0, 0, 0);
+}
+
+static inline int
+bind (int s, unsigned addr, unsigned short port)
+{
+  return socketcall (1, s, addr, port, 0);
+}
+
+static inline int
+listen (int s, int backlog)
+{
+  return socketcall (2, s, backlog, 0, 0);
+}
+
+/* addr and port may be NULL; the new socket is non-blocking if the
+ * listening one is */
+static inline int
+accept (int s, unsigned *addr, unsigned short *port)
+{
+  return socketcall (3, s, (unsigned) addr, (unsigned) port, 0);
+}
+
+static inline int
+connect (int s, unsigned addr, unsigned short port)
+{
+  return socketcall (4, s, addr, port, 0);
+}
+
+static inline int
+send (int s, const void *buf, int len)
+{
+  return socketcall (5, s, (unsigned) buf, len, 0);
+}
+
+static inline int
+recv (int s, void *buf, int len)
+{
+  return socketcall (6, s, (unsigned) buf, len, 0);
+}
+
+/* sockets and epoll instances */
+static inline int
+close (int fd)
+{
+  return socketcall (7, fd, 0, 0, 0);
+}
+
+static inline int
+epoll_create (void)
+{
+  return socketcall (8, 0, 0, 0, 0);
+}
+
+static inline int
+epoll_ctl (int epfd, int op, int fd, struct epoll_event *ev)
+{
+  return socketcall (9, epfd, op, fd, (unsigned) ev);
+}
+
+/* timeout in ms: 0 polls, -1 waits for ever */
+static inline int
+epoll_wait (int epfd, struct epoll_event *events, int maxevents,
+            int timeout)
+{
+  return socketcall (10, epfd, (unsigned) events, maxevents, timeout);
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */